@@ -10,6 +10,21 @@ page for details */
 location */
 #undef ALLOW_ENV_CONFIG
 
+/* Keep counters for each process in shared memory for tsocks-stat,
+they can also be turned off at run time, see the man page for details */
+#undef ENABLE_STATS
+
+/* Compile in USDT probes for perf, bpftrace and SystemTap */
+#undef ENABLE_PROBES
+
+/* Relay UDP through SOCKS 5 servers when TSOCKS_UDP is set, see the man
+page for details */
+#undef ENABLE_UDP
+
+/* Answer name lookups from a cache shared between processes when
+TSOCKS_DNS_CACHE is set, see the man page for details */
+#undef ENABLE_DNSCACHE
+
 /* Use _GNU_SOURCE to define RTLD_NEXT, mostly for RH7 systems */
 #undef USE_GNU_SOURCE
 
@@ -46,6 +61,27 @@ allows socksified DNS */
 /* Prototype and function header for getpeername function */
 #undef GETPEERNAME_SIGNATURE
 
+/* Prototype and function header for getsockopt function */
+#undef GETSOCKOPT_SIGNATURE
+
+/* Prototypes and function headers for the resolver functions, which
+record the names of addresses for routing by domain and are answered
+from the DNS cache */
+#undef GETADDRINFO_SIGNATURE
+#undef GETHOSTBYNAME_SIGNATURE
+#undef GETHOSTBYNAME_R_SIGNATURE
+
+/* Prototypes and function headers for the functions that send and
+receive datagrams, only overridden when ENABLE_UDP is defined */
+#undef SEND_SIGNATURE
+#undef RECV_SIGNATURE
+#undef SENDTO_SIGNATURE
+#undef RECVFROM_SIGNATURE
+#undef SENDMSG_SIGNATURE
+#undef RECVMSG_SIGNATURE
+#undef SENDMMSG_SIGNATURE
+#undef RECVMMSG_SIGNATURE
+
 /* We use strsep which isn't on all machines, but we provide our own
 definition of it for those which don't have it, this causes us to define
 our version */
@@ -0,0 +1,43 @@
+/*
+ * benchutil.c - Helpers the tsocks benchmarks share
+ *
+ * A monotonic clock in nanoseconds to time what is measured with, and
+ * the parsing of the address:port arguments naming servers and targets.
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "benchutil.h"
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Fill in addr from text of the form address:port, returns 0 if it */
+/* was one. text is split at the colon                              */
+int parse_address(char *text, struct sockaddr_in *addr) {
+    char *port;
+
+    memset(addr, 0x0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if ((port = strchr(text, ':')) == NULL)
+	return -1;
+    *port++ = '\0';
+    addr->sin_port = htons(atoi(port));
+
+    return (inet_aton(text, &addr->sin_addr) ? 0 : -1);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,14 @@
+/* benchutil.h - Helpers the tsocks benchmarks share */
+
+#ifndef _BENCHUTIL_H
+
+#define _BENCHUTIL_H	1
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Functions provided by benchutil.c */
+uint64_t now_ns(void);
+int parse_address(char *text, struct sockaddr_in *addr);
+
+#endif
@@ -0,0 +1,400 @@
+/*
+ * CONNBENCH - Part of the tsocks benchmarks
+ *
+ * Opens a large number of TCP connections, using blocking connect() or
+ * non blocking connect() driven by select(), poll() or epoll, and reports
+ * the rate, latency and CPU cost of the connections as a single JSON
+ * object. Run it with and without libtsocks preloaded to see what tsocks
+ * adds to a connection.
+ */
+
+/* Global configuration variables */
+char *progname = "connbench";
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+#include "benchutil.h"
+
+#define MODE_BLOCKING	0
+#define MODE_SELECT	1
+#define MODE_POLL	2
+#define MODE_EPOLL	3
+
+#define TIMEOUT	10 /* Seconds to wait for a connect before giving up */
+
+static char *modes[] = { "blocking", "select", "poll", "epoll", NULL };
+
+/* Structure representing a connection in progress */
+struct pending {
+    int fd;
+    uint64_t start; /* Time connect() was first called */
+};
+
+static int start_connect(struct sockaddr_in *, int, struct pending *);
+static int finish_connect(struct pending *, struct sockaddr_in *, int);
+static void close_conn(int);
+static int compare_u64(const void *, const void *);
+static int read_stats(struct sockaddr_in *, unsigned long *, unsigned long *);
+static double throughput(struct sockaddr_in *, size_t);
+
+/* Create a socket and start connecting it, returns 1 if the */
+/* connect finished at once, 0 if it is in progress and -1 on */
+/* failure                                                    */
+static int start_connect(struct sockaddr_in *addr, int nonblocking,
+	struct pending *p) {
+
+    p->start = now_ns();
+    if ((p->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    if (nonblocking)
+	fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | O_NONBLOCK);
+
+    if (!connect(p->fd, (struct sockaddr *) addr, sizeof(*addr)))
+	return 1;
+    if (nonblocking && (errno == EINPROGRESS))
+	return 0;
+
+    close_conn(p->fd);
+    return -1;
+}
+
+/* Check whether a non blocking connect has finished, epoll has */
+/* to call connect() again since libtsocks doesn't see it        */
+static int finish_connect(struct pending *p, struct sockaddr_in *addr, int recall) {
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (recall) {
+	if (!connect(p->fd, (struct sockaddr *) addr, sizeof(*addr)) ||
+		(errno == EISCONN))
+	    return 1;
+	if ((errno == EALREADY) || (errno == EINPROGRESS) ||
+		(errno == EAGAIN) || (errno == EWOULDBLOCK))
+	    return 0;
+	return -1;
+    }
+
+    if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+	return -1;
+
+    return 1;
+}
+
+/* Close without leaving the socket in TIME_WAIT, so long runs */
+/* don't run out of local ports                                */
+static void close_conn(int fd) {
+    struct linger linger = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t *x = a, *y = b;
+
+    return (*x < *y ? -1 : (*x > *y ? 1 : 0));
+}
+
+/* Ask mocksocks how many connections and SOCKS messages it has seen */
+static int read_stats(struct sockaddr_in *addr, unsigned long *conns,
+	unsigned long *msgs) {
+    char buf[128];
+    ssize_t rc;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) ||
+	    (write(fd, "stats\n", 6) != 6) ||
+	    ((rc = read(fd, buf, sizeof(buf) - 1)) <= 0)) {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+    buf[rc] = '\0';
+
+    return (sscanf(buf, "connections=%lu messages=%lu", conns, msgs) == 2 ? 0 : -1);
+}
+
+/* Push data through one connection to the echo server and return */
+/* the rate in megabytes per second                               */
+static double throughput(struct sockaddr_in *addr, size_t total) {
+    char buf[65536];
+    size_t sent = 0, received = 0, len;
+    struct pollfd pfd;
+    uint64_t start;
+    ssize_t rc;
+    int fd;
+
+    memset(buf, 'x', sizeof(buf));
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    if (connect(fd, (struct sockaddr *) addr, sizeof(*addr))) {
+	close(fd);
+	return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    start = now_ns();
+    pfd.fd = fd;
+    while (received < total) {
+	pfd.events = POLLIN | (sent < total ? POLLOUT : 0);
+	if (poll(&pfd, 1, 5000) <= 0)
+	    break;
+	if ((pfd.revents & POLLOUT) && (sent < total)) {
+	    len = (total - sent < sizeof(buf) ? total - sent : sizeof(buf));
+	    if ((rc = write(fd, buf, len)) > 0)
+		sent += rc;
+	}
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if ((rc = read(fd, buf, sizeof(buf))) <= 0)
+		break;
+	    received += rc;
+	}
+    }
+    close(fd);
+
+    if (received < total)
+	return -1;
+
+    return (double) total / (1 << 20) / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: -t ip:port [-m blocking|select|poll|epoll] "
+	"[-n connects] [-c concurrency] [-s stats ip:port] "
+	"[-b throughput bytes] [-l extra json]";
+    struct sockaddr_in target, stats;
+    struct pending *pending, p;
+    struct epoll_event ev, *events;
+    struct pollfd *pfds;
+    struct rusage before, after;
+    struct timeval tv;
+    fd_set wfds;
+    uint64_t *latency, start, elapsed;
+    unsigned long conns[2], msgs[2];
+    int mode = MODE_BLOCKING, total = 1000, concurrency = 16, havestats = 0;
+    int started = 0, done = 0, errors = 0, active = 0, maxfd, epfd = -1;
+    int i, j, c, rc, n;
+    size_t tbytes = 0;
+    double mbps = -1, cpu;
+    char *extra = NULL;
+
+    memset(&target, 0x0, sizeof(target));
+    while ((c = getopt(argc, argv, "t:m:n:c:s:b:l:")) != -1) {
+	switch (c) {
+	    case 't':
+		if (parse_address(optarg, &target)) {
+		    show_msg(MSGERR, "Invalid target %s\n", optarg);
+		    exit(1);
+		}
+		break;
+	    case 'm':
+		for (mode = 0; modes[mode] && strcmp(modes[mode], optarg); mode++)
+		    /* Empty loop */;
+		if (!modes[mode]) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		break;
+	    case 'n':
+		total = atoi(optarg);
+		break;
+	    case 'c':
+		concurrency = atoi(optarg);
+		break;
+	    case 's':
+		if (parse_address(optarg, &stats)) {
+		    show_msg(MSGERR, "Invalid stats address %s\n", optarg);
+		    exit(1);
+		}
+		havestats = 1;
+		break;
+	    case 'b':
+		tbytes = strtoul(optarg, NULL, 0);
+		break;
+	    case 'l':
+		extra = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    if (!target.sin_port || (total <= 0) || (optind != argc)) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+    if ((mode == MODE_BLOCKING) || (concurrency < 1))
+	concurrency = 1;
+    if ((mode == MODE_SELECT) && (concurrency > FD_SETSIZE / 2))
+	concurrency = FD_SETSIZE / 2;
+
+    if (((latency = malloc(total * sizeof(*latency))) == NULL) ||
+	    ((pending = calloc(concurrency, sizeof(*pending))) == NULL) ||
+	    ((pfds = calloc(concurrency, sizeof(*pfds))) == NULL) ||
+	    ((events = calloc(concurrency, sizeof(*events))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory\n");
+	exit(1);
+    }
+    if ((mode == MODE_EPOLL) && ((epfd = epoll_create1(0)) < 0)) {
+	show_msg(MSGERR, "epoll_create1() failed (%s)\n", strerror(errno));
+	exit(1);
+    }
+
+    if (havestats && read_stats(&stats, &conns[0], &msgs[0]))
+	havestats = 0;
+
+    getrusage(RUSAGE_SELF, &before);
+    start = now_ns();
+
+    while (done + errors < total) {
+	/* Keep the pipeline full */
+	while ((active < concurrency) && (started < total)) {
+	    started++;
+	    rc = start_connect(&target, (mode != MODE_BLOCKING), &p);
+	    if (rc < 0) {
+		errors++;
+		continue;
+	    }
+	    if (rc > 0) {
+		latency[done++] = now_ns() - p.start;
+		close_conn(p.fd);
+		continue;
+	    }
+	    if (mode == MODE_EPOLL) {
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.u32 = active;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, p.fd, &ev);
+	    }
+	    pending[active++] = p;
+	}
+	if (!active)
+	    continue;
+
+	/* Wait for some of them to finish */
+	rc = 1;
+	switch (mode) {
+	    case MODE_SELECT:
+		FD_ZERO(&wfds);
+		for (i = 0, maxfd = 0; i < active; i++) {
+		    FD_SET(pending[i].fd, &wfds);
+		    if (pending[i].fd > maxfd)
+			maxfd = pending[i].fd;
+		}
+		tv.tv_sec = TIMEOUT;
+		tv.tv_usec = 0;
+		if ((rc = select(maxfd + 1, NULL, &wfds, NULL, &tv)) < 0)
+		    continue;
+		for (i = 0; i < active; i++)
+		    pfds[i].revents = (FD_ISSET(pending[i].fd, &wfds) ? POLLOUT : 0);
+		break;
+	    case MODE_POLL:
+		for (i = 0; i < active; i++) {
+		    pfds[i].fd = pending[i].fd;
+		    pfds[i].events = POLLOUT;
+		    pfds[i].revents = 0;
+		}
+		if ((rc = poll(pfds, active, TIMEOUT * 1000)) < 0)
+		    continue;
+		break;
+	    case MODE_EPOLL:
+		for (i = 0; i < active; i++)
+		    pfds[i].revents = 0;
+		if ((rc = n = epoll_wait(epfd, events, concurrency, TIMEOUT * 1000)) < 0)
+		    continue;
+		for (i = 0; i < n; i++)
+		    pfds[events[i].data.u32].revents = POLLOUT;
+		break;
+	}
+	if (rc == 0) {
+	    show_msg(MSGERR, "%d connects made no progress in %d seconds, "
+		    "giving up\n", active, TIMEOUT);
+	    errors += active + total - started;
+	    break;
+	}
+
+	/* Reap the finished ones, moving the last entry into */
+	/* the gap                                            */
+	for (i = active - 1; i >= 0; i--) {
+	    if (!pfds[i].revents)
+		continue;
+	    rc = finish_connect(&pending[i], &target, (mode == MODE_EPOLL));
+	    if (rc == 0)
+		continue;
+	    if (rc > 0)
+		latency[done++] = now_ns() - pending[i].start;
+	    else
+		errors++;
+	    close_conn(pending[i].fd);
+	    j = --active;
+	    if (i != j) {
+		pending[i] = pending[j];
+		pfds[i].revents = pfds[j].revents;
+		if (mode == MODE_EPOLL) {
+		    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		    ev.data.u32 = i;
+		    epoll_ctl(epfd, EPOLL_CTL_MOD, pending[i].fd, &ev);
+		}
+	    }
+	}
+    }
+
+    elapsed = now_ns() - start;
+    getrusage(RUSAGE_SELF, &after);
+
+    if (havestats && read_stats(&stats, &conns[1], &msgs[1]))
+	havestats = 0;
+    if (tbytes)
+	mbps = throughput(&target, tbytes);
+
+    qsort(latency, done, sizeof(*latency), compare_u64);
+    cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec +
+	    after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1e6 +
+	(after.ru_utime.tv_usec - before.ru_utime.tv_usec +
+	 after.ru_stime.tv_usec - before.ru_stime.tv_usec);
+
+#define PERCENTILE(p) (done ? latency[(size_t) ((done - 1) * (p))] / 1e3 : 0)
+
+    printf("{\"bench\":\"connect\",\"mode\":\"%s\",\"preload\":%s,",
+	    modes[mode], (getenv("LD_PRELOAD") && *getenv("LD_PRELOAD") ?
+		"true" : "false"));
+    if (extra)
+	printf("%s,", extra);
+    printf("\"concurrency\":%d,\"connects\":%d,\"errors\":%d,"
+	    "\"connects_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+	    "\"p999_us\":%.1f,\"max_us\":%.1f,\"cpu_us_per_connect\":%.2f",
+	    concurrency, done, errors, done / (elapsed / 1e9),
+	    PERCENTILE(0.5), PERCENTILE(0.99), PERCENTILE(0.999),
+	    PERCENTILE(1.0), (done ? cpu / done : 0));
+    if (havestats && (conns[1] > conns[0]))
+	printf(",\"rtts_per_connect\":%.2f",
+		1 + (double) (msgs[1] - msgs[0]) / (conns[1] - conns[0]));
+    if (tbytes)
+	printf(",\"throughput_MBps\":%.1f", mbps);
+    printf("}\n");
+
+    return (errors ? 1 : 0);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,1067 @@
+/*
+ * HANDSHAKE - Part of the tsocks benchmarks
+ *
+ * Checks how many round trips and system calls libtsocks takes to set
+ * up a connection. libtsocks is linked in and connects through a
+ * scripted SOCKS 4 or 5 server or HTTP proxy in another thread, or a
+ * chain of them (with SOCKS 5 servers that ask for a password and ones
+ * that don't, and that reply with IPv4, IPv6 or named bound addresses,
+ * or HTTP proxies followed at once by the destination's first data).
+ * The server waits a fixed latency before each reply and can inject a
+ * fault in place of the reply to any one message: an extra delay, a
+ * reply trickled out a byte at a time (with the request read a byte at
+ * a time too), a reset, a close, a truncated, refused or garbage reply.
+ * Each connect is made blocking, polled or selected for (asking
+ * connect() how it went, or for polled sockets getsockopt(SO_ERROR) as
+ * many programs do) and its result, the number of round trips the
+ * server saw (counting the TCP handshake) and the number of calls
+ * libtsocks made to the system are checked against what is expected,
+ * and any data that came with the last reply has to be left for the
+ * program to read. Results are printed as JSON, one line per scenario,
+ * and the exit status is non zero if any scenario failed.
+ *
+ * The calls counted are the connect(), select(), poll(), close(),
+ * getpeername(), getsockopt(), send() and recv() calls libtsocks makes
+ * (and getpwuid(), which can go to disk or the network) while the
+ * harness is connecting, the Makefile links this with the linker
+ * wrapping those (see bench/handshake in Makefile.in).
+ */
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+#include <tsocks.h>
+#include "benchutil.h"
+
+#define TIMEOUT		10 /* Seconds any one scenario may take */
+#define TRICKLE_US	1000 /* Gap between bytes of a trickled reply */
+#define MAXSTATES	16 /* Replies in the longest flow */
+#define EARLYDATA	"EARLYDATA" /* Sent by the destination at once */
+
+/* How the harness waits for a connect to finish */
+enum modes { BLOCKING, POLLING, SELECTING, SOCKOPT, MODES };
+static char *modenames[] = { "blocking", "poll", "select", "sockopt" };
+
+/* What the server does instead of replying normally */
+enum faults { NONE, DELAY, PARTIAL, RESET, CLOSE, TRUNCATE, REFUSE,
+	GARBAGE, FAULTS };
+static char *faultnames[] = { "none", "delay", "partial", "reset", "close",
+	"truncate", "refuse", "garbage" };
+
+/* Structure representing one kind of handshake, through one server */
+/* or a chain of them, all played by the harness over the one        */
+/* connection. Each server asks for the path's username and password  */
+/* or doesn't, and a chain can name the servers after the first by    */
+/* names too long for libtsocks to send every message at once. The    */
+/* states libtsocks waits for replies in, the length of each reply    */
+/* and the round trip it answers are worked out by plan_flow().       */
+/* Replies from an HTTP proxy are peeked at before they are read, a   */
+/* call more for each part of one that arrives on its own             */
+struct flow {
+    char *name;
+    int version;
+    int creds; /* The path has a username and password */
+    char *auth; /* For each server, '2' if it asks for them */
+    int longnames;
+    int down; /* Nothing listens on the server's port */
+    char *target;
+    int budget[MODES]; /* System calls for a clean handshake */
+    int bound; /* Address type of a SOCKS 5 connect reply, 0 for 1 */
+    int early; /* EARLYDATA comes with the last reply */
+    int nstates;
+    int states[MAXSTATES];
+    char statenames[MAXSTATES][32];
+    int replylen[MAXSTATES];
+    int flight[MAXSTATES]; /* Counting the TCP handshake as the first */
+    int peek;
+};
+
+static struct flow flows[] = {
+    { "socks4", 4, 0, "0", 0, 0, "10.4.0.1", { 6, 11, 11, 11 } },
+    { "socks5", 5, 1, "0", 0, 0, "10.5.0.1", { 7, 14, 14, 14 } },
+    { "socks5-auth", 5, 1, "2", 0, 0, "10.6.0.1", { 10, 19, 19, 19 } },
+    { "http", SERVER_HTTP, 0, "0", 0, 0, "10.8.0.1", { 3, 8, 7, 8 } },
+    { "http-auth", SERVER_HTTP, 1, "2", 0, 0, "10.9.0.1", { 4, 9, 8, 9 } },
+    { "http-early", SERVER_HTTP, 0, "0", 0, 0, "10.10.0.1", { 3, 8, 7, 8 },
+	0, 1 },
+    { "socks5-down", 5, 0, "0", 0, 1, "10.7.0.1", { 3, 7, 6, 6 } },
+    { "socks5-bound6", 5, 0, "0", 0, 0, "10.58.0.1", { 5, 11, 11, 11 }, 4 },
+    { "socks5-boundname", 5, 0, "0", 0, 0, "10.59.0.1", { 5, 11, 11, 11 },
+	3 },
+    { "socks4-chain2", 4, 0, "00", 0, 0, "10.41.0.1", { 7, 13, 13, 13 } },
+    { "socks4-chain3", 4, 0, "000", 0, 0, "10.42.0.1", { 8, 15, 15, 15 } },
+    { "socks4-chain5-long", 4, 0, "00000", 1, 0, "10.43.0.1",
+	{ 14, 23, 23, 23 } },
+    { "socks5-chain2", 5, 0, "00", 0, 0, "10.51.0.1", { 5, 13, 13, 13 } },
+    { "socks5-chain3", 5, 0, "000", 0, 0, "10.52.0.1", { 5, 15, 15, 15 } },
+    { "socks5-chain2-auth", 5, 1, "22", 0, 0, "10.53.0.1",
+	{ 7, 17, 17, 17 } },
+    { "socks5-chain2-mixed", 5, 1, "02", 0, 0, "10.54.0.1",
+	{ 6, 15, 15, 15 } },
+    { "socks5-chain3-mixed", 5, 1, "020", 0, 0, "10.55.0.1",
+	{ 6, 17, 17, 17 } },
+    { "socks5-chain5-long", 5, 0, "00000", 1, 0, "10.56.0.1",
+	{ 5, 19, 19, 19 } },
+    { "http-chain2-auth", SERVER_HTTP, 1, "22", 0, 0, "10.81.0.1",
+	{ 6, 12, 12, 12 } },
+    { "http-chain2-early", SERVER_HTTP, 0, "00", 0, 0, "10.82.0.1",
+	{ 4, 10, 10, 10 }, 0, 1 },
+};
+#define FLOWS (sizeof(flows) / sizeof(flows[0]))
+
+/* System calls libtsocks needs for each byte of a reply that */
+/* arrives on its own, by mode                                */
+static int perbyte[MODES] = { 1, 3, 3, 3 };
+
+/* Structure representing one connect and how it should go */
+struct scenario {
+    struct flow *flow;
+    int mode;
+    int state; /* Index into flow->states of the faulty reply */
+    int fault;
+    int expecterr;
+    int expectrtts;
+    int budget;
+};
+
+/* Structure representing the scripted server's side of a scenario */
+struct peer {
+    struct scenario *s;
+    int listenfd;
+    int fd;
+    int flights;
+    int pipelined;
+    int state; /* Index into flow->states of the next reply */
+    pthread_t thread;
+};
+
+static int latency = 2000; /* Microseconds before each reply */
+static char *current = "startup";
+
+/* Calls to the system made by libtsocks, counted while the harness */
+/* thread is connecting                                             */
+static __thread int counting = 0;
+static unsigned long calls = 0;
+
+static int (*nextconnect)(CONNECT_SIGNATURE);
+static int (*nextselect)(SELECT_SIGNATURE);
+static int (*nextpoll)(POLL_SIGNATURE);
+static int (*nextclose)(CLOSE_SIGNATURE);
+static int (*nextgetpeername)(GETPEERNAME_SIGNATURE);
+static int (*nextgetsockopt)(GETSOCKOPT_SIGNATURE);
+
+void *__real_dlsym(void *, const char *);
+ssize_t __real_send(int, const void *, size_t, int);
+ssize_t __real_recv(int, void *, size_t, int);
+struct passwd *__real_getpwuid(uid_t);
+
+void *__wrap_dlsym(void *, const char *);
+ssize_t __wrap_send(int, const void *, size_t, int);
+ssize_t __wrap_recv(int, void *, size_t, int);
+struct passwd *__wrap_getpwuid(uid_t);
+
+static int counted_connect(CONNECT_SIGNATURE);
+static int counted_select(SELECT_SIGNATURE);
+static int counted_poll(POLL_SIGNATURE);
+static int counted_close(CLOSE_SIGNATURE);
+static int counted_getpeername(GETPEERNAME_SIGNATURE);
+static int counted_getsockopt(GETSOCKOPT_SIGNATURE);
+static char *errname(int);
+static void timeout_handler(int);
+static int listen_local(int *);
+static int closed_port(void);
+static void warm_up(int, int);
+static void plan_flow(struct flow *);
+static void add_state(struct flow *, int, char *, int, int, int, int);
+static int connect_reply(struct flow *, unsigned char *);
+static void long_name(char *, size_t, int);
+static int write_config(int, int, char *, int);
+static int take(struct peer *, unsigned char *, size_t, int);
+static int read_all(int, unsigned char *, size_t);
+static int reply(struct peer *, int, unsigned char *, unsigned char *,
+	size_t);
+static void *serve(void *);
+static int serve_socks4(struct peer *);
+static int serve_socks5(struct peer *, int);
+static int serve_http(struct peer *);
+static int wait_connect(int, struct sockaddr_in *, int);
+static int read_early(int);
+static int run(struct scenario *, int);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: [-l latency usecs] [-m mode[,mode...]] "
+	"[-s scenario substring]";
+    char defmodes[] = "blocking,poll,select,sockopt";
+    char *modelist = defmodes, *filter = NULL, *word;
+    char conffile[] = "/tmp/tsocks-handshake.XXXXXX";
+    int usemode[MODES] = { 0, 0, 0, 0 };
+    struct scenario s;
+    char name[128];
+    unsigned int f;
+    int listenfd, port, mode, state, fault, conffd, c;
+    int failed = 0, ran = 0;
+
+    while ((c = getopt(argc, argv, "l:m:s:")) != -1) {
+	switch (c) {
+	    case 'l':
+		latency = atoi(optarg);
+		break;
+	    case 'm':
+		modelist = optarg;
+		break;
+	    case 's':
+		filter = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    for (word = strtok(modelist, ","); word; word = strtok(NULL, ",")) {
+	for (mode = 0; (mode < MODES) && strcmp(word, modenames[mode]); mode++)
+	    /* Empty Loop */;
+	if (mode == MODES) {
+	    show_msg(MSGERR, "%s\n", usage);
+	    exit(1);
+	}
+	usemode[mode] = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGALRM, timeout_handler);
+
+    for (f = 0; f < FLOWS; f++)
+	plan_flow(&flows[f]);
+
+    /* The configuration sends everything to the scripted server, */
+    /* which must be set up before libtsocks first connects        */
+    if ((listenfd = listen_local(&port)) < 0)
+	exit(1);
+    if ((conffd = mkstemp(conffile)) < 0) {
+	show_msg(MSGERR, "Could not create configuration file (%s)\n",
+		strerror(errno));
+	exit(1);
+    }
+    write_config(port, closed_port(), conffile, conffd);
+    setenv("TSOCKS_CONF_FILE", conffile, 1);
+    /* Faults make libtsocks complain, which is expected */
+    setenv("TSOCKS_DEBUG", "-1", 0);
+    warm_up(listenfd, port);
+
+    for (mode = 0; mode < MODES; mode++) {
+	if (!usemode[mode])
+	    continue;
+	for (f = 0; f < FLOWS; f++) {
+	    for (state = 0; state < flows[f].nstates; state++) {
+		for (fault = 0; fault < FAULTS; fault++) {
+		    /* A clean handshake only needs trying once, and */
+		    /* there's no reply to a server that isn't there */
+		    if (((fault == NONE) && state) ||
+			    (flows[f].down && (fault != NONE)))
+			continue;
+		    s.flow = &flows[f];
+		    s.mode = mode;
+		    s.state = state;
+		    s.fault = fault;
+		    snprintf(name, sizeof(name), "%s/%s/%s/%s",
+			    flows[f].name, modenames[mode],
+			    (fault == NONE ? "any" : flows[f].statenames[state]),
+			    faultnames[fault]);
+		    if (filter && !strstr(name, filter))
+			continue;
+		    current = name;
+		    failed |= run(&s, listenfd);
+		    ran++;
+		}
+	    }
+	}
+    }
+
+    unlink(conffile);
+
+    if (!ran) {
+	show_msg(MSGERR, "No scenarios matched\n");
+	return 1;
+    }
+
+    return failed;
+}
+
+void *__wrap_dlsym(void *handle, const char *symbol) {
+    void *sym = __real_dlsym(handle, symbol);
+
+    /* Hand libtsocks counting versions of the calls it looks up */
+    if (sym == NULL)
+	return NULL;
+    if (!strcmp(symbol, "connect")) {
+	nextconnect = sym;
+	return counted_connect;
+    } else if (!strcmp(symbol, "select")) {
+	nextselect = sym;
+	return counted_select;
+    } else if (!strcmp(symbol, "poll")) {
+	nextpoll = sym;
+	return counted_poll;
+    } else if (!strcmp(symbol, "close")) {
+	nextclose = sym;
+	return counted_close;
+    } else if (!strcmp(symbol, "getpeername")) {
+	nextgetpeername = sym;
+	return counted_getpeername;
+    } else if (!strcmp(symbol, "getsockopt")) {
+	nextgetsockopt = sym;
+	return counted_getsockopt;
+    }
+
+    return sym;
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+
+    if (counting)
+	calls++;
+    return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+
+    if (counting)
+	calls++;
+    return __real_recv(fd, buf, len, flags);
+}
+
+struct passwd *__wrap_getpwuid(uid_t uid) {
+
+    if (counting)
+	calls++;
+    return __real_getpwuid(uid);
+}
+
+static int counted_connect(CONNECT_SIGNATURE) {
+
+    if (counting)
+	calls++;
+    return nextconnect(__fd, __addr, __len);
+}
+
+static int counted_select(SELECT_SIGNATURE) {
+
+    if (counting)
+	calls++;
+    return nextselect(n, readfds, writefds, exceptfds, timeout);
+}
+
+static int counted_poll(POLL_SIGNATURE) {
+
+    if (counting)
+	calls++;
+    return nextpoll(ufds, nfds, timeout);
+}
+
+static int counted_close(CLOSE_SIGNATURE) {
+
+    if (counting)
+	calls++;
+    return nextclose(fd);
+}
+
+static int counted_getpeername(GETPEERNAME_SIGNATURE) {
+
+    if (counting)
+	calls++;
+    return nextgetpeername(__fd, __name, __namelen);
+}
+
+static int counted_getsockopt(GETSOCKOPT_SIGNATURE) {
+
+    if (counting)
+	calls++;
+    return nextgetsockopt(__fd, __level, __optname, __optval, __optlen);
+}
+
+static char *errname(int err) {
+    static char buf[16];
+
+    switch (err) {
+	case 0:
+	    return "ok";
+	case ECONNREFUSED:
+	    return "ECONNREFUSED";
+	case ECONNRESET:
+	    return "ECONNRESET";
+	case ECONNABORTED:
+	    return "ECONNABORTED";
+	case ENOTCONN:
+	    return "ENOTCONN";
+	case EAGAIN:
+	    return "EAGAIN";
+	case EINPROGRESS:
+	    return "EINPROGRESS";
+	case ETIMEDOUT:
+	    return "ETIMEDOUT";
+    }
+    snprintf(buf, sizeof(buf), "%d", err);
+
+    return buf;
+}
+
+static void timeout_handler(int signo) {
+
+    /* Nothing to do but say which scenario hung */
+    if (write(2, "handshake: timed out in ", 24) < 0 ||
+	    write(2, current, strlen(current)) < 0 || write(2, "\n", 1) < 0)
+	_exit(2);
+    _exit(2);
+}
+
+static int listen_local(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+	    bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, 16) ||
+	    getsockname(fd, (struct sockaddr *) &addr, &len)) {
+	show_msg(MSGERR, "Could not listen on the loopback address (%s)\n",
+		strerror(errno));
+	return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    return fd;
+}
+
+/* A loopback port nothing listens on, for a server that is down */
+static int closed_port(void) {
+    int fd, port;
+
+    if ((fd = listen_local(&port)) < 0)
+	exit(1);
+    close(fd);
+
+    return port;
+}
+
+/* Make a local connection before anything is counted, so the */
+/* work libtsocks does once per process (reading its           */
+/* configuration and setting up its statistics) isn't charged  */
+/* to the first scenario                                       */
+static void warm_up(int listenfd, int port) {
+    struct sockaddr_in addr;
+    int fd, peer;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+	    connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    ((peer = accept(listenfd, NULL, NULL)) < 0)) {
+	show_msg(MSGERR, "Could not connect to the harness (%s)\n",
+		strerror(errno));
+	exit(1);
+    }
+    close(peer);
+    close(fd);
+}
+
+/* Work out the replies libtsocks waits for in a flow, and which  */
+/* round trip each answers. The servers of a chain are all sent    */
+/* their messages at once unless they don't fit or a SOCKS 5       */
+/* server has to choose whether to authenticate, otherwise each is */
+/* negotiated with once the one before it has connected to it, and */
+/* a SOCKS 5 server's methods go along with the request to connect */
+/* to it                                                            */
+static void plan_flow(struct flow *flow) {
+    int hops = strlen(flow->auth), hop, flight = 1;
+    int pipelined = ((hops > 1) && !flow->longnames &&
+	    ((flow->version != 5) || !flow->creds));
+
+    flow->peek = (flow->version == SERVER_HTTP);
+    if (flow->down) {
+	add_state(flow, CONNECTING, "CONNECTING", 0, 1, 0, 0);
+	return;
+    }
+
+    for (hop = 0; hop < hops; hop++) {
+	if (flow->version == 4) {
+	    add_state(flow, SENTV4REQ, "SENTV4REQ", hop, hops, 8,
+		    (pipelined ? 2 : ++flight));
+	} else if (flow->version == SERVER_HTTP) {
+	    add_state(flow, SENTHTTPCONNECT, "SENTHTTPCONNECT", hop, hops, 39,
+		    (pipelined ? 2 : ++flight));
+	} else {
+	    add_state(flow, SENTV5METHOD, "SENTV5METHOD", hop, hops, 2,
+		    (pipelined ? 2 : (hop ? flight : ++flight)));
+	    if (flow->auth[hop] == '2')
+		add_state(flow, SENTV5AUTH, "SENTV5AUTH", hop, hops, 2,
+			++flight);
+	    add_state(flow, SENTV5CONNECT, "SENTV5CONNECT", hop, hops,
+		    connect_reply(flow, NULL), (pipelined ? 2 : ++flight));
+	}
+    }
+}
+
+/* Add a reply to a flow, named after the state and for a chain */
+/* the server it comes from                                     */
+static void add_state(struct flow *flow, int state, char *name, int hop,
+	int hops, int replylen, int flight) {
+    int i = flow->nstates++;
+
+    flow->states[i] = state;
+    if (hops > 1)
+	snprintf(flow->statenames[i], sizeof(flow->statenames[i]), "%s:%d",
+		name, hop + 1);
+    else
+	snprintf(flow->statenames[i], sizeof(flow->statenames[i]), "%s",
+		name);
+    flow->replylen[i] = replylen;
+    flow->flight[i] = flight;
+}
+
+/* The reply to a SOCKS 5 connect request with the bound address */
+/* of the flow's type, put in reply if given. Returns its length  */
+static int connect_reply(struct flow *flow, unsigned char *reply) {
+    unsigned char buf[32] = { 5, 0, 0, 1 };
+    static char name[] = "relay.example";
+    int len = 10;
+
+    if (flow->bound == 4) {
+	buf[3] = 4;
+	len = 22;
+    } else if (flow->bound == 3) {
+	buf[3] = 3;
+	buf[4] = strlen(name);
+	memcpy(&buf[5], name, buf[4]);
+	len = 7 + buf[4];
+    }
+    if (reply)
+	memcpy(reply, buf, len);
+
+    return len;
+}
+
+/* A server name of 251 characters, as long as a SOCKS 5 request */
+/* can carry, a handful of which don't fit in libtsocks's buffer  */
+static void long_name(char *buf, size_t len, int hop) {
+    size_t i;
+
+    for (i = 0; (i < 251) && (i < len - 1); i++)
+	buf[i] = ((i % 64) == 63 ? '.' : 'a' + (hop % 26));
+    buf[i] = '\0';
+}
+
+/* Send each flow's destinations through a path of its own, every */
+/* server of which is the harness (a chain names it again for each */
+/* server after the first), apart from the path to a server that  */
+/* is down. Anything else goes to the default SOCKS 5 server       */
+static int write_config(int port, int downport, char *conffile, int fd) {
+    char name[256];
+    struct in_addr net;
+    struct flow *flow;
+    FILE *conf;
+    unsigned int f;
+    int hop;
+
+    if ((conf = fdopen(fd, "w")) == NULL) {
+	show_msg(MSGERR, "Could not write configuration file %s (%s)\n",
+		conffile, strerror(errno));
+	exit(1);
+    }
+    fprintf(conf, "local = 127.0.0.0/255.0.0.0\n"
+	    "server = 127.0.0.1\n"
+	    "server_port = %d\n"
+	    "server_type = 5\n", port);
+    for (f = 0; f < FLOWS; f++) {
+	flow = &flows[f];
+	inet_aton(flow->target, &net);
+	net.s_addr &= htonl(0xffff0000);
+	fprintf(conf, "path {\n\treaches = %s/255.255.0.0\n", inet_ntoa(net));
+	if (strlen(flow->auth) == 1) {
+	    fprintf(conf, "\tserver = 127.0.0.1\n\tserver_port = %d\n",
+		    (flow->down ? downport : port));
+	} else {
+	    fprintf(conf, "\tchain = 127.0.0.1:%d", port);
+	    for (hop = 1; hop < (int) strlen(flow->auth); hop++) {
+		if (flow->longnames)
+		    long_name(name, sizeof(name), hop);
+		else
+		    strcpy(name, "127.0.0.1");
+		fprintf(conf, ",%s:%d", name, port);
+	    }
+	    fprintf(conf, "\n");
+	}
+	if (flow->version == SERVER_HTTP)
+	    fprintf(conf, "\tserver_type = http\n");
+	else
+	    fprintf(conf, "\tserver_type = %d\n", flow->version);
+	if (flow->creds)
+	    fprintf(conf, "\tdefault_user = handshake\n"
+		    "\tdefault_pass = handshake\n");
+	fprintf(conf, "}\n");
+    }
+    fclose(conf);
+
+    return 0;
+}
+
+/* Read a message from the client, a byte at a time if partial, */
+/* a message that didn't arrive with the one before it means the */
+/* client waited for our reply. Returns -1 if the client hung up */
+static int take(struct peer *peer, unsigned char *buf, size_t len,
+	int partial) {
+    size_t done = 0;
+    ssize_t rc;
+
+    if (!peer->pipelined)
+	peer->flights++;
+    peer->pipelined = 0;
+
+    while (done < len) {
+	if ((rc = read(peer->fd, buf + done, (partial ? 1 : len - done))) <= 0) {
+	    if ((rc < 0) && (errno == EINTR))
+		continue;
+	    return -1;
+	}
+	done += rc;
+    }
+
+    return 0;
+}
+
+/* Reply to the message sent in the state given (an index into the */
+/* flow's states), with the fault if it is for this state. Returns */
+/* 0 if the handshake can go on. The destination's first data goes */
+/* out with the last byte of the last reply of an early flow       */
+static int reply(struct peer *peer, int state, unsigned char *ok,
+	unsigned char *refusal, size_t len) {
+    static char garbage[64] = "HTTP/1.0 400 Bad Request\r\n";
+    static char socks[64] = { 5, 0, 0, 1 };
+    struct flow *flow = peer->s->flow;
+    struct linger linger = { 1, 0 };
+    unsigned char buf[128];
+    int fault = (peer->s->state == state ? peer->s->fault : NONE);
+    int pending = 0, rc = -1;
+    size_t i, extra = 0;
+
+    memcpy(buf, ok, len);
+    if (flow->early && (state == flow->nstates - 1)) {
+	extra = strlen(EARLYDATA);
+	memcpy(buf + len, EARLYDATA, extra);
+    }
+
+    usleep(latency);
+    if (fault == DELAY)
+	usleep(3 * latency);
+
+    /* Anything already sent didn't wait for this reply */
+    if (!ioctl(peer->fd, FIONREAD, &pending) && pending)
+	peer->pipelined = 1;
+
+    switch (fault) {
+	case NONE:
+	case DELAY:
+	    rc = (write(peer->fd, buf, len + extra) ==
+		    (ssize_t) (len + extra) ? 0 : -1);
+	    break;
+	case PARTIAL:
+	    for (i = 0, rc = 0; (i < len) && !rc; i++) {
+		if (i)
+		    usleep(TRICKLE_US);
+		if (i < len - 1)
+		    rc = (write(peer->fd, buf + i, 1) == 1 ? 0 : -1);
+		else
+		    rc = (write(peer->fd, buf + i, 1 + extra) ==
+			    (ssize_t) (1 + extra) ? 0 : -1);
+	    }
+	    break;
+	case RESET:
+	    setsockopt(peer->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	    close(peer->fd);
+	    peer->fd = -1;
+	    break;
+	case TRUNCATE:
+	    if (write(peer->fd, ok, len / 2) < 0)
+		break;
+	    /* Fall through */
+	case CLOSE:
+	    close(peer->fd);
+	    peer->fd = -1;
+	    break;
+	case REFUSE:
+	    if (write(peer->fd, refusal, len) < 0)
+		break;
+	    break;
+	case GARBAGE:
+	    /* A SOCKS reply is as wrong from an HTTP proxy */
+	    if (write(peer->fd, (peer->s->flow->version == SERVER_HTTP ?
+			    socks : garbage), len) < 0)
+		break;
+	    break;
+    }
+
+    return rc;
+}
+
+/* Read the rest of a message, which arrives with its start. Returns */
+/* -1 if the client hung up                                          */
+static int read_all(int fd, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    ssize_t rc;
+
+    while (done < len) {
+	if ((rc = read(fd, buf + done, len - done)) <= 0) {
+	    if ((rc < 0) && (errno == EINTR))
+		continue;
+	    return -1;
+	}
+	done += rc;
+    }
+
+    return 0;
+}
+
+/* Play each server of the flow in turn, stopping at a fault */
+static void *serve(void *arg) {
+    struct peer *peer = arg;
+    struct flow *flow = peer->s->flow;
+    unsigned char buf[512];
+    int on = 1, hop, rc = 0;
+
+    if ((peer->fd = accept(peer->listenfd, NULL, NULL)) < 0)
+	return NULL;
+    setsockopt(peer->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    /* The TCP handshake is a round trip of its own */
+    peer->flights = 1;
+
+    for (hop = 0; flow->auth[hop] && !rc; hop++) {
+	if (flow->version == 4)
+	    rc = serve_socks4(peer);
+	else if (flow->version == SERVER_HTTP)
+	    rc = serve_http(peer);
+	else
+	    rc = serve_socks5(peer, hop);
+    }
+
+    /* Wait for the client to finish with the connection */
+    if (peer->fd >= 0) {
+	while (read(peer->fd, buf, sizeof(buf)) > 0)
+	    /* Empty Loop */;
+	close(peer->fd);
+    }
+
+    return NULL;
+}
+
+/* Each server's side of a handshake, returns 0 if the next server */
+/* in a chain is to be played                                      */
+static int serve_socks4(struct peer *peer) {
+    unsigned char ok[8] = { 0, 90 }, refusal[8] = { 0, 91 };
+    unsigned char req[512];
+    int partial = ((peer->s->fault == PARTIAL) &&
+	    (peer->s->state == peer->state));
+    size_t i;
+
+    if (take(peer, req, 8, partial))
+	return -1;
+    /* The username follows, then for SOCKS 4A (an address of */
+    /* 0.0.0.x) the name of the destination                   */
+    for (i = 8; (i < sizeof(req)) && req[i - 1]; i++) {
+	if (read(peer->fd, &req[i], 1) != 1)
+	    return -1;
+    }
+    if (!req[4] && !req[5] && !req[6] && req[7]) {
+	do {
+	    if (read(peer->fd, req, 1) != 1)
+		return -1;
+	} while (req[0]);
+    }
+
+    return reply(peer, peer->state++, ok, refusal, sizeof(ok));
+}
+
+static int serve_socks5(struct peer *peer, int hop) {
+    unsigned char method[2] = { 5, 0 }, nomethod[2] = { 5, 0xff };
+    unsigned char authok[2] = { 1, 0 }, authfail[2] = { 1, 1 };
+    unsigned char ok[32], refusal[32];
+    unsigned char req[512];
+    struct scenario *s = peer->s;
+    int auth = (s->flow->auth[hop] == '2'), len, i, replylen;
+
+    if (auth)
+	method[1] = 2;
+
+    if (take(peer, req, 2, (s->fault == PARTIAL) &&
+		(s->state == peer->state)) ||
+	    read_all(peer->fd, req + 2, req[1]))
+	return -1;
+    /* A real server refuses a client that doesn't offer its method */
+    for (i = 0; (i < req[1]) && (req[2 + i] != method[1]); i++)
+	/* Empty Loop */;
+    if (i == req[1]) {
+	if (write(peer->fd, nomethod, sizeof(nomethod)) < 0)
+	    return -1;
+	return -1;
+    }
+    if (reply(peer, peer->state++, method, nomethod, sizeof(method)))
+	return -1;
+
+    if (auth) {
+	if (take(peer, req, 2, (s->fault == PARTIAL) &&
+		    (s->state == peer->state)) ||
+		read_all(peer->fd, req + 2, req[1] + 1))
+	    return -1;
+	len = req[2 + req[1]];
+	if (read_all(peer->fd, req, len) ||
+		reply(peer, peer->state++, authok, authfail, sizeof(authok)))
+	    return -1;
+    }
+
+    /* The destination is an address or a name */
+    if (take(peer, req, 5, (s->fault == PARTIAL) &&
+		(s->state == peer->state)))
+	return -1;
+    if (req[3] == 1)
+	len = 5;
+    else if (req[3] == 3)
+	len = req[4] + 2;
+    else
+	len = 17;
+    if (read_all(peer->fd, req + 5, len))
+	return -1;
+
+    replylen = connect_reply(s->flow, ok);
+    memcpy(refusal, ok, replylen);
+    refusal[1] = 5;
+    return reply(peer, peer->state++, ok, refusal, replylen);
+}
+
+static int serve_http(struct peer *peer) {
+    unsigned char ok[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+    unsigned char refusal[] = "HTTP/1.1 502 Bad Gateway\r\nServer: x\r\n\r\n";
+    unsigned char req[1024];
+    int partial = ((peer->s->fault == PARTIAL) &&
+	    (peer->s->state == peer->state));
+    size_t i;
+
+    /* The request ends with a blank line, and has credentials if */
+    /* the path has them                                          */
+    if (take(peer, req, 1, partial))
+	return -1;
+    for (i = 1; (i < sizeof(req) - 1) &&
+	    ((i < 4) || memcmp(&req[i - 4], "\r\n\r\n", 4)); i++) {
+	if (read(peer->fd, &req[i], 1) != 1)
+	    return -1;
+    }
+    req[i] = '\0';
+    if ((strstr((char *) req, "\r\nProxy-Authorization: Basic ") != NULL) !=
+	    peer->s->flow->creds)
+	return -1;
+
+    return reply(peer, peer->state++, ok, refusal, sizeof(ok) - 1);
+}
+
+/* Wait for a non blocking connect, as a program polling or selecting */
+/* for the socket to be writable then asking connect() how it went,   */
+/* or reading SO_ERROR                                                */
+static int wait_connect(int fd, struct sockaddr_in *addr, int mode) {
+    socklen_t len = sizeof(int);
+    struct pollfd pfd;
+    fd_set writefds;
+    int rc, err;
+
+    do {
+	if (mode != SELECTING) {
+	    pfd.fd = fd;
+	    pfd.events = POLLOUT;
+	    rc = poll(&pfd, 1, -1);
+	} else {
+	    FD_ZERO(&writefds);
+	    FD_SET(fd, &writefds);
+	    rc = select(fd + 1, NULL, &writefds, NULL, NULL);
+	}
+	if ((rc < 0) && (errno != EINTR))
+	    return errno;
+	if (rc <= 0)
+	    continue;
+	if (mode == SOCKOPT)
+	    return (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) ?
+		    errno : err);
+	if (!connect(fd, (struct sockaddr *) addr, sizeof(*addr)))
+	    return 0;
+    } while ((errno == EINTR) || (errno == EINPROGRESS) ||
+	    (errno == EALREADY) || (errno == EAGAIN));
+
+    return errno;
+}
+
+/* Read what the destination sent at once as the program would once */
+/* connected, returns 0 if it arrived intact and nothing before it   */
+static int read_early(int fd) {
+    char buf[sizeof(EARLYDATA)];
+    struct pollfd pfd;
+    size_t done = 0;
+    ssize_t rc;
+
+    while (done < sizeof(buf) - 1) {
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ((rc = poll(&pfd, 1, 1000)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (!rc)
+	    return -1;
+	if ((rc = read(fd, buf + done, sizeof(buf) - 1 - done)) <= 0) {
+	    if ((rc < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+		continue;
+	    return -1;
+	}
+	done += rc;
+    }
+
+    return (memcmp(buf, EARLYDATA, done) ? -1 : 0);
+}
+
+/* Run a scenario, returns 1 if it didn't go as expected */
+static int run(struct scenario *s, int listenfd) {
+    struct flow *flow = s->flow;
+    struct sockaddr_in addr;
+    struct peer peer;
+    uint64_t start, elapsed;
+    unsigned long used;
+    int fd, err = 0, early = 0, fail;
+
+    /* Work out what should happen */
+    s->expecterr = 0;
+    s->expectrtts = flow->flight[flow->nstates - 1];
+    s->budget = flow->budget[s->mode];
+    switch (s->fault) {
+	case PARTIAL:
+	    s->budget += (perbyte[s->mode] + flow->peek) *
+		(flow->replylen[s->state] - 1);
+	    break;
+	case RESET:
+	    /* Polled and selected sockets have the error fetched */
+	    if (s->mode != BLOCKING)
+		s->budget++;
+	    s->expecterr = ECONNRESET;
+	    break;
+	case TRUNCATE:
+	    /* The part of the reply sent arrives on its own */
+	    s->budget += perbyte[s->mode] + flow->peek;
+	    /* Fall through */
+	case CLOSE:
+	    /* Closing on messages not read yet resets the connection */
+	    s->expecterr = (((s->state + 1 < flow->nstates) &&
+			(flow->flight[s->state + 1] ==
+			 flow->flight[s->state])) ? ECONNRESET : ENOTCONN);
+	    if ((s->expecterr == ECONNRESET) && (s->mode != BLOCKING))
+		s->budget++;
+	    break;
+	case REFUSE:
+	    s->expecterr = ECONNREFUSED;
+	    break;
+	case GARBAGE:
+	    s->expecterr = ((flow->states[s->state] == SENTV5CONNECT) ?
+		    ECONNABORTED : ECONNREFUSED);
+	    break;
+    }
+    if (s->expecterr)
+	s->expectrtts = flow->flight[s->state];
+    if (flow->down)
+	s->expecterr = ECONNREFUSED;
+
+    memset(&peer, 0x0, sizeof(peer));
+    peer.s = s;
+    peer.listenfd = listenfd;
+    peer.fd = -1;
+    if (!flow->down && pthread_create(&peer.thread, NULL, serve, &peer)) {
+	show_msg(MSGERR, "Could not create thread\n");
+	exit(1);
+    }
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(80);
+    inet_aton(flow->target, &addr.sin_addr);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	show_msg(MSGERR, "Could not create socket (%s)\n", strerror(errno));
+	exit(1);
+    }
+    if (s->mode != BLOCKING)
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    alarm(TIMEOUT);
+    calls = 0;
+    counting = 1;
+    start = now_ns();
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+	err = errno;
+	if ((s->mode != BLOCKING) && (err == EINPROGRESS))
+	    err = wait_connect(fd, &addr, s->mode);
+    }
+    elapsed = now_ns() - start;
+    counting = 0;
+    used = calls;
+
+    /* Whatever came with the last reply is the program's to read */
+    if (flow->early && !err)
+	early = read_early(fd);
+
+    close(fd);
+    if (!flow->down)
+	pthread_join(peer.thread, NULL);
+    alarm(0);
+
+    fail = ((err != s->expecterr) || (peer.flights != s->expectrtts) ||
+	    (used > (unsigned long) s->budget) || early);
+
+    printf("{\"bench\":\"handshake\",\"flow\":\"%s\",\"mode\":\"%s\","
+	    "\"state\":\"%s\",\"fault\":\"%s\",\"latency_us\":%d,"
+	    "\"result\":\"%s\",\"expected\":\"%s\",\"rtts\":%d,"
+	    "\"expected_rtts\":%d,\"syscalls\":%lu,\"budget\":%d,"
+	    "\"ms\":%.3f,\"early\":\"%s\",\"pass\":%s}\n",
+	    flow->name, modenames[s->mode],
+	    (s->fault == NONE ? "any" : flow->statenames[s->state]),
+	    faultnames[s->fault], latency, errname(err),
+	    errname(s->expecterr), peer.flights, s->expectrtts, used, s->budget,
+	    elapsed / 1e6, (!flow->early || err ? "none" :
+		(early ? "lost" : "intact")), (fail ? "false" : "true"));
+    fflush(stdout);
+
+    return fail;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
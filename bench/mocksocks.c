@@ -0,0 +1,473 @@
+/*
+ * MOCKSOCKS - Part of the tsocks benchmarks
+ *
+ * A minimal SOCKS 4/4a/5 server for benchmarking libtsocks. It never
+ * connects anywhere, once a request has been accepted it simply echoes
+ * whatever the client sends. A UDP association echoes every datagram
+ * back to where it came from, SOCKS header and all, so it looks like the
+ * reply of the destination. A second port accepts plain connections
+ * which are echoed too (for measuring direct connections) and answers
+ * "stats" with the number of connections and SOCKS messages seen so far,
+ * datagrams sent to it are echoed as well.
+ */
+
+#define _GNU_SOURCE
+
+/* Global configuration variables */
+char *progname = "mocksocks";
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+
+/* Settings */
+static int version = 0; /* Version to accept, 0 for either */
+static char *username = NULL; /* Username and password required */
+static char *password = NULL; /* by SOCKS 5 if set              */
+static useconds_t delay = 0; /* Delay before every reply */
+
+/* Statistics */
+static unsigned long connections = 0;
+static unsigned long messages = 0;
+
+static int read_all(int, void *, size_t);
+static int write_reply(int, void *, size_t);
+static int read_string(int, char *, size_t);
+static int socks4(int);
+static int socks5(int);
+static void echo(int, char *, size_t);
+static int udp_associate(int);
+static void echo_datagrams(int, int);
+static void *serve_udp(void *);
+static void *serve_socks(void *);
+static void *serve_plain(void *);
+static int listen_on(char *, int);
+static int bind_udp(struct sockaddr_in *);
+static void *accept_loop(void *);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: [-l listen ip] [-p socks port] [-e plain port] "
+	"[-v 4|5] [-a user:pass] [-d delay usecs]";
+    char *address = "127.0.0.1";
+    int socksport = 1080, plainport = 0;
+    int socksfd, plainfd, udpfd;
+    struct sockaddr_in addr;
+    pthread_t thread;
+    char *sep;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:p:e:v:a:d:")) != -1) {
+	switch (c) {
+	    case 'l':
+		address = optarg;
+		break;
+	    case 'p':
+		socksport = atoi(optarg);
+		break;
+	    case 'e':
+		plainport = atoi(optarg);
+		break;
+	    case 'v':
+		version = atoi(optarg);
+		break;
+	    case 'a':
+		if ((sep = strchr(optarg, ':')) == NULL) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		*sep = '\0';
+		username = optarg;
+		password = sep + 1;
+		break;
+	    case 'd':
+		delay = atoi(optarg);
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((socksfd = listen_on(address, socksport)) < 0)
+	exit(1);
+    if (plainport) {
+	if ((plainfd = listen_on(address, plainport)) < 0)
+	    exit(1);
+	if (pthread_create(&thread, NULL, accept_loop, (void *) (long) (-plainfd - 1))) {
+	    show_msg(MSGERR, "Could not create thread\n");
+	    exit(1);
+	}
+	memset(&addr, 0x0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(plainport);
+	inet_aton(address, &addr.sin_addr);
+	if (((udpfd = bind_udp(&addr)) < 0) ||
+		pthread_create(&thread, NULL, serve_udp, (void *) (long) udpfd)) {
+	    show_msg(MSGERR, "Could not echo UDP on port %d\n", plainport);
+	    exit(1);
+	}
+    }
+
+    accept_loop((void *) (long) socksfd);
+
+    return 0;
+}
+
+static int listen_on(char *address, int port) {
+    struct sockaddr_in addr;
+    int fd, on = 1, qlen = 256;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (!inet_aton(address, &addr.sin_addr)) {
+	show_msg(MSGERR, "Invalid address %s\n", address);
+	return -1;
+    }
+
+    if (((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+	    bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, 4096)) {
+	show_msg(MSGERR, "Could not listen on %s:%d (%s)\n", address, port,
+		strerror(errno));
+	return -1;
+    }
+#ifdef TCP_FASTOPEN
+    /* Takes data in the SYN if the kernel lets servers do so */
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#endif
+
+    return fd;
+}
+
+static int bind_udp(struct sockaddr_in *addr) {
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+	return -1;
+    if (bind(fd, (struct sockaddr *) addr, sizeof(*addr))) {
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+/* Accept connections forever, a negative argument is a plain */
+/* listening socket (stored as -fd - 1)                       */
+static void *accept_loop(void *arg) {
+    long listenfd = (long) arg;
+    int plain = (listenfd < 0), fd, on = 1;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (plain)
+	listenfd = -listenfd - 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 128 * 1024);
+
+    while (1) {
+	if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+	    if ((errno != EINTR) && (errno != ECONNABORTED))
+		show_msg(MSGERR, "accept() failed (%s)\n", strerror(errno));
+	    continue;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (pthread_create(&thread, &attr, (plain ? serve_plain : serve_socks),
+		    (void *) (long) fd)) {
+	    show_msg(MSGERR, "Could not create thread\n");
+	    close(fd);
+	}
+    }
+
+    return NULL;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    ssize_t rc;
+
+    while (done < len) {
+	if ((rc = read(fd, (char *) buf + done, len - done)) <= 0) {
+	    if ((rc < 0) && (errno == EINTR))
+		continue;
+	    return -1;
+	}
+	done += rc;
+    }
+
+    return 0;
+}
+
+/* Send a reply to a SOCKS message, after the artificial delay */
+static int write_reply(int fd, void *buf, size_t len) {
+
+    __atomic_add_fetch(&messages, 1, __ATOMIC_RELAXED);
+    if (delay)
+	usleep(delay);
+
+    return (write(fd, buf, len) == (ssize_t) len ? 0 : -1);
+}
+
+/* Read a NUL terminated string */
+static int read_string(int fd, char *buf, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	if (read_all(fd, &buf[i], 1))
+	    return -1;
+	if (buf[i] == '\0')
+	    return 0;
+    }
+
+    return -1;
+}
+
+static int socks4(int fd) {
+    unsigned char req[7], reply[8];
+    char user[256], host[256];
+
+    /* The version has already been read */
+    if (read_all(fd, req, sizeof(req)) || read_string(fd, user, sizeof(user)))
+	return -1;
+
+    /* SOCKS 4a has the hostname after the username */
+    if (!req[3] && !req[4] && !req[5] && req[6] &&
+	    read_string(fd, host, sizeof(host)))
+	return -1;
+
+    memset(reply, 0x0, sizeof(reply));
+    reply[1] = (req[0] == 1 ? 90 : 91);
+    if (write_reply(fd, reply, sizeof(reply)) || (req[0] != 1))
+	return -1;
+
+    return 0;
+}
+
+static int socks5(int fd) {
+    unsigned char buf[512], reply[10];
+    unsigned char method = 0xff;
+    int i, len;
+
+    /* Method negotiation, the version has already been read */
+    if (read_all(fd, buf, 1) || read_all(fd, buf + 1, buf[0]))
+	return -1;
+    for (i = 1; i <= buf[0]; i++) {
+	if ((buf[i] == 0) && !username)
+	    method = 0;
+	else if ((buf[i] == 2) && username)
+	    method = 2;
+    }
+    reply[0] = 5;
+    reply[1] = method;
+    if (write_reply(fd, reply, 2) || (method == 0xff))
+	return -1;
+
+    /* Username and password */
+    if (method == 2) {
+	if (read_all(fd, buf, 2) || read_all(fd, buf + 2, buf[1]) ||
+		read_all(fd, buf + 2 + buf[1], 1))
+	    return -1;
+	len = buf[1];
+	if (read_all(fd, buf + 3 + len, buf[2 + len]))
+	    return -1;
+	reply[0] = 1;
+	reply[1] = !((len == (int) strlen(username)) &&
+		!memcmp(buf + 2, username, len) &&
+		(buf[2 + len] == strlen(password)) &&
+		!memcmp(buf + 3 + len, password, buf[2 + len]));
+	if (write_reply(fd, reply, 2) || reply[1])
+	    return -1;
+    }
+
+    /* Request */
+    if (read_all(fd, buf, 4))
+	return -1;
+    switch (buf[3]) {
+	case 1:
+	    len = 4;
+	    break;
+	case 3:
+	    if (read_all(fd, buf + 4, 1))
+		return -1;
+	    len = buf[4];
+	    break;
+	case 4:
+	    len = 16;
+	    break;
+	default:
+	    return -1;
+    }
+    if (read_all(fd, buf + 5, len + 2))
+	return -1;
+
+    if (buf[1] == 3)
+	return udp_associate(fd);
+
+    memset(reply, 0x0, sizeof(reply));
+    reply[0] = 5;
+    reply[1] = (buf[1] == 1 ? 0 : 7);
+    reply[3] = 1;
+    if (write_reply(fd, reply, sizeof(reply)) || reply[1])
+	return -1;
+
+    return 0;
+}
+
+static void echo(int fd, char *buf, size_t len) {
+    ssize_t rc;
+
+    while ((rc = read(fd, buf, len)) > 0) {
+	if (write(fd, buf, rc) != rc)
+	    break;
+    }
+}
+
+/* Reply to a UDP ASSOCIATE with a UDP socket on the address the */
+/* client connected to and echo datagrams until it hangs up,      */
+/* returns 1 when done                                            */
+static int udp_associate(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    unsigned char reply[10];
+    int udpfd;
+
+    memset(reply, 0x0, sizeof(reply));
+    reply[0] = 5;
+    reply[3] = 1;
+    if (getsockname(fd, (struct sockaddr *) &addr, &len))
+	return -1;
+    addr.sin_port = 0;
+    if (((udpfd = bind_udp(&addr)) < 0) ||
+	    getsockname(udpfd, (struct sockaddr *) &addr, &len)) {
+	reply[1] = 1;
+	write_reply(fd, reply, sizeof(reply));
+	return -1;
+    }
+    memcpy(&reply[4], &addr.sin_addr, 4);
+    memcpy(&reply[8], &addr.sin_port, 2);
+    if (!write_reply(fd, reply, sizeof(reply)))
+	echo_datagrams(udpfd, fd);
+    close(udpfd);
+
+    return 1;
+}
+
+/* Send datagrams back where they came from a batch at a time, */
+/* until the control connection (if there is one) closes       */
+static void echo_datagrams(int udpfd, int ctlfd) {
+    struct mmsghdr msgs[64];
+    struct sockaddr_in from[64];
+    struct iovec iovs[64];
+    struct pollfd pfds[2];
+    char *bufs;
+    int i, n;
+
+    if ((bufs = malloc(64 * 2048)) == NULL)
+	return;
+
+    pfds[0].fd = udpfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = ctlfd;
+    pfds[1].events = POLLIN;
+    while (1) {
+	if (poll(pfds, (ctlfd >= 0 ? 2 : 1), -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if ((ctlfd >= 0) && pfds[1].revents)
+	    break;
+	for (i = 0; i < 64; i++) {
+	    iovs[i].iov_base = bufs + i * 2048;
+	    iovs[i].iov_len = 2048;
+	    memset(&msgs[i], 0x0, sizeof(msgs[i]));
+	    msgs[i].msg_hdr.msg_name = &from[i];
+	    msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	    msgs[i].msg_hdr.msg_iov = &iovs[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if ((n = recvmmsg(udpfd, msgs, 64, MSG_DONTWAIT, NULL)) <= 0)
+	    continue;
+	for (i = 0; i < n; i++)
+	    iovs[i].iov_len = msgs[i].msg_len;
+	sendmmsg(udpfd, msgs, n, 0);
+    }
+    free(bufs);
+}
+
+static void *serve_udp(void *arg) {
+
+    echo_datagrams((long) arg, -1);
+
+    return NULL;
+}
+
+static void *serve_socks(void *arg) {
+    int fd = (long) arg;
+    unsigned char ver;
+    char buf[16384];
+    int rc = -1;
+
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+
+    if (!read_all(fd, &ver, 1)) {
+	if ((ver == 4) && (version != 5))
+	    rc = socks4(fd);
+	else if ((ver == 5) && (version != 4))
+	    rc = socks5(fd);
+    }
+    if (!rc)
+	echo(fd, buf, sizeof(buf));
+
+    close(fd);
+
+    return NULL;
+}
+
+static void *serve_plain(void *arg) {
+    int fd = (long) arg;
+    char buf[16384];
+    ssize_t rc;
+    int len;
+
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+
+    if ((rc = read(fd, buf, sizeof(buf))) > 0) {
+	if ((rc >= 5) && !memcmp(buf, "stats", 5)) {
+	    len = snprintf(buf, sizeof(buf), "connections=%lu messages=%lu\n",
+		    __atomic_load_n(&connections, __ATOMIC_RELAXED) - 1,
+		    __atomic_load_n(&messages, __ATOMIC_RELAXED));
+	    if (write(fd, buf, len) != len)
+		rc = -1;
+	    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+	} else if (write(fd, buf, rc) == rc)
+	    echo(fd, buf, sizeof(buf));
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,361 @@
+/*
+ * POLLBENCH - Part of the tsocks benchmarks
+ *
+ * Measures the cost of waking up an event loop watching a large number
+ * of fds, some of which are connections with SOCKS handshakes that are
+ * still pending. Each wakeup writes a byte to one socket, waits for it
+ * with select(), poll(), ppoll() or epoll_wait() over every fd and
+ * reads it back. Run it with and without libtsocks preloaded, the
+ * difference is what the interception costs per wakeup. One JSON object
+ * is printed per fd count, pending count and call.
+ */
+
+/* Global configuration variables */
+char *progname = "pollbench";
+
+/* Header Files */
+#define _GNU_SOURCE /* For ppoll() */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+#include "benchutil.h"
+
+#define CALL_SELECT	0
+#define CALL_POLL	1
+#define CALL_PPOLL	2
+#define CALL_EPOLL	3
+
+#define SPARE_FDS	16 /* Fds needed besides the ones being watched */
+#define MIN_WAKEUPS	3
+#define WARMUP		2 /* Calls to let pending handshakes settle */
+
+static char *calls[] = { "select", "poll", "ppoll", "epoll_wait", NULL };
+
+static int listenfd = -1;
+static int wakefds[2];
+static struct sockaddr_in target;
+
+static void close_conn(int);
+static void drain_listener(void);
+static int open_fds(int *, int, int);
+static int wait_once(int, int *, int, struct pollfd *, fd_set *, int, int);
+static double measure(int, int *, int, uint64_t, unsigned long *);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: [-n fds[,fds...]] [-f pending percent[,percent...]] "
+	"[-m call[,call...]] [-t pending target ip:port] [-p listen port] "
+	"[-T ms per measurement]";
+    char defcounts[] = "10,100,1000,10000,50000";
+    char defpercents[] = "0,1,10,50";
+    char defcalls[] = "select,poll,ppoll,epoll_wait";
+    char *counts = defcounts, *percents = defpercents, *wanted = defcalls;
+    char *preload, *count;
+    int pcts[32], npcts = 0, p;
+    int usecalls[4] = { 0, 0, 0, 0 };
+    struct sockaddr_in addr;
+    struct rlimit limit;
+    socklen_t len = sizeof(addr);
+    unsigned long wakeups;
+    int port = 0, havetarget = 0, failed = 0;
+    int nfds, npending, call, c, *fds;
+    uint64_t budget = 200000000;
+    char *word;
+    double ns;
+
+    while ((c = getopt(argc, argv, "n:f:m:t:p:T:")) != -1) {
+	switch (c) {
+	    case 'n':
+		counts = optarg;
+		break;
+	    case 'f':
+		percents = optarg;
+		break;
+	    case 'm':
+		wanted = optarg;
+		break;
+	    case 't':
+		if (parse_address(optarg, &target)) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		havetarget = 1;
+		break;
+	    case 'p':
+		port = atoi(optarg);
+		break;
+	    case 'T':
+		budget = strtoull(optarg, NULL, 10) * 1000000;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    for (word = strtok(percents, ","); word && (npcts < 32);
+	    word = strtok(NULL, ","))
+	pcts[npcts++] = atoi(word);
+
+    for (word = strtok(wanted, ","); word; word = strtok(NULL, ",")) {
+	for (call = 0; calls[call] && strcmp(calls[call], word); call++)
+	    /* Empty Loop */;
+	if (!calls[call]) {
+	    show_msg(MSGERR, "Unknown call %s\n", word);
+	    exit(1);
+	}
+	usecalls[call] = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Use as many fds as we're allowed */
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    /* A listener that never accepts, connections to it (directly or */
+    /* as a SOCKS server) never get any further than connecting      */
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+	    bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(listenfd, 65535) ||
+	    getsockname(listenfd, (struct sockaddr *) &addr, &len)) {
+	show_msg(MSGERR, "Could not listen on port %d (%s)\n", port,
+		strerror(errno));
+	exit(1);
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if (!havetarget)
+	target = addr;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, wakefds)) {
+	show_msg(MSGERR, "Could not create socket pair (%s)\n", strerror(errno));
+	exit(1);
+    }
+
+    preload = ((getenv("LD_PRELOAD") && *getenv("LD_PRELOAD")) ?
+	    "true" : "false");
+
+    for (count = strtok(counts, ","); count; count = strtok(NULL, ",")) {
+	if ((nfds = atoi(count)) < 1)
+	    continue;
+	if (nfds + SPARE_FDS > (int) limit.rlim_cur) {
+	    show_msg(MSGERR, "Skipping %d fds, only %ld can be opened\n",
+		    nfds, (long) limit.rlim_cur);
+	    continue;
+	}
+	if ((fds = malloc(nfds * sizeof(*fds))) == NULL) {
+	    show_msg(MSGERR, "Could not allocate memory for fds\n");
+	    exit(1);
+	}
+
+	for (p = 0; p < npcts; p++) {
+	    npending = (long) nfds * pcts[p] / 100;
+	    if (npending >= nfds)
+		npending = nfds - 1;
+	    if (open_fds(fds, nfds, npending)) {
+		failed = 1;
+		continue;
+	    }
+
+	    for (call = 0; calls[call]; call++) {
+		if (!usecalls[call])
+		    continue;
+		if ((call == CALL_SELECT) && (fds[nfds - 1] >= FD_SETSIZE))
+		    continue;
+		if ((ns = measure(call, fds, nfds, budget, &wakeups)) < 0) {
+		    show_msg(MSGERR, "%s failed with %d fds (%d pending)\n",
+			    calls[call], nfds, npending);
+		    failed = 1;
+		    continue;
+		}
+		printf("{\"bench\":\"eventloop\",\"call\":\"%s\",\"preload\":%s,"
+			"\"fds\":%d,\"pending\":%d,\"wakeups\":%lu,"
+			"\"ns_per_wakeup\":%.1f,\"ns_per_fd\":%.2f}\n",
+			calls[call], preload, nfds, npending, wakeups, ns,
+			ns / nfds);
+		fflush(stdout);
+	    }
+
+	    for (c = 1; c < nfds; c++)
+		close_conn(fds[c]);
+	    drain_listener();
+	}
+	free(fds);
+    }
+
+    return failed;
+}
+
+/* Close without leaving the socket in TIME_WAIT */
+static void close_conn(int fd) {
+    struct linger linger = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+/* Throw away the connections queued on the listener */
+static void drain_listener(void) {
+    int fd;
+
+    while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+	close_conn(fd);
+}
+
+/* Fill fds with the socket used for wakeups, npending non blocking */
+/* connections to the target and idle eventfds (which, unlike dups  */
+/* of one socket, don't share a wait queue)                         */
+static int open_fds(int *fds, int nfds, int npending) {
+    int i;
+
+    fds[0] = wakefds[0];
+    for (i = 1; i <= npending; i++) {
+	if ((fds[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	    break;
+	fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+	if (connect(fds[i], (struct sockaddr *) &target, sizeof(target)) &&
+		(errno != EINPROGRESS)) {
+	    show_msg(MSGERR, "Could not start connection (%s)\n",
+		    strerror(errno));
+	    close(fds[i]);
+	    break;
+	}
+    }
+    for (; (i > npending) && (i < nfds); i++) {
+	if ((fds[i] = eventfd(0, 0)) < 0) {
+	    show_msg(MSGERR, "Could not create eventfd (%s)\n", strerror(errno));
+	    break;
+	}
+    }
+
+    if (i == nfds)
+	return 0;
+
+    /* Don't close the wakeup socket */
+    while (--i > 0)
+	close_conn(fds[i]);
+
+    return -1;
+}
+
+/* Wait for the wakeup socket, returns 0 if it was readable */
+static int wait_once(int call, int *fds, int nfds, struct pollfd *pfds,
+	fd_set *watch, int maxfd, int epfd) {
+    struct epoll_event events[64];
+    fd_set readfds;
+    int rc, i;
+
+    switch (call) {
+	case CALL_SELECT:
+	    memcpy(&readfds, watch, sizeof(readfds));
+	    rc = select(maxfd + 1, &readfds, NULL, NULL, NULL);
+	    return ((rc > 0) && FD_ISSET(fds[0], &readfds) ? 0 : -1);
+	case CALL_POLL:
+	    rc = poll(pfds, nfds, -1);
+	    return ((rc > 0) && (pfds[0].revents & POLLIN) ? 0 : -1);
+	case CALL_PPOLL:
+	    rc = ppoll(pfds, nfds, NULL, NULL);
+	    return ((rc > 0) && (pfds[0].revents & POLLIN) ? 0 : -1);
+	case CALL_EPOLL:
+	    rc = epoll_wait(epfd, events, 64, -1);
+	    for (i = 0; i < rc; i++) {
+		if (events[i].data.fd == fds[0])
+		    return 0;
+	    }
+	    return -1;
+    }
+
+    return -1;
+}
+
+/* Returns the ns per wakeup, repeating wakeups for the budget of ns */
+static double measure(int call, int *fds, int nfds, uint64_t budget,
+	unsigned long *wakeups) {
+    struct pollfd *pfds = NULL;
+    struct epoll_event event;
+    uint64_t start, elapsed = 0;
+    int i, maxfd = 0, epfd = -1, rc = 0;
+    fd_set watch;
+    char byte = 'x';
+
+    if ((call == CALL_POLL) || (call == CALL_PPOLL)) {
+	if ((pfds = malloc(nfds * sizeof(*pfds))) == NULL) {
+	    show_msg(MSGERR, "Could not allocate memory for poll\n");
+	    exit(1);
+	}
+	for (i = 0; i < nfds; i++) {
+	    pfds[i].fd = fds[i];
+	    pfds[i].events = POLLIN;
+	}
+    } else if (call == CALL_SELECT) {
+	FD_ZERO(&watch);
+	for (i = 0; i < nfds; i++) {
+	    FD_SET(fds[i], &watch);
+	    if (fds[i] > maxfd)
+		maxfd = fds[i];
+	}
+    } else {
+	if ((epfd = epoll_create1(0)) < 0)
+	    return -1;
+	for (i = 0; i < nfds; i++) {
+	    event.events = EPOLLIN;
+	    event.data.fd = fds[i];
+	    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event)) {
+		close(epfd);
+		return -1;
+	    }
+	}
+    }
+
+    /* Let libtsocks get pending handshakes to the point where */
+    /* they're waiting for the server                          */
+    for (i = 0; (i < WARMUP) && !rc; i++) {
+	if ((write(wakefds[1], &byte, 1) != 1) ||
+		(rc = wait_once(call, fds, nfds, pfds, &watch, maxfd, epfd)) ||
+		(read(wakefds[0], &byte, 1) != 1))
+	    rc = -1;
+    }
+
+    start = now_ns();
+    for (*wakeups = 0; !rc; (*wakeups)++) {
+	if (((elapsed = now_ns() - start) >= budget) &&
+		(*wakeups >= MIN_WAKEUPS))
+	    break;
+	if ((write(wakefds[1], &byte, 1) != 1) ||
+		(rc = wait_once(call, fds, nfds, pfds, &watch, maxfd, epfd)) ||
+		(read(wakefds[0], &byte, 1) != 1))
+	    rc = -1;
+    }
+
+    free(pfds);
+    if (epfd >= 0)
+	close(epfd);
+
+    return (rc ? -1 : (double) elapsed / *wakeups);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,313 @@
+/*
+ * RELAYBENCH - Part of the tsocks benchmarks
+ *
+ * Measures a SOCKS 5 server as a relay, the rate it completes
+ * connections (connect, handshake, connect request and close) and the
+ * throughput of data relayed through it to an echo server, and reports
+ * them as a single JSON object. Without a SOCKS server it connects to
+ * the echo server directly, as a baseline. Meant for tsocksd, with
+ * mocksocks' plain port as the echo server.
+ */
+
+/* Global configuration variables */
+char *progname = "relaybench";
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+#include "benchutil.h"
+
+#define TIMEOUT	10000 /* Milliseconds to wait for the server */
+
+/* Settings */
+static struct sockaddr_in server, target;
+static int viasocks = 0;
+static char *username = NULL, *password = NULL;
+static size_t streambytes = 16777216;
+
+/* Shared between the threads */
+static int total = 10000;
+static int next = 0; /* Connections started */
+static int failures = 0;
+static uint64_t *latencies;
+
+static int open_conn(void);
+static int exchange(int, unsigned char *, int, int);
+static void *connector(void *);
+static void *streamer(void *);
+static int compare_u64(const void *, const void *);
+
+/* Open a connection to the target, through the SOCKS server if there */
+/* is one, returns the socket or -1                                   */
+static int open_conn(void) {
+    struct timeval tv = { TIMEOUT / 1000, 0 };
+    unsigned char buf[520];
+    int fd, on = 1, ulen, plen;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *) (viasocks ? &server : &target),
+		sizeof(struct sockaddr_in)))
+	goto failed;
+    if (!viasocks)
+	return fd;
+
+    buf[0] = 5;
+    buf[1] = 1;
+    buf[2] = (username ? 2 : 0);
+    if (exchange(fd, buf, 3, 2) || (buf[0] != 5) || (buf[1] != buf[2]))
+	goto failed;
+    if (username) {
+	ulen = strlen(username);
+	plen = strlen(password);
+	buf[0] = 1;
+	buf[1] = ulen;
+	memcpy(&buf[2], username, ulen);
+	buf[2 + ulen] = plen;
+	memcpy(&buf[3 + ulen], password, plen);
+	if (exchange(fd, buf, 3 + ulen + plen, 2) || buf[1])
+	    goto failed;
+    }
+    buf[0] = 5;
+    buf[1] = 1;
+    buf[2] = 0;
+    buf[3] = 1;
+    memcpy(&buf[4], &target.sin_addr, 4);
+    memcpy(&buf[8], &target.sin_port, 2);
+    if (exchange(fd, buf, 10, 10) || (buf[0] != 5) || buf[1])
+	goto failed;
+
+    return fd;
+
+failed:
+    close(fd);
+    return -1;
+}
+
+/* Send a message and read a reply of the given length into buf */
+static int exchange(int fd, unsigned char *buf, int len, int want) {
+    ssize_t got;
+    int have = 0;
+
+    if (send(fd, buf, len, MSG_NOSIGNAL) != len)
+	return -1;
+    while (have < want) {
+	if ((got = recv(fd, buf + have, want - have, 0)) <= 0)
+	    return -1;
+	have += got;
+    }
+
+    return 0;
+}
+
+/* Make connections until the total has been started */
+static void *connector(void *arg) {
+    struct linger linger = { 1, 0 };
+    uint64_t start;
+    int i, fd;
+
+    (void) arg;
+    while ((i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < total) {
+	start = now_ns();
+	if ((fd = open_conn()) < 0) {
+	    __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+	    latencies[i] = UINT64_MAX;
+	    continue;
+	}
+	latencies[i] = now_ns() - start;
+	/* Closing with a reset keeps TIME_WAIT from using up the ports */
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(fd);
+    }
+
+    return NULL;
+}
+
+/* Send a stream through the relay and read it back from the echo */
+/* server, returns 0 if all of it came back                       */
+static void *streamer(void *arg) {
+    char buf[65536];
+    size_t sent = 0, received = 0, len;
+    struct pollfd pfd;
+    ssize_t rc;
+    int fd;
+
+    (void) arg;
+    memset(buf, 'x', sizeof(buf));
+    if ((fd = open_conn()) < 0)
+	return (void *) 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pfd.fd = fd;
+    while (received < streambytes) {
+	pfd.events = POLLIN | (sent < streambytes ? POLLOUT : 0);
+	if (poll(&pfd, 1, TIMEOUT) <= 0)
+	    break;
+	if ((pfd.revents & POLLOUT) && (sent < streambytes)) {
+	    len = (streambytes - sent < sizeof(buf) ? streambytes - sent :
+		    sizeof(buf));
+	    if ((rc = write(fd, buf, len)) > 0)
+		sent += rc;
+	}
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if ((rc = read(fd, buf, sizeof(buf))) <= 0)
+		break;
+	    received += rc;
+	}
+    }
+    close(fd);
+
+    return (void *) (long) (received < streambytes);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x < y ? -1 : (x > y));
+}
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: -t echo ip:port [-s socks ip:port] "
+	"[-a user:pass] [-n connects] [-c concurrency] [-S streams] "
+	"[-b bytes per stream] [-l extra json]";
+    pthread_t *threads;
+    struct rlimit limit;
+    uint64_t start;
+    double connsecs, streamsecs;
+    char *extra = NULL, *sep;
+    int concurrency = 16, streams = 4, havetarget = 0, streamfailures = 0;
+    int completed, c, i;
+    void *result;
+
+    while ((c = getopt(argc, argv, "t:s:a:n:c:S:b:l:")) != -1) {
+	switch (c) {
+	    case 't':
+		if (parse_address(optarg, &target)) {
+		    show_msg(MSGERR, "Invalid target %s\n", optarg);
+		    exit(1);
+		}
+		havetarget = 1;
+		break;
+	    case 's':
+		if (parse_address(optarg, &server)) {
+		    show_msg(MSGERR, "Invalid server %s\n", optarg);
+		    exit(1);
+		}
+		viasocks = 1;
+		break;
+	    case 'a':
+		if ((sep = strchr(optarg, ':')) == NULL) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		*sep = '\0';
+		username = optarg;
+		password = sep + 1;
+		break;
+	    case 'n':
+		total = atoi(optarg);
+		break;
+	    case 'c':
+		concurrency = atoi(optarg);
+		break;
+	    case 'S':
+		streams = atoi(optarg);
+		break;
+	    case 'b':
+		streambytes = strtoul(optarg, NULL, 10);
+		break;
+	    case 'l':
+		extra = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+    if (!havetarget || (total < 1) || (concurrency < 1) || (streams < 0)) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit) &&
+	    (limit.rlim_cur < limit.rlim_max)) {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (((latencies = calloc(total, sizeof(uint64_t))) == NULL) ||
+	    ((threads = calloc((concurrency > streams ? concurrency :
+				streams), sizeof(pthread_t))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory\n");
+	exit(1);
+    }
+
+    /* Connection rate */
+    start = now_ns();
+    for (i = 0; i < concurrency; i++) {
+	if (pthread_create(&threads[i], NULL, connector, NULL)) {
+	    show_msg(MSGERR, "Could not create thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < concurrency; i++)
+	pthread_join(threads[i], NULL);
+    connsecs = (now_ns() - start) / 1e9;
+    completed = total - failures;
+    qsort(latencies, total, sizeof(uint64_t), compare_u64);
+
+    /* Throughput, every stream at once */
+    start = now_ns();
+    for (i = 0; i < streams; i++) {
+	if (pthread_create(&threads[i], NULL, streamer, NULL)) {
+	    show_msg(MSGERR, "Could not create thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < streams; i++) {
+	pthread_join(threads[i], &result);
+	streamfailures += (result != NULL);
+    }
+    streamsecs = (now_ns() - start) / 1e9;
+
+    printf("{\"bench\":\"relay\",\"via\":\"%s\",\"connects\":%d,"
+	    "\"concurrency\":%d,\"failed\":%d,\"connects_per_sec\":%.1f",
+	    (viasocks ? "socks5" : "direct"), total, concurrency, failures,
+	    completed / connsecs);
+    if (completed)
+	printf(",\"connect_p50_us\":%.1f,\"connect_p99_us\":%.1f",
+		latencies[completed / 2] / 1000.0,
+		latencies[(int) (completed * 0.99)] / 1000.0);
+    printf(",\"streams\":%d,\"stream_bytes\":%lu,\"streams_failed\":%d",
+	    streams, (unsigned long) streambytes, streamfailures);
+    if (streams && !streamfailures)
+	printf(",\"relay_MBps\":%.1f", (double) streams * streambytes /
+		(1 << 20) / streamsecs);
+    if (extra)
+	printf(",%s", extra);
+    printf("}\n");
+
+    return (failures || streamfailures);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
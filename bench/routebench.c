@@ -0,0 +1,527 @@
+/*
+ * ROUTEBENCH - Part of the tsocks benchmarks
+ *
+ * Generates synthetic configuration files with large numbers of local
+ * and reaches rules then times read_config(), is_local() and
+ * pick_server() over random and skewed streams of destinations. The
+ * same lookups are also done by walking the parsed linked lists the way
+ * tsocks used to, so the routing index can be compared with (and
+ * checked against) the simple engine. One JSON object is printed per
+ * rule count and stream.
+ */
+
+/* Global configuration variables */
+char *progname = "routebench";
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#endif
+#include <common.h>
+#include <parser.h>
+#include "benchutil.h"
+
+/* Limit on the number of rules checked by the linked list engine */
+/* for each stream, it is far too slow to do every lookup with     */
+/* large rule sets                                                 */
+#define REF_BUDGET	200000000UL
+#define REF_MIN_LOOKUPS	1000
+
+/* Structure representing a generated rule */
+struct rule {
+    uint32_t net; /* Host byte order */
+    int len;
+    int startport, endport; /* 0 for any port */
+    int path; /* -1 for local */
+};
+
+/* Structure representing one destination to look up */
+struct dest {
+    struct in_addr ip;
+    unsigned int port;
+};
+
+/* Distribution of prefix lengths, roughly that of a full routing */
+/* table, in parts per thousand                                   */
+static const struct {
+    int len;
+    int permille;
+} lengths[] = {
+    { 8, 5 }, { 12, 10 }, { 16, 60 }, { 18, 30 }, { 19, 50 }, { 20, 80 },
+    { 21, 80 }, { 22, 140 }, { 23, 100 }, { 24, 445 }, { 0, 0 }
+};
+
+static uint64_t seed = 88172645463325252ULL;
+static int npaths = 8;
+static int localpct = 10;
+static int portpct = 25;
+static unsigned long nlookups = 1000000;
+static volatile int sink; /* Keeps lookup results live */
+
+typedef int (*lookupfn)(struct parsedfile *, struct dest *);
+
+static uint64_t next_random(void);
+static long rss_bytes(void);
+static struct rule *make_rules(unsigned long);
+static int write_config(char *, struct rule *, unsigned long);
+static struct dest *random_stream(unsigned long);
+static struct dest *skewed_stream(struct rule *, unsigned long, unsigned long);
+static int open_counter(void);
+static double time_lookups(struct parsedfile *, lookupfn, struct dest *,
+	unsigned long, int, double *);
+static int index_is_local(struct parsedfile *, struct dest *);
+static int index_pick_server(struct parsedfile *, struct dest *);
+static int list_is_local(struct parsedfile *, struct dest *);
+static int list_pick_server(struct parsedfile *, struct dest *);
+static struct serverent *list_server(struct parsedfile *, struct dest *);
+static int run(unsigned long);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: [-n rules[,rules...]] [-l lookups] [-p paths] "
+	"[-L local percent] [-P ported percent] [-s seed]";
+    char defcounts[] = "10,100,1000,10000,100000,1000000";
+    char *counts = defcounts;
+    char *count;
+    int status, failed = 0;
+    pid_t pid;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:l:p:L:P:s:")) != -1) {
+	switch (c) {
+	    case 'n':
+		counts = optarg;
+		break;
+	    case 'l':
+		nlookups = strtoul(optarg, NULL, 10);
+		break;
+	    case 'p':
+		npaths = atoi(optarg);
+		break;
+	    case 'L':
+		localpct = atoi(optarg);
+		break;
+	    case 'P':
+		portpct = atoi(optarg);
+		break;
+	    case 's':
+		seed = strtoull(optarg, NULL, 10) | 1;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    if ((npaths < 1) || !nlookups) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+
+    /* Each rule count is run in its own process so the memory used */
+    /* is measured from a clean heap                                */
+    for (count = strtok(counts, ","); count; count = strtok(NULL, ",")) {
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+	    show_msg(MSGERR, "Could not fork (%s)\n", strerror(errno));
+	    exit(1);
+	}
+	if (!pid)
+	    exit(run(strtoul(count, NULL, 10)));
+	if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) ||
+		WEXITSTATUS(status))
+	    failed = 1;
+    }
+
+    return failed;
+}
+
+/* xorshift64*, deterministic for a given seed */
+static uint64_t next_random(void) {
+
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+
+    return seed * 2685821657736338717ULL;
+}
+
+/* Resident set size of this process */
+static long rss_bytes(void) {
+    long size = 0, resident = 0;
+    FILE *statm;
+
+    if ((statm = fopen("/proc/self/statm", "r")) == NULL)
+	return 0;
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+	resident = 0;
+    fclose(statm);
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static struct rule *make_rules(unsigned long nrules) {
+    struct rule *rules;
+    unsigned long i;
+    int pick, j, first;
+
+    if ((rules = malloc(nrules * sizeof(*rules))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for rules\n");
+	exit(1);
+    }
+
+    for (i = 0; i < nrules; i++) {
+	pick = next_random() % 1000;
+	for (j = 0; lengths[j + 1].len && (pick >= lengths[j].permille); j++)
+	    pick -= lengths[j].permille;
+	rules[i].len = lengths[j].len;
+
+	/* Unicast space only, avoiding the loopback network */
+	do {
+	    rules[i].net = (uint32_t) next_random();
+	    first = rules[i].net >> 24;
+	} while (!first || (first == 127) || (first >= 224));
+	rules[i].net &= ~0U << (32 - rules[i].len);
+
+	rules[i].startport = rules[i].endport = 0;
+	if ((int) (next_random() % 100) < localpct) {
+	    rules[i].path = -1;
+	    continue;
+	}
+	rules[i].path = next_random() % npaths;
+	if ((int) (next_random() % 100) < portpct) {
+	    rules[i].startport = 1 + next_random() % 60000;
+	    rules[i].endport = rules[i].startport + next_random() % 1000;
+	}
+    }
+
+    return rules;
+}
+
+static int write_config(char *filename, struct rule *rules,
+	unsigned long nrules) {
+    struct in_addr net, mask;
+    unsigned long i;
+    char buf[32];
+    FILE *conf;
+    int path;
+
+    if ((conf = fopen(filename, "w")) == NULL)
+	return -1;
+
+    fprintf(conf, "server = 127.0.0.1\nserver_type = 5\n");
+    for (i = 0; i < nrules; i++) {
+	if (rules[i].path != -1)
+	    continue;
+	net.s_addr = htonl(rules[i].net);
+	mask.s_addr = htonl(~0U << (32 - rules[i].len));
+	strcpy(buf, inet_ntoa(net));
+	fprintf(conf, "local = %s/%s\n", buf, inet_ntoa(mask));
+    }
+
+    for (path = 0; path < npaths; path++) {
+	fprintf(conf, "path {\n\tserver = 127.0.0.%d\n", path + 2);
+	for (i = 0; i < nrules; i++) {
+	    if (rules[i].path != path)
+		continue;
+	    net.s_addr = htonl(rules[i].net);
+	    mask.s_addr = htonl(~0U << (32 - rules[i].len));
+	    strcpy(buf, inet_ntoa(net));
+	    if (rules[i].startport)
+		fprintf(conf, "\treaches = %s:%d-%d/%s\n", buf,
+			rules[i].startport, rules[i].endport, inet_ntoa(mask));
+	    else
+		fprintf(conf, "\treaches = %s/%s\n", buf, inet_ntoa(mask));
+	}
+	/* Paths must reach something */
+	fprintf(conf, "\treaches = 0.0.0.%d/255.255.255.255\n}\n", path + 1);
+    }
+
+    return (fclose(conf) ? -1 : 0);
+}
+
+/* Uniformly random addresses and ports */
+static struct dest *random_stream(unsigned long n) {
+    struct dest *dests;
+    unsigned long i;
+
+    if ((dests = malloc(n * sizeof(*dests))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for stream\n");
+	exit(1);
+    }
+
+    for (i = 0; i < n; i++) {
+	dests[i].ip.s_addr = (uint32_t) next_random();
+	dests[i].port = 1 + next_random() % 65535;
+    }
+
+    return dests;
+}
+
+/* Addresses inside the generated rules, chosen with a Zipf */
+/* distribution over the rules so a few networks are hot     */
+static struct dest *skewed_stream(struct rule *rules, unsigned long nrules,
+	unsigned long n) {
+    struct dest *dests;
+    double *cdf, total = 0, u;
+    unsigned long i, lo, hi, mid;
+    struct rule *rule;
+    uint32_t host;
+
+    if (((dests = malloc(n * sizeof(*dests))) == NULL) ||
+	    ((cdf = malloc(nrules * sizeof(*cdf))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory for stream\n");
+	exit(1);
+    }
+
+    for (i = 0; i < nrules; i++) {
+	total += 1.0 / (i + 1);
+	cdf[i] = total;
+    }
+
+    for (i = 0; i < n; i++) {
+	u = (next_random() >> 11) * (1.0 / 9007199254740992.0) * total;
+	for (lo = 0, hi = nrules - 1; lo < hi; ) {
+	    mid = lo + ((hi - lo) >> 1);
+	    if (cdf[mid] < u)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	rule = &rules[lo];
+	host = (rule->len == 32 ? 0 : (uint32_t) next_random() >> rule->len);
+	dests[i].ip.s_addr = htonl(rule->net | host);
+	if (rule->startport)
+	    dests[i].port = rule->startport +
+		next_random() % (rule->endport - rule->startport + 1);
+	else
+	    dests[i].port = 1 + next_random() % 65535;
+    }
+
+    free(cdf);
+
+    return dests;
+}
+
+/* Open a counter of cache misses in this process, -1 if the */
+/* system can't count them                                   */
+static int open_counter(void) {
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    struct perf_event_attr attr;
+
+    memset(&attr, 0x0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+/* Returns the ns per lookup, *misses is set to the cache misses */
+/* per lookup (or -1 if they can't be counted)                    */
+static double time_lookups(struct parsedfile *config, lookupfn fn,
+	struct dest *dests, unsigned long n, int counter, double *misses) {
+    uint64_t start, end, count = 0;
+    unsigned long i;
+    int total = 0;
+
+    *misses = -1;
+    if (counter >= 0) {
+	ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+	ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = now_ns();
+    for (i = 0; i < n; i++)
+	total += fn(config, &dests[i]);
+    end = now_ns();
+    if (counter >= 0) {
+	ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(counter, &count, sizeof(count)) == sizeof(count))
+	    *misses = (double) count / n;
+    }
+    sink = total;
+
+    return (double) (end - start) / n;
+}
+
+static int index_is_local(struct parsedfile *config, struct dest *dest) {
+
+    return is_local(config, &(dest->ip));
+}
+
+static int index_pick_server(struct parsedfile *config, struct dest *dest) {
+    struct serverent *ent;
+
+    pick_server(config, &ent, &(dest->ip), dest->port);
+
+    return ent->lineno;
+}
+
+/* The original linked list engine */
+static int list_is_local(struct parsedfile *config, struct dest *dest) {
+    struct netent *ent;
+
+    for (ent = config->localnets; ent != NULL; ent = ent->next) {
+	if ((dest->ip.s_addr & ent->localnet.s_addr) ==
+		(ent->localip.s_addr & ent->localnet.s_addr))
+	    return 0;
+    }
+
+    return 1;
+}
+
+static struct serverent *list_server(struct parsedfile *config,
+	struct dest *dest) {
+    struct serverent *ent;
+    struct netent *net;
+
+    for (ent = config->paths; ent != NULL; ent = ent->next) {
+	for (net = ent->reachnets; net != NULL; net = net->next) {
+	    if (((dest->ip.s_addr & net->localnet.s_addr) ==
+			(net->localip.s_addr & net->localnet.s_addr)) &&
+		    (!net->startport ||
+		     ((net->startport <= dest->port) &&
+		      (net->endport >= dest->port))))
+		return ent;
+	}
+    }
+
+    return &(config->defaultserver);
+}
+
+static int list_pick_server(struct parsedfile *config, struct dest *dest) {
+
+    return list_server(config, dest)->lineno;
+}
+
+/* Benchmark one rule count, returns non zero if the engines disagree */
+static int run(unsigned long nrules) {
+    char filename[] = "/tmp/routebench.XXXXXX";
+    static char *streams[] = { "random", "skewed" };
+    struct parsedfile config;
+    struct rule *rules;
+    struct dest *dests;
+    struct serverent *ent;
+    unsigned long nlocal = 0, reflookups, mismatches, i;
+    double loadns, indexbytes, ns[4], misses[4];
+    long rssbefore, rssafter;
+    uint64_t start;
+    int fd, counter, s;
+
+    if (!nrules)
+	return 0;
+
+    rules = make_rules(nrules);
+    for (i = 0; i < nrules; i++)
+	nlocal += (rules[i].path == -1);
+
+    if (((fd = mkstemp(filename)) < 0) || close(fd) ||
+	    write_config(filename, rules, nrules)) {
+	show_msg(MSGERR, "Could not write configuration (%s)\n",
+		strerror(errno));
+	unlink(filename);
+	return 1;
+    }
+
+    rssbefore = rss_bytes();
+    start = now_ns();
+    read_config(filename, &config);
+    loadns = now_ns() - start;
+    rssafter = rss_bytes();
+    unlink(filename);
+
+    indexbytes = (config.index.local.nents + config.index.reach.nents) *
+	sizeof(struct routeent) +
+	(config.index.local.ngroups + config.index.reach.ngroups) *
+	sizeof(struct routegroup) +
+	config.index.npaths * sizeof(struct serverent *);
+
+    counter = open_counter();
+
+    /* The linked list engine does at most REF_BUDGET rule checks */
+    reflookups = REF_BUDGET / (nrules + npaths);
+    if (reflookups < REF_MIN_LOOKUPS)
+	reflookups = REF_MIN_LOOKUPS;
+    if (reflookups > nlookups)
+	reflookups = nlookups;
+
+    for (s = 0; s < 2; s++) {
+	dests = (s ? skewed_stream(rules, nrules, nlookups) :
+		random_stream(nlookups));
+
+	mismatches = 0;
+	for (i = 0; i < reflookups; i++) {
+	    pick_server(&config, &ent, &(dests[i].ip), dests[i].port);
+	    if ((is_local(&config, &(dests[i].ip)) !=
+			list_is_local(&config, &dests[i])) ||
+		    (ent != list_server(&config, &dests[i])))
+		mismatches++;
+	}
+
+	ns[0] = time_lookups(&config, index_is_local, dests, nlookups,
+		counter, &misses[0]);
+	ns[1] = time_lookups(&config, index_pick_server, dests, nlookups,
+		counter, &misses[1]);
+	ns[2] = time_lookups(&config, list_is_local, dests, reflookups,
+		counter, &misses[2]);
+	ns[3] = time_lookups(&config, list_pick_server, dests, reflookups,
+		counter, &misses[3]);
+
+	printf("{\"bench\":\"route\",\"rules\":%lu,\"local_rules\":%lu,"
+		"\"paths\":%d,\"stream\":\"%s\",\"lookups\":%lu,"
+		"\"read_config_ms\":%.2f,\"read_config_ns_per_rule\":%.1f,"
+		"\"rss_bytes_per_rule\":%.1f,\"index_bytes_per_rule\":%.1f,"
+		"\"is_local_ns\":%.1f,\"pick_server_ns\":%.1f,",
+		nrules, nlocal, npaths, streams[s], nlookups,
+		loadns / 1000000, loadns / nrules,
+		(double) (rssafter - rssbefore) / nrules, indexbytes / nrules,
+		ns[0], ns[1]);
+	if (counter >= 0)
+	    printf("\"is_local_misses\":%.2f,\"pick_server_misses\":%.2f,",
+		    misses[0], misses[1]);
+	else
+	    printf("\"is_local_misses\":null,\"pick_server_misses\":null,");
+	printf("\"list_lookups\":%lu,\"list_is_local_ns\":%.1f,"
+		"\"list_pick_server_ns\":%.1f,", reflookups, ns[2], ns[3]);
+	if (counter >= 0)
+	    printf("\"list_is_local_misses\":%.2f,"
+		    "\"list_pick_server_misses\":%.2f,", misses[2], misses[3]);
+	else
+	    printf("\"list_is_local_misses\":null,"
+		    "\"list_pick_server_misses\":null,");
+	printf("\"mismatches\":%lu}\n", mismatches);
+
+	if (mismatches)
+	    show_msg(MSGERR, "Routing index and linked lists disagree on %lu "
+		    "of %lu %s lookups with %lu rules\n", mismatches,
+		    reflookups, streams[s], nrules);
+
+	free(dests);
+	if (mismatches)
+	    return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
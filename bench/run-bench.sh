@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# Run the tsocks connection benchmarks, each result is printed as a
+# line of JSON. Set BENCH_CONNECTS, BENCH_CONCURRENCY, BENCH_DELAY_US,
+# BENCH_BYTES, BENCH_MODES or BENCH_PORT to change what is run, and
+# BENCH_FDS or BENCH_PENDING (percentages of the fds) for the event loop
+# benchmark, BENCH_RULES or BENCH_LOOKUPS for the routing benchmark and
+# BENCH_RATE (handshakes a second) for inspectsocks' open loop and
+# BENCH_STREAMS (each of BENCH_BYTES) for relaying through tsocksd and
+# BENCH_DATAGRAMS or BENCH_BATCH for relaying UDP.
+
+LIB=${LIB:-./libtsocks.so.1.9}
+CONNECTS=${BENCH_CONNECTS:-2000}
+CONCURRENCY=${BENCH_CONCURRENCY:-16}
+DELAY=${BENCH_DELAY_US:-0}
+BYTES=${BENCH_BYTES:-16777216}
+MODES=${BENCH_MODES:-"blocking select poll epoll"}
+FDS=${BENCH_FDS:-10,100,1000,10000}
+PENDING=${BENCH_PENDING:-0,1,10,50}
+RULES=${BENCH_RULES:-10,100,1000,10000,100000,1000000}
+LOOKUPS=${BENCH_LOOKUPS:-1000000}
+RATE=${BENCH_RATE:-1000}
+STREAMS=${BENCH_STREAMS:-4}
+DATAGRAMS=${BENCH_DATAGRAMS:-100000}
+BATCH=${BENCH_BATCH:-32}
+PORT=${BENCH_PORT:-21080}
+PLAIN=`expr $PORT + 1`
+# Anything not local, tsocks sends it to the mock server
+TARGET=10.255.255.1:80
+UDPTARGET=10.255.255.1:53
+
+TMP=`mktemp -d ${TMPDIR:-/tmp}/tsocks-bench.XXXXXX` || exit 1
+SERVER=
+RELAY=
+trap 'test -n "$SERVER" && kill $SERVER 2>/dev/null;
+    test -n "$RELAY" && kill $RELAY 2>/dev/null; rm -rf $TMP' 0 1 2 15
+
+# start_server <type> <extra mocksocks args>
+start_server() {
+    test -n "$SERVER" && kill $SERVER 2>/dev/null && wait $SERVER 2>/dev/null
+    ./bench/mocksocks -p $PORT -e $PLAIN -d $DELAY $2 &
+    SERVER=$!
+    # Wait for it to listen
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+	./bench/connbench -t 127.0.0.1:$PLAIN -n 1 >/dev/null 2>&1 && break
+	sleep 0.1
+    done
+    {
+	echo "server = 127.0.0.1"
+	echo "server_port = $PORT"
+	echo "server_type = $1"
+	test -n "$2" && echo "default_user = bench" && echo "default_pass = bench"
+    } > $TMP/tsocks.conf
+}
+
+# run <json labels> <extra connbench args>
+run() {
+    for mode in $MODES; do
+	./bench/connbench -m $mode -n $CONNECTS -c $CONCURRENCY \
+	    -t 127.0.0.1:$PLAIN -s 127.0.0.1:$PLAIN -b $BYTES \
+	    -l "\"socks\":0,\"auth\":false,\"delay_us\":$DELAY"
+	TSOCKS_CONF_FILE=$TMP/tsocks.conf LD_PRELOAD=$LIB \
+	    ./bench/connbench -m $mode -n $CONNECTS -c $CONCURRENCY \
+	    -t $TARGET -s 127.0.0.1:$PLAIN -b $BYTES -l "$1"
+    done
+}
+
+start_server 4 ""
+run "\"socks\":4,\"auth\":false,\"delay_us\":$DELAY"
+start_server 5 ""
+run "\"socks\":5,\"auth\":false,\"delay_us\":$DELAY"
+start_server 5 "-a bench:bench"
+run "\"socks\":5,\"auth\":true,\"delay_us\":$DELAY"
+
+# UDP round trips to the mock server's plain port, which echoes them,
+# and relayed through a UDP association with the mock server, which
+# echoes them as though from the destination
+for mode in mmsg msg; do
+    ./bench/udpbench -m $mode -n $DATAGRAMS -B $BATCH -t 127.0.0.1:$PLAIN \
+	-l "\"socks\":0"
+    TSOCKS_CONF_FILE=$TMP/tsocks.conf TSOCKS_UDP=1 LD_PRELOAD=$LIB \
+	./bench/udpbench -m $mode -n $DATAGRAMS -B $BATCH -t $UDPTARGET \
+	-l "\"socks\":5"
+done
+
+# The mock server's capacity as inspectsocks' load generator sees it,
+# keeping handshakes in progress and then starting them at a fixed rate
+./inspectsocks -L -j -a bench:bench -t $TARGET -c $CONCURRENCY -n $CONNECTS \
+    127.0.0.1 $PORT
+./inspectsocks -L -j -a bench:bench -t $TARGET -c $CONCURRENCY -r $RATE -d 2 \
+    127.0.0.1 $PORT
+
+# tsocksd relaying to the mock server's plain port, which echoes, and
+# the same connections made directly for comparison
+RELAYPORT=`expr $PORT + 3`
+./tsocksd -p $RELAYPORT >/dev/null &
+RELAY=$!
+./bench/relaybench -t 127.0.0.1:$PLAIN -n $CONNECTS -c $CONCURRENCY \
+    -S $STREAMS -b $BYTES
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    ./bench/connbench -t 127.0.0.1:$RELAYPORT -n 1 >/dev/null 2>&1 && break
+    sleep 0.1
+done
+./bench/relaybench -s 127.0.0.1:$RELAYPORT -t 127.0.0.1:$PLAIN -n $CONNECTS \
+    -c $CONCURRENCY -S $STREAMS -b $BYTES
+kill $RELAY && wait $RELAY 2>/dev/null
+RELAY=
+
+# Event loops with handshakes that never complete, pollbench listens on
+# the port the SOCKS server is expected on but never accepts
+EVPORT=`expr $PORT + 2`
+{
+    echo "server = 127.0.0.1"
+    echo "server_port = $EVPORT"
+    echo "server_type = 5"
+} > $TMP/eventloop.conf
+./bench/pollbench -n $FDS -f $PENDING -p $EVPORT
+TSOCKS_CONF_FILE=$TMP/eventloop.conf LD_PRELOAD=$LIB \
+    ./bench/pollbench -n $FDS -f $PENDING -p $EVPORT -t $TARGET
+
+./bench/routebench -n $RULES -l $LOOKUPS
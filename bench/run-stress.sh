@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Run the thread stress test given as the first argument against a
+# mock SOCKS 5 server, with LIB preloaded if it is set (the sanitizer
+# variants have libtsocks linked in). Set STRESS_THREADS, STRESS_MS,
+# STRESS_MODES or BENCH_PORT to change what is run.
+
+BIN=${1:-./bench/threadbench}
+THREADS=${STRESS_THREADS:-1,2,4,8,16,32,64}
+MS=${STRESS_MS:-1000}
+MODES=${STRESS_MODES:-"blocking poll"}
+PORT=`expr ${BENCH_PORT:-21080} + 3`
+PLAIN=`expr $PORT + 1`
+
+# Stop at the first race rather than reporting it again on every connect
+TSAN_OPTIONS=${TSAN_OPTIONS:-halt_on_error=1}
+export TSAN_OPTIONS
+
+TMP=`mktemp -d ${TMPDIR:-/tmp}/tsocks-stress.XXXXXX` || exit 1
+SERVER=
+trap 'test -n "$SERVER" && kill $SERVER 2>/dev/null; rm -rf $TMP' 0 1 2 15
+
+{
+    echo "server = 127.0.0.1"
+    echo "server_port = $PORT"
+    echo "server_type = 5"
+} > $TMP/tsocks.conf
+
+./bench/mocksocks -p $PORT -e $PLAIN &
+SERVER=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    ./bench/connbench -t 127.0.0.1:$PLAIN -n 1 >/dev/null 2>&1 && break
+    sleep 0.1
+done
+
+STATUS=0
+for mode in $MODES; do
+    if test -n "$LIB"; then
+	TSOCKS_CONF_FILE=$TMP/tsocks.conf LD_PRELOAD=$LIB \
+	    $BIN -m $mode -n $THREADS -D $MS -d 127.0.0.1:$PLAIN || STATUS=1
+    else
+	TSOCKS_CONF_FILE=$TMP/tsocks.conf \
+	    $BIN -m $mode -n $THREADS -D $MS -d 127.0.0.1:$PLAIN || STATUS=1
+    fi
+done
+
+exit $STATUS
@@ -0,0 +1,319 @@
+/*
+ * THREADBENCH - Part of the tsocks benchmarks
+ *
+ * Stress test for connect() and close() from many threads at once.
+ * Each thread repeatedly creates a socket, connects it (through a SOCKS
+ * server or directly to a local address, which libtsocks lets through),
+ * checks the connection really is its own by echoing a token unique to
+ * the thread and connection, then closes it. The rate for each number of
+ * threads is printed as a JSON object along with any errors, connections
+ * that echoed somebody else's token and threads that stopped making
+ * progress. Built with libtsocks linked in and a sanitizer (make
+ * bench-tsan or bench-asan) it checks the library's shared state too.
+ */
+
+/* Global configuration variables, the sanitizer variants get */
+/* them from the libtsocks sources linked in                    */
+#ifndef BENCH_VARIANT
+char *progname = "threadbench";
+#endif
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+#include "benchutil.h"
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "plain"
+#endif
+
+#define TIMEOUT		5000 /* ms to wait for any one step */
+#define HANG_TIMEOUT	20 /* Seconds for threads to notice they should stop */
+#define TOKENLEN	24
+
+/* Structure representing one stress thread */
+struct worker {
+    pthread_t thread;
+    int id;
+    struct sockaddr_in *target;
+    unsigned long connects;
+    unsigned long errors;
+    unsigned long mixups;
+};
+
+static int nonblocking = 0;
+static int stop = 0;
+static int finished = 0;
+
+static int wait_for(int, short);
+static int open_conn(struct sockaddr_in *);
+static int check_conn(int, int, unsigned long);
+static void close_conn(int);
+static void *stress(void *);
+static double run(struct sockaddr_in *, int, int, unsigned long *,
+	unsigned long *, unsigned long *);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: -d direct ip:port [-t socks target ip:port] "
+	"[-n threads[,threads...]] [-D ms per run] [-m blocking|poll]";
+    char defthreads[] = "1,2,4,8,16,32,64";
+    char deftarget[] = "10.255.255.1:80";
+    char *threads = defthreads, *word, *preload;
+    struct sockaddr_in targets[2];
+    static char *paths[] = { "socks", "bypass" };
+    double rate, base[2] = { 0, 0 };
+    unsigned long connects, errors, mixups;
+    int ms = 1000, havedirect = 0, failed = 0;
+    int nthreads, path, fd, c;
+
+    parse_address(deftarget, &targets[0]);
+
+    while ((c = getopt(argc, argv, "d:t:n:D:m:")) != -1) {
+	switch (c) {
+	    case 'd':
+		if (parse_address(optarg, &targets[1])) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		havedirect = 1;
+		break;
+	    case 't':
+		if (parse_address(optarg, &targets[0])) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		break;
+	    case 'n':
+		threads = optarg;
+		break;
+	    case 'D':
+		ms = atoi(optarg);
+		break;
+	    case 'm':
+		if (!strcmp(optarg, "poll"))
+		    nonblocking = 1;
+		else if (strcmp(optarg, "blocking")) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    if (!havedirect) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    preload = ((getenv("LD_PRELOAD") && *getenv("LD_PRELOAD")) ?
+	    "true" : "false");
+
+    /* Make sure both paths work (and libtsocks has done its lazy */
+    /* initialization) before starting any threads                 */
+    for (path = 0; path < 2; path++) {
+	if (((fd = open_conn(&targets[path])) < 0) || check_conn(fd, 0, 0)) {
+	    show_msg(MSGERR, "Could not make a %s connection\n", paths[path]);
+	    exit(1);
+	}
+	close_conn(fd);
+    }
+
+    for (word = strtok(threads, ","); word; word = strtok(NULL, ",")) {
+	if ((nthreads = atoi(word)) < 1)
+	    continue;
+	for (path = 0; path < 2; path++) {
+	    rate = run(&targets[path], nthreads, ms, &connects, &errors, &mixups);
+	    if (!base[path])
+		base[path] = rate / nthreads;
+	    printf("{\"bench\":\"threads\",\"path\":\"%s\",\"mode\":\"%s\","
+		    "\"variant\":\"%s\",\"preload\":%s,\"threads\":%d,"
+		    "\"connects\":%lu,\"connects_per_sec\":%.1f,"
+		    "\"scaling\":%.2f,\"errors\":%lu,\"mixups\":%lu}\n",
+		    paths[path], (nonblocking ? "poll" : "blocking"),
+		    BENCH_VARIANT, preload, nthreads, connects, rate,
+		    (base[path] ? rate / base[path] : 0), errors, mixups);
+	    fflush(stdout);
+	    if (errors || mixups)
+		failed = 1;
+	}
+    }
+
+    return failed;
+}
+
+/* Wait for an event on a socket, returns 0 if it happened */
+static int wait_for(int fd, short events) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while ((rc = poll(&pfd, 1, TIMEOUT)) < 0) {
+	if (errno != EINTR)
+	    return -1;
+    }
+
+    return ((rc == 1) && (pfd.revents & events) ? 0 : -1);
+}
+
+/* Returns a connected socket or -1 */
+static int open_conn(struct sockaddr_in *addr) {
+    socklen_t len = sizeof(int);
+    int fd, err = 0, on = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (nonblocking)
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (connect(fd, (struct sockaddr *) addr, sizeof(*addr))) {
+	/* libtsocks finishes the handshake inside poll() */
+	if (!nonblocking || (errno != EINPROGRESS) || wait_for(fd, POLLOUT) ||
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+	    close_conn(fd);
+	    return -1;
+	}
+    }
+
+    return fd;
+}
+
+/* Echo a token naming the thread and connection, returns 0 if this */
+/* connection's token came back, 1 if another one did and -1 on     */
+/* errors                                                           */
+static int check_conn(int fd, int id, unsigned long seq) {
+    char token[TOKENLEN + 1], reply[TOKENLEN];
+    size_t done = 0;
+    ssize_t rc;
+
+    snprintf(token, sizeof(token), "%08d:%014lu\n", id, seq);
+    if (write(fd, token, TOKENLEN) != TOKENLEN)
+	return -1;
+
+    while (done < TOKENLEN) {
+	if (nonblocking && wait_for(fd, POLLIN))
+	    return -1;
+	if ((rc = read(fd, reply + done, TOKENLEN - done)) <= 0) {
+	    if ((rc < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+		continue;
+	    return -1;
+	}
+	done += rc;
+    }
+
+    return (memcmp(token, reply, TOKENLEN) ? 1 : 0);
+}
+
+/* Close without leaving the socket in TIME_WAIT */
+static void close_conn(int fd) {
+    struct linger linger = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void *stress(void *arg) {
+    struct worker *worker = arg;
+    unsigned long seq;
+    int fd, rc;
+
+    for (seq = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); seq++) {
+	if ((fd = open_conn(worker->target)) < 0) {
+	    worker->errors++;
+	    continue;
+	}
+	if ((rc = check_conn(fd, worker->id, seq)) < 0)
+	    worker->errors++;
+	else if (rc > 0)
+	    worker->mixups++;
+	else
+	    worker->connects++;
+	close_conn(fd);
+    }
+
+    __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* Run nthreads threads for ms milliseconds, returns connects per second */
+static double run(struct sockaddr_in *target, int nthreads, int ms,
+	unsigned long *connects, unsigned long *errors, unsigned long *mixups) {
+    struct worker *workers;
+    struct timespec delay;
+    uint64_t start, elapsed;
+    int i, started, done;
+
+    if ((workers = calloc(nthreads, sizeof(*workers))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for threads\n");
+	exit(1);
+    }
+
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+    start = now_ns();
+    for (started = 0; started < nthreads; started++) {
+	workers[started].id = started;
+	workers[started].target = target;
+	if (pthread_create(&workers[started].thread, NULL, stress,
+		    &workers[started])) {
+	    show_msg(MSGERR, "Could not create thread\n");
+	    break;
+	}
+    }
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    /* Threads that don't stop are stuck (e.g on a lost request) */
+    delay.tv_sec = 0;
+    delay.tv_nsec = 10000000;
+    for (i = 0; (i < HANG_TIMEOUT * 100) &&
+	    (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < started); i++)
+	nanosleep(&delay, NULL);
+    if ((done = __atomic_load_n(&finished, __ATOMIC_ACQUIRE)) < started) {
+	show_msg(MSGERR, "%d of %d threads made no progress in %d seconds\n",
+		started - done, started, HANG_TIMEOUT);
+	/* Exit handlers could wait on the stuck threads */
+	fflush(stdout);
+	_exit(2);
+    }
+    elapsed = now_ns() - start;
+
+    *connects = *errors = *mixups = 0;
+    for (i = 0; i < started; i++) {
+	pthread_join(workers[i].thread, NULL);
+	*connects += workers[i].connects;
+	*errors += workers[i].errors;
+	*mixups += workers[i].mixups;
+    }
+    free(workers);
+
+    return *connects / (elapsed / 1e9);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
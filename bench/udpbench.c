@@ -0,0 +1,263 @@
+/*
+ * UDPBENCH - Part of the tsocks benchmarks
+ *
+ * Measures the rate datagrams make a round trip to a UDP echo server,
+ * sending a batch and waiting for it to come back before sending the
+ * next, and reports it as a single JSON object. Each datagram carries
+ * its sequence number and replies are checked to come from the target,
+ * so run under libtsocks with TSOCKS_UDP set it checks that datagrams
+ * relayed through a SOCKS 5 UDP association are given back intact.
+ * The batches are sent and received with sendmmsg() and recvmmsg(),
+ * or one call a datagram with sendto() and recvfrom() (-m msg), or
+ * send() and recv() on a connected socket (-m send).
+ */
+
+#define _GNU_SOURCE
+
+/* Global configuration variables */
+char *progname = "udpbench";
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <common.h>
+#include "benchutil.h"
+
+#define TIMEOUT	1000 /* Milliseconds to wait for a batch to come back */
+#define MAXBATCH	256
+#define MAXSIZE	2048
+
+#define MODE_MMSG	0
+#define MODE_MSG	1
+#define MODE_SEND	2
+
+/* Settings */
+static struct sockaddr_in target;
+static int mode = MODE_MMSG;
+static int batch = 32;
+static size_t size = 64;
+
+/* Results */
+static unsigned long received = 0, lost = 0, bad = 0;
+
+static int send_batch(int, char (*)[MAXSIZE], uint32_t, int);
+static int recv_batch(int, char (*)[MAXSIZE], uint32_t, int);
+static void check(char *, ssize_t, struct sockaddr_in *, uint32_t, int);
+
+/* Send count datagrams numbered from seq, returns 0 if all went */
+static int send_batch(int fd, char (*bufs)[MAXSIZE], uint32_t seq,
+	int count) {
+    struct mmsghdr msgs[MAXBATCH];
+    struct iovec iovs[MAXBATCH];
+    int i, done, rc;
+
+    for (i = 0; i < count; i++) {
+	seq++;
+	memcpy(bufs[i], &seq, sizeof(seq));
+    }
+
+    if (mode != MODE_MMSG) {
+	for (i = 0; i < count; i++) {
+	    if (mode == MODE_SEND)
+		rc = send(fd, bufs[i], size, 0);
+	    else
+		rc = sendto(fd, bufs[i], size, 0, (struct sockaddr *) &target,
+			sizeof(target));
+	    if (rc != (int) size)
+		return -1;
+	}
+	return 0;
+    }
+
+    memset(msgs, 0x0, count * sizeof(msgs[0]));
+    for (i = 0; i < count; i++) {
+	iovs[i].iov_base = bufs[i];
+	iovs[i].iov_len = size;
+	msgs[i].msg_hdr.msg_name = &target;
+	msgs[i].msg_hdr.msg_namelen = sizeof(target);
+	msgs[i].msg_hdr.msg_iov = &iovs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (done = 0; done < count; done += rc) {
+	if ((rc = sendmmsg(fd, msgs + done, count - done, 0)) <= 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* Wait for a batch to come back, what hasn't after the timeout is */
+/* counted as lost                                                  */
+static int recv_batch(int fd, char (*bufs)[MAXSIZE], uint32_t seq,
+	int count) {
+    struct mmsghdr msgs[MAXBATCH];
+    struct sockaddr_in from[MAXBATCH];
+    struct iovec iovs[MAXBATCH];
+    struct pollfd pfd;
+    socklen_t len;
+    ssize_t got;
+    int have = 0, i, rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (have < count) {
+	if (poll(&pfd, 1, TIMEOUT) <= 0)
+	    break;
+	if (mode != MODE_MMSG) {
+	    len = sizeof(from[0]);
+	    if (mode == MODE_SEND) {
+		got = recv(fd, bufs[0], MAXSIZE, MSG_DONTWAIT);
+		from[0] = target;
+	    } else {
+		got = recvfrom(fd, bufs[0], MAXSIZE, MSG_DONTWAIT,
+			(struct sockaddr *) &from[0], &len);
+	    }
+	    if (got < 0)
+		continue;
+	    check(bufs[0], got, &from[0], seq, count);
+	    have++;
+	    continue;
+	}
+
+	memset(msgs, 0x0, (count - have) * sizeof(msgs[0]));
+	for (i = 0; i < count - have; i++) {
+	    iovs[i].iov_base = bufs[i];
+	    iovs[i].iov_len = MAXSIZE;
+	    msgs[i].msg_hdr.msg_name = &from[i];
+	    msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	    msgs[i].msg_hdr.msg_iov = &iovs[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if ((rc = recvmmsg(fd, msgs, count - have, MSG_DONTWAIT, NULL)) <= 0)
+	    continue;
+	for (i = 0; i < rc; i++)
+	    check(bufs[i], msgs[i].msg_len, &from[i], seq, count);
+	have += rc;
+    }
+    lost += count - have;
+
+    return have;
+}
+
+/* A reply must be the whole datagram, from the target and one of */
+/* the batch just sent                                            */
+static void check(char *buf, ssize_t len, struct sockaddr_in *from,
+	uint32_t seq, int count) {
+    uint32_t got;
+
+    received++;
+    memcpy(&got, buf, sizeof(got));
+    if ((len != (ssize_t) size) ||
+	    (from->sin_addr.s_addr != target.sin_addr.s_addr) ||
+	    (from->sin_port != target.sin_port) ||
+	    (got <= seq) || (got > seq + count))
+	bad++;
+}
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: -t echo ip:port [-n datagrams] [-s size] "
+	"[-B batch] [-m mmsg|msg|send] [-l extra json]";
+    char (*bufs)[MAXSIZE];
+    char *extra = NULL;
+    unsigned long total = 100000, sent = 0;
+    uint64_t start;
+    double secs;
+    int havetarget = 0, fd, count, c;
+
+    while ((c = getopt(argc, argv, "t:n:s:B:m:l:")) != -1) {
+	switch (c) {
+	    case 't':
+		if (parse_address(optarg, &target)) {
+		    show_msg(MSGERR, "Invalid target %s\n", optarg);
+		    exit(1);
+		}
+		havetarget = 1;
+		break;
+	    case 'n':
+		total = strtoul(optarg, NULL, 10);
+		break;
+	    case 's':
+		size = strtoul(optarg, NULL, 10);
+		break;
+	    case 'B':
+		batch = atoi(optarg);
+		break;
+	    case 'm':
+		if (!strcmp(optarg, "mmsg"))
+		    mode = MODE_MMSG;
+		else if (!strcmp(optarg, "msg"))
+		    mode = MODE_MSG;
+		else if (!strcmp(optarg, "send"))
+		    mode = MODE_SEND;
+		else {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		break;
+	    case 'l':
+		extra = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+    if (!havetarget || (size < sizeof(uint32_t)) || (size > MAXSIZE) ||
+	    (batch < 1) || (batch > MAXBATCH)) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+
+    if ((bufs = calloc(MAXBATCH, MAXSIZE)) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory\n");
+	exit(1);
+    }
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+	show_msg(MSGERR, "Could not create socket (%s)\n", strerror(errno));
+	exit(1);
+    }
+    if ((mode == MODE_SEND) &&
+	    connect(fd, (struct sockaddr *) &target, sizeof(target))) {
+	show_msg(MSGERR, "Could not connect (%s)\n", strerror(errno));
+	exit(1);
+    }
+
+    start = now_ns();
+    while (sent < total) {
+	count = (total - sent < (unsigned long) batch ? total - sent : batch);
+	if (send_batch(fd, bufs, sent, count)) {
+	    show_msg(MSGERR, "Send failed (%s)\n", strerror(errno));
+	    break;
+	}
+	recv_batch(fd, bufs, sent, count);
+	sent += count;
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    printf("{\"bench\":\"udp\",\"mode\":\"%s\",\"datagrams\":%lu,"
+	    "\"size\":%lu,\"batch\":%d,\"received\":%lu,\"lost\":%lu,"
+	    "\"bad\":%lu,\"round_trips_per_sec\":%.1f",
+	    (mode == MODE_MMSG ? "mmsg" : (mode == MODE_MSG ? "msg" : "send")),
+	    total, (unsigned long) size, batch, received, lost, bad,
+	    received / secs);
+    if (extra)
+	printf(",%s", extra);
+    printf("}\n");
+
+    return ((sent < total) || bad || (received < total / 2));
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,484 @@
+/*
+ * cache.c    - Precompiled binary cache of tsocks.conf
+ *
+ * validateconf -c writes the parsed configuration and its routing
+ * index next to the text file. libtsocks maps the cache read only
+ * (so every process shares the same pages) instead of parsing the
+ * text file whenever the cache is current.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "common.h"
+#include "parser.h"
+#include "cache.h"
+
+#define ALIGN(x)	(((x) + 7) & ~((size_t) 7))
+
+static uint32_t hash_cache(const struct cachehdr *);
+static char *cache_name(char *, char *, size_t);
+static int check_table(const struct cachehdr *, const struct cachetable *,
+	size_t);
+static int check_domains(const struct cachehdr *);
+static int check_files(const struct cachehdr *);
+static char *cache_string(const struct cachehdr *, uint32_t);
+
+/* FNV-1a over the header (with the hash itself zeroed) and the */
+/* server and file tables, enough to reject truncated or foreign */
+/* files                                                         */
+static uint32_t hash_cache(const struct cachehdr *hdr) {
+    struct cachehdr copy;
+    const unsigned char *p;
+    uint32_t hash = 2166136261u;
+    size_t i, len;
+
+    memcpy(&copy, hdr, sizeof(copy));
+    copy.hash = 0;
+    for (p = (const unsigned char *) &copy, i = 0; i < sizeof(copy); i++)
+	hash = (hash ^ p[i]) * 16777619u;
+
+    p = (const unsigned char *) hdr + hdr->servers;
+    len = hdr->nservers * sizeof(struct cacheserver);
+    for (i = 0; i < len; i++)
+	hash = (hash ^ p[i]) * 16777619u;
+
+    p = (const unsigned char *) hdr + hdr->files;
+    len = hdr->nfiles * sizeof(struct cachesrcfile);
+    for (i = 0; i < len; i++)
+	hash = (hash ^ p[i]) * 16777619u;
+
+    return hash;
+}
+
+static char *cache_name(char *filename, char *buf, size_t len) {
+
+    if (snprintf(buf, len, "%s" CACHE_SUFFIX, filename) >= len)
+	return NULL;
+
+    return buf;
+}
+
+/* Write the cache for a configuration parsed from filename, the */
+/* cache is written to a temporary file and renamed into place   */
+int write_config_cache(char *filename, struct parsedfile *config) {
+    struct stat st;
+    struct cachehdr *hdr;
+    struct cacheserver *cs;
+    struct cachesrcfile *cf;
+    struct serverent *server;
+    char cachefile[BUFSIZ], tmpfile[BUFSIZ];
+    char *image;
+    size_t size, strsize, off;
+    int i, fd, rc;
+
+    if (stat(filename, &st)) {
+	show_msg(MSGERR, "Could not stat %s (%s)\n", filename, strerror(errno));
+	return -1;
+    }
+
+    if ((cache_name(filename, cachefile, sizeof(cachefile)) == NULL) ||
+	    (snprintf(tmpfile, sizeof(tmpfile), "%s.%d", cachefile,
+		      (int) getpid()) >= sizeof(tmpfile))) {
+	show_msg(MSGERR, "Configuration file name is too long\n");
+	return -1;
+    }
+
+    /* Work out the size of the image */
+    strsize = 0;
+    for (i = -1; i < config->index.npaths; i++) {
+	server = (i < 0 ? &(config->defaultserver) : config->index.paths[i]);
+	if (server->address)
+	    strsize += strlen(server->address) + 1;
+	if (server->defuser)
+	    strsize += strlen(server->defuser) + 1;
+	if (server->defpass)
+	    strsize += strlen(server->defpass) + 1;
+	if (server->chain)
+	    strsize += strlen(server->chain) + 1;
+    }
+    for (i = 0; i < config->nfiles; i++)
+	strsize += strlen(config->files[i].filename) + 1;
+    size = ALIGN(sizeof(*hdr)) +
+	ALIGN((config->index.npaths + 1) * sizeof(*cs)) +
+	ALIGN(config->nfiles * sizeof(*cf)) +
+	ALIGN(config->index.local.ngroups * sizeof(struct routegroup)) +
+	ALIGN(config->index.local.nents * sizeof(struct routeent)) +
+	ALIGN(config->index.reach.ngroups * sizeof(struct routegroup)) +
+	ALIGN(config->index.reach.nents * sizeof(struct routeent)) +
+	ALIGN(config->index.local6.ngroups * sizeof(struct routegroup)) +
+	ALIGN(config->index.local6.nents * sizeof(struct routeent6)) +
+	ALIGN(config->index.reach6.ngroups * sizeof(struct routegroup)) +
+	ALIGN(config->index.reach6.nents * sizeof(struct routeent6)) +
+	ALIGN(config->index.domains.nbuckets * sizeof(uint32_t)) +
+	ALIGN(config->index.domains.nrules * sizeof(struct domainrule)) +
+	ALIGN(config->index.domains.nameslen) +
+	strsize;
+    if (size > UINT32_MAX) {
+	show_msg(MSGERR, "Configuration is too large to cache\n");
+	return -1;
+    }
+
+    if ((image = calloc(1, size)) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for configuration cache\n");
+	return -1;
+    }
+
+    hdr = (struct cachehdr *) image;
+    hdr->magic = CACHE_MAGIC;
+    hdr->version = CACHE_VERSION;
+    hdr->size = size;
+    hdr->srcmtime = st.st_mtim.tv_sec;
+    hdr->srcmtimensec = st.st_mtim.tv_nsec;
+    hdr->srcsize = st.st_size;
+    hdr->srcino = st.st_ino;
+    hdr->srcdev = st.st_dev;
+    hdr->fallback = config->fallback;
+    hdr->nservers = config->index.npaths + 1;
+    off = ALIGN(sizeof(*hdr));
+
+    hdr->servers = off;
+    off += ALIGN(hdr->nservers * sizeof(*cs));
+
+    hdr->nfiles = config->nfiles;
+    hdr->files = off;
+    off += ALIGN(hdr->nfiles * sizeof(*cf));
+
+#define COPY_TABLE(dst, src, entsize) \
+    (dst).ngroups = (src).ngroups; \
+    (dst).nents = (src).nents; \
+    (dst).groups = off; \
+    memcpy(image + off, (src).groups, (src).ngroups * sizeof(struct routegroup)); \
+    off += ALIGN((src).ngroups * sizeof(struct routegroup)); \
+    (dst).ents = off; \
+    memcpy(image + off, (src).ents, (src).nents * (entsize)); \
+    off += ALIGN((src).nents * (entsize));
+
+    COPY_TABLE(hdr->local, config->index.local, sizeof(struct routeent));
+    COPY_TABLE(hdr->reach, config->index.reach, sizeof(struct routeent));
+    COPY_TABLE(hdr->local6, config->index.local6, sizeof(struct routeent6));
+    COPY_TABLE(hdr->reach6, config->index.reach6, sizeof(struct routeent6));
+#undef COPY_TABLE
+
+#define COPY_ARRAY(dst, src, len) \
+    (dst) = off; \
+    memcpy(image + off, (src), (len)); \
+    off += ALIGN(len);
+
+    hdr->domains.nbuckets = config->index.domains.nbuckets;
+    hdr->domains.nrules = config->index.domains.nrules;
+    hdr->domains.nameslen = config->index.domains.nameslen;
+    COPY_ARRAY(hdr->domains.buckets, config->index.domains.buckets,
+	    config->index.domains.nbuckets * sizeof(uint32_t));
+    COPY_ARRAY(hdr->domains.rules, config->index.domains.rules,
+	    config->index.domains.nrules * sizeof(struct domainrule));
+    COPY_ARRAY(hdr->domains.names, config->index.domains.names,
+	    config->index.domains.nameslen);
+#undef COPY_ARRAY
+
+#define COPY_STRING(dst, src) \
+    if (src) { \
+	(dst) = off; \
+	strcpy(image + off, (src)); \
+	off += strlen(src) + 1; \
+    }
+
+    cs = (struct cacheserver *) (image + hdr->servers);
+    for (i = -1; i < config->index.npaths; i++, cs++) {
+	server = (i < 0 ? &(config->defaultserver) : config->index.paths[i]);
+	cs->lineno = server->lineno;
+	cs->port = server->port;
+	cs->type = server->type;
+	COPY_STRING(cs->address, server->address);
+	COPY_STRING(cs->defuser, server->defuser);
+	COPY_STRING(cs->defpass, server->defpass);
+	COPY_STRING(cs->chain, server->chain);
+    }
+
+    /* Files of networks, as they were when they were read */
+    cf = (struct cachesrcfile *) (image + hdr->files);
+    for (i = 0; i < config->nfiles; i++, cf++) {
+	cf->mtime = config->files[i].st.st_mtim.tv_sec;
+	cf->mtimensec = config->files[i].st.st_mtim.tv_nsec;
+	cf->size = config->files[i].st.st_size;
+	cf->ino = config->files[i].st.st_ino;
+	cf->dev = config->files[i].st.st_dev;
+	COPY_STRING(cf->filename, config->files[i].filename);
+    }
+#undef COPY_STRING
+
+    hdr->hash = hash_cache(hdr);
+
+    rc = -1;
+    if ((fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	show_msg(MSGERR, "Could not create %s (%s)\n", tmpfile, strerror(errno));
+    } else if (write(fd, image, size) != size) {
+	show_msg(MSGERR, "Could not write %s (%s)\n", tmpfile, strerror(errno));
+	close(fd);
+	unlink(tmpfile);
+    } else if (close(fd) || rename(tmpfile, cachefile)) {
+	show_msg(MSGERR, "Could not install %s (%s)\n", cachefile, strerror(errno));
+	unlink(tmpfile);
+    } else {
+	rc = 0;
+    }
+
+    free(image);
+
+    return rc;
+}
+
+static int check_table(const struct cachehdr *hdr, const struct cachetable *table,
+	size_t entsize) {
+    const struct routegroup *groups;
+    uint32_t i;
+
+    if ((table->groups > hdr->size) || (table->ents > hdr->size) ||
+	    (table->groups & 7) || (table->ents & 7) ||
+	    (table->ngroups > (hdr->size - table->groups) / sizeof(struct routegroup)) ||
+	    (table->nents > (hdr->size - table->ents) / entsize))
+	return -1;
+
+    groups = (const struct routegroup *) ((const char *) hdr + table->groups);
+    for (i = 0; i < table->ngroups; i++) {
+	if ((groups[i].first > table->nents) ||
+		(groups[i].count > table->nents - groups[i].first))
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* The domain rules must be chained within the table and their */
+/* names inside the (terminated) names                         */
+static int check_domains(const struct cachehdr *hdr) {
+    const struct cachedomains *dom = &(hdr->domains);
+    const struct domainrule *rules;
+    const uint32_t *buckets;
+    const char *names;
+    uint32_t i;
+
+    if (dom->nrules == 0)
+	return (dom->nbuckets || dom->nameslen ? -1 : 0);
+    if ((dom->nbuckets & (dom->nbuckets - 1)) || (dom->nbuckets == 0) ||
+	    (dom->buckets > hdr->size) || (dom->rules > hdr->size) ||
+	    (dom->names > hdr->size) || (dom->buckets & 7) ||
+	    (dom->rules & 7) ||
+	    (dom->nbuckets > (hdr->size - dom->buckets) / sizeof(uint32_t)) ||
+	    (dom->nrules > (hdr->size - dom->rules) / sizeof(*rules)) ||
+	    (dom->nameslen == 0) || (dom->nameslen > hdr->size - dom->names))
+	return -1;
+
+    buckets = (const uint32_t *) ((const char *) hdr + dom->buckets);
+    rules = (const struct domainrule *) ((const char *) hdr + dom->rules);
+    names = (const char *) hdr + dom->names;
+    if (names[dom->nameslen - 1] != '\0')
+	return -1;
+    for (i = 0; i < dom->nbuckets; i++) {
+	if ((buckets[i] != DOMAIN_NONE) && (buckets[i] >= dom->nrules))
+	    return -1;
+    }
+    for (i = 0; i < dom->nrules; i++) {
+	if (((rules[i].next != DOMAIN_NONE) && (rules[i].next >= dom->nrules)) ||
+		(rules[i].name >= dom->nameslen) ||
+		(rules[i].path < -1) ||
+		(rules[i].path >= (int32_t) hdr->nservers - 1))
+	    return -1;
+    }
+
+    return 0;
+}
+
+/* Every file must have a name */
+static int check_files(const struct cachehdr *hdr) {
+    const struct cachesrcfile *files;
+    uint32_t i;
+
+    if ((hdr->files > hdr->size) || (hdr->files & 7) ||
+	    (hdr->nfiles > (hdr->size - hdr->files) / sizeof(*files)))
+	return -1;
+
+    files = (const struct cachesrcfile *) ((const char *) hdr + hdr->files);
+    for (i = 0; i < hdr->nfiles; i++) {
+	if (cache_string(hdr, files[i].filename) == NULL)
+	    return -1;
+    }
+
+    return 0;
+}
+
+static char *cache_string(const struct cachehdr *hdr, uint32_t off) {
+
+    if ((off == 0) || (off >= hdr->size) ||
+	    !memchr((const char *) hdr + off, 0, hdr->size - off))
+	return NULL;
+
+    return (char *) hdr + off;
+}
+
+/* Map the cache for filename into config, returns 0 on success */
+/* or -1 if there is no cache or it is not current              */
+int read_config_cache(char *filename, struct parsedfile *config) {
+    char line[BUFSIZ], cachefile[BUFSIZ];
+    struct stat st, cst;
+    struct cachehdr *hdr;
+    struct cacheserver *cs;
+    struct cachesrcfile *cf;
+    struct serverent *servers = NULL;
+    void *image;
+    uint32_t i;
+    int fd;
+
+    if ((filename == NULL) && ((filename = find_config(line)) == NULL))
+	return -1;
+
+    if ((cache_name(filename, cachefile, sizeof(cachefile)) == NULL) ||
+	    ((fd = open(cachefile, O_RDONLY)) < 0))
+	return -1;
+
+    if (fstat(fd, &cst) || (cst.st_size < sizeof(*hdr)) ||
+	    (cst.st_size > UINT32_MAX) || stat(filename, &st)) {
+	close(fd);
+	return -1;
+    }
+
+    image = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+	return -1;
+    hdr = (struct cachehdr *) image;
+
+    /* Make sure the cache is ours, intact and was built from the */
+    /* configuration file as it currently is                     */
+    if ((hdr->magic != CACHE_MAGIC) || (hdr->version != CACHE_VERSION) ||
+	    (hdr->size != cst.st_size) || (hdr->nservers == 0) ||
+	    (hdr->servers > hdr->size) || (hdr->servers & 7) ||
+	    (hdr->nservers > (hdr->size - hdr->servers) / sizeof(*cs)) ||
+	    check_files(hdr) || (hdr->hash != hash_cache(hdr)) ||
+	    check_table(hdr, &(hdr->local), sizeof(struct routeent)) ||
+	    check_table(hdr, &(hdr->reach), sizeof(struct routeent)) ||
+	    check_table(hdr, &(hdr->local6), sizeof(struct routeent6)) ||
+	    check_table(hdr, &(hdr->reach6), sizeof(struct routeent6)) ||
+	    check_domains(hdr)) {
+	show_msg(MSGWARN, "Configuration cache %s is invalid, ignoring it\n",
+		cachefile);
+	munmap(image, cst.st_size);
+	return -1;
+    }
+    if ((hdr->srcmtime != st.st_mtim.tv_sec) ||
+	    (hdr->srcmtimensec != st.st_mtim.tv_nsec) ||
+	    (hdr->srcsize != st.st_size) || (hdr->srcino != st.st_ino) ||
+	    (hdr->srcdev != st.st_dev)) {
+	show_msg(MSGDEBUG, "Configuration cache %s is out of date\n",
+		cachefile);
+	munmap(image, cst.st_size);
+	return -1;
+    }
+
+    memset(config, 0x0, sizeof(*config));
+    if (((hdr->nservers > 1) &&
+	 (((servers = calloc(hdr->nservers - 1, sizeof(*servers))) == NULL) ||
+	  ((config->index.paths = malloc((hdr->nservers - 1) *
+					 sizeof(*config->index.paths))) == NULL))) ||
+	    (hdr->nfiles &&
+	     ((config->files = calloc(hdr->nfiles, sizeof(*config->files))) == NULL))) {
+	free(servers);
+	free(config->index.paths);
+	munmap(image, cst.st_size);
+	return -1;
+    }
+
+    /* The strings and tables are used straight out of the map, */
+    /* only the (few) server entries are allocated              */
+    cs = (struct cacheserver *) ((char *) image + hdr->servers);
+    for (i = 0; i < hdr->nservers; i++, cs++) {
+	struct serverent *server = (i == 0 ? &(config->defaultserver) : &servers[i - 1]);
+
+	server->lineno = cs->lineno;
+	server->port = cs->port;
+	server->type = cs->type;
+	server->address = cache_string(hdr, cs->address);
+	server->defuser = cache_string(hdr, cs->defuser);
+	server->defpass = cache_string(hdr, cs->defpass);
+	server->chain = cache_string(hdr, cs->chain);
+	if (i > 0) {
+	    server->next = (i + 1 < hdr->nservers ? &servers[i] : NULL);
+	    config->index.paths[i - 1] = server;
+	}
+    }
+
+    cf = (struct cachesrcfile *) ((char *) image + hdr->files);
+    for (i = 0; i < hdr->nfiles; i++, cf++) {
+	config->files[i].filename = cache_string(hdr, cf->filename);
+	config->files[i].st.st_mtim.tv_sec = cf->mtime;
+	config->files[i].st.st_mtim.tv_nsec = cf->mtimensec;
+	config->files[i].st.st_size = cf->size;
+	config->files[i].st.st_ino = cf->ino;
+	config->files[i].st.st_dev = cf->dev;
+    }
+    config->nfiles = hdr->nfiles;
+
+    config->paths = servers;
+    config->fallback = hdr->fallback;
+    config->index.npaths = hdr->nservers - 1;
+    config->index.local.ngroups = hdr->local.ngroups;
+    config->index.local.nents = hdr->local.nents;
+    config->index.local.groups = (struct routegroup *) ((char *) image + hdr->local.groups);
+    config->index.local.ents = (struct routeent *) ((char *) image + hdr->local.ents);
+    config->index.reach.ngroups = hdr->reach.ngroups;
+    config->index.reach.nents = hdr->reach.nents;
+    config->index.reach.groups = (struct routegroup *) ((char *) image + hdr->reach.groups);
+    config->index.reach.ents = (struct routeent *) ((char *) image + hdr->reach.ents);
+    config->index.local6.ngroups = hdr->local6.ngroups;
+    config->index.local6.nents = hdr->local6.nents;
+    config->index.local6.groups = (struct routegroup *) ((char *) image + hdr->local6.groups);
+    config->index.local6.ents = (struct routeent6 *) ((char *) image + hdr->local6.ents);
+    config->index.reach6.ngroups = hdr->reach6.ngroups;
+    config->index.reach6.nents = hdr->reach6.nents;
+    config->index.reach6.groups = (struct routegroup *) ((char *) image + hdr->reach6.groups);
+    config->index.reach6.ents = (struct routeent6 *) ((char *) image + hdr->reach6.ents);
+    config->index.domains.nbuckets = hdr->domains.nbuckets;
+    config->index.domains.nrules = hdr->domains.nrules;
+    config->index.domains.nameslen = hdr->domains.nameslen;
+    config->index.domains.buckets = (uint32_t *) ((char *) image + hdr->domains.buckets);
+    config->index.domains.rules = (struct domainrule *) ((char *) image + hdr->domains.rules);
+    config->index.domains.names = (char *) image + hdr->domains.names;
+    config->image = image;
+    config->imagelen = cst.st_size;
+
+    /* The files of networks it was built from must be unchanged too */
+    if (config_files_changed(config)) {
+	show_msg(MSGDEBUG, "Configuration cache %s is out of date\n",
+		cachefile);
+	free_config(config);
+	return -1;
+    }
+
+    show_msg(MSGDEBUG, "Mapped configuration cache %s (%d paths, %d local "
+	    "and %d reaches entries)\n", cachefile, config->index.npaths,
+	    config->index.local.nents, config->index.reach.nents);
+
+    return 0;
+}
+
+/* Load the configuration from the cache if it is current, */
+/* otherwise fall back to parsing the text file            */
+int load_config(char *filename, struct parsedfile *config) {
+
+    if (read_config_cache(filename, config) == 0)
+	return 0;
+
+    return read_config(filename, config);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,93 @@
+/* cache.h - Structures and functions for the precompiled binary */
+/* form of tsocks.conf which is mapped read only by libtsocks    */
+
+#ifndef _CACHE_H
+
+#define _CACHE_H	1
+
+#include <stdint.h>
+#include <parser.h>
+
+#define CACHE_MAGIC	0x434b5354	/* "TSKC" */
+#define CACHE_VERSION	5
+#define CACHE_SUFFIX	".cache"	/* Appended to the conf file name */
+
+/* All references inside the cache are byte offsets from the start */
+/* of the file, an offset of 0 is used for a NULL string           */
+
+/* Structure representing a routing table in the cache */
+struct cachetable {
+   uint32_t ngroups;
+   uint32_t nents;
+   uint32_t groups; /* Offset of the struct routegroup array */
+   uint32_t ents; /* Offset of the struct routeent (or routeent6) array */
+};
+
+/* Structure representing the domain rules in the cache */
+struct cachedomains {
+   uint32_t nbuckets;
+   uint32_t nrules;
+   uint32_t nameslen;
+   uint32_t buckets; /* Offset of the bucket array */
+   uint32_t rules; /* Offset of the struct domainrule array */
+   uint32_t names; /* Offset of the names */
+};
+
+/* Structure representing a server in the cache, the first one is */
+/* the default server and the rest are the paths in list order    */
+struct cacheserver {
+   int32_t lineno;
+   int32_t port;
+   int32_t type;
+   uint32_t address; /* Offset of the address string */
+   uint32_t defuser; /* Offset of the default username string */
+   uint32_t defpass; /* Offset of the default password string */
+   uint32_t chain; /* Offset of the chain string */
+};
+
+/* Structure representing a file of networks (from reaches_file */
+/* or local_file) the cache was built from, a file that couldn't  */
+/* be read has every field but the name 0                         */
+struct cachesrcfile {
+   int64_t mtime;
+   int64_t mtimensec;
+   uint64_t size;
+   uint64_t ino;
+   uint64_t dev;
+   uint32_t filename; /* Offset of the file name string */
+   uint32_t pad;
+};
+
+/* Structure representing the cache file header */
+struct cachehdr {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t size; /* Total size of the cache */
+   uint32_t hash; /* FNV-1a of the header, server and file tables */
+   /* Identity of the text configuration file this was built from */
+   int64_t srcmtime;
+   int64_t srcmtimensec;
+   uint64_t srcsize;
+   uint64_t srcino;
+   uint64_t srcdev;
+   /* Contents of the parsed file */
+   uint32_t fallback;
+   uint32_t nservers;
+   uint32_t servers; /* Offset of the struct cacheserver array */
+   uint32_t pad;
+   struct cachetable local;
+   struct cachetable reach;
+   struct cachetable local6;
+   struct cachetable reach6;
+   struct cachedomains domains;
+   uint32_t nfiles;
+   uint32_t files; /* Offset of the struct cachesrcfile array */
+   uint32_t pad2;
+};
+
+/* Functions provided by the cache module */
+int write_config_cache(char *, struct parsedfile *);
+int read_config_cache(char *, struct parsedfile *);
+int load_config(char *, struct parsedfile *);
+
+#endif
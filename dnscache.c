@@ -0,0 +1,913 @@
+/*
+ * dnscache.c    - Resolver answers shared between processes
+ *
+ * When TSOCKS_DNS_CACHE is set libtsocks answers getaddrinfo(),
+ * gethostbyname() and gethostbyname_r() from a cache in a file in
+ * DNSCACHE_DIR (or $TSOCKS_DNS_CACHE_DIR) that every process of the
+ * user maps shared, so names looked up by one short lived process are
+ * answered from memory for the ones after it. A name that isn't there
+ * is looked up with a DNS query of our own so the answer's TTL is
+ * known. Names DNS says have no addresses are kept for the negative
+ * TTL in the SOA record (RFC 2308), once the real resolver has agreed.
+ *
+ * Slots are claimed by a compare and swap on their sequence number and
+ * read by copying them and checking it didn't change, so no process
+ * ever waits for another and one killed while writing only loses that
+ * slot. Names in the hosts file, names without a dot (which the search
+ * list applies to), numeric addresses and requests the cache can't
+ * answer exactly are all left to the real resolver.
+ *
+ * getaddrinfo() answers are put in the order the C library would put
+ * them in, by its default destination address selection policy (RFC
+ * 3484/6724). Where /etc/gai.conf changes the policy, answers with
+ * more than one address are left to the real resolver too.
+ */
+
+#include <config.h>
+
+#ifdef ENABLE_DNSCACHE
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+#include "dnscache.h"
+
+#ifndef EAI_NODATA
+#define EAI_NODATA	EAI_NONAME
+#endif
+
+#define QUERYSIZE	512
+#define ANSWERSIZE	4096
+
+/* What became of the answer for one record type */
+#define PART_CACHED	0	/* Found in the cache */
+#define PART_FOUND	1	/* Looked up and there are addresses */
+#define PART_NONE	2	/* Looked up and there are none */
+#define PART_FAILED	3	/* Couldn't be looked up */
+
+/* What resolve() found for a name */
+#define ANSWER_FOUND	0	/* Addresses */
+#define ANSWER_NONE	1	/* The cache says there are none */
+#define ANSWER_CHECK	2	/* DNS says there are none, the real resolver */
+				/* has to agree before that's kept             */
+#define ANSWER_BYPASS	3	/* Ask the real resolver */
+
+/* Structure representing the answer for one record type while a */
+/* request is answered                                           */
+struct part {
+   uint16_t type;
+   int state;
+   uint32_t hash;
+   struct dnsslot slot;
+};
+
+/* Structure representing an address of an answer while the answer */
+/* is sorted, with the source address the system would use for it  */
+struct dest {
+   int type; /* T_A or T_AAAA */
+   uint8_t *addr; /* In the part's slot */
+   int usable; /* There is a route to it */
+   struct in6_addr d; /* The address, IPv4 mapped */
+   struct in6_addr s; /* The source address, IPv4 mapped */
+   int index; /* Its place in DNS's answer */
+};
+
+/* Structure representing an entry of a policy table, the first */
+/* entry an address is in applies                              */
+struct policy {
+   const char *prefix;
+   int len;
+   int value;
+};
+
+/* The C library's default policy, RFC 3484's with labels for */
+/* unique local and Teredo addresses                         */
+static const struct policy precedences[] = {
+   { "::1", 128, 50 },
+   { "2002::", 16, 30 },
+   { "::", 96, 20 },
+   { "::ffff:0:0", 96, 10 },
+   { "::", 0, 40 },
+};
+static const struct policy labels[] = {
+   { "::1", 128, 0 },
+   { "2002::", 16, 2 },
+   { "::", 96, 3 },
+   { "::ffff:0:0", 96, 4 },
+   { "fec0::", 10, 5 },
+   { "fc00::", 7, 6 },
+   { "2001::", 32, 7 },
+   { "::", 0, 1 },
+};
+#define POLICIES(table)	(sizeof(table) / sizeof((table)[0]))
+
+/* Structure for each addrinfo made from the cache, the addrinfo and */
+/* its address are one allocation as the C library's freeaddrinfo() */
+/* expects                                                           */
+struct aibuf {
+   struct addrinfo ai;
+   union {
+      struct sockaddr_in sin;
+      struct sockaddr_in6 sin6;
+   } addr;
+};
+
+/* The file for this user, NULL until the first lookup or if the */
+/* cache is turned off                                           */
+static struct dnsregion *region = NULL;
+static pthread_mutex_t dnscache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int opened = 0;
+/* Whether there are addresses other than loopback, for AI_ADDRCONFIG */
+static int have4 = 1, have6 = 1;
+/* Whether /etc/gai.conf changes how answers are sorted */
+static int gaiconf = 0;
+
+static struct dnsregion *map_region(void);
+static void find_families(void);
+static void find_gaiconf(void);
+static uint32_t hash_name(const char *, uint16_t);
+static int find_slot(struct part *, const char *, time_t);
+static void store_slot(struct part *);
+static int query(struct part *, const char *, time_t);
+static int in_hosts(const char *);
+static int resolve(const char *, int, int, struct part *, int *);
+static void keep_none(struct part *, int);
+static int nodata(struct part *, int);
+static int answer_ttl(struct part *, int);
+static void sort_dests(struct dest *, int, int (*)(CONNECT_SIGNATURE));
+static int compare_dests(const void *, const void *);
+static int policy(const struct policy *, int, const struct in6_addr *);
+static int scope(const struct in6_addr *);
+static int common_prefix(const struct in6_addr *, const struct in6_addr *);
+
+/* Map the file the first time it's called, returns whether there is */
+/* a cache to use. Setuid programs never use one, the answers in it  */
+/* are only as trustworthy as the user                               */
+int __attribute__ ((visibility ("hidden")))
+dnscache_open(int suid) {
+    struct dnsregion *r = NULL;
+    char *env;
+    int saveerr;
+
+    if (__atomic_load_n(&opened, __ATOMIC_ACQUIRE))
+	return (__atomic_load_n(&region, __ATOMIC_ACQUIRE) != NULL);
+
+    saveerr = errno;
+    pthread_mutex_lock(&dnscache_lock);
+    if (!opened) {
+	if (!suid && (env = getenv("TSOCKS_DNS_CACHE")) && (atoi(env) > 0)) {
+	    find_families();
+	    find_gaiconf();
+	    r = map_region();
+	}
+	__atomic_store_n(&region, r, __ATOMIC_RELEASE);
+	__atomic_store_n(&opened, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dnscache_lock);
+    errno = saveerr;
+
+    return (__atomic_load_n(&region, __ATOMIC_ACQUIRE) != NULL);
+}
+
+static struct dnsregion *map_region(void) {
+    struct dnsregion *r;
+    struct stat st;
+    char path[BUFSIZ];
+    uint64_t magic, expected = 0;
+    char *dir;
+    int fd;
+
+    if (((dir = getenv("TSOCKS_DNS_CACHE_DIR")) == NULL) || !*dir)
+	dir = DNSCACHE_DIR;
+    snprintf(path, sizeof(path), "%s/" DNSCACHE_PREFIX "%u" DNSCACHE_SUFFIX,
+	    dir, (unsigned int) geteuid());
+
+    /* Answers are only shared with processes of the same user */
+    if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		    0600)) < 0) {
+	show_msg(MSGWARN, "Could not open DNS cache %s (%s)\n", path,
+		strerror(errno));
+	return NULL;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != geteuid()) || (st.st_mode & 077)) {
+	show_msg(MSGWARN, "DNS cache %s is not a file only this user can "
+		"use, not using it\n", path);
+	close(fd);
+	return NULL;
+    }
+    if ((st.st_size == 0) && ftruncate(fd, sizeof(*r))) {
+	show_msg(MSGWARN, "Could not size DNS cache %s (%s)\n", path,
+		strerror(errno));
+	close(fd);
+	return NULL;
+    } else if ((st.st_size != 0) && (st.st_size != sizeof(*r))) {
+	show_msg(MSGWARN, "DNS cache %s is from another version of tsocks, "
+		"not using it\n", path);
+	close(fd);
+	return NULL;
+    }
+    r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+	show_msg(MSGWARN, "Could not map DNS cache %s (%s)\n", path,
+		strerror(errno));
+	return NULL;
+    }
+
+    /* The first process to map a new file marks it as set up */
+    magic = ((uint64_t) DNSCACHE_MAGIC << 32) | DNSCACHE_VERSION;
+    if (!__atomic_compare_exchange_n(&(r->magic), &expected, magic, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && (expected != magic)) {
+	show_msg(MSGWARN, "DNS cache %s is from another version of tsocks, "
+		"not using it\n", path);
+	munmap(r, sizeof(*r));
+	return NULL;
+    }
+    show_msg(MSGDEBUG, "Mapped DNS cache %s\n", path);
+
+    return r;
+}
+
+static void find_families(void) {
+    struct ifaddrs *ifs, *ifa;
+
+    if (getifaddrs(&ifs))
+	return;
+
+    have4 = have6 = 0;
+    for (ifa = ifs; ifa != NULL; ifa = ifa->ifa_next) {
+	if ((ifa->ifa_addr == NULL) || (ifa->ifa_flags & IFF_LOOPBACK))
+	    continue;
+	if (ifa->ifa_addr->sa_family == AF_INET)
+	    have4 = 1;
+	else if (ifa->ifa_addr->sa_family == AF_INET6)
+	    have6 = 1;
+    }
+    freeifaddrs(ifs);
+}
+
+/* Any label, precedence or scopev4 line in gai.conf replaces the */
+/* default policy                                                 */
+static void find_gaiconf(void) {
+    char line[BUFSIZ], *tok, *save;
+    FILE *conf;
+
+    if ((conf = fopen("/etc/gai.conf", "re")) == NULL)
+	return;
+
+    while (!gaiconf && fgets(line, sizeof(line), conf)) {
+	if ((tok = strchr(line, '#')))
+	    *tok = '\0';
+	if ((tok = strtok_r(line, " \t\r\n", &save)) &&
+		(!strcmp(tok, "label") || !strcmp(tok, "precedence") ||
+		 !strcmp(tok, "scopev4")))
+	    gaiconf = 1;
+    }
+    fclose(conf);
+}
+
+static uint32_t hash_name(const char *name, uint16_t type) {
+    uint32_t hash = 2166136261U;
+
+    for (; *name; name++) {
+	hash ^= (unsigned char) *name;
+	hash *= 16777619U;
+    }
+    hash ^= type;
+    hash *= 16777619U;
+
+    return hash;
+}
+
+/* Look for the answer for a part, returns 0 and copies it into the */
+/* part if there is one that hasn't run out                         */
+static int find_slot(struct part *part, const char *name, time_t now) {
+    struct dnsslot *slot, *copy = &(part->slot);
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < DNSCACHE_PROBES; i++) {
+	slot = &(region->slots[(part->hash + i) & (DNSCACHE_SLOTS - 1)]);
+	/* Slots are never emptied, so nothing is kept further on */
+	if ((seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE)) == 0)
+	    return -1;
+	if ((seq & 1) ||
+		(__atomic_load_n(&(slot->hash), __ATOMIC_RELAXED) != part->hash))
+	    continue;
+	memcpy(copy, slot, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq)
+	    continue;
+	copy->name[DNSCACHE_NAMELEN - 1] = '\0';
+	if ((copy->type == part->type) && (copy->expires > now) &&
+		(copy->naddrs <= DNSCACHE_ADDRS) && !strcmp(copy->name, name))
+	    return 0;
+    }
+
+    return -1;
+}
+
+/* Keep the answer in a part in the slot with the old answer for it, */
+/* else an unused one, else the one closest to running out. A slot   */
+/* another process is writing is left to it                          */
+static void store_slot(struct part *part) {
+    struct dnsslot *slot, *victim = NULL;
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < DNSCACHE_PROBES; i++) {
+	slot = &(region->slots[(part->hash + i) & (DNSCACHE_SLOTS - 1)]);
+	if ((seq = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED)) == 0) {
+	    victim = slot;
+	    break;
+	}
+	if (seq & 1)
+	    continue;
+	if ((__atomic_load_n(&(slot->hash), __ATOMIC_RELAXED) == part->hash) &&
+		(slot->type == part->type) &&
+		!strncmp(slot->name, part->slot.name, DNSCACHE_NAMELEN)) {
+	    victim = slot;
+	    break;
+	}
+	if ((victim == NULL) || (slot->expires < victim->expires))
+	    victim = slot;
+    }
+
+    if ((victim == NULL) ||
+	    ((seq = __atomic_load_n(&(victim->seq), __ATOMIC_RELAXED)) & 1) ||
+	    !__atomic_compare_exchange_n(&(victim->seq), &seq, seq + 1, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&(victim->hash), part->hash, __ATOMIC_RELAXED);
+    victim->type = part->type;
+    victim->naddrs = part->slot.naddrs;
+    victim->nxdomain = part->slot.nxdomain;
+    victim->expires = part->slot.expires;
+    memcpy(victim->addrs, part->slot.addrs, sizeof(victim->addrs));
+    memcpy(victim->name, part->slot.name, sizeof(victim->name));
+
+    __atomic_store_n(&(victim->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Ask DNS for the records of the part's type, the answer and how */
+/* long it lasts go in the part                                   */
+static int query(struct part *part, const char *name, time_t now) {
+    unsigned char q[QUERYSIZE], a[ANSWERSIZE], *p, *eom, *min;
+    HEADER *hdr = (HEADER *) a;
+    struct dnsslot *slot = &(part->slot);
+    uint16_t type, class, rdlen;
+    uint32_t ttl, minimum, addrttl = DNSCACHE_MAXTTL;
+    uint32_t nonettl = DNSCACHE_MAXNEGTTL;
+    int qlen, alen, len, count, soa = 0, n, i;
+
+    if (!(_res.options & RES_INIT) && (res_init() == -1))
+	return PART_FAILED;
+    if (((qlen = res_mkquery(QUERY, name, C_IN, part->type, NULL, 0, NULL,
+			q, sizeof(q))) < 0) ||
+	    ((alen = res_send(q, qlen, a, sizeof(a))) < HFIXEDSZ) ||
+	    (alen > (int) sizeof(a)) || hdr->tc ||
+	    ((hdr->rcode != NOERROR) && (hdr->rcode != NXDOMAIN)))
+	return PART_FAILED;
+
+    memset(slot, 0x0, sizeof(*slot));
+    slot->type = part->type;
+    strcpy(slot->name, name);
+    slot->nxdomain = (hdr->rcode == NXDOMAIN);
+    len = (part->type == T_A ? 4 : 16);
+
+    eom = a + alen;
+    p = a + HFIXEDSZ;
+    for (i = ntohs(hdr->qdcount); i > 0; i--) {
+	if (((n = dn_skipname(p, eom)) < 0) || (p + n + QFIXEDSZ > eom))
+	    return PART_FAILED;
+	p += n + QFIXEDSZ;
+    }
+
+    /* The answer section and then the authority section, where the */
+    /* SOA says how long to remember there are no records           */
+    count = ntohs(hdr->ancount) + ntohs(hdr->nscount);
+    for (i = 0; i < count; i++) {
+	if (((n = dn_skipname(p, eom)) < 0) || (p + n + RRFIXEDSZ > eom))
+	    return PART_FAILED;
+	p += n;
+	NS_GET16(type, p);
+	NS_GET16(class, p);
+	NS_GET32(ttl, p);
+	NS_GET16(rdlen, p);
+	if (p + rdlen > eom)
+	    return PART_FAILED;
+
+	if (i < ntohs(hdr->ancount)) {
+	    if ((class == C_IN) && (type == part->type) && (rdlen == len)) {
+		if (slot->naddrs < DNSCACHE_ADDRS)
+		    memcpy(slot->addrs[slot->naddrs++], p, len);
+		addrttl = (ttl < addrttl ? ttl : addrttl);
+	    } else if (type == T_CNAME) {
+		addrttl = (ttl < addrttl ? ttl : addrttl);
+	    }
+	} else if ((type == T_SOA) && (rdlen >= 20)) {
+	    /* Two names and five numbers, the last the minimum */
+	    min = p + rdlen - 4;
+	    NS_GET32(minimum, min);
+	    ttl = (minimum < ttl ? minimum : ttl);
+	    nonettl = (ttl < nonettl ? ttl : nonettl);
+	    soa = 1;
+	}
+	p += rdlen;
+    }
+
+    if (slot->naddrs) {
+	slot->nxdomain = 0;
+	slot->expires = now + addrttl;
+	return PART_FOUND;
+    }
+
+    /* With no SOA there's nothing to say how long there are none */
+    slot->expires = now + (soa ? nonettl : 0);
+    return PART_NONE;
+}
+
+/* Whether the hosts file has the name, its entries are left to the */
+/* real resolver                                                    */
+static int in_hosts(const char *name) {
+    char line[BUFSIZ], *tok, *save;
+    int found = 0;
+    FILE *hosts;
+
+    if ((hosts = fopen(_PATH_HOSTS, "re")) == NULL)
+	return 0;
+
+    while (!found && fgets(line, sizeof(line), hosts)) {
+	if ((tok = strchr(line, '#')))
+	    *tok = '\0';
+	/* The address, then the names */
+	if (strtok_r(line, " \t\r\n", &save) == NULL)
+	    continue;
+	while (!found && (tok = strtok_r(NULL, " \t\r\n", &save)))
+	    found = !strcasecmp(tok, name);
+    }
+    fclose(hosts);
+
+    return found;
+}
+
+/* Find the answers for a name, a part for each record type asked for */
+/* (AAAA and A for AF_UNSPEC) with its name in key. Parts the cache   */
+/* doesn't have are looked up and the ones with addresses kept         */
+static int resolve(const char *name, int family, int addrconfig,
+	struct part *parts, int *nparts) {
+    struct in6_addr addr;
+    struct in_addr addr4;
+    char key[DNSCACHE_NAMELEN];
+    time_t now = time(NULL);
+    int len, i, missing = 0, found = 0, cached = 0;
+    int want4, want6;
+
+    /* Kept in lower case without a trailing dot */
+    len = strlen(name);
+    if (len && (name[len - 1] == '.'))
+	len--;
+    if ((len == 0) || (len >= DNSCACHE_NAMELEN))
+	return ANSWER_BYPASS;
+    for (i = 0; i < len; i++)
+	key[i] = tolower((unsigned char) name[i]);
+    key[len] = '\0';
+    if (!strchr(key, '.') || inet_aton(key, &addr4) ||
+	    (inet_pton(AF_INET6, key, &addr) == 1))
+	return ANSWER_BYPASS;
+
+    want4 = ((family != AF_INET6) && (!addrconfig || have4));
+    want6 = ((family != AF_INET) && (!addrconfig || have6));
+    if (!want4 && !want6)
+	return ANSWER_BYPASS;
+
+    /* IPv6 first when there are IPv6 addresses to use it from, */
+    /* getaddrinfo() answers are sorted afterwards               */
+    *nparts = 0;
+    if (want6 && have6)
+	parts[(*nparts)++].type = T_AAAA;
+    if (want4)
+	parts[(*nparts)++].type = T_A;
+    if (want6 && !have6)
+	parts[(*nparts)++].type = T_AAAA;
+
+    for (i = 0; i < *nparts; i++) {
+	parts[i].hash = hash_name(key, parts[i].type);
+	if (!find_slot(&parts[i], key, now)) {
+	    parts[i].state = PART_CACHED;
+	    cached++;
+	} else {
+	    parts[i].state = PART_FAILED;
+	    missing++;
+	}
+    }
+    if (missing && in_hosts(key))
+	return ANSWER_BYPASS;
+
+    for (i = 0; i < *nparts; i++) {
+	if ((parts[i].state != PART_CACHED) &&
+		((parts[i].state = query(&parts[i], key, now)) == PART_FAILED))
+	    return ANSWER_BYPASS;
+	if (parts[i].state == PART_FOUND)
+	    store_slot(&parts[i]);
+	if (parts[i].slot.naddrs)
+	    found++;
+    }
+    show_msg(MSGDEBUG, "DNS cache had %d of %d answers for %s\n", cached,
+	    *nparts, key);
+
+    if (found) {
+	keep_none(parts, *nparts);
+	return ANSWER_FOUND;
+    }
+
+    return (cached == *nparts ? ANSWER_NONE : ANSWER_CHECK);
+}
+
+/* Keep the parts that were looked up and have no addresses, once */
+/* it's certain the name has none                                 */
+static void keep_none(struct part *parts, int nparts) {
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < nparts; i++) {
+	if ((parts[i].state == PART_NONE) && (parts[i].slot.expires > now))
+	    store_slot(&parts[i]);
+    }
+}
+
+/* Whether the name exists but has no addresses of a type asked for */
+static int nodata(struct part *parts, int nparts) {
+    int i;
+
+    for (i = 0; i < nparts; i++) {
+	if (!parts[i].slot.nxdomain)
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* Seconds until the first of the answers with addresses runs out */
+static int answer_ttl(struct part *parts, int nparts) {
+    time_t now = time(NULL), expires = 0;
+    int i;
+
+    for (i = 0; i < nparts; i++) {
+	if (parts[i].slot.naddrs &&
+		(!expires || (parts[i].slot.expires < expires)))
+	    expires = parts[i].slot.expires;
+    }
+
+    return (expires > now ? expires - now : 0);
+}
+
+/* Sort the addresses of an answer as the C library does (RFC 3484  */
+/* section 6), finding the source address for each by connecting a */
+/* UDP socket to it. The rules that need more than the source       */
+/* address itself (deprecated, home and native addresses, and the   */
+/* length of an IPv4 source's network) are left out, so DNS's order */
+/* is kept where they would be all that decides                     */
+static void sort_dests(struct dest *dests, int n,
+	int (*realconnect)(CONNECT_SIGNATURE)) {
+    struct sockaddr_in6 sin6, src6;
+    struct sockaddr_in sin, src;
+    struct sockaddr *sa, *srcsa;
+    socklen_t len, srclen;
+    int i, fd;
+
+    for (i = 0; i < n; i++) {
+	memset(&(dests[i].d), 0x0, sizeof(dests[i].d));
+	memset(&(dests[i].s), 0x0, sizeof(dests[i].s));
+	if (dests[i].type == T_A) {
+	    memset(&sin, 0x0, sizeof(sin));
+	    sin.sin_family = AF_INET;
+	    sin.sin_port = htons(9);
+	    memcpy(&(sin.sin_addr), dests[i].addr, 4);
+	    dests[i].d.s6_addr[10] = dests[i].d.s6_addr[11] = 0xff;
+	    memcpy(&(dests[i].d.s6_addr[12]), dests[i].addr, 4);
+	    sa = (struct sockaddr *) &sin;
+	    len = sizeof(sin);
+	    srcsa = (struct sockaddr *) &src;
+	    srclen = sizeof(src);
+	} else {
+	    memset(&sin6, 0x0, sizeof(sin6));
+	    sin6.sin6_family = AF_INET6;
+	    sin6.sin6_port = htons(9);
+	    memcpy(&(sin6.sin6_addr), dests[i].addr, 16);
+	    memcpy(&(dests[i].d), dests[i].addr, 16);
+	    sa = (struct sockaddr *) &sin6;
+	    len = sizeof(sin6);
+	    srcsa = (struct sockaddr *) &src6;
+	    srclen = sizeof(src6);
+	}
+	dests[i].index = i;
+
+	/* Rule 1 needs to know whether there is a route to it at all */
+	dests[i].usable = 0;
+	if ((fd = socket(sa->sa_family, SOCK_DGRAM | SOCK_CLOEXEC,
+			IPPROTO_UDP)) < 0)
+	    continue;
+	if (!realconnect(fd, sa, len) && !getsockname(fd, srcsa, &srclen)) {
+	    dests[i].usable = 1;
+	    if (dests[i].type == T_A) {
+		dests[i].s.s6_addr[10] = dests[i].s.s6_addr[11] = 0xff;
+		memcpy(&(dests[i].s.s6_addr[12]), &(src.sin_addr), 4);
+	    } else {
+		dests[i].s = src6.sin6_addr;
+	    }
+	}
+	close(fd);
+    }
+
+    qsort(dests, n, sizeof(*dests), compare_dests);
+}
+
+static int compare_dests(const void *p1, const void *p2) {
+    const struct dest *a = p1, *b = p2;
+    int va, vb;
+
+    /* Rule 1: Avoid unusable destinations */
+    if (a->usable != b->usable)
+	return b->usable - a->usable;
+
+    if (a->usable) {
+	/* Rule 2: Prefer matching scope */
+	va = (scope(&(a->d)) == scope(&(a->s)));
+	vb = (scope(&(b->d)) == scope(&(b->s)));
+	if (va != vb)
+	    return vb - va;
+
+	/* Rule 5: Prefer matching label */
+	va = (policy(labels, POLICIES(labels), &(a->d)) ==
+		policy(labels, POLICIES(labels), &(a->s)));
+	vb = (policy(labels, POLICIES(labels), &(b->d)) ==
+		policy(labels, POLICIES(labels), &(b->s)));
+	if (va != vb)
+	    return vb - va;
+    }
+
+    /* Rule 6: Prefer higher precedence */
+    va = policy(precedences, POLICIES(precedences), &(a->d));
+    vb = policy(precedences, POLICIES(precedences), &(b->d));
+    if (va != vb)
+	return vb - va;
+
+    /* Rule 8: Prefer smaller scope */
+    va = scope(&(a->d));
+    vb = scope(&(b->d));
+    if (va != vb)
+	return va - vb;
+
+    /* Rule 9: Use longest matching prefix, for IPv6 */
+    if (a->usable && (a->type == T_AAAA) && (b->type == T_AAAA)) {
+	va = common_prefix(&(a->d), &(a->s));
+	vb = common_prefix(&(b->d), &(b->s));
+	if (va != vb)
+	    return vb - va;
+    }
+
+    /* Rule 10: Otherwise, leave the order unchanged */
+    return a->index - b->index;
+}
+
+/* The value of the first entry of a policy table the address is in */
+static int policy(const struct policy *table, int n,
+	const struct in6_addr *addr) {
+    struct in6_addr prefix;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if ((inet_pton(AF_INET6, table[i].prefix, &prefix) == 1) &&
+		(common_prefix(&prefix, addr) >= table[i].len))
+	    return table[i].value;
+    }
+
+    return 0;
+}
+
+/* The scope of an address (IPv4 mapped), as RFC 3484 section 3.2 */
+static int scope(const struct in6_addr *addr) {
+    const uint8_t *a = addr->s6_addr;
+
+    if (IN6_IS_ADDR_V4MAPPED(addr))
+	return (((a[12] == 127) || ((a[12] == 169) && (a[13] == 254))) ?
+		2 : 14);
+    if (IN6_IS_ADDR_MULTICAST(addr))
+	return (a[1] & 0xf);
+    if (IN6_IS_ADDR_LINKLOCAL(addr) || IN6_IS_ADDR_LOOPBACK(addr))
+	return 2;
+    if (IN6_IS_ADDR_SITELOCAL(addr))
+	return 5;
+
+    return 14;
+}
+
+/* The number of leading bits two addresses have in common */
+static int common_prefix(const struct in6_addr *a, const struct in6_addr *b) {
+    int i, bits = 0;
+    uint8_t x;
+
+    for (i = 0; i < 16; i++) {
+	if ((x = a->s6_addr[i] ^ b->s6_addr[i]) != 0)
+	    return bits + __builtin_clz(x) - 24;
+	bits += 8;
+    }
+
+    return bits;
+}
+
+/* The answer comes from the cache where it can, ttl is set to the */
+/* seconds its addresses last for, or 0 if the real call gave them */
+int __attribute__ ((visibility ("hidden")))
+dnscache_getaddrinfo(int (*real)(GETADDRINFO_SIGNATURE),
+	int (*realconnect)(CONNECT_SIGNATURE), int *ttl,
+	GETADDRINFO_SIGNATURE) {
+    struct addrinfo hints, *tmpl[2] = { NULL, NULL }, *t;
+    struct addrinfo *head = NULL, **tail = &head;
+    struct dest dests[2 * DNSCACHE_ADDRS];
+    struct part parts[2];
+    struct aibuf *buf;
+    int flags, family, nparts, ndests = 0, rc = 0, i, j, v6;
+
+    *ttl = 0;
+
+    /* The same defaults as the C library for no hints, anything the */
+    /* cache's answers don't cover goes to the real call             */
+    flags = (__req ? __req->ai_flags : (AI_V4MAPPED | AI_ADDRCONFIG));
+    family = (__req ? __req->ai_family : AF_UNSPEC);
+    if ((__name == NULL) ||
+	    (flags & ~(AI_ADDRCONFIG | AI_V4MAPPED | AI_NUMERICSERV |
+		       AI_PASSIVE)) ||
+	    ((family == AF_INET6) && (flags & AI_V4MAPPED)) ||
+	    ((family != AF_UNSPEC) && (family != AF_INET) &&
+	     (family != AF_INET6)))
+	return real(__name, __service, __req, __pai);
+
+    switch (resolve(__name, family, (flags & AI_ADDRCONFIG), parts,
+		&nparts)) {
+	case ANSWER_BYPASS:
+	    return real(__name, __service, __req, __pai);
+	case ANSWER_NONE:
+	    return (nodata(parts, nparts) ? EAI_NODATA : EAI_NONAME);
+	case ANSWER_CHECK:
+	    rc = real(__name, __service, __req, __pai);
+	    if ((rc == EAI_NONAME) || (rc == EAI_NODATA))
+		keep_none(parts, nparts);
+	    return rc;
+    }
+
+    /* The addresses go in the order the real call would give them */
+    for (i = 0; i < nparts; i++) {
+	for (j = 0; j < parts[i].slot.naddrs; j++) {
+	    dests[ndests].type = parts[i].type;
+	    dests[ndests++].addr = parts[i].slot.addrs[j];
+	}
+    }
+    if (ndests > 1) {
+	if (gaiconf)
+	    return real(__name, __service, __req, __pai);
+	sort_dests(dests, ndests, realconnect);
+    }
+
+    /* The socket types, protocols and port come from the real call */
+    /* for a numeric address, copied for each address in the answer */
+    for (i = 0; (rc == 0) && (i < nparts); i++) {
+	if (parts[i].slot.naddrs == 0)
+	    continue;
+	memset(&hints, 0x0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST | (flags & AI_NUMERICSERV);
+	hints.ai_family = (parts[i].type == T_A ? AF_INET : AF_INET6);
+	if (__req) {
+	    hints.ai_socktype = __req->ai_socktype;
+	    hints.ai_protocol = __req->ai_protocol;
+	}
+	rc = real((parts[i].type == T_A ? "0.0.0.0" : "::"), __service,
+		&hints, &tmpl[parts[i].type == T_AAAA]);
+    }
+
+    for (i = 0; (rc == 0) && (i < ndests); i++) {
+	v6 = (dests[i].type == T_AAAA);
+	for (t = tmpl[v6]; t != NULL; t = t->ai_next) {
+	    if ((buf = calloc(1, sizeof(*buf))) == NULL) {
+		rc = EAI_MEMORY;
+		break;
+	    }
+	    buf->ai = *t;
+	    buf->ai.ai_addr = (struct sockaddr *) &(buf->addr);
+	    buf->ai.ai_canonname = NULL;
+	    buf->ai.ai_next = NULL;
+	    memcpy(&(buf->addr), t->ai_addr, t->ai_addrlen);
+	    if (v6)
+		memcpy(&(buf->addr.sin6.sin6_addr), dests[i].addr, 16);
+	    else
+		memcpy(&(buf->addr.sin.sin_addr), dests[i].addr, 4);
+	    *tail = &(buf->ai);
+	    tail = &(buf->ai.ai_next);
+	}
+    }
+    for (i = 0; i < 2; i++) {
+	if (tmpl[i])
+	    freeaddrinfo(tmpl[i]);
+    }
+
+    if (rc) {
+	if (head)
+	    freeaddrinfo(head);
+	return rc;
+    }
+    *__pai = head;
+    *ttl = answer_ttl(parts, nparts);
+
+    return 0;
+}
+
+int __attribute__ ((visibility ("hidden")))
+dnscache_gethostbyname_r(int (*real)(GETHOSTBYNAME_R_SIGNATURE),
+	int *ttl, GETHOSTBYNAME_R_SIGNATURE) {
+    struct part parts[2];
+    char **list, *p;
+    size_t need;
+    int nparts, n, i, rc;
+
+    *ttl = 0;
+    switch (resolve(__name, AF_INET, 0, parts, &nparts)) {
+	case ANSWER_BYPASS:
+	    return real(__name, __result_buf, __buf, __buflen, __result,
+		    __h_errnop);
+	case ANSWER_NONE:
+	    *__result = NULL;
+	    *__h_errnop = (nodata(parts, nparts) ? NO_DATA : HOST_NOT_FOUND);
+	    return 0;
+	case ANSWER_CHECK:
+	    rc = real(__name, __result_buf, __buf, __buflen, __result,
+		    __h_errnop);
+	    if ((*__result == NULL) && ((*__h_errnop == HOST_NOT_FOUND) ||
+			(*__h_errnop == NO_DATA)))
+		keep_none(parts, nparts);
+	    return rc;
+    }
+
+    /* The address list and the (empty) alias list, then the */
+    /* addresses and the name                                */
+    n = parts[0].slot.naddrs;
+    p = __buf + (-(uintptr_t) __buf & (sizeof(char *) - 1));
+    need = (p - __buf) + (n + 2) * sizeof(char *) + n * 4 +
+	strlen(__name) + 1;
+    if (need > __buflen) {
+	*__result = NULL;
+	*__h_errnop = NETDB_INTERNAL;
+	errno = ERANGE;
+	return ERANGE;
+    }
+    list = (char **) p;
+    p += (n + 2) * sizeof(char *);
+    for (i = 0; i < n; i++) {
+	memcpy(p, parts[0].slot.addrs[i], 4);
+	list[i] = p;
+	p += 4;
+    }
+    list[n] = list[n + 1] = NULL;
+    strcpy(p, __name);
+
+    __result_buf->h_name = p;
+    __result_buf->h_aliases = &list[n + 1];
+    __result_buf->h_addrtype = AF_INET;
+    __result_buf->h_length = 4;
+    __result_buf->h_addr_list = list;
+    *__result = __result_buf;
+    *__h_errnop = NETDB_SUCCESS;
+    *ttl = answer_ttl(parts, nparts);
+
+    return 0;
+}
+
+#endif
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,59 @@
+/* dnscache.h - Resolver answers kept in a file in shared memory that */
+/* every process under tsocks for the user maps, so a name one       */
+/* process looked up is answered from memory for every later one     */
+/* until its DNS TTL runs out. The file is an open addressing hash   */
+/* table, each slot guarded by a sequence number rather than a lock  */
+
+#ifndef _DNSCACHE_H
+
+#define _DNSCACHE_H	1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DNSCACHE_MAGIC	0x534e4454	/* "TDNS" */
+#define DNSCACHE_VERSION	1
+#define DNSCACHE_DIR	"/dev/shm"	/* Default directory for the file */
+#define DNSCACHE_PREFIX	"tsocks-dns-"	/* Named tsocks-dns-<uid>.cache */
+#define DNSCACHE_SUFFIX	".cache"
+#define DNSCACHE_SLOTS	2048	/* A power of 2 */
+#define DNSCACHE_PROBES	8	/* Slots an answer may be kept in */
+#define DNSCACHE_ADDRS	8	/* Addresses kept for an answer */
+#define DNSCACHE_NAMELEN	256	/* Longest name kept, with the NUL */
+#define DNSCACHE_MAXTTL	86400	/* Longest an answer is kept */
+#define DNSCACHE_MAXNEGTTL	900	/* Longest a name is known not to exist */
+
+/* Structure representing one answer, for a name and a record type. */
+/* seq is odd while the slot is being written and 0 until it first  */
+/* is, readers copy the slot and check seq didn't change             */
+struct dnsslot {
+   uint32_t seq;
+   uint32_t hash; /* Of the name and type */
+   uint16_t type; /* T_A or T_AAAA */
+   uint8_t naddrs; /* 0 for a name with no records of the type */
+   uint8_t nxdomain; /* For no records, the name doesn't exist at all */
+   uint32_t pad;
+   int64_t expires; /* time() the answer runs out */
+   uint8_t addrs[DNSCACHE_ADDRS][16];
+   char name[DNSCACHE_NAMELEN];
+};
+
+/* Structure representing the whole file */
+struct dnsregion {
+   uint64_t magic; /* DNSCACHE_MAGIC << 32 | DNSCACHE_VERSION once set */
+		   /* up, the rest of a new file is zeroes            */
+   struct dnsslot slots[DNSCACHE_SLOTS];
+};
+
+struct addrinfo;
+struct hostent;
+
+/* Functions provided by the dnscache module */
+int dnscache_open(int suid);
+int dnscache_getaddrinfo(int (*real)(GETADDRINFO_SIGNATURE),
+	int (*realconnect)(CONNECT_SIGNATURE), int *ttl,
+	GETADDRINFO_SIGNATURE);
+int dnscache_gethostbyname_r(int (*real)(GETHOSTBYNAME_R_SIGNATURE),
+	int *ttl, GETHOSTBYNAME_R_SIGNATURE);
+
+#endif
@@ -3,6 +3,20 @@
  * This utility can be used to determine the protocol
  * level of a SOCKS server.
  *
+ * With -L it instead drives SOCKS handshakes against the server from
+ * an epoll loop, either keeping a number of them in progress (closed
+ * loop) or starting them at a constant rate (open loop), and reports
+ * the handshake rate, percentiles for each phase of the handshake
+ * and the errors seen. In open loop latencies are measured from when
+ * each handshake was due to start, so a server falling behind shows.
+ *
+ * With -P it probes a list of servers for what they support (SOCKS 4,
+ * SOCKS 5 with and without authentication, connect requests for IPv4
+ * addresses, domain names and IPv6 addresses, UDP associate and TCP
+ * Fast Open), every probe over its own connection and all of them at
+ * once, and prints the results with how long each took as a table,
+ * as lines of JSON or as tsocks.conf lines for the fastest server.
+ *
  * Copyright (C) 2000 Shaun Clowes
  *
  * This program is free software; you can redistribute it and/or modify
@@ -28,27 +42,314 @@ int defaultport	= 1080;			   /* Default SOCKS port       */
 #include <config.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <string.h>
 #include <strings.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <common.h>
 
+#define HIST_SUB	16	/* Histogram buckets per power of 2 */
+#define HIST_BUCKETS	(64 * HIST_SUB)
+#define ERRNOS		256	/* Error numbers counted separately */
+
+/* Phases of a handshake, timed separately */
+enum phase {
+   PHASE_CONNECT,	/* TCP connect to the server */
+   PHASE_METHOD,	/* SOCKS 5 method negotiation */
+   PHASE_AUTH,		/* SOCKS 5 username/password */
+   PHASE_REQUEST,	/* The connect request */
+   PHASE_TOTAL,
+   PHASES
+};
+
+/* States of a handshake in progress, each waits for a reply */
+enum loadstate {
+   LOAD_FREE,
+   LOAD_CONNECTING,
+   LOAD_METHOD,
+   LOAD_AUTH,
+   LOAD_REQUEST
+};
+
+/* Capabilities probed for with -P, each over its own connection */
+enum capability {
+   CAP_SOCKS4,		/* Answers SOCKS 4 connect requests */
+   CAP_NOAUTH,		/* SOCKS 5 without authentication */
+   CAP_USERPASS,	/* SOCKS 5 username/password authentication */
+   CAP_CONNECT,		/* SOCKS 5 connect to an IPv4 address */
+   CAP_DOMAIN,		/* SOCKS 5 connect to a domain name */
+   CAP_IPV6,		/* SOCKS 5 connect to an IPv6 address */
+   CAP_UDP,		/* SOCKS 5 UDP associate */
+   CAP_TFO,		/* Accepts data in the SYN (TCP Fast Open) */
+   CAPS
+};
+
+/* What a probe found out */
+enum outcome {
+   OUT_SKIPPED,		/* Not probed */
+   OUT_YES,
+   OUT_NO,
+   OUT_DENIED,		/* Authentication failed or was not possible */
+   OUT_INVALID,		/* A reply that made no sense */
+   OUT_CLOSED,		/* Closed by the server part way through */
+   OUT_TIMEOUT,
+   OUT_ERROR		/* A socket error */
+};
+
+/* States of a probe in progress */
+enum probestate {
+   PROBE_FREE,
+   PROBE_CONNECTING,
+   PROBE_FASTOPEN,	/* Data sent in the SYN, waiting for the SYN-ACK */
+   PROBE_V4REPLY,
+   PROBE_METHOD,
+   PROBE_AUTH,
+   PROBE_REPLY
+};
+
+/* Structure representing a latency histogram, in ns */
+struct histogram {
+   unsigned long n;
+   uint64_t max;
+   unsigned long buckets[HIST_BUCKETS];
+};
+
+/* Structure representing a handshake in progress */
+struct loadconn {
+   int fd;
+   int index; /* In the table of handshakes, and the epoll data */
+   enum loadstate state;
+   uint64_t start; /* When it started, or was due to in open loop */
+   uint64_t phasestart;
+   uint64_t deadline;
+   int want; /* Bytes of reply expected */
+   int got;
+   unsigned char buf[520];
+};
+
+/* Structure representing what the load generator has seen */
+struct loadresults {
+   unsigned long started, completed, failed, dropped, unfinished;
+   unsigned long connecterrors[ERRNOS]; /* TCP connect to the server */
+   unsigned long ioerrors[ERRNOS]; /* Once connected */
+   unsigned long socks4[256], socks5[256]; /* Error replies */
+   unsigned long closed, timeouts, refused, authfailed, badreplies;
+   struct histogram phases[PHASES];
+};
+
+/* Structure representing the result of probing for a capability */
+struct proberesult {
+   enum outcome outcome;
+   int reply; /* SOCKS reply code or authentication status, -1 if none */
+   int err; /* errno for OUT_ERROR */
+   uint64_t ns; /* From the start of the probe to its result */
+};
+
+/* Structure representing a server being probed */
+struct probeserver {
+   char *name; /* As given */
+   struct sockaddr_in addr;
+   int resolved;
+   uint64_t rtt; /* Quickest TCP connect to it seen, 0 if none */
+   struct proberesult results[CAPS];
+};
+
+/* Structure representing a probe in progress */
+struct probeconn {
+   int fd;
+   int index; /* In the table of probes, and the epoll data */
+   struct probeserver *server;
+   enum capability cap;
+   enum probestate state;
+   int stage; /* Of the Fast Open probe, 0 to get a cookie and 1 to use it */
+   uint64_t start;
+   uint64_t deadline;
+   int want; /* Bytes of reply expected */
+   int got;
+   unsigned char buf[520];
+};
+
+static char *phasenames[PHASES] = { "tcp connect", "method", "authentication",
+	"request", "total" };
+static char *capnames[CAPS] = { "socks4", "noauth", "userpass", "connect",
+	"domain", "ipv6", "udp", "tfo" };
+static char *outcomenames[] = { "skipped", "yes", "no", "denied", "invalid",
+	"closed", "timeout", "error" };
+
+/* Load generator settings */
+static int loadversion = 5;
+static char *loaduser = NULL, *loadpass = NULL;
+static struct sockaddr_in target;
+static int gottarget = 0;
+static int concurrency = 100;
+static double rate = 0;
+static unsigned long count = 0;
+static double duration = 0;
+static int timeoutms = 5000;
+static int json = 0;
+
+/* Probe settings */
+static char *domainhost = "localhost";
+static int domainport = 0; /* The IPv4 target's port if 0 */
+static int fastopen = 0; /* The kernel will send data in the SYN */
+static int genconf = 0;
+
 int send_request(struct sockaddr_in *server, void *req,
 	int reqlen, void *rep, int replen);
+static int parse_address(char *, struct sockaddr_in *, int);
+static uint64_t now_ns(void);
+static void hist_add(struct histogram *, uint64_t);
+static uint64_t hist_percentile(struct histogram *, double);
+static int load(struct sockaddr_in *);
+static int load_start(int, struct loadconn *, int, struct sockaddr_in *,
+	uint64_t, struct loadresults *);
+static void load_event(int, struct loadconn *, uint32_t, struct loadresults *);
+static int load_send(int, struct loadconn *, enum loadstate, int, int);
+static void load_finish(int, struct loadconn *, struct loadresults *, int);
+static void load_report(struct sockaddr_in *, struct loadresults *, double);
+static int add_server(struct probeserver **, int *, char *);
+static int read_servers(struct probeserver **, int *, char *);
+static int probe(struct probeserver *, int);
+static int probe_start(int, struct probeconn *, int, struct probeserver *,
+	enum capability);
+static void probe_connect(int, struct probeconn *);
+static void probe_connected(int, struct probeconn *);
+static void probe_event(int, struct probeconn *);
+static int probe_send(int, struct probeconn *, enum probestate, int, int);
+static int probe_request(int, struct probeconn *);
+static void probe_target(struct probeserver *, struct sockaddr_in *);
+static void probe_finish(struct probeconn *, enum outcome, int, int);
+static void probe_report(struct probeserver *, int);
+static int probe_config(struct probeserver *, int);
 
 int main(int argc, char *argv[]) {
-    char *usage = "Usage: <socks server name/ip> [portno]";
+    char *usage = "Usage: [-L [-v 4|5] [-a user:pass] -t target ip:port "
+	"[-c concurrency] [-r rate] [-n handshakes] [-d seconds] "
+	"[-w timeout ms] [-j]] <socks server name/ip> [portno]\n"
+	"       -P [-a user:pass] [-t target ip:port] [-T target host:port] "
+	"[-c concurrency] [-w timeout ms] [-j|-g] [-f serverfile] "
+	"[server[:port]...]";
     char req[9];
     char resp[100];
     unsigned short int portno = defaultport;
     int ver = 0;
     int read_bytes;
     struct sockaddr_in server;
+    struct probeserver *servers = NULL;
+    int loadmode = 0, probemode = 0, nservers = 0, c, i;
+    char *sep, *serverfile = NULL;
+
+    while ((c = getopt(argc, argv, "LPv:a:t:T:c:r:n:d:w:jgf:")) != -1) {
+	switch (c) {
+	    case 'L':
+		loadmode = 1;
+		break;
+	    case 'P':
+		probemode = 1;
+		break;
+	    case 'v':
+		loadversion = atoi(optarg);
+		break;
+	    case 'a':
+		if ((sep = strchr(optarg, ':')) == NULL) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		*sep = '\0';
+		loaduser = optarg;
+		loadpass = sep + 1;
+		break;
+	    case 't':
+		if (parse_address(optarg, &target, 0)) {
+		    show_msg(MSGERR, "Invalid target %s\n", optarg);
+		    exit(1);
+		}
+		gottarget = 1;
+		break;
+	    case 'T':
+		domainhost = optarg;
+		if ((sep = strrchr(optarg, ':')) != NULL) {
+		    *sep = '\0';
+		    domainport = atoi(sep + 1);
+		}
+		if (!*domainhost || (strlen(domainhost) > 255) ||
+			(domainport < 0) || (domainport > 65535)) {
+		    show_msg(MSGERR, "Invalid target %s\n", optarg);
+		    exit(1);
+		}
+		break;
+	    case 'c':
+		concurrency = atoi(optarg);
+		break;
+	    case 'r':
+		rate = atof(optarg);
+		break;
+	    case 'n':
+		count = strtoul(optarg, NULL, 10);
+		break;
+	    case 'd':
+		duration = atof(optarg);
+		break;
+	    case 'w':
+		timeoutms = atoi(optarg);
+		break;
+	    case 'j':
+		json = 1;
+		break;
+	    case 'g':
+		genconf = 1;
+		break;
+	    case 'f':
+		serverfile = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+    /* The server and port follow the options */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (probemode) {
+	if (loadmode || (json && genconf) || (concurrency < 1) ||
+		(timeoutms < 1) || ((argc < 2) && !serverfile)) {
+	    show_msg(MSGERR, "%s\n", usage);
+	    exit(1);
+	}
+	if (serverfile && read_servers(&servers, &nservers, serverfile))
+	    exit(1);
+	for (i = 1; i < argc; i++)
+	    add_server(&servers, &nservers, argv[i]);
+	return probe(servers, nservers);
+    }
+
+    if (loadmode) {
+	if ((argc < 2) || (argc > 3) || !gottarget ||
+		((loadversion != 4) && (loadversion != 5)) ||
+		(loaduser && (loadversion != 5)) || (concurrency < 1) ||
+		(rate < 0) || (duration < 0) || (timeoutms < 1) ||
+		parse_address(argv[1], &server, defaultport) ||
+		((argc == 3) && !(server.sin_port =
+			htons((unsigned short int) atoi(argv[2]))))) {
+	    show_msg(MSGERR, "%s\n", usage);
+	    exit(1);
+	}
+	if (!count && !duration)
+	    count = 10000;
+	return load(&server);
+    }
 
     if ((argc < 2) || (argc > 3)) {
 	show_msg(MSGERR, "Invalid number of arguments\n");
@@ -169,6 +470,1216 @@ int send_request(struct sockaddr_in *server, void *req,
 
 }
 
+/* Parse host[:port], the port is required if no default is given */
+static int parse_address(char *spec, struct sockaddr_in *addr,
+	int defport) {
+    char host[256], *sep;
+    unsigned int ip;
+    int port = defport;
+
+    strncpy(host, spec, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    if ((sep = strrchr(host, ':')) != NULL) {
+	*sep = '\0';
+	port = atoi(sep + 1);
+    }
+    if ((port <= 0) || (port > 65535) ||
+	    ((ip = resolve_ip(host, 0, HOSTNAMES)) == (unsigned int) -1))
+	return -1;
+
+    memset(addr, 0x0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = ip;
+    addr->sin_port = htons(port);
+
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Histograms have HIST_SUB linear buckets for each power of 2, */
+/* good to about 6%                                             */
+static void hist_add(struct histogram *hist, uint64_t ns) {
+    int msb, bucket;
+
+    if (ns < HIST_SUB)
+	bucket = ns;
+    else {
+	msb = 63 - __builtin_clzll(ns);
+	bucket = (msb - 3) * HIST_SUB + ((ns >> (msb - 4)) & (HIST_SUB - 1));
+    }
+    hist->buckets[bucket]++;
+    hist->n++;
+    if (ns > hist->max)
+	hist->max = ns;
+}
+
+/* The middle of the bucket the percentile falls in, or the largest */
+/* value seen if that is smaller                                     */
+static uint64_t hist_percentile(struct histogram *hist, double percentile) {
+    unsigned long want, seen = 0;
+    uint64_t middle;
+    int bucket, shift;
+
+    if (!hist->n)
+	return 0;
+    want = (unsigned long) (hist->n * percentile / 100);
+    if (want >= hist->n)
+	return hist->max;
+
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+	if ((seen += hist->buckets[bucket]) > want)
+	    break;
+    }
+    if (bucket < HIST_SUB)
+	return bucket;
+    shift = bucket / HIST_SUB - 1;
+
+    middle = ((uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift) +
+	((1ULL << shift) >> 1);
+
+    return (middle > hist->max ? hist->max : middle);
+}
+
+/* Run handshakes against the server until enough have been made */
+/* or the time is up                                              */
+static int load(struct sockaddr_in *server) {
+    struct loadresults *results;
+    struct loadconn *conns;
+    struct epoll_event *events;
+    struct rlimit limit;
+    uint64_t begin, now, due = 0, end = 0, lastcheck = 0;
+    unsigned long attempts = 0;
+    int epfd, active = 0, free = 0, *freelist, waitms, nevents, i;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Each handshake needs a descriptor */
+    if (!getrlimit(RLIMIT_NOFILE, &limit) &&
+	    (limit.rlim_cur < (rlim_t) concurrency + 16)) {
+	limit.rlim_cur = (limit.rlim_max < (rlim_t) concurrency + 16 ?
+		limit.rlim_max : (rlim_t) concurrency + 16);
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (((results = calloc(1, sizeof(*results))) == NULL) ||
+	    ((conns = calloc(concurrency, sizeof(*conns))) == NULL) ||
+	    ((freelist = calloc(concurrency, sizeof(int))) == NULL) ||
+	    ((events = calloc(concurrency, sizeof(*events))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory for %d handshakes\n",
+		concurrency);
+	exit(1);
+    }
+    for (i = 0; i < concurrency; i++)
+	freelist[free++] = concurrency - 1 - i;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	show_msg(MSGERR, "Could not create epoll instance (%s)\n",
+		strerror(errno));
+	exit(1);
+    }
+
+    begin = due = now_ns();
+    if (duration)
+	end = begin + (uint64_t) (duration * 1e9);
+
+    while (1) {
+	now = now_ns();
+	if ((end && (now >= end)) || (count && (attempts >= count)
+		    && !active))
+	    break;
+
+	/* Start whatever handshakes are due */
+	while ((!count || (attempts < count)) && (!end || (due < end))) {
+	    if (rate) {
+		if (due > now)
+		    break;
+		/* An open loop doesn't wait for a free slot */
+		if (!free) {
+		    results->dropped++;
+		    attempts++;
+		    due = begin + (uint64_t) (attempts * 1e9 / rate);
+		    continue;
+		}
+	    } else if (!free)
+		break;
+	    i = freelist[--free];
+	    attempts++;
+	    if (load_start(epfd, conns, i, server, (rate ? due : now), results)) {
+		freelist[free++] = i;
+	    } else
+		active++;
+	    if (rate)
+		due = begin + (uint64_t) (attempts * 1e9 / rate);
+	}
+
+	/* Wait until the next handshake is due or a timeout check */
+	waitms = 10;
+	if (rate && (!count || (attempts < count)) && (due > now) &&
+		((due - now) / 1000000 < (uint64_t) waitms))
+	    waitms = (due - now) / 1000000;
+	if (!active && (!rate || (count && (attempts >= count))))
+	    continue;
+
+	if ((nevents = epoll_wait(epfd, events, concurrency, waitms)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    show_msg(MSGERR, "epoll_wait failed (%s)\n", strerror(errno));
+	    exit(1);
+	}
+	for (i = 0; i < nevents; i++) {
+	    load_event(epfd, &conns[events[i].data.u32], events[i].events,
+		    results);
+	    if (conns[events[i].data.u32].state == LOAD_FREE) {
+		freelist[free++] = events[i].data.u32;
+		active--;
+	    }
+	}
+
+	/* Give up on handshakes that have taken too long */
+	now = now_ns();
+	if (now - lastcheck >= 10000000) {
+	    lastcheck = now;
+	    for (i = 0; i < concurrency; i++) {
+		if ((conns[i].state != LOAD_FREE) && (conns[i].deadline <= now)) {
+		    results->timeouts++;
+		    load_finish(epfd, &conns[i], results, 0);
+		    freelist[free++] = i;
+		    active--;
+		}
+	    }
+	}
+    }
+
+    /* Anything still going when the time ran out */
+    for (i = 0; i < concurrency; i++) {
+	if (conns[i].state != LOAD_FREE) {
+	    results->unfinished++;
+	    close(conns[i].fd);
+	}
+    }
+
+    load_report(server, results, (now_ns() - begin) / 1e9);
+
+    return (results->completed ? 0 : 1);
+}
+
+/* Start a handshake, the TCP connect to the server first */
+static int load_start(int epfd, struct loadconn *conns, int i,
+	struct sockaddr_in *server, uint64_t start,
+	struct loadresults *results) {
+    struct loadconn *conn = &conns[i];
+    struct epoll_event event;
+    struct linger linger = { 1, 0 };
+    int on = 1;
+
+    results->started++;
+    memset(conn, 0x0, sizeof(*conn));
+    conn->index = i;
+    conn->start = conn->phasestart = start;
+    conn->deadline = now_ns() + (uint64_t) timeoutms * 1000000;
+
+    if ((conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+		    SOCK_CLOEXEC, 0)) < 0) {
+	results->failed++;
+	results->connecterrors[errno < ERRNOS ? errno : 0]++;
+	return -1;
+    }
+    /* Closing with a reset keeps TIME_WAIT from using up the ports */
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+    if (connect(conn->fd, (struct sockaddr *) server, sizeof(*server)) &&
+	    (errno != EINPROGRESS)) {
+	results->failed++;
+	results->connecterrors[errno < ERRNOS ? errno : 0]++;
+	close(conn->fd);
+	return -1;
+    }
+
+    conn->state = LOAD_CONNECTING;
+    event.events = EPOLLOUT;
+    event.data.u32 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &event)) {
+	show_msg(MSGERR, "epoll_ctl failed (%s)\n", strerror(errno));
+	exit(1);
+    }
+
+    return 0;
+}
+
+/* Move a handshake on when its socket is ready */
+static void load_event(int epfd, struct loadconn *conn, uint32_t events,
+	struct loadresults *results) {
+    socklen_t len = sizeof(int);
+    uint64_t now = now_ns();
+    int err = 0, rc, ulen, plen;
+    ssize_t got;
+
+    if (conn->state == LOAD_CONNECTING) {
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+	    results->connecterrors[err < ERRNOS ? err : 0]++;
+	    load_finish(epfd, conn, results, 0);
+	    return;
+	}
+	hist_add(&(results->phases[PHASE_CONNECT]), now - conn->phasestart);
+	conn->phasestart = now;
+
+	if (loadversion == 4) {
+	    /* Version, connect, port, address and an empty user id */
+	    conn->buf[0] = 4;
+	    conn->buf[1] = 1;
+	    memcpy(&conn->buf[2], &target.sin_port, 2);
+	    memcpy(&conn->buf[4], &target.sin_addr, 4);
+	    conn->buf[8] = 0;
+	    rc = load_send(epfd, conn, LOAD_REQUEST, 9, 8);
+	} else {
+	    conn->buf[0] = 5;
+	    conn->buf[1] = 1;
+	    conn->buf[2] = (loaduser ? 2 : 0);
+	    rc = load_send(epfd, conn, LOAD_METHOD, 3, 2);
+	}
+	if (rc) {
+	    results->ioerrors[errno < ERRNOS ? errno : 0]++;
+	    load_finish(epfd, conn, results, 0);
+	}
+	return;
+    }
+
+    /* Waiting for a reply */
+    got = recv(conn->fd, conn->buf + conn->got, conn->want - conn->got, 0);
+    if (got <= 0) {
+	if ((got < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+	    return;
+	if (got == 0)
+	    results->closed++;
+	else
+	    results->ioerrors[errno < ERRNOS ? errno : 0]++;
+	load_finish(epfd, conn, results, 0);
+	return;
+    }
+    conn->got += got;
+
+    /* A SOCKS 5 reply's length depends on its address type */
+    if ((conn->state == LOAD_REQUEST) && (loadversion == 5) &&
+	    (conn->got >= 5) && (conn->want == 5)) {
+	switch (conn->buf[3]) {
+	    case 1:
+		conn->want = 10;
+		break;
+	    case 3:
+		conn->want = 7 + conn->buf[4];
+		break;
+	    case 4:
+		conn->want = 22;
+		break;
+	    default:
+		conn->want = 10;
+	}
+    }
+    if (conn->got < conn->want)
+	return;
+
+    switch (conn->state) {
+	case LOAD_METHOD:
+	    hist_add(&(results->phases[PHASE_METHOD]), now - conn->phasestart);
+	    conn->phasestart = now;
+	    if ((conn->buf[0] != 5) || (conn->buf[1] == 0xff)) {
+		if (conn->buf[0] == 5)
+		    results->refused++;
+		else
+		    results->badreplies++;
+		load_finish(epfd, conn, results, 0);
+		return;
+	    }
+	    if (conn->buf[1] == 2) {
+		if (!loaduser) {
+		    results->badreplies++;
+		    load_finish(epfd, conn, results, 0);
+		    return;
+		}
+		ulen = strlen(loaduser);
+		plen = strlen(loadpass);
+		conn->buf[0] = 1;
+		conn->buf[1] = ulen;
+		memcpy(&conn->buf[2], loaduser, ulen);
+		conn->buf[2 + ulen] = plen;
+		memcpy(&conn->buf[3 + ulen], loadpass, plen);
+		rc = load_send(epfd, conn, LOAD_AUTH, 3 + ulen + plen, 2);
+		break;
+	    }
+	    /* Fall through, no authentication was needed */
+	case LOAD_AUTH:
+	    if (conn->state == LOAD_AUTH) {
+		hist_add(&(results->phases[PHASE_AUTH]),
+			now - conn->phasestart);
+		conn->phasestart = now;
+		if (conn->buf[1] != 0) {
+		    results->authfailed++;
+		    load_finish(epfd, conn, results, 0);
+		    return;
+		}
+	    }
+	    conn->buf[0] = 5;
+	    conn->buf[1] = 1;
+	    conn->buf[2] = 0;
+	    conn->buf[3] = 1;
+	    memcpy(&conn->buf[4], &target.sin_addr, 4);
+	    memcpy(&conn->buf[8], &target.sin_port, 2);
+	    rc = load_send(epfd, conn, LOAD_REQUEST, 10, 5);
+	    break;
+	case LOAD_REQUEST:
+	    hist_add(&(results->phases[PHASE_REQUEST]),
+		    now - conn->phasestart);
+	    if (loadversion == 4) {
+		if (conn->buf[0] != 0)
+		    results->badreplies++;
+		else if (conn->buf[1] != 90)
+		    results->socks4[conn->buf[1]]++;
+		load_finish(epfd, conn, results, (conn->buf[0] == 0) &&
+			(conn->buf[1] == 90));
+	    } else {
+		if (conn->buf[0] != 5)
+		    results->badreplies++;
+		else if (conn->buf[1] != 0)
+		    results->socks5[conn->buf[1]]++;
+		load_finish(epfd, conn, results, (conn->buf[0] == 5) &&
+			(conn->buf[1] == 0));
+	    }
+	    return;
+	default:
+	    return;
+    }
+
+    if (rc) {
+	results->ioerrors[errno < ERRNOS ? errno : 0]++;
+	load_finish(epfd, conn, results, 0);
+    }
+}
+
+/* Send a message (in the buffer) and wait for want bytes of reply, */
+/* the messages are small enough to always fit in the socket buffer */
+static int load_send(int epfd, struct loadconn *conn, enum loadstate state,
+	int len, int want) {
+    struct epoll_event event;
+
+    if (send(conn->fd, conn->buf, len, MSG_NOSIGNAL) != len) {
+	if (errno == EAGAIN)
+	    errno = ENOBUFS;
+	return -1;
+    }
+
+    /* Connected, only replies are waited for from now on */
+    if (conn->state == LOAD_CONNECTING) {
+	event.events = EPOLLIN;
+	event.data.u32 = conn->index;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event))
+	    return -1;
+    }
+    conn->state = state;
+    conn->want = want;
+    conn->got = 0;
+
+    return 0;
+}
+
+/* A handshake is over, one way or another */
+static void load_finish(int epfd, struct loadconn *conn,
+	struct loadresults *results, int completed) {
+
+    if (completed) {
+	results->completed++;
+	hist_add(&(results->phases[PHASE_TOTAL]), now_ns() - conn->start);
+    } else
+	results->failed++;
+
+    close(conn->fd);
+    conn->state = LOAD_FREE;
+}
+
+/* Print what was seen, as a table or a line of JSON */
+static void load_report(struct sockaddr_in *server,
+	struct loadresults *results, double elapsed) {
+    static double percentiles[] = { 50, 90, 99, 99.9 };
+    struct histogram *hist;
+    char label[64];
+    int i, p, errors = 0;
+
+    if (json) {
+	printf("{\"bench\":\"inspectsocks\",\"server\":\"%s:%d\",\"socks\":%d,"
+		"\"auth\":%s,\"loop\":\"%s\",\"concurrency\":%d,\"rate\":%.1f,"
+		"\"started\":%lu,\"completed\":%lu,\"failed\":%lu,\"dropped\":%lu,"
+		"\"unfinished\":%lu,\"elapsed_s\":%.3f,\"handshakes_per_sec\":%.1f",
+		inet_ntoa(server->sin_addr), ntohs(server->sin_port), loadversion,
+		(loaduser ? "true" : "false"), (rate ? "open" : "closed"),
+		concurrency, rate, results->started, results->completed,
+		results->failed, results->dropped, results->unfinished, elapsed,
+		results->completed / elapsed);
+	for (i = 0; i < PHASES; i++) {
+	    hist = &(results->phases[i]);
+	    if (!hist->n)
+		continue;
+	    strcpy(label, phasenames[i]);
+	    if (strchr(label, ' '))
+		*strchr(label, ' ') = '_';
+	    for (p = 0; p < (int) (sizeof(percentiles) / sizeof(double)); p++)
+		printf(",\"%s_p%g_us\":%.1f", label, percentiles[p],
+			hist_percentile(hist, percentiles[p]) / 1000.0);
+	    printf(",\"%s_max_us\":%.1f", label, hist->max / 1000.0);
+	}
+	printf(",\"errors\":{");
+    } else {
+	printf("%lu SOCKS %d handshakes%s with %s:%d, %s loop, %d at once",
+		results->started, loadversion,
+		(loaduser ? " (username/password)" : ""),
+		inet_ntoa(server->sin_addr), ntohs(server->sin_port),
+		(rate ? "open" : "closed"), concurrency);
+	if (rate)
+	    printf(", %.1f a second", rate);
+	printf("\n%lu completed, %lu failed", results->completed,
+		results->failed);
+	if (results->dropped)
+	    printf(", %lu not started as %d were in progress",
+		    results->dropped, concurrency);
+	if (results->unfinished)
+	    printf(", %lu unfinished", results->unfinished);
+	printf(" in %.3f seconds, %.1f handshakes a second\n\n", elapsed,
+		results->completed / elapsed);
+	printf("%-16s %9s %9s %9s %9s %9s %9s\n", "PHASE (ms)", "COUNT", "P50",
+		"P90", "P99", "P99.9", "MAX");
+	for (i = 0; i < PHASES; i++) {
+	    hist = &(results->phases[i]);
+	    if (!hist->n)
+		continue;
+	    printf("%-16s %9lu", phasenames[i], hist->n);
+	    for (p = 0; p < (int) (sizeof(percentiles) / sizeof(double)); p++)
+		printf(" %9.3f", hist_percentile(hist, percentiles[p]) / 1e6);
+	    printf(" %9.3f\n", hist->max / 1e6);
+	}
+	printf("\n");
+    }
+
+#define LOAD_ERROR(count, ...) \
+    do { \
+	if (count) { \
+	    snprintf(label, sizeof(label), __VA_ARGS__); \
+	    if (json) \
+		printf("%s\"%s\":%lu", (errors ? "," : ""), label, count); \
+	    else \
+		printf("%s%-40s %9lu\n", (errors ? "" : "ERRORS\n"), label, \
+			count); \
+	    errors++; \
+	} \
+    } while (0)
+
+    for (i = 0; i < ERRNOS; i++)
+	LOAD_ERROR(results->connecterrors[i], "connect: %s", strerror(i));
+    for (i = 0; i < ERRNOS; i++)
+	LOAD_ERROR(results->ioerrors[i], "handshake: %s", strerror(i));
+    LOAD_ERROR(results->closed, "closed by server");
+    LOAD_ERROR(results->timeouts, "timed out after %d ms", timeoutms);
+    LOAD_ERROR(results->refused, "no acceptable methods");
+    LOAD_ERROR(results->authfailed, "authentication failed");
+    LOAD_ERROR(results->badreplies, "invalid reply");
+    for (i = 0; i < 256; i++)
+	LOAD_ERROR(results->socks4[i], "socks 4 reply %d", i);
+    for (i = 0; i < 256; i++)
+	LOAD_ERROR(results->socks5[i], "socks 5 reply %d", i);
+#undef LOAD_ERROR
+
+    if (json)
+	printf("}}\n");
+}
+
+/* Add a server (host[:port]) to be probed, one that can't be resolved */
+/* is reported as such rather than stopping the others being probed   */
+static int add_server(struct probeserver **servers, int *nservers,
+	char *spec) {
+    struct probeserver *server;
+    int i;
+
+    if ((*nservers % 64) == 0) {
+	if ((*servers = realloc(*servers, (*nservers + 64) *
+			sizeof(**servers))) == NULL) {
+	    show_msg(MSGERR, "Could not allocate memory for servers\n");
+	    exit(1);
+	}
+    }
+    server = &(*servers)[(*nservers)++];
+    memset(server, 0x0, sizeof(*server));
+    if ((server->name = strdup(spec)) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for servers\n");
+	exit(1);
+    }
+    for (i = 0; i < CAPS; i++)
+	server->results[i].reply = -1;
+    server->resolved = !parse_address(spec, &server->addr, defaultport);
+
+    return 0;
+}
+
+/* Read servers to probe from a file (- for stdin), one to a line */
+static int read_servers(struct probeserver **servers, int *nservers,
+	char *filename) {
+    FILE *file;
+    char line[BUFSIZ], *spec;
+
+    if (!strcmp(filename, "-"))
+	file = stdin;
+    else if ((file = fopen(filename, "r")) == NULL) {
+	show_msg(MSGERR, "Could not open server file %s (%s)\n", filename,
+		strerror(errno));
+	return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+	if (strchr(line, '#'))
+	    *strchr(line, '#') = '\0';
+	spec = line + strspn(line, " \t\r\n");
+	spec[strcspn(spec, " \t\r\n")] = '\0';
+	if (*spec)
+	    add_server(servers, nservers, spec);
+    }
+
+    if (file != stdin)
+	fclose(file);
+
+    return 0;
+}
+
+/* Probe every capability of every server at once, as many at a time */
+/* as the concurrency allows                                          */
+static int probe(struct probeserver *servers, int nservers) {
+    struct probeconn *conns;
+    struct epoll_event *events;
+    struct rlimit limit;
+    uint64_t now, lastcheck = 0;
+    int epfd, active = 0, free = 0, *freelist, next = 0, nevents, i, j;
+    int answered, failed = 0;
+    FILE *sysctl;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Fast Open is only attempted if the kernel will do it as a client */
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCPI_OPT_SYN_DATA)
+    if ((sysctl = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r")) != NULL) {
+	if ((fscanf(sysctl, "%d", &i) == 1) && (i & 1))
+	    fastopen = 1;
+	fclose(sysctl);
+    }
+#else
+    (void) sysctl;
+#endif
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit) &&
+	    (limit.rlim_cur < (rlim_t) concurrency + 16)) {
+	limit.rlim_cur = (limit.rlim_max < (rlim_t) concurrency + 16 ?
+		limit.rlim_max : (rlim_t) concurrency + 16);
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (((conns = calloc(concurrency, sizeof(*conns))) == NULL) ||
+	    ((freelist = calloc(concurrency, sizeof(int))) == NULL) ||
+	    ((events = calloc(concurrency, sizeof(*events))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory for %d probes\n",
+		concurrency);
+	exit(1);
+    }
+    for (i = 0; i < concurrency; i++)
+	freelist[free++] = concurrency - 1 - i;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	show_msg(MSGERR, "Could not create epoll instance (%s)\n",
+		strerror(errno));
+	exit(1);
+    }
+
+    while (1) {
+	/* Start as many probes as there are free slots for */
+	while (free && (next < nservers * CAPS)) {
+	    j = next++;
+	    if (!servers[j / CAPS].resolved ||
+		    ((j % CAPS == CAP_TFO) && !fastopen))
+		continue;
+	    i = freelist[--free];
+	    probe_start(epfd, conns, i, &servers[j / CAPS], j % CAPS);
+	    if (conns[i].state == PROBE_FREE)
+		freelist[free++] = i;
+	    else
+		active++;
+	}
+	if (!active)
+	    break;
+
+	if ((nevents = epoll_wait(epfd, events, concurrency, 10)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    show_msg(MSGERR, "epoll_wait failed (%s)\n", strerror(errno));
+	    exit(1);
+	}
+	for (i = 0; i < nevents; i++) {
+	    probe_event(epfd, &conns[events[i].data.u32]);
+	    if (conns[events[i].data.u32].state == PROBE_FREE) {
+		freelist[free++] = events[i].data.u32;
+		active--;
+	    }
+	}
+
+	/* Give up on probes that have taken too long */
+	now = now_ns();
+	if (now - lastcheck >= 10000000) {
+	    lastcheck = now;
+	    for (i = 0; i < concurrency; i++) {
+		if ((conns[i].state != PROBE_FREE) &&
+			(conns[i].deadline <= now)) {
+		    probe_finish(&conns[i], OUT_TIMEOUT, -1, 0);
+		    freelist[free++] = i;
+		    active--;
+		}
+	    }
+	}
+    }
+    close(epfd);
+
+    if (genconf)
+	failed = probe_config(servers, nservers);
+    else
+	probe_report(servers, nservers);
+
+    /* Every server should at least have answered something */
+    for (i = 0; i < nservers; i++) {
+	for (answered = 0, j = 0; j < CAPS; j++)
+	    answered |= (servers[i].results[j].outcome == OUT_YES);
+	failed |= !answered;
+    }
+
+    return failed;
+}
+
+/* Start probing a server for a capability */
+static int probe_start(int epfd, struct probeconn *conns, int i,
+	struct probeserver *server, enum capability cap) {
+    struct probeconn *conn = &conns[i];
+
+    memset(conn, 0x0, sizeof(*conn));
+    conn->fd = -1;
+    conn->index = i;
+    conn->server = server;
+    conn->cap = cap;
+    conn->start = now_ns();
+    probe_connect(epfd, conn);
+
+    return (conn->state == PROBE_FREE ? -1 : 0);
+}
+
+/* Make the TCP connect to the server, for the Fast Open probe with */
+/* data in the SYN if the kernel has a cookie for the server        */
+static void probe_connect(int epfd, struct probeconn *conn) {
+    struct epoll_event event;
+    struct linger linger = { 1, 0 };
+    int on = 1, rc;
+
+    conn->deadline = now_ns() + (uint64_t) timeoutms * 1000000;
+    conn->state = PROBE_CONNECTING;
+
+    if ((conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+		    SOCK_CLOEXEC, 0)) < 0) {
+	probe_finish(conn, OUT_ERROR, -1, errno);
+	return;
+    }
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+#ifdef TCP_FASTOPEN_CONNECT
+    if (conn->cap == CAP_TFO)
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+		sizeof(on));
+#endif
+
+    if ((rc = connect(conn->fd, (struct sockaddr *) &conn->server->addr,
+		    sizeof(conn->server->addr))) && (errno != EINPROGRESS)) {
+	probe_finish(conn, OUT_ERROR, -1, errno);
+	return;
+    }
+
+    /* With a cookie the connect is put off until there is data to */
+    /* send in the SYN, a method request serves                   */
+    if (!rc && (conn->cap == CAP_TFO)) {
+	conn->buf[0] = 5;
+	conn->buf[1] = 1;
+	conn->buf[2] = 0;
+	if (send(conn->fd, conn->buf, 3, MSG_NOSIGNAL) != 3) {
+	    probe_finish(conn, OUT_ERROR, -1, errno);
+	    return;
+	}
+	conn->state = PROBE_FASTOPEN;
+    }
+
+    event.events = EPOLLOUT;
+    event.data.u32 = conn->index;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &event)) {
+	show_msg(MSGERR, "epoll_ctl failed (%s)\n", strerror(errno));
+	exit(1);
+    }
+}
+
+/* The TCP connect has completed, send the probe's first message */
+static void probe_connected(int epfd, struct probeconn *conn) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(int);
+    uint64_t now = now_ns();
+    int err = 0, rc;
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCPI_OPT_SYN_DATA)
+    struct tcp_info info;
+#endif
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+	probe_finish(conn, OUT_ERROR, -1, err);
+	return;
+    }
+
+    if (conn->cap == CAP_TFO) {
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCPI_OPT_SYN_DATA)
+	/* The first connect gets the server's cookie, if it has one, */
+	/* the second shows whether it takes the data in the SYN      */
+	if (conn->stage == 0) {
+	    close(conn->fd);
+	    conn->stage = 1;
+	    conn->start = now;
+	    probe_connect(epfd, conn);
+	    return;
+	}
+	len = sizeof(info);
+	if (getsockopt(conn->fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+	    probe_finish(conn, OUT_ERROR, -1, errno);
+	    return;
+	}
+	probe_finish(conn, ((conn->state == PROBE_FASTOPEN) &&
+		    (info.tcpi_options & TCPI_OPT_SYN_DATA) ? OUT_YES :
+		    OUT_NO), -1, 0);
+#endif
+	return;
+    }
+
+    if (!conn->server->rtt || (now - conn->start < conn->server->rtt))
+	conn->server->rtt = now - conn->start;
+
+    switch (conn->cap) {
+	case CAP_SOCKS4:
+	    /* Version, connect, port, address and an empty user id */
+	    probe_target(conn->server, &addr);
+	    conn->buf[0] = 4;
+	    conn->buf[1] = 1;
+	    memcpy(&conn->buf[2], &addr.sin_port, 2);
+	    memcpy(&conn->buf[4], &addr.sin_addr, 4);
+	    conn->buf[8] = 0;
+	    rc = probe_send(epfd, conn, PROBE_V4REPLY, 9, 8);
+	    break;
+	case CAP_NOAUTH:
+	case CAP_USERPASS:
+	    conn->buf[0] = 5;
+	    conn->buf[1] = 1;
+	    conn->buf[2] = (conn->cap == CAP_NOAUTH ? 0 : 2);
+	    rc = probe_send(epfd, conn, PROBE_METHOD, 3, 2);
+	    break;
+	default:
+	    /* Requests are made with whatever method the server likes */
+	    conn->buf[0] = 5;
+	    conn->buf[1] = (loaduser ? 2 : 1);
+	    conn->buf[2] = 0;
+	    conn->buf[3] = 2;
+	    rc = probe_send(epfd, conn, PROBE_METHOD, 2 + conn->buf[1], 2);
+    }
+    if (rc)
+	probe_finish(conn, OUT_ERROR, -1, errno);
+}
+
+/* Move a probe on when its socket is ready */
+static void probe_event(int epfd, struct probeconn *conn) {
+    int ulen, plen, code;
+    ssize_t got;
+
+    if ((conn->state == PROBE_CONNECTING) ||
+	    (conn->state == PROBE_FASTOPEN)) {
+	probe_connected(epfd, conn);
+	return;
+    }
+
+    /* A server that doesn't speak the version closes (or resets) the */
+    /* connection or sends nonsense in reply to the first message     */
+    got = recv(conn->fd, conn->buf + conn->got, conn->want - conn->got, 0);
+    if (got <= 0) {
+	if ((got < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+	    return;
+	if (((got == 0) || (errno == ECONNRESET)) &&
+		((conn->state == PROBE_V4REPLY) ||
+		 (conn->state == PROBE_METHOD)))
+	    probe_finish(conn, OUT_NO, -1, 0);
+	else if (got < 0)
+	    probe_finish(conn, OUT_ERROR, -1, errno);
+	else
+	    probe_finish(conn, OUT_CLOSED, -1, 0);
+	return;
+    }
+    conn->got += got;
+
+    /* A SOCKS 5 reply's length depends on its address type */
+    if ((conn->state == PROBE_REPLY) && (conn->got >= 5) &&
+	    (conn->want == 5)) {
+	switch (conn->buf[3]) {
+	    case 3:
+		conn->want = 7 + conn->buf[4];
+		break;
+	    case 4:
+		conn->want = 22;
+		break;
+	    default:
+		conn->want = 10;
+	}
+    }
+    if (conn->got < conn->want)
+	return;
+
+    switch (conn->state) {
+	case PROBE_V4REPLY:
+	    if ((conn->buf[0] == 0) && (conn->buf[1] >= 90) &&
+		    (conn->buf[1] <= 93))
+		probe_finish(conn, OUT_YES, conn->buf[1], 0);
+	    else
+		probe_finish(conn, OUT_NO, -1, 0);
+	    return;
+	case PROBE_METHOD:
+	    if (conn->buf[0] != 5) {
+		probe_finish(conn, OUT_NO, -1, 0);
+		return;
+	    }
+	    if (conn->cap == CAP_NOAUTH) {
+		probe_finish(conn, (conn->buf[1] == 0 ? OUT_YES : OUT_NO), -1,
+			0);
+		return;
+	    }
+	    if ((conn->cap == CAP_USERPASS) && (conn->buf[1] != 2)) {
+		probe_finish(conn, OUT_NO, -1, 0);
+		return;
+	    }
+	    if ((conn->cap == CAP_USERPASS) && !loaduser) {
+		probe_finish(conn, OUT_YES, -1, 0);
+		return;
+	    }
+	    if (conn->buf[1] == 0) {
+		if (probe_request(epfd, conn))
+		    probe_finish(conn, OUT_ERROR, -1, errno);
+		return;
+	    }
+	    if ((conn->buf[1] != 2) || !loaduser) {
+		probe_finish(conn, OUT_DENIED, -1, 0);
+		return;
+	    }
+	    ulen = strlen(loaduser);
+	    plen = strlen(loadpass);
+	    conn->buf[0] = 1;
+	    conn->buf[1] = ulen;
+	    memcpy(&conn->buf[2], loaduser, ulen);
+	    conn->buf[2 + ulen] = plen;
+	    memcpy(&conn->buf[3 + ulen], loadpass, plen);
+	    if (probe_send(epfd, conn, PROBE_AUTH, 3 + ulen + plen, 2))
+		probe_finish(conn, OUT_ERROR, -1, errno);
+	    return;
+	case PROBE_AUTH:
+	    if (conn->cap == CAP_USERPASS)
+		probe_finish(conn, (conn->buf[1] == 0 ? OUT_YES : OUT_DENIED),
+			conn->buf[1], 0);
+	    else if (conn->buf[1] != 0)
+		probe_finish(conn, OUT_DENIED, conn->buf[1], 0);
+	    else if (probe_request(epfd, conn))
+		probe_finish(conn, OUT_ERROR, -1, errno);
+	    return;
+	case PROBE_REPLY:
+	    if (conn->buf[0] != 5) {
+		probe_finish(conn, OUT_INVALID, -1, 0);
+		return;
+	    }
+	    /* Failing to reach the target still shows the request was */
+	    /* understood, unless the command or address type wasn't   */
+	    code = conn->buf[1];
+	    if (conn->cap == CAP_UDP)
+		probe_finish(conn, (code == 0 ? OUT_YES : OUT_NO), code, 0);
+	    else
+		probe_finish(conn, ((code == 7) || (code == 8) ? OUT_NO :
+			    OUT_YES), code, 0);
+	    return;
+	default:
+	    return;
+    }
+}
+
+/* Send a message (in the buffer) and wait for want bytes of reply */
+static int probe_send(int epfd, struct probeconn *conn,
+	enum probestate state, int len, int want) {
+    struct epoll_event event;
+
+    if (send(conn->fd, conn->buf, len, MSG_NOSIGNAL) != len) {
+	if (errno == EAGAIN)
+	    errno = ENOBUFS;
+	return -1;
+    }
+
+    if (conn->state == PROBE_CONNECTING) {
+	event.events = EPOLLIN;
+	event.data.u32 = conn->index;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event))
+	    return -1;
+    }
+    conn->state = state;
+    conn->want = want;
+    conn->got = 0;
+
+    return 0;
+}
+
+/* Make the SOCKS 5 request the capability is about */
+static int probe_request(int epfd, struct probeconn *conn) {
+    struct sockaddr_in addr;
+    unsigned short port;
+    int len;
+
+    probe_target(conn->server, &addr);
+    conn->buf[0] = 5;
+    conn->buf[1] = (conn->cap == CAP_UDP ? 3 : 1);
+    conn->buf[2] = 0;
+    switch (conn->cap) {
+	case CAP_DOMAIN:
+	    len = strlen(domainhost);
+	    port = (domainport ? htons(domainport) : addr.sin_port);
+	    conn->buf[3] = 3;
+	    conn->buf[4] = len;
+	    memcpy(&conn->buf[5], domainhost, len);
+	    memcpy(&conn->buf[5 + len], &port, 2);
+	    len += 7;
+	    break;
+	case CAP_IPV6:
+	    /* ::1 */
+	    conn->buf[3] = 4;
+	    memset(&conn->buf[4], 0x0, 16);
+	    conn->buf[19] = 1;
+	    memcpy(&conn->buf[20], &addr.sin_port, 2);
+	    len = 22;
+	    break;
+	case CAP_UDP:
+	    /* Where the datagrams will come from isn't known */
+	    conn->buf[3] = 1;
+	    memset(&conn->buf[4], 0x0, 6);
+	    len = 10;
+	    break;
+	default:
+	    conn->buf[3] = 1;
+	    memcpy(&conn->buf[4], &addr.sin_addr, 4);
+	    memcpy(&conn->buf[8], &addr.sin_port, 2);
+	    len = 10;
+    }
+
+    return probe_send(epfd, conn, PROBE_REPLY, len, 5);
+}
+
+/* Connect requests are for the target given, or the server itself */
+/* which any server should be able to reach                       */
+static void probe_target(struct probeserver *server,
+	struct sockaddr_in *addr) {
+
+    *addr = (gottarget ? target : server->addr);
+}
+
+/* A probe is over, record what it found */
+static void probe_finish(struct probeconn *conn, enum outcome outcome,
+	int reply, int err) {
+    struct proberesult *result = &(conn->server->results[conn->cap]);
+
+    result->outcome = outcome;
+    result->reply = reply;
+    result->err = err;
+    result->ns = now_ns() - conn->start;
+
+    if (conn->fd >= 0)
+	close(conn->fd);
+    conn->state = PROBE_FREE;
+}
+
+/* Print what was found, as a table or lines of JSON */
+static void probe_report(struct probeserver *servers, int nservers) {
+    struct probeserver *server;
+    struct proberesult *result;
+    char cell[32];
+    int errors = 0, i, j;
+
+    if (!json) {
+	printf("%-24s %8s", "SERVER", "RTT MS");
+	for (j = 0; j < CAPS; j++)
+	    printf(" %-8s", capnames[j]);
+	printf("\n");
+    }
+
+    for (i = 0; i < nservers; i++) {
+	server = &servers[i];
+	if (json) {
+	    printf("{\"server\":\"%s\"", server->name);
+	    if (!server->resolved) {
+		printf(",\"error\":\"could not resolve\"}\n");
+		continue;
+	    }
+	    printf(",\"address\":\"%s\",\"port\":%d", inet_ntoa(server->addr.
+			sin_addr), ntohs(server->addr.sin_port));
+	    if (server->rtt)
+		printf(",\"rtt_ms\":%.3f", server->rtt / 1e6);
+	    for (j = 0; j < CAPS; j++) {
+		result = &(server->results[j]);
+		printf(",\"%s\":{\"result\":\"%s\"", capnames[j],
+			outcomenames[result->outcome]);
+		if (result->reply >= 0)
+		    printf(",\"reply\":%d", result->reply);
+		if (result->outcome == OUT_ERROR)
+		    printf(",\"error\":\"%s\"", strerror(result->err));
+		if (result->outcome != OUT_SKIPPED)
+		    printf(",\"ms\":%.3f", result->ns / 1e6);
+		printf("}");
+	    }
+	    printf("}\n");
+	    continue;
+	}
+
+	printf("%-24s", server->name);
+	if (!server->resolved) {
+	    printf(" could not resolve\n");
+	    continue;
+	}
+	if (server->rtt)
+	    printf(" %8.3f", server->rtt / 1e6);
+	else
+	    printf(" %8s", "-");
+	for (j = 0; j < CAPS; j++) {
+	    result = &(server->results[j]);
+	    /* Show a reply that wasn't simply success */
+	    if (result->outcome == OUT_SKIPPED)
+		strcpy(cell, "-");
+	    else if ((result->reply > 0) && (result->reply != 90) &&
+		    (result->outcome != OUT_DENIED))
+		snprintf(cell, sizeof(cell), "%s/%d",
+			outcomenames[result->outcome], result->reply);
+	    else
+		strcpy(cell, outcomenames[result->outcome]);
+	    printf(" %-8s", cell);
+	}
+	printf("\n");
+    }
+
+    if (json)
+	return;
+
+    /* How long each probe took and why any failed */
+    printf("\n%-24s", "PROBE MS");
+    for (j = 0; j < CAPS; j++)
+	printf(" %-8s", capnames[j]);
+    printf("\n");
+    for (i = 0; i < nservers; i++) {
+	server = &servers[i];
+	if (!server->resolved)
+	    continue;
+	printf("%-24s", server->name);
+	for (j = 0; j < CAPS; j++) {
+	    result = &(server->results[j]);
+	    if (result->outcome == OUT_SKIPPED)
+		printf(" %-8s", "-");
+	    else
+		printf(" %-8.3f", result->ns / 1e6);
+	}
+	printf("\n");
+    }
+    for (i = 0; i < nservers; i++) {
+	for (j = 0; j < CAPS; j++) {
+	    result = &(servers[i].results[j]);
+	    if (result->outcome == OUT_ERROR)
+		printf("%s%s %s: %s\n", (errors++ ? "" : "\n"),
+			servers[i].name, capnames[j], strerror(result->err));
+	}
+    }
+}
+
+/* Print tsocks.conf lines using the server that completed a connect */
+/* request the fastest, the others that did are listed after it. A   */
+/* SOCKS 4 request takes a round trip less, so SOCKS 5 servers come  */
+/* first                                                              */
+static int probe_config(struct probeserver *servers, int nservers) {
+    struct probeserver *server, **usable;
+    struct proberesult *result;
+    int nusable = 0, type, i, j;
+
+#define PROBE_RANK(server) \
+    ((server)->results[CAP_CONNECT].outcome == OUT_YES ? \
+     (server)->results[CAP_CONNECT].ns : \
+     (server)->results[CAP_SOCKS4].ns + (1ULL << 62))
+
+    if ((usable = calloc(nservers, sizeof(*usable))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for servers\n");
+	exit(1);
+    }
+    for (i = 0; i < nservers; i++) {
+	server = &servers[i];
+	if ((server->results[CAP_CONNECT].outcome != OUT_YES) &&
+		(server->results[CAP_SOCKS4].outcome != OUT_YES))
+	    continue;
+	/* Insertion sort, on the time to complete the request */
+	for (j = nusable++; j > 0; j--) {
+	    if (PROBE_RANK(usable[j - 1]) <= PROBE_RANK(server))
+		break;
+	    usable[j] = usable[j - 1];
+	}
+	usable[j] = server;
+    }
+#undef PROBE_RANK
+
+    printf("# Written by inspectsocks -P from probing %d server%s\n",
+	    nservers, (nservers == 1 ? "" : "s"));
+    if (!nusable) {
+	printf("# No server completed a connect request\n");
+	free(usable);
+	return 1;
+    }
+
+    for (i = 0; i < nusable; i++) {
+	server = usable[i];
+	type = (server->results[CAP_CONNECT].outcome == OUT_YES ? 5 : 4);
+	result = &server->results[type == 5 ? CAP_CONNECT : CAP_SOCKS4];
+	if (i == 1)
+	    printf("\n# Other servers that completed a connect request, "
+		    "fastest first\n");
+	else if (i)
+	    printf("\n");
+	printf("# %s:", server->name);
+	for (j = 0; j < CAPS; j++) {
+	    if (server->results[j].outcome == OUT_YES)
+		printf(" %s", capnames[j]);
+	}
+	printf(", request %.3f ms\n", result->ns / 1e6);
+	printf("%sserver = %s\n", (i ? "# " : ""),
+		inet_ntoa(server->addr.sin_addr));
+	printf("%sserver_port = %d\n", (i ? "# " : ""),
+		ntohs(server->addr.sin_port));
+	printf("%sserver_type = %d\n", (i ? "# " : ""), type);
+	if ((type == 5) && loaduser &&
+		(server->results[CAP_NOAUTH].outcome != OUT_YES)) {
+	    printf("%sdefault_user = %s\n", (i ? "# " : ""), loaduser);
+	    printf("%sdefault_pass = %s\n", (i ? "# " : ""), loadpass);
+	}
+    }
+    free(usable);
+
+    return 0;
+}
+
 /*
  * vim:sts=4:sw=4:tw=80
  */
@@ -0,0 +1,158 @@
+/*
+ * names.c    - Cache of the host names addresses were resolved from
+ *
+ * libtsocks records the addresses the resolver returns for a name when
+ * the configuration has domain rules, and connect() looks up the name
+ * for the destination here. An entry lasts for the TTL of the record
+ * when the answer came from the shared DNS cache, getaddrinfo() and
+ * gethostbyname() don't give it so otherwise an entry lasts NAMES_TTL
+ * seconds from the last time the name was resolved. The cache is
+ * allocated the first time it's needed and is a fixed size, a full set
+ * replaces the entry closest to expiring.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+#include "names.h"
+
+/* Structure representing the name for one address, IPv4 addresses */
+/* are kept mapped into IPv6                                        */
+struct nameent {
+    uint8_t addr[16];
+    time_t expires; /* 0 for an unused entry */
+    char name[NAMES_MAXLEN];
+};
+
+static struct nameent *names = NULL;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int names_key(int, const void *, uint8_t *);
+static struct nameent *names_set(const uint8_t *);
+static time_t names_now(void);
+
+/* Make the key for an address, returns -1 for other families */
+static int names_key(int family, const void *addr, uint8_t *key) {
+
+    if (family == AF_INET6) {
+	memcpy(key, addr, 16);
+    } else if (family == AF_INET) {
+	memset(key, 0x0, 10);
+	key[10] = key[11] = 0xff;
+	memcpy(&key[12], addr, 4);
+    } else {
+	return -1;
+    }
+
+    return 0;
+}
+
+/* The first entry of the set for an address */
+static struct nameent *names_set(const uint8_t *key) {
+    uint32_t hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	hash ^= key[i];
+	hash *= 16777619U;
+    }
+
+    return &names[(hash & (NAMES_SETS - 1)) * NAMES_WAYS];
+}
+
+static time_t names_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1; /* Never 0 */
+}
+
+/* Remember that addr was resolved from name for ttl seconds (0 if */
+/* it isn't known), literal addresses and names too long to keep   */
+/* are ignored                                                     */
+void __attribute__ ((visibility ("hidden")))
+names_add(int family, const void *addr, const char *name, int ttl) {
+    struct nameent *set, *ent = NULL;
+    struct in6_addr literal;
+    uint8_t key[16];
+    time_t now;
+    int i;
+
+    if ((name == NULL) || (strlen(name) >= NAMES_MAXLEN) ||
+	    names_key(family, addr, key) ||
+	    (inet_pton(AF_INET, name, &literal) == 1) ||
+	    (inet_pton(AF_INET6, name, &literal) == 1))
+	return;
+
+    now = names_now();
+    pthread_mutex_lock(&names_lock);
+    if (names == NULL) {
+	if ((set = calloc(NAMES_SETS * NAMES_WAYS, sizeof(*names))) == NULL) {
+	    pthread_mutex_unlock(&names_lock);
+	    show_msg(MSGERR, "Could not allocate memory for host names\n");
+	    return;
+	}
+	__atomic_store_n(&names, set, __ATOMIC_RELAXED);
+    }
+
+    /* The entry for the address, or else the one to replace */
+    set = names_set(key);
+    for (i = 0; i < NAMES_WAYS; i++) {
+	if (set[i].expires && !memcmp(set[i].addr, key, sizeof(key))) {
+	    ent = &set[i];
+	    break;
+	}
+	if ((ent == NULL) || (set[i].expires < ent->expires))
+	    ent = &set[i];
+    }
+    memcpy(ent->addr, key, sizeof(key));
+    strcpy(ent->name, name);
+    ttl = (ttl > 0 ? ttl : NAMES_TTL);
+    ent->expires = now + ttl;
+    pthread_mutex_unlock(&names_lock);
+
+    show_msg(MSGDEBUG, "Keeping the name %s of a resolved address for %d "
+	    "seconds\n", name, ttl);
+}
+
+/* Find the name addr was resolved from, returns 0 and copies it to */
+/* name if there is one that hasn't expired                         */
+int __attribute__ ((visibility ("hidden")))
+names_find(int family, const void *addr, char *name, size_t len) {
+    struct nameent *set;
+    uint8_t key[16];
+    time_t now;
+    int i, rc = -1;
+
+    if (!__atomic_load_n(&names, __ATOMIC_RELAXED) ||
+	    names_key(family, addr, key))
+	return -1;
+
+    now = names_now();
+    pthread_mutex_lock(&names_lock);
+    set = names_set(key);
+    for (i = 0; i < NAMES_WAYS; i++) {
+	if ((set[i].expires > now) && !memcmp(set[i].addr, key, sizeof(key))) {
+	    if (strlen(set[i].name) < len) {
+		strcpy(name, set[i].name);
+		rc = 0;
+	    }
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&names_lock);
+
+    return rc;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,23 @@
+/* names.h - Cache of the host names addresses were resolved from, */
+/* kept so connections can be routed by reaches_domain and        */
+/* local_domain rules. The cache is a fixed number of small sets  */
+/* of entries, each entry lasting as long as the DNS record it    */
+/* came from when that's known (see dnscache.c) and otherwise     */
+/* NAMES_TTL seconds from the last time the resolver gave it      */
+
+#ifndef _NAMES_H
+
+#define _NAMES_H	1
+
+#include <stddef.h>
+
+#define NAMES_SETS	1024	/* A power of 2 */
+#define NAMES_WAYS	4	/* Entries in a set */
+#define NAMES_TTL	300	/* Seconds an entry is kept without a TTL */
+#define NAMES_MAXLEN	256	/* Longest name kept, with the NUL */
+
+/* Functions provided by the names module */
+void names_add(int family, const void *addr, const char *name, int ttl);
+int names_find(int family, const void *addr, char *name, size_t len);
+
+#endif
@@ -0,0 +1,932 @@
+/*
+ * optimize.c - Analysis, minimization and comparison of the routing
+ *              rules in tsocks.conf for validateconf
+ */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <config.h>
+#include "common.h"
+#include "parser.h"
+#include "optimize.h"
+
+#define LOCAL_PATH -1 /* Path of local rules, they beat every path */
+#define ANY_PORT 65535 /* Highest port, rules for any port use 0-65535 */
+#define MAX_CHECKS (1 << 24) /* Most lookups compare_configs() does */
+#define MAX_SHOWN 10 /* Most differences compare_configs() shows */
+
+/* Whether decision da of config a and db of config b use the same server */
+#define SAME(same, b, da, db) ((same)[((da) + 2) * ((b)->index.npaths + 2) + (db) + 2])
+
+/* Structure representing one local or reaches rule */
+struct rule {
+    uint32_t net; /* Network, host byte order */
+    uint32_t mask; /* Mask, host byte order */
+    uint32_t lo; /* Ports matched by the rule, */
+    uint32_t hi; /* 0 - 65535 for any port     */
+    int path; /* Index of the path, LOCAL_PATH for local networks */
+    int lineno; /* Line in the conf file, 0 if not from a line */
+    struct prefixfile *file; /* List the rule was read from */
+    int dead;
+};
+
+/* Structure representing the rules of a configuration */
+struct ruleset {
+    struct rule *rules;
+    size_t nrules, allocated;
+    FILE *report;
+    unsigned long covered; /* Rules that can never match */
+    unsigned long filecovered; /* Of those, ones from lists */
+    unsigned long merged; /* Rules merged with a neighbour */
+};
+
+static int contiguous(uint32_t);
+static char *rule_net(struct rule *, char *, size_t);
+static char *rule_source(struct rule *, char *, size_t);
+static void add_rule(struct ruleset *, uint32_t, uint32_t, unsigned long,
+	unsigned long, int, int, struct prefixfile *);
+static void gather_rules(struct parsedfile *, struct ruleset *);
+static void remove_dead(struct ruleset *);
+static int compare_cover(const void *, const void *);
+static int compare_merge(const void *, const void *);
+static int compare_ports(const void *, const void *);
+static int compare_output(const void *, const void *);
+static unsigned long cover_rules(struct ruleset *);
+static unsigned long merge_nets(struct ruleset *);
+static unsigned long merge_ports(struct ruleset *);
+static void write_server_conf(FILE *, struct serverent *, char *);
+static void write_nets6(FILE *, struct netent6 *, char *);
+static void write_domains(FILE *, struct domainent *, char *);
+static void write_conf(FILE *, struct parsedfile *, struct ruleset *, char *);
+static int same_server(struct serverent *, struct serverent *);
+static struct serverent *decision_server(struct parsedfile *, int);
+static char *decision_text(struct parsedfile *, int, char *, size_t);
+static void add_bounds(struct routetable *, uint32_t **, size_t *,
+	uint32_t *, size_t *, int *);
+static int compare_uint32(const void *, const void *);
+static size_t unique(uint32_t *, size_t);
+static void add_bounds6(struct routetable6 *, uint8_t (*)[16], size_t *,
+	uint32_t *, size_t *);
+static int compare_addr6(const void *, const void *);
+static size_t unique6(uint8_t (*)[16], size_t);
+static unsigned long compare_nets6(struct parsedfile *, struct parsedfile *,
+	unsigned char *, FILE *);
+static int compare_names(const void *, const void *);
+static unsigned long compare_domains(struct parsedfile *, struct parsedfile *,
+	unsigned char *, FILE *);
+
+static int contiguous(uint32_t mask) {
+    uint32_t inverse = ~mask;
+
+    return !(inverse & (inverse + 1));
+}
+
+static char *rule_net(struct rule *r, char *buf, size_t len) {
+    char ports[16] = "";
+
+    if ((r->lo != 0) || (r->hi != ANY_PORT)) {
+	if (r->lo == r->hi)
+	    snprintf(ports, sizeof(ports), ":%u", r->lo);
+	else
+	    snprintf(ports, sizeof(ports), ":%u-%u", r->lo, r->hi);
+    }
+    snprintf(buf, len, "%u.%u.%u.%u%s/%u.%u.%u.%u",
+	    r->net >> 24, (r->net >> 16) & 0xff, (r->net >> 8) & 0xff,
+	    r->net & 0xff, ports, r->mask >> 24, (r->mask >> 16) & 0xff,
+	    (r->mask >> 8) & 0xff, r->mask & 0xff);
+
+    return buf;
+}
+
+static char *rule_source(struct rule *r, char *buf, size_t len) {
+    char net[64];
+
+    if (r->lineno)
+	snprintf(buf, len, "line %d (%s)", r->lineno, rule_net(r, net, sizeof(net)));
+    else if (r->file)
+	snprintf(buf, len, "%s (%s)", r->file->filename, rule_net(r, net, sizeof(net)));
+    else
+	snprintf(buf, len, "%s", rule_net(r, net, sizeof(net)));
+
+    return buf;
+}
+
+static void add_rule(struct ruleset *set, uint32_t net, uint32_t mask,
+	unsigned long startport, unsigned long endport, int path, int lineno,
+	struct prefixfile *file) {
+    struct rule *r;
+
+    if (set->nrules == set->allocated) {
+	set->allocated = (set->allocated ? set->allocated * 2 : 256);
+	if ((set->rules = realloc(set->rules, set->allocated *
+			sizeof(*set->rules))) == NULL) {
+	    show_msg(MSGERR, "Could not allocate memory for rules\n");
+	    exit(1);
+	}
+    }
+
+    r = &(set->rules[set->nrules++]);
+    r->net = ntohl(net);
+    r->mask = ntohl(mask);
+    r->lo = (startport ? startport : 0);
+    r->hi = (startport ? endport : ANY_PORT);
+    r->path = path;
+    r->lineno = lineno;
+    r->file = file;
+    r->dead = 0;
+}
+
+/* Collect the local and reaches rules of a configuration, paths */
+/* are numbered as in the routing index                           */
+static void gather_rules(struct parsedfile *config, struct ruleset *set) {
+    struct serverent *server;
+    struct netent *net;
+    struct prefixfile *pf;
+    uint32_t i;
+    int path;
+
+    for (net = config->localnets; net != NULL; net = net->next)
+	add_rule(set, net->localip.s_addr & net->localnet.s_addr,
+		net->localnet.s_addr, 0, 0, LOCAL_PATH, net->lineno, NULL);
+    for (pf = config->localfiles; pf != NULL; pf = pf->next) {
+	for (i = 0; i < pf->nents; i++)
+	    add_rule(set, pf->ents[i].net, pf->ents[i].mask, 0, 0,
+		    LOCAL_PATH, 0, pf);
+    }
+
+    for (path = 0; path < config->index.npaths; path++) {
+	server = config->index.paths[path];
+	for (net = server->reachnets; net != NULL; net = net->next)
+	    add_rule(set, net->localip.s_addr & net->localnet.s_addr,
+		    net->localnet.s_addr, net->startport, net->endport, path,
+		    net->lineno, NULL);
+	for (pf = server->reachfiles; pf != NULL; pf = pf->next) {
+	    for (i = 0; i < pf->nents; i++)
+		add_rule(set, pf->ents[i].net, pf->ents[i].mask, 0, 0,
+			path, 0, pf);
+	}
+    }
+}
+
+static void remove_dead(struct ruleset *set) {
+    size_t i, j;
+
+    for (i = 0, j = 0; i < set->nrules; i++) {
+	if (!set->rules[i].dead)
+	    set->rules[j++] = set->rules[i];
+    }
+    set->nrules = j;
+}
+
+/* Same order as the routing index, so for any network the rule */
+/* with the highest priority comes first                        */
+static int compare_cover(const void *a, const void *b) {
+    const struct rule *x = a, *y = b;
+
+    if (x->mask != y->mask)
+	return (x->mask > y->mask ? -1 : 1);
+    if (x->net != y->net)
+	return (x->net < y->net ? -1 : 1);
+    if (x->path != y->path)
+	return (x->path < y->path ? -1 : 1);
+    if (x->lo != y->lo)
+	return (x->lo < y->lo ? -1 : 1);
+    if (x->hi != y->hi)
+	return (x->hi > y->hi ? -1 : 1);
+    return 0;
+}
+
+/* Rules for the same path and ports together, ordered by network */
+static int compare_merge(const void *a, const void *b) {
+    const struct rule *x = a, *y = b;
+
+    if (x->path != y->path)
+	return (x->path < y->path ? -1 : 1);
+    if (x->lo != y->lo)
+	return (x->lo < y->lo ? -1 : 1);
+    if (x->hi != y->hi)
+	return (x->hi < y->hi ? -1 : 1);
+    if (x->net != y->net)
+	return (x->net < y->net ? -1 : 1);
+    if (x->mask != y->mask)
+	return (x->mask < y->mask ? -1 : 1);
+    return 0;
+}
+
+/* Rules for the same path and network together, ordered by port */
+static int compare_ports(const void *a, const void *b) {
+    const struct rule *x = a, *y = b;
+
+    if (x->path != y->path)
+	return (x->path < y->path ? -1 : 1);
+    if (x->mask != y->mask)
+	return (x->mask < y->mask ? -1 : 1);
+    if (x->net != y->net)
+	return (x->net < y->net ? -1 : 1);
+    if (x->lo != y->lo)
+	return (x->lo < y->lo ? -1 : 1);
+    return 0;
+}
+
+static int compare_output(const void *a, const void *b) {
+    const struct rule *x = a, *y = b;
+
+    if (x->path != y->path)
+	return (x->path < y->path ? -1 : 1);
+    if (x->net != y->net)
+	return (x->net < y->net ? -1 : 1);
+    if (x->mask != y->mask)
+	return (x->mask > y->mask ? -1 : 1);
+    if (x->lo != y->lo)
+	return (x->lo < y->lo ? -1 : 1);
+    return 0;
+}
+
+/* Find rules which can never be the one that decides a connection */
+/* since every address and port they match is matched by a rule of  */
+/* a path tried before them (or a local network, or a wider rule in */
+/* the same path)                                                   */
+static unsigned long cover_rules(struct ruleset *set) {
+    struct rule *rules = set->rules, *e, *f;
+    size_t *first, *count, ngroups = 0, i, g, lo, hi, mid, j;
+    unsigned long killed = 0;
+    char ebuf[128], fbuf[128];
+    uint32_t mask, net;
+
+    qsort(rules, set->nrules, sizeof(*rules), compare_cover);
+
+    if (((first = malloc((set->nrules + 1) * sizeof(size_t))) == NULL) ||
+	    ((count = malloc((set->nrules + 1) * sizeof(size_t))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory for rules\n");
+	exit(1);
+    }
+    for (i = 0; i < set->nrules; i++) {
+	if ((i == 0) || (rules[i].mask != rules[i - 1].mask)) {
+	    first[ngroups] = i;
+	    count[ngroups++] = 0;
+	}
+	count[ngroups - 1]++;
+    }
+
+    for (i = 0; i < set->nrules; i++) {
+	e = &rules[i];
+	for (g = 0; (g < ngroups) && !e->dead; g++) {
+	    mask = rules[first[g]].mask;
+	    if ((mask & e->mask) != mask)
+		continue;
+	    net = e->net & mask;
+
+	    lo = first[g];
+	    hi = first[g] + count[g];
+	    while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (rules[mid].net < net)
+		    lo = mid + 1;
+		else
+		    hi = mid;
+	    }
+
+	    for (j = lo; (j < first[g] + count[g]) && (rules[j].net == net); j++) {
+		f = &rules[j];
+		if (f->path > e->path)
+		    break;
+		if ((j == i) || (f->lo > e->lo) || (f->hi < e->hi))
+		    continue;
+		/* Of identical rules in a path keep the first */
+		if ((f->path == e->path) && (f->mask == e->mask) &&
+			(f->lo == e->lo) && (f->hi == e->hi) && (j > i))
+		    continue;
+
+		e->dead = 1;
+		killed++;
+		if (e->lineno)
+		    fprintf(set->report, "Line %d: %s %s can never match, "
+			    "it is covered by %s%s\n", e->lineno,
+			    (e->path == LOCAL_PATH ? "local" : "reaches"),
+			    rule_net(e, ebuf, sizeof(ebuf)),
+			    (f->path == LOCAL_PATH ? "local network " : ""),
+			    rule_source(f, fbuf, sizeof(fbuf)));
+		else
+		    set->filecovered++;
+		break;
+	    }
+	}
+    }
+
+    free(first);
+    free(count);
+    remove_dead(set);
+    set->covered += killed;
+
+    return killed;
+}
+
+/* Merge pairs of adjacent networks with the same path and ports */
+/* into one network, using the array as a stack so merged         */
+/* networks can be merged again                                   */
+static unsigned long merge_nets(struct ruleset *set) {
+    struct rule *rules = set->rules, *a, *b;
+    unsigned long merged = 0;
+    char abuf[128], bbuf[128], net[64];
+    uint32_t size;
+    size_t i, j;
+
+    qsort(rules, set->nrules, sizeof(*rules), compare_merge);
+
+    for (i = 0, j = 0; i < set->nrules; i++) {
+	rules[j++] = rules[i];
+	while (j > 1) {
+	    a = &rules[j - 2];
+	    b = &rules[j - 1];
+	    if ((a->path != b->path) || (a->lo != b->lo) || (a->hi != b->hi) ||
+		    (a->mask != b->mask) || !a->mask || !contiguous(a->mask))
+		break;
+	    size = ~a->mask + 1;
+	    if ((a->net & size) || (b->net != (a->net | size)))
+		break;
+
+	    rule_source(a, abuf, sizeof(abuf));
+	    rule_source(b, bbuf, sizeof(bbuf));
+	    a->mask <<= 1;
+	    if (a->lineno || b->lineno)
+		fprintf(set->report, "Rules %s and %s can be merged into %s\n",
+			abuf, bbuf, rule_net(a, net, sizeof(net)));
+	    a->lineno = 0;
+	    a->file = NULL;
+	    j--;
+	    merged++;
+	}
+    }
+    set->nrules = j;
+    set->merged += merged;
+
+    return merged;
+}
+
+/* Merge rules for the same path and network whose port ranges */
+/* overlap or are adjacent                                     */
+static unsigned long merge_ports(struct ruleset *set) {
+    struct rule *rules = set->rules, *a, *b;
+    unsigned long merged = 0;
+    char abuf[128], bbuf[128], net[64];
+    size_t i, j;
+
+    qsort(rules, set->nrules, sizeof(*rules), compare_ports);
+
+    for (i = 0, j = 0; i < set->nrules; i++) {
+	if (j > 0) {
+	    a = &rules[j - 1];
+	    b = &rules[i];
+	    if ((a->path == b->path) && (a->mask == b->mask) &&
+		    (a->net == b->net) && (b->lo <= a->hi + 1)) {
+		rule_source(a, abuf, sizeof(abuf));
+		rule_source(b, bbuf, sizeof(bbuf));
+		if (b->hi > a->hi)
+		    a->hi = b->hi;
+		if (a->lineno || b->lineno)
+		    fprintf(set->report, "Rules %s and %s can be merged into %s\n",
+			    abuf, bbuf, rule_net(a, net, sizeof(net)));
+		a->lineno = 0;
+		a->file = NULL;
+		merged++;
+		continue;
+	    }
+	}
+	rules[j++] = rules[i];
+    }
+    set->nrules = j;
+    set->merged += merged;
+
+    return merged;
+}
+
+static void write_server_conf(FILE *out, struct serverent *server, char *indent) {
+
+    if (server->address == NULL)
+	return;
+
+    if (server->chain) {
+	fprintf(out, "%schain = %s:%d,%s\n", indent, server->address,
+		server->port, server->chain);
+    } else {
+	fprintf(out, "%sserver = %s\n", indent, server->address);
+	fprintf(out, "%sserver_port = %d\n", indent, server->port);
+    }
+    if (server->type == SERVER_HTTP)
+	fprintf(out, "%sserver_type = http\n", indent);
+    else
+	fprintf(out, "%sserver_type = %d\n", indent, server->type);
+    if (server->defuser)
+	fprintf(out, "%sdefault_user = %s\n", indent, server->defuser);
+    if (server->defpass)
+	fprintf(out, "%sdefault_pass = %s\n", indent, server->defpass);
+}
+
+/* IPv6 rules aren't minimized, they're written out as they were read */
+static void write_nets6(FILE *out, struct netent6 *net, char *directive) {
+    char text[INET6_ADDRSTRLEN];
+
+    for (; net != NULL; net = net->next) {
+	/* Not from a line, ::1 is always added by the parser */
+	if (!net->lineno)
+	    continue;
+	inet_ntop(AF_INET6, &(net->net), text, sizeof(text));
+	if (!net->startport)
+	    fprintf(out, "%s = %s/%d\n", directive, text, net->prefixlen);
+	else if (net->startport == net->endport)
+	    fprintf(out, "%s = [%s]:%lu/%d\n", directive, text, net->startport,
+		    net->prefixlen);
+	else
+	    fprintf(out, "%s = [%s]:%lu-%lu/%d\n", directive, text,
+		    net->startport, net->endport, net->prefixlen);
+    }
+}
+
+/* Domain rules are written out as they were read too */
+static void write_domains(FILE *out, struct domainent *domain, char *directive) {
+
+    for (; domain != NULL; domain = domain->next)
+	fprintf(out, "%s = %s\n", directive, domain->domain);
+}
+
+/* Write out a configuration file using the remaining rules, paths */
+/* are written in reverse order since the parser reverses them     */
+static void write_conf(FILE *out, struct parsedfile *config,
+	struct ruleset *set, char *filename) {
+    struct rule *rules = set->rules;
+    struct serverent *server;
+    char net[64];
+    size_t i, start;
+    int path;
+
+    qsort(rules, set->nrules, sizeof(*rules), compare_output);
+
+    fprintf(out, "# Minimized from %s by validateconf\n", filename);
+    write_server_conf(out, &(config->defaultserver), "");
+    if (config->fallback)
+	fprintf(out, "fallback = yes\n");
+
+    for (i = 0; (i < set->nrules) && (rules[i].path == LOCAL_PATH); i++) {
+	/* This is always added by the parser */
+	if ((rules[i].net == 0x7f000000) && (rules[i].mask == 0xff000000))
+	    continue;
+	fprintf(out, "local = %s\n", rule_net(&rules[i], net, sizeof(net)));
+    }
+    write_nets6(out, config->localnets6, "local");
+    write_domains(out, config->localdomains, "local_domain");
+
+    for (path = config->index.npaths - 1; path >= 0; path--) {
+	server = config->index.paths[path];
+	for (start = 0; (start < set->nrules) && (rules[start].path != path); start++)
+	    /* Empty loop */;
+	if ((start == set->nrules) && (server->reachnets6 == NULL) &&
+		(server->reachdomains == NULL)) {
+	    fprintf(set->report, "Path at line %d is never used\n",
+		    server->lineno);
+	    continue;
+	}
+
+	fprintf(out, "\npath {\n");
+	write_server_conf(out, server, "\t");
+	for (i = start; (i < set->nrules) && (rules[i].path == path); i++)
+	    fprintf(out, "\treaches = %s\n", rule_net(&rules[i], net, sizeof(net)));
+	write_nets6(out, server->reachnets6, "\treaches");
+	write_domains(out, server->reachdomains, "\treaches_domain");
+	fprintf(out, "}\n");
+    }
+}
+
+/* Find rules that can never match and rules that can be merged,  */
+/* reporting them as it goes. If out isn't NULL an equivalent but */
+/* minimal configuration file is written to it                    */
+int __attribute__ ((visibility ("hidden")))
+analyze_config(struct parsedfile *config, FILE *report, FILE *out,
+	char *filename) {
+    struct ruleset set;
+    unsigned long changes;
+    size_t nrules;
+
+    memset(&set, 0x0, sizeof(set));
+    set.report = report;
+
+    gather_rules(config, &set);
+    nrules = set.nrules;
+
+    do {
+	changes = cover_rules(&set);
+	changes += merge_nets(&set);
+	changes += merge_ports(&set);
+    } while (changes);
+
+    if (set.filecovered)
+	fprintf(report, "%lu networks from reaches_file and local_file lists "
+		"can never match\n", set.filecovered);
+    fprintf(report, "%lu rules, %lu can never match, %lu merged, "
+	    "%lu remaining\n", (unsigned long) nrules, set.covered,
+	    set.merged, (unsigned long) set.nrules);
+
+    if (out)
+	write_conf(out, config, &set, filename);
+
+    free(set.rules);
+
+    return 0;
+}
+
+static int same_server(struct serverent *a, struct serverent *b) {
+
+    if ((a == NULL) || (b == NULL))
+	return (a == b);
+
+#define SAME_STRING(x, y) \
+    (((x) == NULL) ? ((y) == NULL) : (((y) != NULL) && !strcmp((x), (y))))
+
+    return (SAME_STRING(a->address, b->address) && (a->port == b->port) &&
+	    (a->type == b->type) && SAME_STRING(a->defuser, b->defuser) &&
+	    SAME_STRING(a->defpass, b->defpass) &&
+	    SAME_STRING(a->chain, b->chain));
+}
+
+/* The server a decision connects through, NULL for a direct */
+/* connection                                                 */
+static struct serverent *decision_server(struct parsedfile *config, int decision) {
+    struct serverent *server;
+
+    if (decision == ROUTE_LOCAL)
+	return NULL;
+    server = (decision == ROUTE_DEFAULT ? &(config->defaultserver) :
+	    config->index.paths[decision]);
+    if ((server->address == NULL) && config->fallback)
+	return NULL;
+
+    return server;
+}
+
+static char *decision_text(struct parsedfile *config, int decision,
+	char *buf, size_t len) {
+
+    if (decision == ROUTE_LOCAL)
+	snprintf(buf, len, "local");
+    else if (decision == ROUTE_DEFAULT)
+	snprintf(buf, len, "default server");
+    else if (decision == ROUTE_NOMATCH)
+	snprintf(buf, len, "address rules");
+    else
+	snprintf(buf, len, "path at line %d",
+		config->index.paths[decision]->lineno);
+
+    return buf;
+}
+
+/* Add the first address of every network in a table and the first */
+/* address after it to a list of addresses where the decision can   */
+/* change, and likewise for ports                                   */
+static void add_bounds(struct routetable *table, uint32_t **ips, size_t *nips,
+	uint32_t *ports, size_t *nports, int *allcontiguous) {
+    uint32_t i, net, mask;
+
+    if ((*ips = realloc(*ips, (*nips + table->nents * 2) * sizeof(**ips))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for comparison\n");
+	exit(1);
+    }
+
+    for (i = 0; i < table->nents; i++) {
+	net = ntohl(table->ents[i].net);
+	mask = ntohl(table->ents[i].mask);
+	if (!contiguous(mask))
+	    *allcontiguous = 0;
+	(*ips)[(*nips)++] = net;
+	if ((uint64_t) net + ~mask + 1 <= 0xffffffff)
+	    (*ips)[(*nips)++] = net + ~mask + 1;
+	if (table->ents[i].startport) {
+	    ports[(*nports)++] = table->ents[i].startport;
+	    if (table->ents[i].endport < ANY_PORT)
+		ports[(*nports)++] = table->ents[i].endport + 1;
+	}
+    }
+}
+
+static int compare_uint32(const void *a, const void *b) {
+    const uint32_t *x = a, *y = b;
+
+    return (*x < *y ? -1 : (*x > *y ? 1 : 0));
+}
+
+static size_t unique(uint32_t *values, size_t n) {
+    size_t i, j;
+
+    qsort(values, n, sizeof(*values), compare_uint32);
+    for (i = 0, j = 0; i < n; i++) {
+	if ((j == 0) || (values[i] != values[j - 1]))
+	    values[j++] = values[i];
+    }
+
+    return j;
+}
+
+/* As add_bounds() for an IPv6 table, whose networks are prefixes */
+static void add_bounds6(struct routetable6 *table, uint8_t (*ips)[16],
+	size_t *nips, uint32_t *ports, size_t *nports) {
+    uint32_t g, i, prefixlen;
+    uint8_t *next;
+    int byte, carry;
+
+    for (g = 0; g < table->ngroups; g++) {
+	prefixlen = table->groups[g].mask;
+	for (i = table->groups[g].first;
+		i < table->groups[g].first + table->groups[g].count; i++) {
+	    memcpy(ips[(*nips)++], table->ents[i].net, 16);
+	    /* The first address after the network, unless it wraps */
+	    next = ips[*nips];
+	    memcpy(next, table->ents[i].net, 16);
+	    carry = 1;
+	    if (prefixlen > 0) {
+		byte = (prefixlen - 1) / 8;
+		carry = next[byte] + (1 << (7 - ((prefixlen - 1) % 8))) > 0xff;
+		next[byte] += 1 << (7 - ((prefixlen - 1) % 8));
+		for (byte--; carry && (byte >= 0); byte--)
+		    carry = (++next[byte] == 0);
+	    }
+	    if (!carry)
+		(*nips)++;
+	    if (table->ents[i].startport) {
+		ports[(*nports)++] = table->ents[i].startport;
+		if (table->ents[i].endport < ANY_PORT)
+		    ports[(*nports)++] = table->ents[i].endport + 1;
+	    }
+	}
+    }
+}
+
+static int compare_addr6(const void *a, const void *b) {
+
+    return memcmp(a, b, 16);
+}
+
+static size_t unique6(uint8_t (*values)[16], size_t n) {
+    size_t i, j;
+
+    qsort(values, n, sizeof(*values), compare_addr6);
+    for (i = 0, j = 0; i < n; i++) {
+	if ((j == 0) || memcmp(values[i], values[j - 1], 16))
+	    memcpy(values[j++], values[i], 16);
+    }
+
+    return j;
+}
+
+/* Check two configurations route every IPv6 address and port     */
+/* through the same server, as compare_configs() does for IPv4.    */
+/* IPv6 networks are always prefixes so one address from each     */
+/* range is enough. Returns the number of differences               */
+static unsigned long compare_nets6(struct parsedfile *a, struct parsedfile *b,
+	unsigned char *same, FILE *report) {
+    struct routetable6 *tables[4] = { &(a->index.local6), &(a->index.reach6),
+	&(b->index.local6), &(b->index.reach6) };
+    uint8_t (*ips)[16];
+    uint32_t *ports;
+    size_t nips = 0, nports = 0, nslots = 1, nportslots = 2, i, p;
+    unsigned long checks, check, differ = 0;
+    uint64_t random = 0x9e3779b97f4a7c15ULL;
+    int exhaustive, da, db;
+    char abuf[64], bbuf[64], text[INET6_ADDRSTRLEN];
+    struct in6_addr addr;
+
+    for (i = 0; i < 4; i++) {
+	nslots += tables[i]->nents * 2;
+	nportslots += tables[i]->nents * 2;
+    }
+    /* Nothing to check if neither configuration has IPv6 rules */
+    if (nslots == 1)
+	return 0;
+
+    if (((ips = malloc(nslots * sizeof(*ips))) == NULL) ||
+	    ((ports = malloc(nportslots * sizeof(*ports))) == NULL)) {
+	show_msg(MSGERR, "Could not allocate memory for comparison\n");
+	exit(1);
+    }
+    memset(ips[nips++], 0x0, 16);
+    ports[nports++] = 0;
+    ports[nports++] = 1;
+    for (i = 0; i < 4; i++)
+	add_bounds6(tables[i], ips, &nips, ports, &nports);
+    nips = unique6(ips, nips);
+    nports = unique(ports, nports);
+
+    exhaustive = ((uint64_t) nips * nports <= MAX_CHECKS);
+    checks = (exhaustive ? nips * nports : MAX_CHECKS);
+
+    for (check = 0; check < checks; check++) {
+	if (exhaustive) {
+	    i = check / nports;
+	    p = check % nports;
+	} else {
+	    /* xorshift64 */
+	    random ^= random << 13;
+	    random ^= random >> 7;
+	    random ^= random << 17;
+	    i = (random >> 32) % nips;
+	    p = (random & 0xffff) % nports;
+	}
+
+	memcpy(addr.s6_addr, ips[i], 16);
+	da = route_addr6(&(a->index), &addr, ports[p]);
+	db = route_addr6(&(b->index), &addr, ports[p]);
+	if (SAME(same, b, da, db))
+	    continue;
+
+	if (differ++ < MAX_SHOWN) {
+	    inet_ntop(AF_INET6, &addr, text, sizeof(text));
+	    fprintf(report, "[%s]:%u is routed via the %s in the first "
+		    "configuration but the %s in the second\n",
+		    text, ports[p], decision_text(a, da, abuf, sizeof(abuf)),
+		    decision_text(b, db, bbuf, sizeof(bbuf)));
+	}
+    }
+
+    if (differ)
+	fprintf(report, "%lu of %lu %s routed differently\n", differ, checks,
+		(exhaustive ? "IPv6 address and port ranges" :
+		 "IPv6 ranges and ports"));
+    else if (exhaustive)
+	fprintf(report, "Every IPv6 address and port is routed the same way "
+		"(checked all %lu ranges)\n", checks);
+    else
+	fprintf(report, "No differences in %lu IPv6 ranges and ports\n",
+		checks);
+
+    free(ips);
+    free(ports);
+
+    return differ;
+}
+
+static int compare_names(const void *a, const void *b) {
+
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Check two configurations route names in every domain either of */
+/* them lists the same way. A name is decided by the longest of    */
+/* the listed domains it is in, so checking the listed domains      */
+/* themselves covers every name. Returns the number of differences */
+static unsigned long compare_domains(struct parsedfile *a, struct parsedfile *b,
+	unsigned char *same, FILE *report) {
+    struct domaintable *tables[2] = { &(a->index.domains), &(b->index.domains) };
+    unsigned long checks = 0, differ = 0;
+    char abuf[64], bbuf[64], **names;
+    size_t nnames = 0, i;
+    uint32_t r;
+    int t, da, db;
+
+    if (!tables[0]->nrules && !tables[1]->nrules)
+	return 0;
+
+    if ((names = malloc((tables[0]->nrules + tables[1]->nrules) *
+		    sizeof(*names))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for comparison\n");
+	exit(1);
+    }
+    for (t = 0; t < 2; t++) {
+	for (r = 0; r < tables[t]->nrules; r++)
+	    names[nnames++] = tables[t]->names + tables[t]->rules[r].name;
+    }
+    qsort(names, nnames, sizeof(*names), compare_names);
+
+    for (i = 0; i < nnames; i++) {
+	if ((i > 0) && !strcmp(names[i], names[i - 1]))
+	    continue;
+	checks++;
+	da = route_domain(tables[0], names[i]);
+	db = route_domain(tables[1], names[i]);
+	/* Without a domain rule the name is routed by its address */
+	if ((da == ROUTE_NOMATCH) || (db == ROUTE_NOMATCH) ?
+		(da == db) : SAME(same, b, da, db))
+	    continue;
+
+	if (differ++ < MAX_SHOWN)
+	    fprintf(report, "Names in %s are routed via the %s in the first "
+		    "configuration but the %s in the second\n", names[i],
+		    decision_text(a, da, abuf, sizeof(abuf)),
+		    decision_text(b, db, bbuf, sizeof(bbuf)));
+    }
+    free(names);
+
+    if (differ)
+	fprintf(report, "%lu of %lu domains routed differently\n", differ,
+		checks);
+    else
+	fprintf(report, "Every domain is routed the same way (checked all "
+		"%lu domains)\n", checks);
+
+    return differ;
+}
+
+/* Check two configurations route every address and port through */
+/* the same server. The decision can only change at the start or  */
+/* just past the end of a network or port range, so when the      */
+/* masks are all contiguous and there aren't too many ranges one  */
+/* address and port from each range is checked, otherwise random  */
+/* addresses and ports are. Returns the number of differences     */
+unsigned long __attribute__ ((visibility ("hidden")))
+compare_configs(struct parsedfile *a, struct parsedfile *b, FILE *report) {
+    struct routetable *tables[4] = { &(a->index.local), &(a->index.reach),
+	&(b->index.local), &(b->index.reach) };
+    uint32_t *ips = NULL, *ports, ip, port, span;
+    size_t nips = 0, nports = 0, i, p, nportslots = 2;
+    unsigned long checks, check, differ = 0;
+    uint64_t random = 0x9e3779b97f4a7c15ULL;
+    int allcontiguous = 1, exhaustive, da, db;
+    unsigned char *same;
+    char abuf[64], bbuf[64];
+    struct in_addr addr;
+
+    /* Which pairs of decisions use the same server */
+    if ((same = malloc((a->index.npaths + 2) * (b->index.npaths + 2))) == NULL)
+	exit(1);
+    for (da = ROUTE_LOCAL; da < a->index.npaths; da++) {
+	for (db = ROUTE_LOCAL; db < b->index.npaths; db++)
+	    SAME(same, b, da, db) = same_server(decision_server(a, da), decision_server(b, db));
+    }
+
+    for (i = 0; i < 4; i++)
+	nportslots += tables[i]->nents * 2;
+    if (((ports = malloc(nportslots * sizeof(*ports))) == NULL) ||
+	    ((ips = malloc(sizeof(*ips))) == NULL))
+	exit(1);
+    ips[nips++] = 0;
+    ports[nports++] = 0;
+    ports[nports++] = 1;
+    for (i = 0; i < 4; i++)
+	add_bounds(tables[i], &ips, &nips, ports, &nports, &allcontiguous);
+    nips = unique(ips, nips);
+    nports = unique(ports, nports);
+
+    exhaustive = (allcontiguous && ((uint64_t) nips * nports <= MAX_CHECKS));
+    checks = (exhaustive ? nips * nports : MAX_CHECKS);
+
+    for (check = 0; check < checks; check++) {
+	if (exhaustive) {
+	    i = check / nports;
+	    p = check % nports;
+	    ip = ips[i];
+	    port = ports[p];
+	} else {
+	    /* xorshift64 */
+	    random ^= random << 13;
+	    random ^= random >> 7;
+	    random ^= random << 17;
+	    i = (random >> 32) % nips;
+	    p = (random & 0xffff) % nports;
+	    if (!allcontiguous && (random & 0x10000))
+		ip = random >> 32;
+	    else {
+		span = (i + 1 < nips ? ips[i + 1] - ips[i] : 0xffffffff - ips[i]);
+		ip = ips[i] + (span > 1 ? (uint32_t) (random >> 17) % span : 0);
+	    }
+	    span = (p + 1 < nports ? ports[p + 1] - ports[p] : ANY_PORT + 1 - ports[p]);
+	    port = ports[p] + (span > 1 ? (uint32_t) (random >> 3) % span : 0);
+	}
+
+	da = route_addr(&(a->index), htonl(ip), port);
+	db = route_addr(&(b->index), htonl(ip), port);
+	if (SAME(same, b, da, db))
+	    continue;
+
+	if (differ++ < MAX_SHOWN) {
+	    addr.s_addr = htonl(ip);
+	    fprintf(report, "%s:%u is routed via the %s in the first "
+		    "configuration but the %s in the second\n",
+		    inet_ntoa(addr), port, decision_text(a, da, abuf, sizeof(abuf)),
+		    decision_text(b, db, bbuf, sizeof(bbuf)));
+	}
+    }
+
+    if (differ)
+	fprintf(report, "%lu of %lu %s routed differently\n", differ, checks,
+		(exhaustive ? "address and port ranges" : "random addresses"));
+    else if (exhaustive)
+	fprintf(report, "Every address and port is routed the same way "
+		"(checked all %lu ranges)\n", checks);
+    else
+	fprintf(report, "No differences in %lu random addresses and ports\n",
+		checks);
+
+    differ += compare_nets6(a, b, same, report);
+    differ += compare_domains(a, b, same, report);
+
+    free(same);
+    free(ips);
+    free(ports);
+
+    return differ;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,15 @@
+/* optimize.h - Analysis, minimization and comparison of the routing */
+/* rules in a parsed tsocks.conf, used by validateconf               */
+
+#ifndef _OPTIMIZE_H
+
+#define _OPTIMIZE_H	1
+
+#include <stdio.h>
+#include <parser.h>
+
+/* Functions provided by the optimize module */
+int analyze_config(struct parsedfile *, FILE *, FILE *, char *);
+unsigned long compare_configs(struct parsedfile *, struct parsedfile *, FILE *);
+
+#endif
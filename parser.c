@@ -5,13 +5,16 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <pwd.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/time.h>
 #include <config.h>
 #include "common.h"
 #include "parser.h"
@@ -19,6 +22,18 @@
 /* Global configuration variables */
 #define MAXLINE         BUFSIZ             /* Max length of conf line  */
 static struct serverent *currentcontext = NULL;
+static char *currentfile = NULL;
+
+/* Structure representing a network while reading a prefix file */
+struct prefix {
+    uint32_t net; /* Network, host byte order */
+    uint32_t len; /* Prefix length */
+};
+
+/* IPv6 networks have at least two colons, IPv4 networks at most one */
+/* (before the ports)                                                  */
+#define IS_NET6(value)	((*(value) == '[') || \
+	(strchr((value), ':') != strrchr((value), ':')))
 
 static int handle_line(struct parsedfile *, char *, int);
 static int check_server(struct serverent *);
@@ -33,7 +48,24 @@ static int handle_local(struct parsedfile *, int, char *);
 static int handle_defuser(struct parsedfile *, int, char *);
 static int handle_defpass(struct parsedfile *, int, char *);
 static int make_netent(char *value, struct netent **ent);
+static int make_netent6(char *value, struct netent6 **ent);
+static int add_netent6(struct netent6 **, int, char *, char *, int);
 static int handle_fallback(struct parsedfile *, int, char *);
+static int handle_chain(struct parsedfile *, int, char *);
+static int handle_reachesfile(struct parsedfile *, int, char *);
+static int handle_localfile(struct parsedfile *, int, char *);
+static int handle_reachesdomain(struct parsedfile *, int, char *);
+static int handle_localdomain(struct parsedfile *, int, char *);
+static struct domainent *make_domainent(char *, int);
+static struct prefixfile *read_prefix_file(struct parsedfile *, char *, int);
+static void add_srcfile(struct parsedfile *, char *, struct stat *);
+static int parse_prefix(char *, struct prefix *);
+static int compare_prefix(const void *, const void *);
+static void free_prefixfiles(struct prefixfile *);
+static void free_nets(struct netent *);
+static void free_nets6(struct netent6 *);
+static void free_domains_list(struct domainent *);
+static void free_server(struct serverent *);
 
 char __attribute__ ((visibility ("hidden")))
 *find_config(char *line) {
@@ -80,13 +112,15 @@ read_config (char *filename, struct parsedfile *config) {
         filename = find_config(line);
     }
 
-    show_msg(MSGDEBUG, "using %s as configuration file\n", line);
+    show_msg(MSGDEBUG, "using %s as configuration file\n", filename);
+    currentfile = filename;
 
     /* Read the configuration file */
     if ((conf = fopen(filename, "r")) == NULL) {
 	show_msg(MSGERR, "Could not open socks configuration file "
 		"(%s), assuming all networks local\n", filename);
 	handle_local(config, 0, "0.0.0.0/0.0.0.0");
+	handle_local(config, 0, "::/0");
 	rc = 1; /* Severe errors reading configuration */
     }
     else {
@@ -102,8 +136,9 @@ read_config (char *filename, struct parsedfile *config) {
 	}
 	fclose(conf);
 
-	/* Always add the 127.0.0.1/255.0.0.0 subnet to local */
+	/* Always add the 127.0.0.1/255.0.0.0 subnet (and ::1) to local */
 	handle_local(config, 0, "127.0.0.0/255.0.0.0");
+	handle_local(config, 0, "::1/128");
 
 	/* Check default server */
 	check_server(&(config->defaultserver));
@@ -115,9 +150,105 @@ read_config (char *filename, struct parsedfile *config) {
 
     }
 
+    /* Build the index used to route connections */
+    if (build_index(config)) {
+	show_msg(MSGERR, "Could not allocate memory for routing index\n");
+	exit(-1);
+    }
+
     return rc;
 }
 
+/* Release everything read_config() or read_config_cache() */
+/* allocated for a configuration                            */
+void __attribute__ ((visibility ("hidden")))
+free_config(struct parsedfile *config) {
+    struct serverent *server, *nextserver;
+    int i;
+
+    if (config->image) {
+	/* Mapped from a cache, the servers were allocated as one */
+	/* block and everything else lives in the map             */
+	free(config->paths);
+	free(config->index.paths);
+	free(config->files);
+	munmap(config->image, config->imagelen);
+    } else {
+	free_nets(config->localnets);
+	free_nets6(config->localnets6);
+	free_prefixfiles(config->localfiles);
+	free_domains_list(config->localdomains);
+	free_server(&(config->defaultserver));
+	for (server = config->paths; server != NULL; server = nextserver) {
+	    nextserver = server->next;
+	    free_server(server);
+	    free(server);
+	}
+	free_table(&(config->index.local));
+	free_table(&(config->index.reach));
+	free_table6(&(config->index.local6));
+	free_table6(&(config->index.reach6));
+	free_domains(&(config->index.domains));
+	free(config->index.paths);
+	for (i = 0; i < config->nfiles; i++)
+	    free(config->files[i].filename);
+	free(config->files);
+    }
+
+    memset(config, 0x0, sizeof(*config));
+}
+
+static void free_nets(struct netent *net) {
+    struct netent *nextnet;
+
+    for (; net != NULL; net = nextnet) {
+	nextnet = net->next;
+	free(net);
+    }
+}
+
+static void free_nets6(struct netent6 *net) {
+    struct netent6 *nextnet;
+
+    for (; net != NULL; net = nextnet) {
+	nextnet = net->next;
+	free(net);
+    }
+}
+
+static void free_domains_list(struct domainent *dom) {
+    struct domainent *nextdom;
+
+    for (; dom != NULL; dom = nextdom) {
+	nextdom = dom->next;
+	free(dom->domain);
+	free(dom);
+    }
+}
+
+static void free_server(struct serverent *server) {
+
+    free(server->address);
+    free(server->defuser);
+    free(server->defpass);
+    free(server->chain);
+    free_nets(server->reachnets);
+    free_nets6(server->reachnets6);
+    free_prefixfiles(server->reachfiles);
+    free_domains_list(server->reachdomains);
+}
+
+static void free_prefixfiles(struct prefixfile *pf) {
+    struct prefixfile *nextpf;
+
+    for (; pf != NULL; pf = nextpf) {
+	nextpf = pf->next;
+	free(pf->filename);
+	free(pf->ents);
+	free(pf);
+    }
+}
+
 /* Check server entries (and establish defaults) */
 static int check_server(struct serverent *server) {
 
@@ -160,6 +291,11 @@ static int handle_line(struct parsedfile *config, char *line, int lineno) {
 	    handle_path(config, lineno, nowords, words);
 	} else if (!strcmp(words[0], "}")) {
 	    handle_endpath(config, lineno, nowords, words);
+	} else if (!strcmp(words[0], "chain") && (nowords >= 3) &&
+		!strcmp(words[1], "=")) {
+	    /* The servers of a chain may be separated by spaces */
+	    /* as well as commas, so take the rest of the line   */
+	    handle_chain(config, lineno, strchr(savedline, '=') + 1);
 	} else {
 	    /* Has to be a pair */
 	    if ((nowords != 3) || (strcmp(words[1], "="))) {
@@ -180,6 +316,14 @@ static int handle_line(struct parsedfile *config, char *line, int lineno) {
 		handle_defpass(config, lineno, words[2]);
 	    } else if (!strcmp(words[0], "local")) {
 		handle_local(config, lineno, words[2]);
+	    } else if (!strcmp(words[0], "reaches_file")) {
+		handle_reachesfile(config, lineno, words[2]);
+	    } else if (!strcmp(words[0], "local_file")) {
+		handle_localfile(config, lineno, words[2]);
+	    } else if (!strcmp(words[0], "reaches_domain")) {
+		handle_reachesdomain(config, lineno, words[2]);
+	    } else if (!strcmp(words[0], "local_domain")) {
+		handle_localdomain(config, lineno, words[2]);
 			} else if (!strcmp(words[0], "fallback")) {
 				handle_fallback(config, lineno, words[2]);
 	    } else {
@@ -275,6 +419,10 @@ static int handle_reaches(struct parsedfile *config, int lineno, char *value) {
     int rc;
     struct netent *ent;
 
+    if (IS_NET6(value))
+	return add_netent6(&(currentcontext->reachnets6), lineno, value,
+		"reach statement", 1);
+
     rc = make_netent(value, &ent);
     switch(rc) {
 	case 1:
@@ -326,6 +474,7 @@ static int handle_reaches(struct parsedfile *config, int lineno, char *value) {
     }
 
     /* The entry is valid so add it to linked list */
+    ent -> lineno = lineno;
     ent -> next = currentcontext -> reachnets;
     currentcontext -> reachnets = ent;
 
@@ -383,6 +532,75 @@ static int handle_port(struct parsedfile *config, int lineno, char *value) {
     return 0;
 }
 
+/* Read the servers of a chain, the first is connected to like the */
+/* server of a path and the rest are reached through it in order  */
+static int handle_chain(struct parsedfile *config, int lineno, char *value) {
+    char *hop, *host, *port, *end, *chain;
+    char hosts[CHAIN_MAXHOPS][256];
+    int ports[CHAIN_MAXHOPS];
+    int nhops = 0, len = 0, i;
+
+    if ((currentcontext->address != NULL) || (currentcontext->port != 0)) {
+	show_msg(MSGERR, "A chain cannot be given with a server or server "
+		"port, on line %d in configuration file\n", lineno);
+	return 0;
+    }
+
+    /* Everything after a # is a comment */
+    value[strcspn(value, "#")] = '\0';
+
+    while ((hop = strsplit(NULL, &value, ",")) != NULL) {
+	host = hop + strspn(hop, " \t");
+	host[strcspn(host, " \t")] = '\0';
+	if (*host == '\0')
+	    continue;
+	if (nhops == CHAIN_MAXHOPS) {
+	    show_msg(MSGERR, "A chain can have at most %d servers, on line "
+		    "%d in configuration file\n", CHAIN_MAXHOPS, lineno);
+	    return 0;
+	}
+	ports[nhops] = 1080;
+	if ((port = strchr(host, ':')) != NULL) {
+	    *port++ = '\0';
+	    errno = 0;
+	    ports[nhops] = strtol(port, &end, 10);
+	    if (errno || (*end != '\0') || (ports[nhops] < 1) ||
+		    (ports[nhops] > 65535)) {
+		show_msg(MSGERR, "Invalid server port number (%s) in chain on "
+			"line %d in configuration file\n", port, lineno);
+		return 0;
+	    }
+	}
+	if ((*host == '\0') || (strlen(host) >= sizeof(hosts[0]))) {
+	    show_msg(MSGERR, "Invalid server in chain on line %d in "
+		    "configuration file\n", lineno);
+	    return 0;
+	}
+	strcpy(hosts[nhops++], host);
+    }
+    if (nhops == 0) {
+	show_msg(MSGERR, "Empty chain on line %d in configuration file\n",
+		lineno);
+	return 0;
+    }
+
+    /* The servers after the first are kept as one string */
+    for (i = 1; i < nhops; i++)
+	len += strlen(hosts[i]) + 7;
+    if (len) {
+	if ((chain = malloc(len)) == NULL)
+	    exit(-1);
+	for (i = 1, len = 0; i < nhops; i++)
+	    len += sprintf(chain + len, "%s%s:%d", (i > 1 ? "," : ""),
+		    hosts[i], ports[i]);
+	currentcontext->chain = chain;
+    }
+    currentcontext->address = strdup(hosts[0]);
+    currentcontext->port = ports[0];
+
+    return 0;
+}
+
 static int handle_defuser(struct parsedfile *config, int lineno, char *value) {
 
     if (currentcontext->defuser != NULL) {
@@ -433,6 +651,8 @@ static int handle_type(struct parsedfile *config, int lineno, char *value) {
 		    "once per path on line %d in configuration "
 		    "file. (Path begins on line %d)\n",
 		    lineno, currentcontext->lineno);
+    } else if (!strcmp(value, "http")) {
+	currentcontext->type = SERVER_HTTP;
     } else {
 	errno = 0;
 	currentcontext->type = (int) strtol(value, (char **)NULL, 10);
@@ -440,7 +660,7 @@ static int handle_type(struct parsedfile *config, int lineno, char *value) {
 		((currentcontext->type != 4) && (currentcontext->type != 5))) {
 	    show_msg(MSGERR, "Invalid server type (%s) "
 		    "specified in configuration file "
-		    "on line %d, only 4 or 5 may be "
+		    "on line %d, only 4, 5 or http may be "
 		    "specified\n", value, lineno);
 	    currentcontext->type = 0;
 	}
@@ -461,6 +681,10 @@ static int handle_local(struct parsedfile *config, int lineno, char *value) {
 	return 0;
     }
 
+    if (IS_NET6(value))
+	return add_netent6(&(config->localnets6), lineno, value,
+		"local network specification", 0);
+
     rc = make_netent(value, &ent);
     switch(rc) {
 	case 1:
@@ -508,12 +732,115 @@ static int handle_local(struct parsedfile *config, int lineno, char *value) {
     }
 
     /* The entry is valid so add it to linked list */
+    ent -> lineno = lineno;
     ent -> next = config->localnets;
     (config->localnets) = ent;
 
     return 0;
 }
 
+static int handle_reachesfile(struct parsedfile *config, int lineno, char *value) {
+    struct prefixfile *pf;
+
+    if ((pf = read_prefix_file(config, value, lineno)) == NULL)
+	return 0;
+
+    pf->next = currentcontext->reachfiles;
+    currentcontext->reachfiles = pf;
+
+    return 0;
+}
+
+static int handle_localfile(struct parsedfile *config, int lineno, char *value) {
+    struct prefixfile *pf;
+
+    if (currentcontext != &(config->defaultserver)) {
+	show_msg(MSGERR, "Local networks cannot be specified in path "
+		"block at line %d in configuration file. "
+		"(Path block started at line %d)\n",
+		lineno, currentcontext->lineno);
+	return 0;
+    }
+
+    if ((pf = read_prefix_file(config, value, lineno)) == NULL)
+	return 0;
+
+    pf->next = config->localfiles;
+    config->localfiles = pf;
+
+    return 0;
+}
+
+static int handle_reachesdomain(struct parsedfile *config, int lineno, char *value) {
+    struct domainent *dom;
+
+    if ((dom = make_domainent(value, lineno)) == NULL)
+	return 0;
+
+    dom->next = currentcontext->reachdomains;
+    currentcontext->reachdomains = dom;
+
+    return 0;
+}
+
+static int handle_localdomain(struct parsedfile *config, int lineno, char *value) {
+    struct domainent *dom;
+
+    if (currentcontext != &(config->defaultserver)) {
+	show_msg(MSGERR, "Local domains cannot be specified in path "
+		"block at line %d in configuration file. "
+		"(Path block started at line %d)\n",
+		lineno, currentcontext->lineno);
+	return 0;
+    }
+
+    if ((dom = make_domainent(value, lineno)) == NULL)
+	return 0;
+
+    dom->next = config->localdomains;
+    config->localdomains = dom;
+
+    return 0;
+}
+
+/* Make an entry for a domain given as "example.com", ".example.com" */
+/* or "*.example.com", all of which match example.com and any name   */
+/* under it                                                          */
+static struct domainent *make_domainent(char *value, int lineno) {
+    struct domainent *dom;
+    size_t len;
+    char *c;
+
+    if (!strncmp(value, "*.", 2))
+	value += 2;
+    while (*value == '.')
+	value++;
+    for (len = strlen(value); len && (value[len - 1] == '.'); len--)
+	value[len - 1] = '\0';
+
+    for (c = value; *c; c++) {
+	if (!isalnum((unsigned char) *c) && (*c != '-') && (*c != '_') &&
+		((*c != '.') || (c[1] == '.')))
+	    break;
+	*c = tolower((unsigned char) *c);
+    }
+    if (!len || *c || (len > 253)) {
+	show_msg(MSGERR, "Domain (%s) is not a valid domain name on "
+		"line %d in configuration file\n", value, lineno);
+	return NULL;
+    }
+
+    if (((dom = malloc(sizeof(*dom))) == NULL) ||
+	    ((dom->domain = strdup(value)) == NULL)) {
+	show_msg(MSGERR, "Could not malloc space for domain\n");
+	exit(-1);
+    }
+    dom->lineno = lineno;
+    dom->next = NULL;
+
+    return dom;
+}
+
 static int handle_fallback(struct parsedfile *config, int lineno, char *value) {
     char *v = strsplit(NULL, &value, " ");
     if (config->fallback !=0) {
@@ -527,6 +854,255 @@ static int handle_fallback(struct parsedfile *config, int lineno, char *value) {
     return 0;
 }
 
+/* Read a file of networks, one per line, in the form            */
+/* "198.126.0.0/16", "198.126.0.0/255.255.0.0" or "198.126.0.1". */
+/* Rather than building a netent per line the networks go into   */
+/* a sorted array which is reduced to the smallest set of        */
+/* networks covering the same addresses. The file is remembered  */
+/* (even if it can't be read) so changes to it can be noticed     */
+static struct prefixfile *read_prefix_file(struct parsedfile *config,
+	char *value, int lineno) {
+    struct prefixfile *pf;
+    struct stat st;
+    struct prefix *prefixes = NULL, *newprefixes;
+    size_t nprefixes = 0, allocated = 0, i, j;
+    struct timeval start, end;
+    char line[256], path[MAXLINE], *slash;
+    uint64_t lastend;
+    FILE *list;
+    int toolong = 0;
+
+    gettimeofday(&start, NULL);
+
+    /* Relative names are relative to the configuration file */
+    if ((value[0] != '/') && currentfile &&
+	    ((slash = strrchr(currentfile, '/')) != NULL))
+	snprintf(path, sizeof(path), "%.*s/%s",
+		(int) (slash - currentfile), currentfile, value);
+    else
+	snprintf(path, sizeof(path), "%s", value);
+
+    if ((list = fopen(path, "r")) == NULL) {
+	show_msg(MSGERR, "Could not open network list file %s (%s) "
+		"on line %d in configuration file\n", path,
+		strerror(errno), lineno);
+	add_srcfile(config, path, NULL);
+	return NULL;
+    }
+    if (fstat(fileno(list), &st))
+	memset(&st, 0x0, sizeof(st));
+    add_srcfile(config, path, &st);
+
+    if ((pf = malloc(sizeof(*pf))) == NULL)
+	exit(-1);
+    memset(pf, 0x0, sizeof(*pf));
+    pf->filename = strdup(path);
+    pf->lineno = lineno;
+
+    while (fgets(line, sizeof(line), list) != NULL) {
+	/* Lines too long for the buffer can't be valid, skip */
+	/* the rest of them                                   */
+	if (!strchr(line, '\n') && !feof(list)) {
+	    toolong = 1;
+	    continue;
+	}
+	if (toolong) {
+	    toolong = 0;
+	    pf->invalid++;
+	    pf->lines++;
+	    continue;
+	}
+	pf->lines++;
+
+	if (nprefixes == allocated) {
+	    allocated = (allocated ? allocated * 2 : 1024);
+	    if ((newprefixes = realloc(prefixes, allocated * sizeof(*prefixes))) == NULL)
+		exit(-1);
+	    prefixes = newprefixes;
+	}
+
+	switch (parse_prefix(line, &prefixes[nprefixes])) {
+	    case 0:
+		nprefixes++;
+		break;
+	    case 1:
+		/* Empty line or comment */
+		break;
+	    default:
+		if (pf->invalid++ < 10) {
+		    line[strcspn(line, "\r\n")] = '\0';
+		    show_msg(MSGERR, "Invalid network (%s) on line %lu of %s\n",
+			    line, pf->lines, path);
+		}
+		break;
+	}
+    }
+    fclose(list);
+    pf->parsed = nprefixes;
+
+    /* Sort by network and then by length, so any network covering */
+    /* another comes before it                                     */
+    qsort(prefixes, nprefixes, sizeof(*prefixes), compare_prefix);
+
+    /* Drop networks covered by one we've already kept, since the */
+    /* networks are either nested or disjoint a network is        */
+    /* covered if it starts before the end of the last one kept   */
+    lastend = 0;
+    for (i = 0, j = 0; i < nprefixes; i++) {
+	if ((j > 0) && ((uint64_t) prefixes[i].net < lastend)) {
+	    pf->duplicates++;
+	    continue;
+	}
+	prefixes[j++] = prefixes[i];
+	lastend = (uint64_t) prefixes[i].net + ((uint64_t) 1 << (32 - prefixes[i].len));
+    }
+    nprefixes = j;
+
+    /* Merge adjacent networks, using the array as a stack so a   */
+    /* merged network can in turn be merged with its neighbour    */
+    for (i = 0, j = 0; i < nprefixes; i++) {
+	prefixes[j++] = prefixes[i];
+	while ((j > 1) && (prefixes[j - 1].len == prefixes[j - 2].len) &&
+		(prefixes[j - 1].len > 0) &&
+		!(prefixes[j - 2].net & ((uint32_t) 1 << (32 - prefixes[j - 2].len))) &&
+		(prefixes[j - 1].net == (prefixes[j - 2].net |
+					 ((uint32_t) 1 << (32 - prefixes[j - 2].len))))) {
+	    j--;
+	    prefixes[j - 1].len--;
+	    pf->merged++;
+	}
+    }
+    nprefixes = j;
+
+    if ((pf->ents = malloc((nprefixes ? nprefixes : 1) * sizeof(*pf->ents))) == NULL)
+	exit(-1);
+    for (i = 0; i < nprefixes; i++) {
+	pf->ents[i].mask = htonl(prefixes[i].len ?
+		(uint32_t) 0xffffffff << (32 - prefixes[i].len) : 0);
+	pf->ents[i].net = htonl(prefixes[i].net);
+	pf->ents[i].startport = 0;
+	pf->ents[i].endport = 0;
+	pf->ents[i].path = -1;
+    }
+    pf->nents = nprefixes;
+    free(prefixes);
+
+    gettimeofday(&end, NULL);
+    pf->usecs = (end.tv_sec - start.tv_sec) * 1000000 +
+	(end.tv_usec - start.tv_usec);
+
+    show_msg(MSGDEBUG, "Read %lu networks from %s in %ldus, %lu invalid, "
+	    "%lu duplicate, %lu merged, %u kept\n", pf->parsed, path,
+	    pf->usecs, pf->invalid, pf->duplicates, pf->merged, pf->nents);
+
+    return pf;
+}
+
+static void add_srcfile(struct parsedfile *config, char *path,
+	struct stat *st) {
+    struct srcfile *files;
+
+    if ((files = realloc(config->files, (config->nfiles + 1) *
+		    sizeof(*files))) == NULL)
+	exit(-1);
+    config->files = files;
+    files += config->nfiles++;
+    if ((files->filename = strdup(path)) == NULL)
+	exit(-1);
+    if (st)
+	files->st = *st;
+    else
+	memset(&(files->st), 0x0, sizeof(files->st));
+}
+
+/* Returns non zero if a file of networks the configuration was */
+/* read from has changed, gone or appeared since                */
+int __attribute__ ((visibility ("hidden")))
+config_files_changed(struct parsedfile *config) {
+    struct stat st;
+    int i;
+
+    for (i = 0; i < config->nfiles; i++) {
+	if (stat(config->files[i].filename, &st))
+	    memset(&st, 0x0, sizeof(st));
+	if (!SAME_FILE(st, config->files[i].st))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* Parse a network from a line of a prefix file, returns 0 on */
+/* success, 1 for an empty line and 2 if the line is invalid  */
+static int parse_prefix(char *line, struct prefix *prefix) {
+    uint32_t octets[8];
+    int i, n = 0, noctets = 0, digits;
+    uint32_t mask;
+
+    line += strspn(line, " \t");
+    if ((*line == '#') || (*line == '\n') || (*line == '\r') || (*line == '\0'))
+	return 1;
+
+    /* Address and possibly a dotted quad mask, up to 8 octets */
+    while (1) {
+	for (n = 0, digits = 0; (*line >= '0') && (*line <= '9'); line++, digits++)
+	    n = n * 10 + (*line - '0');
+	if ((digits == 0) || (digits > 3) || (n > 255))
+	    return 2;
+	octets[noctets++] = n;
+	if ((noctets == 4) || (noctets == 8)) {
+	    if ((noctets == 4) && (*line == '/')) {
+		line++;
+		/* Either a prefix length or a mask */
+		if (line[strspn(line, "0123456789")] == '.')
+		    continue;
+		for (n = 0, digits = 0; (*line >= '0') && (*line <= '9'); line++, digits++)
+		    n = n * 10 + (*line - '0');
+		if ((digits == 0) || (digits > 2) || (n > 32))
+		    return 2;
+		prefix->len = n;
+	    } else if (noctets == 4) {
+		prefix->len = 32;
+	    }
+	    break;
+	}
+	if (*line++ != '.')
+	    return 2;
+    }
+
+    /* Only whitespace or a comment may follow */
+    line += strspn(line, " \t\r\n");
+    if ((*line != '\0') && (*line != '#'))
+	return 2;
+
+    prefix->net = (octets[0] << 24) | (octets[1] << 16) | (octets[2] << 8) | octets[3];
+    if (noctets == 8) {
+	/* Masks must be contiguous to be a prefix */
+	mask = (octets[4] << 24) | (octets[5] << 16) | (octets[6] << 8) | octets[7];
+	for (i = 0; (i < 32) && (mask & ((uint32_t) 1 << (31 - i))); i++)
+	    /* Empty loop */;
+	if ((i < 32) && (mask << i))
+	    return 2;
+	prefix->len = i;
+    }
+
+    /* The address must not have bits set outside the prefix */
+    if (prefix->len < 32 && (prefix->net & ((uint32_t) 0xffffffff >> prefix->len)))
+	return 2;
+
+    return 0;
+}
+
+static int compare_prefix(const void *a, const void *b) {
+    const struct prefix *x = a, *y = b;
+
+    if (x->net != y->net)
+	return (x->net < y->net ? -1 : 1);
+    if (x->len != y->len)
+	return (x->len < y->len ? -1 : 1);
+    return 0;
+}
+
 /* Construct a netent given a string like                             */
 /* "198.126.0.1[:portno[-portno]]/255.255.255.0"                      */
 int make_netent(char *value, struct netent **ent) {
@@ -621,54 +1197,124 @@ int make_netent(char *value, struct netent **ent) {
     return 0;
 }
 
-int __attribute__ ((visibility ("hidden")))
-is_local(struct parsedfile *config, struct in_addr *testip) {
-    struct netent *ent;
+/* Parse an IPv6 network and add it to a list, reporting any problem */
+/* with it, what says which statement it is for                      */
+static int add_netent6(struct netent6 **list, int lineno, char *value,
+	char *what, int ports) {
+    struct netent6 *ent;
 
-    for (ent = (config->localnets); ent != NULL; ent = ent -> next) {
-	if ((testip->s_addr & ent->localnet.s_addr) ==
-		(ent->localip.s_addr & ent->localnet.s_addr))  {
+    switch (make_netent6(value, &ent)) {
+	case 1:
+	    show_msg(MSGERR, "IPv6 network in %s (%s) is not validly "
+		    "constructed on line %d in configuration file\n",
+		    what, value, lineno);
 	    return 0;
-	}
+	case 2:
+	    show_msg(MSGERR, "IPv6 address in %s (%s) is not valid on line "
+		    "%d in configuration file\n", what, value, lineno);
+	    return 0;
+	case 3:
+	    show_msg(MSGERR, "Prefix length in %s (%s) is not valid on line "
+		    "%d in configuration file\n", what, value, lineno);
+	    return 0;
+	case 4:
+	    show_msg(MSGERR, "Address in %s (%s) has bits set beyond the "
+		    "prefix length on line %d in configuration file, "
+		    "ignored\n", what, value, lineno);
+	    return 0;
+	case 5:
+	case 6:
+	case 7:
+	    show_msg(MSGERR, "Port specification in %s (%s) is not valid on "
+		    "line %d in configuration file\n", what, value, lineno);
+	    return 0;
+    }
+
+    if (!ports && (ent->startport || ent->endport)) {
+	show_msg(MSGERR, "Port specification is not allowed in %s (%s) on "
+		"line %d in configuration file\n", what, value, lineno);
+	free(ent);
+	return 0;
     }
 
-    return 1;
+    ent->lineno = lineno;
+    ent->next = *list;
+    *list = ent;
+
+    return 0;
 }
 
-/* Find the appropriate server to reach an ip */
-int __attribute__ ((visibility ("hidden")))
-pick_server(struct parsedfile *config, struct serverent **ent,
-	struct in_addr *ip, unsigned int port) {
-    struct netent *net;
-    char ipbuf[64];
-
-    show_msg(MSGDEBUG, "Picking appropriate server for %s\n", inet_ntoa(*ip));
-    *ent = (config->paths);
-    while (*ent != NULL) {
-	/* Go through all the servers looking for one */
-	/* with a path to this network                */
-	show_msg(MSGDEBUG, "Checking SOCKS server %s\n",
-		((*ent)->address ? (*ent)->address : "(No Address)"));
-	net = (*ent)->reachnets;
-	while (net != NULL) {
-	    strcpy(ipbuf, inet_ntoa(net->localip));
-	    show_msg(MSGDEBUG, "Server can reach %s/%s\n",
-		    ipbuf, inet_ntoa(net->localnet));
-	    if (((ip->s_addr & net->localnet.s_addr) ==
-			(net->localip.s_addr & net->localnet.s_addr)) &&
-		    (!net->startport ||
-		     ((net->startport <= port) && (net->endport >= port))))
-	    {
-		show_msg(MSGDEBUG, "This server can reach target\n");
-		/* Found the net, return */
-		return 0;
-	    }
-	    net = net->next;
+/* Construct a netent6 given a string like "2001:db8::/32" or, with */
+/* ports, "[2001:db8::]:portno[-portno]/32", returning the same     */
+/* codes as make_netent()                                           */
+static int make_netent6(char *value, struct netent6 **ent) {
+    char buf[200];
+    char *addr, *prefix, *ports = NULL, *endport, *badchar;
+    unsigned long len, startp = 0, endp = 0;
+    int i;
+
+    strncpy(buf, value, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    if ((prefix = strrchr(buf, '/')) == NULL)
+	return 1;
+    *prefix++ = '\0';
+    addr = buf;
+    if (*addr == '[') {
+	addr++;
+	if ((ports = strchr(addr, ']')) == NULL)
+	    return 1;
+	*ports++ = '\0';
+	if (*ports == '\0')
+	    ports = NULL;
+	else if (*ports++ != ':')
+	    return 1;
+    }
+
+    if ((*ent = malloc(sizeof(**ent))) == NULL)
+	exit(1);
+    memset(*ent, 0x0, sizeof(**ent));
+
+    if (inet_pton(AF_INET6, addr, &((*ent)->net)) != 1) {
+	free(*ent);
+	return 2;
+    }
+    len = strtoul(prefix, &badchar, 10);
+    if ((*prefix == '\0') || (*badchar != '\0') || (len > 128)) {
+	free(*ent);
+	return 3;
+    }
+    (*ent)->prefixlen = len;
+    for (i = len; i < 128; i++) {
+	if ((*ent)->net.s6_addr[i / 8] & (0x80 >> (i % 8))) {
+	    free(*ent);
+	    return 4;
 	}
-	(*ent) = (*ent)->next;
     }
 
-    *ent = &(config->defaultserver);
+    if (ports) {
+	if ((endport = strchr(ports, '-')) != NULL)
+	    *endport++ = '\0';
+	startp = strtoul(ports, &badchar, 10);
+	if (!startp || (*badchar != '\0') || (startp > 65535)) {
+	    free(*ent);
+	    return 5;
+	}
+	endp = startp;
+	if (endport) {
+	    endp = strtoul(endport, &badchar, 10);
+	    if (!endp || (*badchar != '\0') || (endp > 65535)) {
+		free(*ent);
+		return 6;
+	    }
+	    if (endp < startp) {
+		free(*ent);
+		return 7;
+	    }
+	}
+    }
+    (*ent)->startport = startp;
+    (*ent)->endport = endp;
 
     return 0;
 }
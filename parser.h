@@ -5,6 +5,21 @@
 
 #define _PARSER_H	1
 
+#include <stddef.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <route.h>
+
+#define CHAIN_MAXHOPS	8	/* Most servers a chain can go through */
+#define SERVER_HTTP	1	/* Type of an HTTP CONNECT proxy, given as */
+				/* server_type = http                     */
+
+/* Whether two stat results are for the same, unchanged file */
+#define SAME_FILE(a, b) (((a).st_ino == (b).st_ino) && \
+	((a).st_dev == (b).st_dev) && ((a).st_size == (b).st_size) && \
+	((a).st_mtim.tv_sec == (b).st_mtim.tv_sec) && \
+	((a).st_mtim.tv_nsec == (b).st_mtim.tv_nsec))
+
 /* Structure definitions */
 
 /* Structure representing one server specified in the config */
@@ -12,10 +27,15 @@ struct serverent {
 	int lineno; /* Line number in conf file this path started on */
 	char *address; /* Address/hostname of server */
 	int port; /* Port number of server */
-	int type; /* Type of server (4/5) */
+	int type; /* Type of server (4/5, or SERVER_HTTP) */
 	char *defuser; /* Default username for this socks server */
 	char *defpass; /* Default password for this socks server */
+	char *chain; /* For a chain, the servers reached through this one */
+		     /* in order, as "host:port,host:port"              */
 	struct netent *reachnets; /* Linked list of nets from this server */
+	struct netent6 *reachnets6; /* Linked list of IPv6 nets */
+	struct prefixfile *reachfiles; /* Lists of nets read from files */
+	struct domainent *reachdomains; /* Domains reached through this server */
 	struct serverent *next; /* Pointer to next server entry */
 };
 
@@ -25,21 +45,75 @@ struct netent {
    struct in_addr localnet; /* Mask for the network */
    unsigned long startport; /* Range of ports for the */
    unsigned long endport;   /* network                */
+   int lineno; /* Line number in conf file */
 	struct netent *next; /* Pointer to next network entry */
 };
 
+/* Structure representing an IPv6 network */
+struct netent6 {
+   struct in6_addr net; /* Base address of the network */
+   int prefixlen; /* Length of the network prefix */
+   unsigned long startport; /* Range of ports for the */
+   unsigned long endport;   /* network                */
+   int lineno; /* Line number in conf file */
+   struct netent6 *next; /* Pointer to next network entry */
+};
+
+/* Structure representing a domain from a reaches_domain or */
+/* local_domain directive, it matches the domain itself and  */
+/* every name under it                                       */
+struct domainent {
+   char *domain; /* Lower case, without a leading "*." or dots */
+   int lineno; /* Line number in conf file */
+   struct domainent *next; /* Pointer to next domain entry */
+};
+
+/* Structure representing a list of networks read from a file by */
+/* a reaches_file or local_file directive, the list is sorted,    */
+/* with duplicates removed and adjacent networks merged           */
+struct prefixfile {
+   char *filename; /* File the networks were read from */
+   int lineno; /* Line number of the directive */
+   struct routeent *ents; /* The networks */
+   uint32_t nents;
+   /* Statistics about reading the file */
+   unsigned long lines; /* Lines read */
+   unsigned long parsed; /* Networks parsed */
+   unsigned long invalid; /* Lines that could not be parsed */
+   unsigned long duplicates; /* Networks covered by another network */
+   unsigned long merged; /* Networks merged with a neighbour */
+   long usecs; /* Time taken to read the file */
+   struct prefixfile *next;
+};
+
+/* Structure representing a file of networks the configuration */
+/* was read from, as it was when it was read                    */
+struct srcfile {
+   char *filename;
+   struct stat st; /* Zeroed if the file could not be read */
+};
+
 /* Structure representing a complete parsed file */
 struct parsedfile {
    struct netent *localnets;
+   struct netent6 *localnets6;
+   struct prefixfile *localfiles;
+   struct domainent *localdomains;
    struct serverent defaultserver;
    struct serverent *paths;
    int fallback;
+   struct srcfile *files; /* Files named by reaches_file and local_file */
+   int nfiles;
+   struct routeindex index; /* Routing index for the lists above */
+   void *image; /* Mapped configuration cache this was loaded from */
+   size_t imagelen; /* Length of the mapped cache */
 };
 
 /* Functions provided by parser module */
 int read_config(char *, struct parsedfile *);
-int is_local(struct parsedfile *, struct in_addr *);
-int pick_server(struct parsedfile *, struct serverent **, struct in_addr *, unsigned int port);
+char *find_config(char *);
+void free_config(struct parsedfile *);
+int config_files_changed(struct parsedfile *);
 char *strsplit(char *separator, char **text, const char *search);
 
 #endif
@@ -0,0 +1,35 @@
+/* probes.h - USDT probes in libtsocks for perf, bpftrace and        */
+/* SystemTap, each is a single nop until a tracer attaches to it.    */
+/* Addresses are passed in network byte order (as bpftrace's ntop()  */
+/* wants them), ports in host byte order. Without --enable-probes    */
+/* (or sys/sdt.h) the arguments are evaluated and thrown away        */
+
+#ifndef _PROBES_H
+
+#define _PROBES_H	1
+
+#ifdef ENABLE_PROBES
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)	DTRACE_PROBE1(tsocks, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2(tsocks, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3(tsocks, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(tsocks, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)	DTRACE_PROBE5(tsocks, name, a, b, c, d, e)
+#else
+#define PROBE1(name, a)	((void) (a))
+#define PROBE2(name, a, b)	((void) (a), (void) (b))
+#define PROBE3(name, a, b, c)	((void) (a), (void) (b), (void) (c))
+#define PROBE4(name, a, b, c, d)	((void) (a), (void) (b), (void) (c), \
+				 (void) (d))
+#define PROBE5(name, a, b, c, d, e)	((void) (a), (void) (b), (void) (c), \
+				 (void) (d), (void) (e))
+#endif
+
+/* What route_connect() decided to do with a connection */
+#define PROBE_LOCAL	"local"
+#define PROBE_PROXY	"proxy"
+#define PROBE_FALLBACK	"fallback"
+#define PROBE_UNROUTABLE	"unroutable"
+
+#endif
@@ -0,0 +1,682 @@
+/*
+ * route.c    - Routing index for tsocks.conf local and reaches entries
+ */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <config.h>
+#include "common.h"
+#include "parser.h"
+
+/* Structure representing an IPv6 entry and its prefix length */
+/* while a table is built                                      */
+struct buildent6 {
+    struct routeent6 ent;
+    uint32_t len;
+};
+
+static int compare_ent(const void *, const void *);
+static int compare_ent6(const void *, const void *);
+static void mask6(uint8_t *, const uint8_t *, unsigned int);
+static int build_table6(struct routetable6 *, struct buildent6 *, uint32_t);
+static int build_index6(struct parsedfile *);
+static inline uint32_t hash_label(uint32_t, const char *, size_t);
+static uint32_t hash_domain(const char *);
+static const struct domainrule *find_domain(const struct domaintable *,
+	uint32_t, const char *);
+static int build_domains(struct parsedfile *);
+
+#define DOMAIN_BASIS	2166136261U	/* FNV-1a */
+#define DOMAIN_PRIME	16777619U
+
+/* Entries are ordered by netmask (most specific first), then by   */
+/* network and lastly by path so the first entry found for a given */
+/* network is always the one with the highest priority             */
+static int compare_ent(const void *a, const void *b) {
+    const struct routeent *x = a, *y = b;
+    uint32_t xmask = ntohl(x->mask), ymask = ntohl(y->mask);
+
+    if (xmask != ymask)
+	return (xmask > ymask ? -1 : 1);
+    if (x->net != y->net)
+	return (x->net < y->net ? -1 : 1);
+    if (x->path != y->path)
+	return (x->path < y->path ? -1 : 1);
+    if (x->startport != y->startport)
+	return (x->startport < y->startport ? -1 : 1);
+    return 0;
+}
+
+/* IPv6 entries are ordered the same way, by prefix length */
+static int compare_ent6(const void *a, const void *b) {
+    const struct buildent6 *x = a, *y = b;
+    int rc;
+
+    if (x->len != y->len)
+	return (x->len > y->len ? -1 : 1);
+    if ((rc = memcmp(x->ent.net, y->ent.net, sizeof(x->ent.net))))
+	return rc;
+    if (x->ent.path != y->ent.path)
+	return (x->ent.path < y->ent.path ? -1 : 1);
+    if (x->ent.startport != y->ent.startport)
+	return (x->ent.startport < y->ent.startport ? -1 : 1);
+    return 0;
+}
+
+/* Clear the bits of an address beyond a prefix length */
+static void mask6(uint8_t *dst, const uint8_t *src, unsigned int len) {
+    unsigned int i;
+
+    for (i = 0; i < 16; i++, len = (len > 8 ? len - 8 : 0))
+	dst[i] = src[i] & (len >= 8 ? 0xff : (uint8_t) (0xff00 >> len));
+}
+
+/* Build a table from an array of entries, the table takes */
+/* ownership of the (malloc()ed) array                     */
+int __attribute__ ((visibility ("hidden")))
+build_table(struct routetable *table, struct routeent *ents, uint32_t nents) {
+    uint32_t i, ngroups = 0;
+
+    memset(table, 0x0, sizeof(*table));
+    if (nents == 0) {
+	free(ents);
+	return 0;
+    }
+
+    qsort(ents, nents, sizeof(*ents), compare_ent);
+
+    for (i = 0; i < nents; i++) {
+	if ((i == 0) || (ents[i].mask != ents[i - 1].mask))
+	    ngroups++;
+    }
+
+    if ((table->groups = malloc(ngroups * sizeof(*table->groups))) == NULL) {
+	free(ents);
+	return -1;
+    }
+
+    ngroups = 0;
+    for (i = 0; i < nents; i++) {
+	if ((i == 0) || (ents[i].mask != ents[i - 1].mask)) {
+	    table->groups[ngroups].mask = ents[i].mask;
+	    table->groups[ngroups].first = i;
+	    table->groups[ngroups].count = 0;
+	    ngroups++;
+	}
+	table->groups[ngroups - 1].count++;
+    }
+
+    table->ngroups = ngroups;
+    table->nents = nents;
+    table->ents = ents;
+
+    return 0;
+}
+
+void __attribute__ ((visibility ("hidden")))
+free_table(struct routetable *table) {
+    free(table->groups);
+    free(table->ents);
+    memset(table, 0x0, sizeof(*table));
+}
+
+/* Build an IPv6 table, grouping the entries by prefix length, */
+/* the array of entries is freed                               */
+static int build_table6(struct routetable6 *table, struct buildent6 *bents,
+	uint32_t nents) {
+    uint32_t i, ngroups = 0;
+
+    memset(table, 0x0, sizeof(*table));
+    if (nents == 0) {
+	free(bents);
+	return 0;
+    }
+
+    qsort(bents, nents, sizeof(*bents), compare_ent6);
+
+    for (i = 0; i < nents; i++) {
+	if ((i == 0) || (bents[i].len != bents[i - 1].len))
+	    ngroups++;
+    }
+
+    if (((table->groups = malloc(ngroups * sizeof(*table->groups))) == NULL) ||
+	    ((table->ents = malloc(nents * sizeof(*table->ents))) == NULL)) {
+	free(table->groups);
+	table->groups = NULL;
+	free(bents);
+	return -1;
+    }
+
+    ngroups = 0;
+    for (i = 0; i < nents; i++) {
+	if ((i == 0) || (bents[i].len != bents[i - 1].len)) {
+	    table->groups[ngroups].mask = bents[i].len;
+	    table->groups[ngroups].first = i;
+	    table->groups[ngroups].count = 0;
+	    ngroups++;
+	}
+	table->groups[ngroups - 1].count++;
+	table->ents[i] = bents[i].ent;
+    }
+    free(bents);
+
+    table->ngroups = ngroups;
+    table->nents = nents;
+
+    return 0;
+}
+
+void __attribute__ ((visibility ("hidden")))
+free_table6(struct routetable6 *table) {
+    free(table->groups);
+    free(table->ents);
+    memset(table, 0x0, sizeof(*table));
+}
+
+/* Build the routing index for a parsed file from its linked lists */
+int __attribute__ ((visibility ("hidden")))
+build_index(struct parsedfile *config) {
+    struct routeindex *index = &(config->index);
+    struct serverent *server;
+    struct netent *net;
+    struct prefixfile *pf;
+    struct routeent *ents;
+    uint32_t nents, j;
+    int i;
+
+    memset(index, 0x0, sizeof(*index));
+
+    /* Local networks */
+    nents = 0;
+    for (net = config->localnets; net != NULL; net = net->next)
+	nents++;
+    for (pf = config->localfiles; pf != NULL; pf = pf->next)
+	nents += pf->nents;
+    if ((ents = malloc((nents ? nents : 1) * sizeof(*ents))) == NULL)
+	return -1;
+    nents = 0;
+    for (net = config->localnets; net != NULL; net = net->next) {
+	ents[nents].net = net->localip.s_addr & net->localnet.s_addr;
+	ents[nents].mask = net->localnet.s_addr;
+	ents[nents].startport = 0;
+	ents[nents].endport = 0;
+	ents[nents].path = -1;
+	nents++;
+    }
+    for (pf = config->localfiles; pf != NULL; pf = pf->next) {
+	memcpy(ents + nents, pf->ents, pf->nents * sizeof(*ents));
+	nents += pf->nents;
+    }
+    if (build_table(&(index->local), ents, nents))
+	return -1;
+
+    /* Paths, in the order they are tried */
+    for (server = config->paths; server != NULL; server = server->next)
+	index->npaths++;
+    if ((index->paths = malloc((index->npaths ? index->npaths : 1) *
+		    sizeof(*index->paths))) == NULL)
+	return -1;
+    nents = 0;
+    for (i = 0, server = config->paths; server != NULL; server = server->next) {
+	index->paths[i++] = server;
+	for (net = server->reachnets; net != NULL; net = net->next)
+	    nents++;
+	for (pf = server->reachfiles; pf != NULL; pf = pf->next)
+	    nents += pf->nents;
+    }
+
+    /* Reaches entries from all paths */
+    if ((ents = malloc((nents ? nents : 1) * sizeof(*ents))) == NULL)
+	return -1;
+    nents = 0;
+    for (i = 0; i < index->npaths; i++) {
+	for (net = index->paths[i]->reachnets; net != NULL; net = net->next) {
+	    ents[nents].net = net->localip.s_addr & net->localnet.s_addr;
+	    ents[nents].mask = net->localnet.s_addr;
+	    ents[nents].startport = (uint16_t) net->startport;
+	    ents[nents].endport = (uint16_t) net->endport;
+	    ents[nents].path = i;
+	    nents++;
+	}
+	for (pf = index->paths[i]->reachfiles; pf != NULL; pf = pf->next) {
+	    for (j = 0; j < pf->nents; j++) {
+		ents[nents] = pf->ents[j];
+		ents[nents].path = i;
+		nents++;
+	    }
+	}
+    }
+    if (build_table(&(index->reach), ents, nents) || build_index6(config) ||
+	    build_domains(config))
+	return -1;
+
+    show_msg(MSGDEBUG, "Routing index has %d local entries in %d groups, "
+	    "%d reaches entries in %d groups and %d domain rules\n",
+	    index->local.nents, index->local.ngroups,
+	    index->reach.nents, index->reach.ngroups, index->domains.nrules);
+
+    return 0;
+}
+
+/* Build the IPv6 tables of the index, once the paths are known */
+static int build_index6(struct parsedfile *config) {
+    struct routeindex *index = &(config->index);
+    struct buildent6 *bents;
+    struct netent6 *net;
+    uint32_t nents;
+    int i;
+
+    nents = 0;
+    for (net = config->localnets6; net != NULL; net = net->next)
+	nents++;
+    if ((bents = malloc((nents ? nents : 1) * sizeof(*bents))) == NULL)
+	return -1;
+    nents = 0;
+    for (net = config->localnets6; net != NULL; net = net->next) {
+	memset(&bents[nents], 0x0, sizeof(bents[nents]));
+	mask6(bents[nents].ent.net, net->net.s6_addr, net->prefixlen);
+	bents[nents].ent.path = -1;
+	bents[nents].len = net->prefixlen;
+	nents++;
+    }
+    if (build_table6(&(index->local6), bents, nents))
+	return -1;
+
+    nents = 0;
+    for (i = 0; i < index->npaths; i++) {
+	for (net = index->paths[i]->reachnets6; net != NULL; net = net->next)
+	    nents++;
+    }
+    if ((bents = malloc((nents ? nents : 1) * sizeof(*bents))) == NULL)
+	return -1;
+    nents = 0;
+    for (i = 0; i < index->npaths; i++) {
+	for (net = index->paths[i]->reachnets6; net != NULL; net = net->next) {
+	    memset(&bents[nents], 0x0, sizeof(bents[nents]));
+	    mask6(bents[nents].ent.net, net->net.s6_addr, net->prefixlen);
+	    bents[nents].ent.startport = (uint16_t) net->startport;
+	    bents[nents].ent.endport = (uint16_t) net->endport;
+	    bents[nents].ent.path = i;
+	    bents[nents].len = net->prefixlen;
+	    nents++;
+	}
+    }
+
+    return build_table6(&(index->reach6), bents, nents);
+}
+
+/* Fold a label into the hash of the labels to the right of it */
+static inline uint32_t hash_label(uint32_t hash, const char *label,
+	size_t len) {
+
+    while (len--) {
+	hash ^= (unsigned char) *label++;
+	hash *= DOMAIN_PRIME;
+    }
+    hash ^= '.';
+    hash *= DOMAIN_PRIME;
+
+    return hash;
+}
+
+/* Hash a domain a label at a time from the right, so the hash of */
+/* each suffix of a name follows from the one before              */
+static uint32_t hash_domain(const char *domain) {
+    const char *end = domain + strlen(domain), *label;
+    uint32_t hash = DOMAIN_BASIS;
+
+    for (;;) {
+	for (label = end; (label > domain) && (label[-1] != '.'); label--)
+	    ;
+	hash = hash_label(hash, label, end - label);
+	if (label == domain)
+	    break;
+	end = label - 1;
+    }
+
+    return hash;
+}
+
+/* Build the table of domain rules, a domain named more than once */
+/* keeps its first rule (local_domain ones come before paths)     */
+static int build_domains(struct parsedfile *config) {
+    struct routeindex *index = &(config->index);
+    struct domaintable *table = &(index->domains);
+    struct domainrule *rule;
+    struct domainent *dom;
+    uint32_t nrules = 0, nameslen = 0, hash, bucket;
+    size_t len;
+    int i;
+
+    memset(table, 0x0, sizeof(*table));
+    for (i = -1; i < index->npaths; i++) {
+	for (dom = (i < 0 ? config->localdomains : index->paths[i]->reachdomains);
+		dom != NULL; dom = dom->next) {
+	    nrules++;
+	    nameslen += strlen(dom->domain) + 1;
+	}
+    }
+    if (nrules == 0)
+	return 0;
+
+    for (table->nbuckets = 1; table->nbuckets < nrules * 2; )
+	table->nbuckets <<= 1;
+    if (((table->buckets = malloc(table->nbuckets * sizeof(uint32_t))) == NULL) ||
+	    ((table->rules = malloc(nrules * sizeof(*table->rules))) == NULL) ||
+	    ((table->names = malloc(nameslen)) == NULL)) {
+	free_domains(table);
+	return -1;
+    }
+    memset(table->buckets, 0xff, table->nbuckets * sizeof(uint32_t));
+
+    for (i = -1; i < index->npaths; i++) {
+	for (dom = (i < 0 ? config->localdomains : index->paths[i]->reachdomains);
+		dom != NULL; dom = dom->next) {
+	    hash = hash_domain(dom->domain);
+	    if (find_domain(table, hash, dom->domain))
+		continue;
+	    bucket = hash & (table->nbuckets - 1);
+	    rule = &(table->rules[table->nrules]);
+	    rule->hash = hash;
+	    rule->next = table->buckets[bucket];
+	    rule->name = table->nameslen;
+	    rule->path = i;
+	    table->buckets[bucket] = table->nrules++;
+	    len = strlen(dom->domain) + 1;
+	    memcpy(table->names + table->nameslen, dom->domain, len);
+	    table->nameslen += len;
+	}
+    }
+
+    return 0;
+}
+
+void __attribute__ ((visibility ("hidden")))
+free_domains(struct domaintable *table) {
+    free(table->buckets);
+    free(table->rules);
+    free(table->names);
+    memset(table, 0x0, sizeof(*table));
+}
+
+/* Find the rule for a domain given its hash */
+static const struct domainrule *find_domain(const struct domaintable *table,
+	uint32_t hash, const char *domain) {
+    const struct domainrule *rule;
+    uint32_t i;
+
+    for (i = table->buckets[hash & (table->nbuckets - 1)]; i != DOMAIN_NONE;
+	    i = rule->next) {
+	rule = &(table->rules[i]);
+	if ((rule->hash == hash) && !strcmp(table->names + rule->name, domain))
+	    return rule;
+    }
+
+    return NULL;
+}
+
+/* Returns the decision for a host name from the domain rules, the */
+/* most specific domain the name is in decides, or ROUTE_NOMATCH   */
+/* if it isn't in any                                              */
+int __attribute__ ((visibility ("hidden")))
+route_domain(const struct domaintable *table, const char *name) {
+    const struct domainrule *rule;
+    char lower[256], *end, *label;
+    uint32_t hash = DOMAIN_BASIS;
+    int best = ROUTE_NOMATCH;
+    size_t len;
+
+    if ((table->nrules == 0) || (name == NULL))
+	return ROUTE_NOMATCH;
+
+    for (len = 0; name[len] && (len < sizeof(lower) - 1); len++)
+	lower[len] = tolower((unsigned char) name[len]);
+    if (name[len])
+	return ROUTE_NOMATCH;
+    while (len && (lower[len - 1] == '.'))
+	len--;
+    if (len == 0)
+	return ROUTE_NOMATCH;
+    lower[len] = '\0';
+
+    /* Each suffix from the shortest, so later matches are more specific */
+    end = lower + len;
+    for (;;) {
+	for (label = end; (label > lower) && (label[-1] != '.'); label--)
+	    ;
+	hash = hash_label(hash, label, end - label);
+	if ((rule = find_domain(table, hash, label)) != NULL)
+	    best = (rule->path < 0 ? ROUTE_LOCAL : rule->path);
+	if (label == lower)
+	    break;
+	end = label - 1;
+    }
+
+    return best;
+}
+
+/* Find the first entry in a group with the given network */
+static inline const struct routeent *find_net(const struct routetable *table,
+	const struct routegroup *group, uint32_t net) {
+    const struct routeent *ents = table->ents + group->first;
+    uint32_t lo = 0, hi = group->count, mid;
+
+    while (lo < hi) {
+	mid = lo + ((hi - lo) >> 1);
+	if (ents[mid].net < net)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    if ((lo < group->count) && (ents[lo].net == net))
+	return &ents[lo];
+
+    return NULL;
+}
+
+/* Returns 1 if the ip is in any of the networks in the table */
+int __attribute__ ((visibility ("hidden")))
+route_local(const struct routetable *table, uint32_t ip) {
+    uint32_t i;
+
+    for (i = 0; i < table->ngroups; i++) {
+	if (find_net(table, &table->groups[i], ip & table->groups[i].mask))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* Returns the highest priority path that can reach the ip and */
+/* port or -1 if none can                                      */
+int __attribute__ ((visibility ("hidden")))
+route_reach(const struct routetable *table, uint32_t ip, unsigned int port) {
+    const struct routeent *ent, *end;
+    uint32_t i, net;
+    int best = -1;
+
+    for (i = 0; i < table->ngroups; i++) {
+	net = ip & table->groups[i].mask;
+	if ((ent = find_net(table, &table->groups[i], net)) == NULL)
+	    continue;
+	end = table->ents + table->groups[i].first + table->groups[i].count;
+	for (; (ent < end) && (ent->net == net); ent++) {
+	    if ((best != -1) && (ent->path >= best))
+		break;
+	    if (!ent->startport ||
+		    ((ent->startport <= port) && (ent->endport >= port))) {
+		best = ent->path;
+		break;
+	    }
+	}
+	if (best == 0)
+	    break;
+    }
+
+    return best;
+}
+
+/* Returns the decision libtsocks makes for an ip and port */
+int __attribute__ ((visibility ("hidden")))
+route_addr(const struct routeindex *index, uint32_t ip, unsigned int port) {
+    int path;
+
+    if (route_local(&(index->local), ip))
+	return ROUTE_LOCAL;
+    path = route_reach(&(index->reach), ip, port);
+    if ((path < 0) || (path >= index->npaths))
+	return ROUTE_DEFAULT;
+    return path;
+}
+
+/* Find the first entry in an IPv6 group with the given network */
+static inline const struct routeent6 *find_net6(const struct routetable6 *table,
+	const struct routegroup *group, const uint8_t *net) {
+    const struct routeent6 *ents = table->ents + group->first;
+    uint32_t lo = 0, hi = group->count, mid;
+
+    while (lo < hi) {
+	mid = lo + ((hi - lo) >> 1);
+	if (memcmp(ents[mid].net, net, 16) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    if ((lo < group->count) && !memcmp(ents[lo].net, net, 16))
+	return &ents[lo];
+
+    return NULL;
+}
+
+/* Returns 1 if the IPv6 address is in any of the networks in the table */
+int __attribute__ ((visibility ("hidden")))
+route_local6(const struct routetable6 *table, const uint8_t *ip) {
+    uint8_t net[16];
+    uint32_t i;
+
+    for (i = 0; i < table->ngroups; i++) {
+	mask6(net, ip, table->groups[i].mask);
+	if (find_net6(table, &table->groups[i], net))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* Returns the highest priority path that can reach the IPv6 address */
+/* and port or -1 if none can                                        */
+int __attribute__ ((visibility ("hidden")))
+route_reach6(const struct routetable6 *table, const uint8_t *ip,
+	unsigned int port) {
+    const struct routeent6 *ent, *end;
+    uint8_t net[16];
+    uint32_t i;
+    int best = -1;
+
+    for (i = 0; i < table->ngroups; i++) {
+	mask6(net, ip, table->groups[i].mask);
+	if ((ent = find_net6(table, &table->groups[i], net)) == NULL)
+	    continue;
+	end = table->ents + table->groups[i].first + table->groups[i].count;
+	for (; (ent < end) && !memcmp(ent->net, net, 16); ent++) {
+	    if ((best != -1) && (ent->path >= best))
+		break;
+	    if (!ent->startport ||
+		    ((ent->startport <= port) && (ent->endport >= port))) {
+		best = ent->path;
+		break;
+	    }
+	}
+	if (best == 0)
+	    break;
+    }
+
+    return best;
+}
+
+/* Returns the decision libtsocks makes for an IPv6 address and port, */
+/* IPv4-mapped addresses are routed as the IPv4 address               */
+int __attribute__ ((visibility ("hidden")))
+route_addr6(const struct routeindex *index, const struct in6_addr *ip,
+	unsigned int port) {
+    uint32_t ip4;
+    int path;
+
+    if (IN6_IS_ADDR_V4MAPPED(ip)) {
+	memcpy(&ip4, &(ip->s6_addr[12]), sizeof(ip4));
+	return route_addr(index, ip4, port);
+    }
+
+    if (route_local6(&(index->local6), ip->s6_addr))
+	return ROUTE_LOCAL;
+    path = route_reach6(&(index->reach6), ip->s6_addr, port);
+    if ((path < 0) || (path >= index->npaths))
+	return ROUTE_DEFAULT;
+    return path;
+}
+
+int __attribute__ ((visibility ("hidden")))
+is_local(struct parsedfile *config, struct in_addr *testip) {
+
+    if (route_local(&(config->index.local), testip->s_addr))
+	return 0;
+
+    return 1;
+}
+
+/* Find the appropriate server to reach an ip */
+int __attribute__ ((visibility ("hidden")))
+pick_server(struct parsedfile *config, struct serverent **ent,
+	struct in_addr *ip, unsigned int port) {
+    int path;
+
+    path = route_reach(&(config->index.reach), ip->s_addr, port);
+    if ((path >= 0) && (path < config->index.npaths))
+	*ent = config->index.paths[path];
+    else
+	*ent = &(config->defaultserver);
+
+    show_msg(MSGDEBUG, "Picked path %d (line %d) for port %d\n",
+	    path, (*ent)->lineno, port);
+
+    return 0;
+}
+
+int __attribute__ ((visibility ("hidden")))
+is_local6(struct parsedfile *config, struct in6_addr *testip) {
+
+    if (route_addr6(&(config->index), testip, 0) == ROUTE_LOCAL)
+	return 0;
+
+    return 1;
+}
+
+/* Find the appropriate server to reach an IPv6 address */
+int __attribute__ ((visibility ("hidden")))
+pick_server6(struct parsedfile *config, struct serverent **ent,
+	struct in6_addr *ip, unsigned int port) {
+    int path;
+
+    path = route_reach6(&(config->index.reach6), ip->s6_addr, port);
+    if ((path >= 0) && (path < config->index.npaths))
+	*ent = config->index.paths[path];
+    else
+	*ent = &(config->defaultserver);
+
+    show_msg(MSGDEBUG, "Picked path %d (line %d) for port %d\n",
+	    path, (*ent)->lineno, port);
+
+    return 0;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
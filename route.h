@@ -0,0 +1,116 @@
+/* route.h - Flattened routing index built from a parsed tsocks.conf */
+/* The index only uses offsets and fixed size types so it can be     */
+/* stored in (and used directly from) a mapped configuration cache   */
+
+#ifndef _ROUTE_H
+
+#define _ROUTE_H	1
+
+#include <stdint.h>
+
+/* Structure representing one local or reaches entry */
+struct routeent {
+   uint32_t net; /* Network (already masked), network byte order */
+   uint32_t mask; /* Mask for the network, network byte order */
+   uint16_t startport; /* Range of ports for the network, */
+   uint16_t endport;   /* 0 for any port                  */
+   int32_t path; /* Index of the path (priority), -1 for local */
+};
+
+/* Structure representing one IPv6 local or reaches entry */
+struct routeent6 {
+   uint8_t net[16]; /* Network (already masked) */
+   uint16_t startport; /* Range of ports for the network, */
+   uint16_t endport;   /* 0 for any port                  */
+   int32_t path; /* Index of the path (priority), -1 for local */
+};
+
+/* Structure representing all the entries sharing a netmask, the */
+/* entries are sorted by network and then by path                */
+struct routegroup {
+   uint32_t mask; /* Mask shared by the entries in the group */
+   uint32_t first; /* Index of the first entry in the group */
+   uint32_t count; /* Number of entries in the group */
+};
+
+/* Structure representing a table of entries grouped by netmask */
+struct routetable {
+   uint32_t ngroups;
+   uint32_t nents;
+   struct routegroup *groups;
+   struct routeent *ents;
+};
+
+/* Structure representing a table of IPv6 entries grouped by prefix */
+/* length, each group's mask is the length of its entries' prefixes  */
+struct routetable6 {
+   uint32_t ngroups;
+   uint32_t nents;
+   struct routegroup *groups;
+   struct routeent6 *ents;
+};
+
+/* Structure representing one reaches_domain or local_domain rule, */
+/* rules are chained in hash buckets by index                       */
+struct domainrule {
+   uint32_t hash; /* Hash of the domain's labels, last label first */
+   uint32_t next; /* Next rule in the bucket, DOMAIN_NONE for none */
+   uint32_t name; /* Offset of the domain in the table's names */
+   int32_t path; /* Index of the path (priority), -1 for local */
+};
+
+/* Structure representing the domain rules hashed by domain, a name */
+/* is matched by hashing its suffixes a label at a time from the    */
+/* right so it takes one lookup per label                           */
+struct domaintable {
+   uint32_t nbuckets; /* A power of 2, 0 when there are no rules */
+   uint32_t nrules;
+   uint32_t nameslen;
+   uint32_t *buckets; /* First rule in each bucket */
+   struct domainrule *rules;
+   char *names; /* The domains, each terminated by a NUL */
+};
+
+#define DOMAIN_NONE	0xffffffff
+
+/* Structure representing the complete index for a parsed file */
+struct routeindex {
+   struct routetable local; /* Local networks */
+   struct routetable reach; /* Reaches entries of all paths */
+   int npaths; /* Number of paths */
+   struct serverent **paths; /* Paths in priority (list) order */
+   struct routetable6 local6; /* Local IPv6 networks */
+   struct routetable6 reach6; /* IPv6 reaches entries of all paths */
+   struct domaintable domains; /* Domain rules of all paths */
+};
+
+/* Decisions returned by route_addr() other than path indexes */
+#define ROUTE_LOCAL	-2	/* Connect directly */
+#define ROUTE_DEFAULT	-1	/* Use the default server */
+#define ROUTE_NOMATCH	-3	/* No domain rule for the name, from */
+				/* route_domain()                    */
+
+struct parsedfile;
+struct serverent;
+struct in_addr;
+struct in6_addr;
+
+/* Functions provided by the route module */
+int build_table(struct routetable *, struct routeent *, uint32_t);
+int build_index(struct parsedfile *);
+int route_local(const struct routetable *, uint32_t);
+int route_reach(const struct routetable *, uint32_t, unsigned int);
+int route_addr(const struct routeindex *, uint32_t, unsigned int);
+void free_table(struct routetable *);
+int is_local(struct parsedfile *, struct in_addr *);
+int pick_server(struct parsedfile *, struct serverent **, struct in_addr *, unsigned int port);
+int route_local6(const struct routetable6 *, const uint8_t *);
+int route_reach6(const struct routetable6 *, const uint8_t *, unsigned int);
+int route_addr6(const struct routeindex *, const struct in6_addr *, unsigned int);
+void free_table6(struct routetable6 *);
+int is_local6(struct parsedfile *, struct in6_addr *);
+int pick_server6(struct parsedfile *, struct serverent **, struct in6_addr *, unsigned int port);
+int route_domain(const struct domaintable *, const char *);
+void free_domains(struct domaintable *);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * stats.c    - Per process counters kept in shared memory
+ *
+ * libtsocks counts what it does for each process in a small file in
+ * STATS_DIR (or $TSOCKS_STATS_DIR) which it maps shared. The file is
+ * created when the process first connects and removed when it exits.
+ * Counters are only ever added to with relaxed atomics so keeping them
+ * costs next to nothing, tsocks-stat maps the files of all the live
+ * processes to show what they are doing. Sockets connected through a
+ * server are tagged with it so that when the program closes them what
+ * TCP_INFO says about their traffic is added to the server's counters,
+ * which costs one getsockopt() per proxied socket and nothing on the
+ * data path. None of these functions change errno.
+ */
+
+#include <config.h>
+
+#ifdef ENABLE_STATS
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_LINUX_TCP_H
+#include <linux/tcp.h>
+#endif
+#include "common.h"
+#include "parser.h"
+#include "stats.h"
+
+/* The region for this process, NULL until it connects or if */
+/* statistics are turned off                                 */
+struct statsregion __attribute__ ((visibility ("hidden"))) *stats = NULL;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int opened = 0;
+static int registered = 0;
+static char statsfile[BUFSIZ];
+
+/* Tags for the sockets connected through a server, the index of */
+/* the server's slot + 1 in the top 16 bits and when the socket  */
+/* was connected (in ms) below. Pages are never freed            */
+static uint64_t *tags[STATS_TAGPAGES];
+
+static struct statsregion *map_region(int);
+static struct statspath *find_path(struct statsregion *, struct serverent *);
+static uint64_t *find_tag(int, int);
+static void stats_forked(void);
+static void stats_close(void) __attribute__((destructor));
+
+/* Create and map the region for this process, the first time it is */
+/* called. Setuid programs never get one, they would leave files    */
+/* wherever the user pointed them                                   */
+void __attribute__ ((visibility ("hidden")))
+stats_open(int suid) {
+    struct statsregion *region;
+    int saveerr;
+
+    if (__atomic_load_n(&opened, __ATOMIC_ACQUIRE))
+	return;
+
+    saveerr = errno;
+    pthread_mutex_lock(&stats_lock);
+    if (!opened) {
+	if (!registered) {
+	    pthread_atfork(NULL, NULL, stats_forked);
+	    registered = 1;
+	}
+	region = (suid ? NULL : map_region(getpid()));
+	__atomic_store_n(&stats, region, __ATOMIC_RELEASE);
+	__atomic_store_n(&opened, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    errno = saveerr;
+}
+
+static struct statsregion *map_region(int pid) {
+    struct statsregion *region;
+    struct stat st;
+    char *dir, *env;
+    ssize_t len;
+    int fd;
+
+    if ((env = getenv("TSOCKS_STATS")) && !atoi(env))
+	return NULL;
+    if (((dir = getenv("TSOCKS_STATS_DIR")) == NULL) || !*dir)
+	dir = STATS_DIR;
+
+    snprintf(statsfile, sizeof(statsfile), "%s/" STATS_PREFIX "%d"
+	    STATS_SUFFIX, dir, pid);
+    if ((fd = open(statsfile, O_RDWR | O_CREAT | O_NOFOLLOW, 0600)) < 0) {
+	show_msg(MSGDEBUG, "Could not create statistics file %s (%s)\n",
+		statsfile, strerror(errno));
+	return NULL;
+    }
+
+    /* A file left behind by an earlier process with our pid is */
+    /* reused, anybody else's is left alone                     */
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != geteuid()) || ftruncate(fd, 0) ||
+	    ftruncate(fd, sizeof(*region))) {
+	show_msg(MSGDEBUG, "Could not use statistics file %s\n", statsfile);
+	close(fd);
+	return NULL;
+    }
+
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+	unlink(statsfile);
+	return NULL;
+    }
+
+    region->version = STATS_VERSION;
+    region->size = sizeof(*region);
+    region->pid = pid;
+    region->started = time(NULL);
+    if ((fd = open("/proc/self/comm", O_RDONLY)) >= 0) {
+	len = read(fd, region->progname, sizeof(region->progname) - 1);
+	if ((len > 0) && (region->progname[len - 1] == '\n'))
+	    region->progname[len - 1] = '\0';
+	close(fd);
+    }
+    __atomic_store_n(&(region->magic), STATS_MAGIC, __ATOMIC_RELEASE);
+
+    show_msg(MSGDEBUG, "Keeping statistics in %s\n", statsfile);
+
+    return region;
+}
+
+/* The child of a fork counts in a region of its own, made when */
+/* it first connects                                            */
+static void stats_forked(void) {
+    int i;
+
+    if (stats)
+	munmap(stats, sizeof(*stats));
+    stats = NULL;
+    opened = 0;
+
+    /* The tags are for slots in the parent's region */
+    for (i = 0; i < STATS_TAGPAGES; i++) {
+	if (tags[i])
+	    memset(tags[i], 0x0, STATS_TAGPAGE * sizeof(uint64_t));
+    }
+}
+
+static void stats_close(void) {
+
+    if (stats && (stats->pid == getpid()))
+	unlink(statsfile);
+}
+
+/* Monotonic time in nanoseconds, 0 if nothing is being counted */
+uint64_t __attribute__ ((visibility ("hidden")))
+stats_clock(void) {
+    struct timespec ts;
+
+    if (!__atomic_load_n(&stats, __ATOMIC_ACQUIRE))
+	return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void __attribute__ ((visibility ("hidden")))
+stats_count(int counter) {
+    struct statsregion *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+
+    if (s)
+	__atomic_add_fetch(&(s->counters[counter]), 1, __ATOMIC_RELAXED);
+}
+
+/* Count a call to an interposed function which started at start */
+/* (from stats_clock()) and spent waited ns in the real function  */
+/* waiting for events                                             */
+void __attribute__ ((visibility ("hidden")))
+stats_call(int call, uint64_t start, uint64_t waited) {
+    struct statsregion *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    uint64_t now;
+
+    if (!s)
+	return;
+    __atomic_add_fetch(&(s->calls[call]), 1, __ATOMIC_RELAXED);
+    if (start && ((now = stats_clock()) > start + waited))
+	__atomic_add_fetch(&(s->callns[call]), now - start - waited,
+		__ATOMIC_RELAXED);
+}
+
+/* Count a request to a SOCKS server being made, completing or */
+/* failing, completed requests also count the time they took   */
+/* since started (from stats_clock())                          */
+void __attribute__ ((visibility ("hidden")))
+stats_request(struct serverent *path, int counter, uint64_t started) {
+    struct statsregion *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    struct statspath *slot;
+    uint64_t us;
+    int bucket;
+
+    if (!s)
+	return;
+    __atomic_add_fetch(&(s->counters[counter]), 1, __ATOMIC_RELAXED);
+
+    slot = find_path(s, path);
+    if (counter == STAT_PROXIED)
+	__atomic_add_fetch(&(slot->proxied), 1, __ATOMIC_RELAXED);
+    else if (counter == STAT_COMPLETED)
+	__atomic_add_fetch(&(slot->completed), 1, __ATOMIC_RELAXED);
+    else
+	__atomic_add_fetch(&(slot->failed), 1, __ATOMIC_RELAXED);
+
+    if ((counter == STAT_COMPLETED) && started) {
+	us = (stats_clock() - started) / 1000;
+	for (bucket = 0; (bucket < STATS_BUCKETS - 1) && (us >> (bucket + 1));
+		bucket++)
+	    /* Empty Loop */;
+	__atomic_add_fetch(&(s->handshake[bucket]), 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Count an error reply from a SOCKS server */
+void __attribute__ ((visibility ("hidden")))
+stats_socks_error(int version, int code) {
+    struct statsregion *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+
+    if (!s)
+	return;
+    if (version == 4)
+	__atomic_add_fetch(&(s->socks4errors[((code >= 91) && (code <= 93)) ?
+		    code - 90 : 0]), 1, __ATOMIC_RELAXED);
+    else
+	__atomic_add_fetch(&(s->socks5errors[((code >= 1) && (code <= 8)) ?
+		    code : 0]), 1, __ATOMIC_RELAXED);
+}
+
+/* Tag a socket the program connected through a server, or clear */
+/* the tag of one it is connecting again if path is NULL          */
+void __attribute__ ((visibility ("hidden")))
+stats_tag(int fd, struct serverent *path) {
+    struct statsregion *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    uint64_t *tag, ms;
+    int saveerr;
+
+    if (!s || ((tag = find_tag(fd, (path != NULL))) == NULL))
+	return;
+    if (!path) {
+	__atomic_store_n(tag, 0, __ATOMIC_RELAXED);
+	return;
+    }
+
+    saveerr = errno;
+    ms = stats_clock() / 1000000;
+    __atomic_store_n(tag, ((uint64_t) (find_path(s, path) - s->paths + 1) <<
+		48) | (ms & ((1ULL << 48) - 1)), __ATOMIC_RELAXED);
+    errno = saveerr;
+}
+
+/* The program is closing a socket, if it was connected through a */
+/* server add what TCP_INFO says about it to the server's counts  */
+void __attribute__ ((visibility ("hidden")))
+stats_closing(int fd) {
+    struct statsregion *s = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    struct statspath *slot;
+    uint64_t *tag, value, ms;
+#ifdef HAVE_LINUX_TCP_H
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+#endif
+    int saveerr;
+
+    if (!s || ((tag = find_tag(fd, 0)) == NULL) ||
+	    !(value = __atomic_exchange_n(tag, 0, __ATOMIC_RELAXED)))
+	return;
+
+    saveerr = errno;
+    slot = &(s->paths[(value >> 48) - 1]);
+    ms = (stats_clock() / 1000000 - value) & ((1ULL << 48) - 1);
+    __atomic_add_fetch(&(slot->closed), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(slot->lifetimems), ms, __ATOMIC_RELAXED);
+#ifdef HAVE_LINUX_TCP_H
+    memset(&info, 0x0, sizeof(info));
+    if (!getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len)) {
+	__atomic_add_fetch(&(slot->retransmits), info.tcpi_total_retrans,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&(slot->rttus), info.tcpi_rtt, __ATOMIC_RELAXED);
+	/* Older kernels return less */
+	if (len >= offsetof(struct tcp_info, tcpi_bytes_received) +
+		sizeof(info.tcpi_bytes_received)) {
+	    __atomic_add_fetch(&(slot->sent), info.tcpi_bytes_acked,
+		    __ATOMIC_RELAXED);
+	    __atomic_add_fetch(&(slot->received), info.tcpi_bytes_received,
+		    __ATOMIC_RELAXED);
+	}
+    }
+#endif
+    errno = saveerr;
+}
+
+/* Find the tag for a socket, making its page if asked to */
+static uint64_t *find_tag(int fd, int make) {
+    uint64_t *page, *expected = NULL;
+
+    if ((fd < 0) || (fd >= STATS_TAGPAGE * STATS_TAGPAGES))
+	return NULL;
+
+    if (((page = __atomic_load_n(&tags[fd / STATS_TAGPAGE],
+			__ATOMIC_ACQUIRE)) == NULL) && make) {
+	if ((page = calloc(STATS_TAGPAGE, sizeof(uint64_t))) == NULL)
+	    return NULL;
+	/* Another thread may have made it first */
+	if (!__atomic_compare_exchange_n(&tags[fd / STATS_TAGPAGE], &expected,
+		    page, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    free(page);
+	    page = expected;
+	}
+    }
+
+    return (page ? &page[fd % STATS_TAGPAGE] : NULL);
+}
+
+/* Find the slot counting a server, claiming a free one the first */
+/* time the server is used. A slot is claimed by setting its id   */
+/* to -1, the id is only published once the rest is filled in     */
+static struct statspath *find_path(struct statsregion *s,
+	struct serverent *path) {
+    struct statspath *slot;
+    int32_t id = path->lineno + 1, claim;
+    int i;
+
+    for (i = 0; i < STATS_PATHS - 1; i++) {
+	slot = &(s->paths[i]);
+	claim = 0;
+	if (__atomic_compare_exchange_n(&(slot->id), &claim, -1, 0,
+		    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+	    slot->type = path->type;
+	    slot->port = path->port;
+	    strncpy(slot->address, (path->address ? path->address : ""),
+		    sizeof(slot->address) - 1);
+	    __atomic_store_n(&(slot->id), id, __ATOMIC_RELEASE);
+	    return slot;
+	}
+	/* The server on a line can change when the configuration */
+	/* is reloaded                                            */
+	if ((claim == id) && (slot->type == path->type) &&
+		(slot->port == path->port) && path->address &&
+		!strncmp(slot->address, path->address, sizeof(slot->address) - 1))
+	    return slot;
+    }
+
+    return &(s->paths[STATS_PATHS - 1]);
+}
+
+#endif
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,113 @@
+/* stats.h - Counters libtsocks keeps for each process in a small */
+/* shared memory region, tsocks-stat reads and aggregates them    */
+
+#ifndef _STATS_H
+
+#define _STATS_H	1
+
+#include <stdint.h>
+
+#define STATS_MAGIC	0x54534b53	/* "SKST" */
+#define STATS_VERSION	2
+#define STATS_DIR	"/dev/shm"	/* Default directory for the regions */
+#define STATS_PREFIX	"tsocks-"	/* Regions are named tsocks-<pid>.stats */
+#define STATS_SUFFIX	".stats"
+#define STATS_PATHS	32	/* Servers counted separately, the last */
+				/* slot takes any beyond that            */
+#define STATS_BUCKETS	24	/* Handshake times, bucket n counts those */
+				/* under 2^(n+1) microseconds             */
+#define STATS_SOCKS4ERRORS	4	/* Results 91 to 93, others at 0 */
+#define STATS_SOCKS5ERRORS	9	/* Replies 1 to 8, others at 0 */
+#define STATS_TAGPAGE	1024	/* Sockets are tagged with their server */
+#define STATS_TAGPAGES	1024	/* in pages of this many descriptors,  */
+				/* sockets beyond them aren't tagged   */
+
+/* Counters for the connections seen */
+enum statscounter {
+   STAT_CONNECTS,	/* TCP connects seen */
+   STAT_LOCAL,		/* Made directly to local networks */
+   STAT_PROXIED,	/* Sent to a SOCKS server */
+   STAT_FALLBACKS,	/* Made directly as there was no server */
+   STAT_UNROUTABLE,	/* Refused as there was no valid server */
+   STAT_COMPLETED,	/* SOCKS handshakes completed */
+   STAT_FAILED,		/* SOCKS handshakes failed, for any reason */
+   STAT_BADREPLIES,	/* Replies that weren't SOCKS */
+   STAT_METHODREFUSED,	/* SOCKS 5 servers accepting none of our methods */
+   STAT_AUTHFAILED,	/* SOCKS 5 username/password rejected */
+   STAT_COUNTERS
+};
+
+/* Interposed calls, timed to show what libtsocks costs the program */
+enum statscall {
+   STAT_CONNECT,
+   STAT_SELECT,
+   STAT_POLL,
+   STAT_CLOSE,
+   STAT_GETPEERNAME,
+   STAT_CALLS
+};
+
+/* Structure representing the counters for one SOCKS server */
+struct statspath {
+   int32_t id; /* Line number of the path + 1, 0 for a free slot */
+   int32_t type;
+   int32_t port;
+   char address[68];
+   uint64_t proxied;
+   uint64_t completed;
+   uint64_t failed;
+   /* From TCP_INFO when the program closes a socket it connected */
+   /* through the server                                           */
+   uint64_t closed;
+   uint64_t sent; /* Bytes acknowledged by the server */
+   uint64_t received;
+   uint64_t retransmits; /* Segments */
+   uint64_t rttus; /* Sum of the smoothed round trip times */
+   uint64_t lifetimems; /* Sum of the times the sockets were open */
+};
+
+/* Structure representing a process's region, everything after the */
+/* header is only ever updated with relaxed atomic adds            */
+struct statsregion {
+   uint32_t magic; /* Written last, once the header is complete */
+   uint32_t version;
+   uint32_t size;
+   int32_t pid;
+   int64_t started; /* When counting started (time()) */
+   char progname[32];
+   uint64_t counters[STAT_COUNTERS];
+   uint64_t socks4errors[STATS_SOCKS4ERRORS];
+   uint64_t socks5errors[STATS_SOCKS5ERRORS];
+   uint64_t handshake[STATS_BUCKETS];
+   uint64_t calls[STAT_CALLS];
+   uint64_t callns[STAT_CALLS]; /* Time spent in libtsocks itself */
+   struct statspath paths[STATS_PATHS];
+};
+
+#ifdef ENABLE_STATS
+/* Functions provided by the stats module, the region is only */
+/* created when a process first connects                      */
+struct serverent;
+
+extern struct statsregion *stats;
+
+void stats_open(int suid);
+uint64_t stats_clock(void);
+void stats_count(int counter);
+void stats_call(int call, uint64_t start, uint64_t waited);
+void stats_request(struct serverent *path, int counter, uint64_t started);
+void stats_socks_error(int version, int code);
+void stats_tag(int fd, struct serverent *path);
+void stats_closing(int fd);
+#else
+#define stats_open(suid)
+#define stats_clock()	((uint64_t) 0)
+#define stats_count(counter)
+#define stats_call(call, start, waited)	((void) (start), (void) (waited))
+#define stats_request(path, counter, started)	((void) (started))
+#define stats_socks_error(version, code)
+#define stats_tag(fd, path)
+#define stats_closing(fd)
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * trace.c    - Timelines of SOCKS handshakes
+ *
+ * When TSOCKS_TRACE_FILE names a file libtsocks stamps each state a
+ * proxied connection goes through with CLOCK_MONOTONIC and, once the
+ * handshake has completed or failed, appends the timeline to the file
+ * as a binary record (see trace.h). Every TSOCKS_TRACE_SAMPLE'th
+ * request is traced and at most TSOCKS_TRACE_RATE a second, so tracing
+ * a busy program costs it little. Any number of processes can append
+ * to the same file, tsocks-trace converts it to the JSON trace viewers
+ * read. None of these functions change errno.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "common.h"
+#include "parser.h"
+#include "tsocks.h"
+
+/* Set once a trace file has been named, until then nothing is */
+/* stamped                                                     */
+int __attribute__ ((visibility ("hidden"))) tracing = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int opened = 0;
+static int tracefd = -1;
+static char tracefile[BUFSIZ];
+static unsigned int sample = TRACE_SAMPLE;
+static unsigned int rate = TRACE_RATE;
+static unsigned int requests = 0;
+static uint64_t window = 0; /* The second being rate limited */
+static unsigned int written = 0; /* Records written in that second */
+
+static int open_file(void);
+static uint64_t trace_clock(void);
+
+/* Read the trace settings, the first time it is called. Setuid */
+/* programs are never traced, they would write wherever the     */
+/* user pointed them                                            */
+void __attribute__ ((visibility ("hidden")))
+trace_open(int suid) {
+    char *env;
+    int saveerr;
+
+    if (__atomic_load_n(&opened, __ATOMIC_ACQUIRE))
+	return;
+
+    saveerr = errno;
+    pthread_mutex_lock(&trace_lock);
+    if (!opened) {
+	if (!suid && (env = getenv("TSOCKS_TRACE_FILE")) && *env) {
+	    strncpy(tracefile, env, sizeof(tracefile) - 1);
+	    if ((env = getenv("TSOCKS_TRACE_SAMPLE")) && (atoi(env) > 0))
+		sample = atoi(env);
+	    if ((env = getenv("TSOCKS_TRACE_RATE")) && (atoi(env) > 0))
+		rate = atoi(env);
+	    if (open_file() == 0) {
+		show_msg(MSGDEBUG, "Tracing 1 in %u requests, at most %u a "
+			"second, to %s\n", sample, rate, tracefile);
+		__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+	    }
+	}
+	__atomic_store_n(&opened, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    errno = saveerr;
+}
+
+/* trace_lock must be held */
+static int open_file(void) {
+    struct traceheader header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(tracefile, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW |
+		    O_CLOEXEC, 0600)) < 0) {
+	show_msg(MSGERR, "Could not open trace file %s (%s)\n", tracefile,
+		strerror(errno));
+	return -1;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+	show_msg(MSGERR, "Trace file %s is not a regular file\n", tracefile);
+	close(fd);
+	return -1;
+    }
+    if (st.st_size == 0) {
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+	    close(fd);
+	    return -1;
+	}
+    }
+    __atomic_store_n(&tracefd, fd, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static uint64_t trace_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Stamp the state the request is in if it has just entered it */
+void __attribute__ ((visibility ("hidden")))
+trace_stamp(struct connreq *conn) {
+    int saveerr, n = conn->nstamps;
+
+    if (n && (conn->stamps[n - 1].state == conn->state))
+	return;
+
+    saveerr = errno;
+    if (n == TRACE_STAMPS)
+	n--;
+    else
+	conn->nstamps++;
+    conn->stamps[n].state = conn->state;
+    conn->stamps[n].at = trace_clock();
+    errno = saveerr;
+}
+
+/* Write the timeline of a request that has completed or failed, if */
+/* it is sampled and the rate allows                                */
+void __attribute__ ((visibility ("hidden")))
+trace_request(struct connreq *conn) {
+    struct tracerecord record;
+    uint64_t now, second;
+    int saveerr, fd, i;
+
+    if (!tracing || !conn->nstamps)
+	return;
+    if (__atomic_fetch_add(&requests, 1, __ATOMIC_RELAXED) % sample)
+	return;
+
+    saveerr = errno;
+    now = trace_clock();
+    second = now / 1000000000;
+    if (__atomic_load_n(&window, __ATOMIC_RELAXED) != second) {
+	__atomic_store_n(&window, second, __ATOMIC_RELAXED);
+	__atomic_store_n(&written, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&written, 1, __ATOMIC_RELAXED) > rate) {
+	errno = saveerr;
+	return;
+    }
+
+    memset(&record, 0x0, sizeof(record));
+    record.size = TRACE_RECORDSIZE(conn->nstamps);
+    record.nstamps = conn->nstamps;
+    record.type = conn->path->type;
+    record.pid = getpid();
+    record.sockid = conn->sockid;
+    record.err = (conn->state == DONE ? 0 : conn->err);
+    record.lineno = conn->path->lineno;
+    record.family = conn->connaddr.sin_family;
+    if (record.family == AF_INET6)
+	memcpy(record.dstip6, &(conn->connaddr6), sizeof(record.dstip6));
+    else
+	record.dstip = conn->connaddr.sin_addr.s_addr;
+    record.dstport = conn->connaddr.sin_port;
+    record.serverip = conn->serveraddr.sin_addr.s_addr;
+    record.serverport = conn->serveraddr.sin_port;
+    record.start = conn->stamps[0].at;
+    for (i = 0; i < conn->nstamps; i++)
+	record.stamps[i] = ((uint64_t) conn->stamps[i].state << 56) |
+	    TRACE_OFFSET(conn->stamps[i].at - record.start);
+
+    /* The program may have closed the file, it is opened again */
+    if ((fd = __atomic_load_n(&tracefd, __ATOMIC_ACQUIRE)) < 0) {
+	pthread_mutex_lock(&trace_lock);
+	if (((fd = tracefd) < 0) && (open_file() == 0))
+	    fd = tracefd;
+	pthread_mutex_unlock(&trace_lock);
+    }
+    if ((fd >= 0) && (write(fd, &record, record.size) != record.size))
+	show_msg(MSGDEBUG, "Could not write to trace file %s\n", tracefile);
+    errno = saveerr;
+}
+
+/* Called when the program closes a file descriptor, so the trace */
+/* file is not written to once the descriptor is reused            */
+void __attribute__ ((visibility ("hidden")))
+trace_closed(int fd) {
+
+    if (fd == __atomic_load_n(&tracefd, __ATOMIC_ACQUIRE))
+	__atomic_compare_exchange_n(&tracefd, &fd, -1, 0, __ATOMIC_ACQ_REL,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,72 @@
+/* trace.h - Timelines of SOCKS handshakes, libtsocks appends them */
+/* to a trace file which tsocks-trace converts for trace viewers   */
+
+#ifndef _TRACE_H
+
+#define _TRACE_H	1
+
+#include <stdint.h>
+
+#define TRACE_MAGIC	0x54535452	/* "RTST" */
+#define TRACE_VERSION	2
+#define TRACE_STAMPS	24	/* States kept for a request, the last */
+				/* slot is reused once they run out    */
+#define TRACE_SAMPLE	1	/* Default, trace 1 in this many requests */
+#define TRACE_RATE	100	/* Default, at most this many a second */
+
+/* Structure representing a state a request entered and when */
+struct tracestamp {
+   uint64_t at; /* CLOCK_MONOTONIC ns */
+   int state;
+};
+
+/* The trace file starts with a header (each process that opens an */
+/* empty file writes one, so one can turn up between records too)  */
+/* and is followed by records, each written with a single write()  */
+struct traceheader {
+   uint32_t magic;
+   uint32_t version;
+};
+
+/* Structure representing a request's timeline in the trace file, */
+/* addresses and ports are in network byte order                   */
+struct tracerecord {
+   uint16_t size; /* Of the record including the stamps */
+   uint8_t nstamps;
+   uint8_t type; /* SOCKS version */
+   int32_t pid;
+   int32_t sockid;
+   int32_t err; /* 0 if the request completed */
+   int32_t lineno; /* Of the path used, 0 for the default server */
+   uint32_t dstip; /* 0 for an IPv6 destination */
+   uint32_t serverip;
+   uint16_t dstport;
+   uint16_t serverport;
+   uint8_t dstip6[16]; /* The destination if family is AF_INET6 */
+   uint32_t family; /* Of the destination */
+   uint32_t pad;
+   uint64_t start; /* CLOCK_MONOTONIC ns when the request was made */
+   uint64_t stamps[TRACE_STAMPS]; /* State << 56 | ns since start, */
+				  /* only nstamps are written      */
+};
+
+#define TRACE_STATE(stamp)	((int) ((stamp) >> 56))
+#define TRACE_OFFSET(stamp)	((stamp) & ((1ULL << 56) - 1))
+#define TRACE_RECORDSIZE(n)	(sizeof(struct tracerecord) - \
+				 (TRACE_STAMPS - (n)) * sizeof(uint64_t))
+
+/* Functions provided by the trace module, nothing is stamped or */
+/* written unless TSOCKS_TRACE_FILE names a file                 */
+struct connreq;
+
+extern int tracing;
+
+void trace_open(int suid);
+void trace_stamp(struct connreq *conn);
+void trace_request(struct connreq *conn);
+void trace_closed(int fd);
+
+/* Stamp the request if it has changed state */
+#define trace_state(conn)	do { if (tracing) trace_stamp(conn); } while (0)
+
+#endif
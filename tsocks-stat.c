@@ -0,0 +1,479 @@
+/*
+ * TSOCKS-STAT - Part of the tsocks package
+ * This utility shows what libtsocks is doing in all the processes it
+ * is loaded into, like top. It reads the counters each process keeps
+ * in shared memory (see stats.h) and shows connection, failure and
+ * handshake rates for each process, each SOCKS server and in total.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Global configuration variables */
+char *progname = "tsocks-stat";	   /* Name for error msgs      */
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include <common.h>
+#include <parser.h>
+#include <stats.h>
+
+/* Structure representing a process seen in an earlier frame */
+struct proc {
+    struct statsregion last; /* Counters when last seen */
+    double lasttime;
+    int seen;
+    double rates[STAT_COUNTERS];
+    double p50, p99; /* Handshake times in this frame, in ms */
+    double busy; /* Fraction of the time spent in libtsocks */
+    double elapsed; /* Seconds this frame covers */
+    struct statspath paths[STATS_PATHS]; /* Server counts in this frame */
+    struct proc *next;
+};
+
+/* Structure representing the counters for a server, summed over */
+/* all the processes                                              */
+struct server {
+    char label[96];
+    int type;
+    double proxied, completed, failed, closed, sent, received, retransmits;
+    uint64_t nclosed, rttus, lifetimems; /* For the averages */
+    struct server *next;
+};
+
+static char *callnames[STAT_CALLS] = { "connect", "select", "poll", "close",
+	"getpeername" };
+static char *socks5errors[STATS_SOCKS5ERRORS] = { "other", "general failure",
+	"denied by rule", "network unreachable", "host unreachable",
+	"connection refused", "TTL expired", "command not supported",
+	"address type not supported" };
+static char *socks4errors[STATS_SOCKS4ERRORS] = { "other", "rejected",
+	"identd unreachable", "identd mismatch" };
+
+static struct proc *procs = NULL;
+
+static double now(void);
+static int read_region(char *, struct statsregion *);
+static void read_all(char *, int);
+static void percentiles(uint64_t *, uint64_t *, double *, double *);
+static struct server *find_server(struct server **, struct statspath *);
+static void show(int, double);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: [-d directory] [-i seconds] [-n frames] [-b] "
+	"[-p pid]";
+    char *dir = STATS_DIR;
+    double interval = 1, start;
+    struct timespec delay;
+    int frames = 0, batch = 0, pid = 0, frame, c;
+
+    if (getenv("TSOCKS_STATS_DIR") && *getenv("TSOCKS_STATS_DIR"))
+	dir = getenv("TSOCKS_STATS_DIR");
+
+    while ((c = getopt(argc, argv, "d:i:n:bp:")) != -1) {
+	switch (c) {
+	    case 'd':
+		dir = optarg;
+		break;
+	    case 'i':
+		if ((interval = atof(optarg)) <= 0) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		break;
+	    case 'n':
+		frames = atoi(optarg);
+		break;
+	    case 'b':
+		batch = 1;
+		break;
+	    case 'p':
+		pid = atoi(optarg);
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    if (!isatty(1))
+	batch = 1;
+
+    for (frame = 0; !frames || (frame < frames); frame++) {
+	if (frame) {
+	    delay.tv_sec = (time_t) interval;
+	    delay.tv_nsec = (long) ((interval - delay.tv_sec) * 1e9);
+	    nanosleep(&delay, NULL);
+	}
+	start = now();
+	read_all(dir, pid);
+	if (!batch)
+	    printf("\033[H\033[2J");
+	show(frame, start);
+	fflush(stdout);
+    }
+
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copy the counters from a region, returns 0 if it belongs to a live */
+/* process. Regions left behind by processes that have gone are       */
+/* removed if we can                                                  */
+static int read_region(char *filename, struct statsregion *snap) {
+    struct statsregion *region;
+    struct stat st;
+    uint64_t *from, *to;
+    size_t i, j;
+    int fd, rc = -1;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+	return -1;
+    if (fstat(fd, &st) || (st.st_size != sizeof(*region))) {
+	close(fd);
+	return -1;
+    }
+    region = mmap(NULL, sizeof(*region), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+	return -1;
+
+    if ((__atomic_load_n(&(region->magic), __ATOMIC_ACQUIRE) == STATS_MAGIC) &&
+	    (region->version == STATS_VERSION) &&
+	    (region->size == sizeof(*region))) {
+	if (kill(region->pid, 0) && (errno == ESRCH)) {
+	    unlink(filename);
+	} else {
+	    /* Everything between the header and the servers is counters */
+	    memcpy(snap, region, sizeof(*snap));
+	    from = region->counters;
+	    to = snap->counters;
+	    for (i = 0; &from[i] < (uint64_t *) region->paths; i++)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	    /* and so is everything in a server from proxied on */
+	    for (i = 0; i < STATS_PATHS; i++) {
+		snap->paths[i].id = __atomic_load_n(&(region->paths[i].id),
+			__ATOMIC_ACQUIRE);
+		from = &(region->paths[i].proxied);
+		to = &(snap->paths[i].proxied);
+		for (j = 0; &from[j] < (uint64_t *) &(region->paths[i + 1]); j++)
+		    to[j] = __atomic_load_n(&from[j], __ATOMIC_RELAXED);
+	    }
+	    snap->progname[sizeof(snap->progname) - 1] = '\0';
+	    rc = 0;
+	}
+    }
+    munmap(region, sizeof(*region));
+
+    return rc;
+}
+
+/* Read every live region and work out each process's rates since */
+/* it was last seen (or since it started counting)                 */
+static void read_all(char *dir, int pid) {
+    char filename[BUFSIZ];
+    struct statsregion snap;
+    struct proc *proc, **prev;
+    struct dirent *ent;
+    uint64_t handshake[STATS_BUCKETS], callns, *from, *to;
+    double t, elapsed;
+    size_t plen = strlen(STATS_PREFIX), slen = strlen(STATS_SUFFIX), len;
+    DIR *d;
+    int i, j;
+
+    for (proc = procs; proc; proc = proc->next)
+	proc->seen = 0;
+
+    if ((d = opendir(dir)) == NULL) {
+	show_msg(MSGERR, "Could not read %s (%s)\n", dir, strerror(errno));
+	exit(1);
+    }
+
+    while ((ent = readdir(d)) != NULL) {
+	len = strlen(ent->d_name);
+	if ((len <= plen + slen) || strncmp(ent->d_name, STATS_PREFIX, plen) ||
+		strcmp(ent->d_name + len - slen, STATS_SUFFIX))
+	    continue;
+	snprintf(filename, sizeof(filename), "%s/%s", dir, ent->d_name);
+	if (read_region(filename, &snap) || (pid && (snap.pid != pid)))
+	    continue;
+	t = now();
+
+	for (proc = procs; proc; proc = proc->next) {
+	    if ((proc->last.pid == snap.pid) &&
+		    (proc->last.started == snap.started))
+		break;
+	}
+	if (proc == NULL) {
+	    /* The first frame covers everything since it started */
+	    if ((proc = malloc(sizeof(*proc))) == NULL) {
+		show_msg(MSGERR, "Could not allocate memory for process\n");
+		exit(1);
+	    }
+	    memset(proc, 0x0, sizeof(*proc));
+	    proc->last.pid = snap.pid;
+	    proc->last.started = snap.started;
+	    proc->lasttime = snap.started;
+	    proc->next = procs;
+	    procs = proc;
+	}
+
+	if ((elapsed = t - proc->lasttime) < 0.001)
+	    elapsed = 0.001;
+	for (i = 0; i < STAT_COUNTERS; i++)
+	    proc->rates[i] = (snap.counters[i] - proc->last.counters[i]) /
+		elapsed;
+	for (i = 0; i < STATS_BUCKETS; i++)
+	    handshake[i] = snap.handshake[i] - proc->last.handshake[i];
+	percentiles(handshake, NULL, &(proc->p50), &(proc->p99));
+	for (i = 0, callns = 0; i < STAT_CALLS; i++)
+	    callns += snap.callns[i] - proc->last.callns[i];
+	proc->busy = callns / (elapsed * 1e9);
+	proc->elapsed = elapsed;
+	memcpy(proc->paths, snap.paths, sizeof(proc->paths));
+	for (i = 0; i < STATS_PATHS; i++) {
+	    from = &(proc->last.paths[i].proxied);
+	    to = &(proc->paths[i].proxied);
+	    for (j = 0; &to[j] < (uint64_t *) &(proc->paths[i + 1]); j++)
+		to[j] -= from[j];
+	}
+
+	/* Keep the counters to work out the next frame's rates */
+	memcpy(&(proc->last), &snap, sizeof(snap));
+	proc->lasttime = t;
+	proc->seen = 1;
+    }
+    closedir(d);
+
+    /* Forget the processes that have gone */
+    for (prev = &procs; (proc = *prev) != NULL; ) {
+	if (!proc->seen) {
+	    *prev = proc->next;
+	    free(proc);
+	} else
+	    prev = &(proc->next);
+    }
+}
+
+/* Work out the median and 99th percentile of a histogram (less */
+/* another one if given) as the upper bound of the bucket, in ms */
+static void percentiles(uint64_t *buckets, uint64_t *less, double *p50,
+	double *p99) {
+    uint64_t total = 0, sum = 0, n;
+    int i;
+
+    *p50 = *p99 = -1;
+    for (i = 0; i < STATS_BUCKETS; i++)
+	total += buckets[i] - (less ? less[i] : 0);
+    if (!total)
+	return;
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+	n = buckets[i] - (less ? less[i] : 0);
+	sum += n;
+	if ((*p50 < 0) && (sum * 2 >= total))
+	    *p50 = (2 << i) / 1000.0;
+	if ((*p99 < 0) && (sum * 100 >= total * 99))
+	    *p99 = (2 << i) / 1000.0;
+    }
+}
+
+static struct server *find_server(struct server **servers,
+	struct statspath *path) {
+    struct server *server;
+    char label[96];
+
+    if (path->id > 0)
+	snprintf(label, sizeof(label), "%.68s:%d", path->address, path->port);
+    else
+	strcpy(label, "(others)");
+
+    for (server = *servers; server; server = server->next) {
+	if (!strcmp(server->label, label) && (server->type == path->type))
+	    return server;
+    }
+
+    if ((server = malloc(sizeof(*server))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for server\n");
+	exit(1);
+    }
+    memset(server, 0x0, sizeof(*server));
+    strcpy(server->label, label);
+    server->type = path->type;
+    server->next = *servers;
+    *servers = server;
+
+    return server;
+}
+
+static void show(int frame, double start) {
+    struct server *servers = NULL, *server;
+    struct proc *proc, *best, **order;
+    struct statspath *path;
+    double totals[STAT_COUNTERS], busy = 0, ns;
+    uint64_t socks4[STATS_SOCKS4ERRORS], socks5[STATS_SOCKS5ERRORS];
+    uint64_t calls[STAT_CALLS], callns[STAT_CALLS];
+    char timestring[32], type[8];
+    time_t t = (time_t) start;
+    int nprocs = 0, i, j;
+
+    for (proc = procs; proc; proc = proc->next)
+	nprocs++;
+    memset(totals, 0x0, sizeof(totals));
+    memset(socks4, 0x0, sizeof(socks4));
+    memset(socks5, 0x0, sizeof(socks5));
+    memset(calls, 0x0, sizeof(calls));
+    memset(callns, 0x0, sizeof(callns));
+
+    strftime(timestring, sizeof(timestring), "%Y-%m-%d %H:%M:%S",
+	    localtime(&t));
+    printf("tsocks-stat: %d process%s at %s, rates per second %s\n\n", nprocs,
+	    (nprocs == 1 ? "" : "es"), timestring,
+	    (frame ? "since the last frame" : "since each process started"));
+
+    /* Busiest processes first */
+    if ((order = malloc((nprocs + 1) * sizeof(*order))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for processes\n");
+	exit(1);
+    }
+    for (i = 0, proc = procs; proc; proc = proc->next)
+	order[i++] = proc;
+    for (i = 0; i < nprocs; i++) {
+	for (j = i + 1, best = order[i]; j < nprocs; j++) {
+	    if (order[j]->rates[STAT_CONNECTS] > best->rates[STAT_CONNECTS]) {
+		order[i] = order[j];
+		order[j] = best;
+		best = order[i];
+	    }
+	}
+    }
+
+    printf("%7s %-15s %9s %9s %9s %9s %8s %8s %6s\n", "PID", "PROGRAM",
+	    "CONNECT", "PROXIED", "LOCAL", "FAILED", "P50 MS", "P99 MS", "BUSY%");
+    for (i = 0; i < nprocs; i++) {
+	proc = order[i];
+	printf("%7d %-15.15s %9.1f %9.1f %9.1f %9.1f ", proc->last.pid,
+		(proc->last.progname[0] ? proc->last.progname : "?"),
+		proc->rates[STAT_CONNECTS], proc->rates[STAT_PROXIED],
+		proc->rates[STAT_LOCAL], proc->rates[STAT_FAILED]);
+	if (proc->p50 < 0)
+	    printf("%8s %8s", "-", "-");
+	else
+	    printf("%8.3f %8.3f", proc->p50, proc->p99);
+	printf(" %6.2f\n", proc->busy * 100);
+
+	for (j = 0; j < STAT_COUNTERS; j++)
+	    totals[j] += proc->rates[j];
+	busy += proc->busy;
+	for (j = 0; j < STATS_SOCKS4ERRORS; j++)
+	    socks4[j] += proc->last.socks4errors[j];
+	for (j = 0; j < STATS_SOCKS5ERRORS; j++)
+	    socks5[j] += proc->last.socks5errors[j];
+	for (j = 0; j < STAT_CALLS; j++) {
+	    calls[j] += proc->last.calls[j];
+	    callns[j] += proc->last.callns[j];
+	}
+    }
+    free(order);
+    printf("%7s %-15s %9.1f %9.1f %9.1f %9.1f %8s %8s %6.2f\n\n", "", "TOTAL",
+	    totals[STAT_CONNECTS], totals[STAT_PROXIED], totals[STAT_LOCAL],
+	    totals[STAT_FAILED], "", "", busy * 100);
+
+    /* The servers every process has used, the traffic and round */
+    /* trip times are for the sockets closed in this frame        */
+    for (proc = procs; proc; proc = proc->next) {
+	for (i = 0; i < STATS_PATHS; i++) {
+	    if (!proc->last.paths[i].proxied)
+		continue;
+	    path = &(proc->paths[i]);
+	    server = find_server(&servers, path);
+	    server->proxied += path->proxied / proc->elapsed;
+	    server->completed += path->completed / proc->elapsed;
+	    server->failed += path->failed / proc->elapsed;
+	    server->closed += path->closed / proc->elapsed;
+	    server->sent += path->sent / proc->elapsed;
+	    server->received += path->received / proc->elapsed;
+	    server->retransmits += path->retransmits / proc->elapsed;
+	    server->nclosed += path->closed;
+	    server->rttus += path->rttus;
+	    server->lifetimems += path->lifetimems;
+	}
+    }
+    printf("%-26s %4s %8s %8s %8s %8s %9s %9s %7s %7s %7s\n", "SERVER", "TYPE",
+	    "PROXIED", "DONE", "FAILED", "CLOSED", "SENT KB", "RECV KB",
+	    "RTT MS", "RETRANS", "LIFE S");
+    while ((server = servers) != NULL) {
+	if (server->type == SERVER_HTTP)
+	    strcpy(type, "http");
+	else
+	    snprintf(type, sizeof(type), "%d", server->type);
+	printf("%-26.26s %4s %8.1f %8.1f %8.1f %8.1f %9.1f %9.1f ",
+		server->label, type, server->proxied,
+		server->completed, server->failed, server->closed,
+		server->sent / 1024, server->received / 1024);
+	if (server->nclosed)
+	    printf("%7.2f %7.1f %7.1f\n", (double) server->rttus /
+		    server->nclosed / 1000, server->retransmits,
+		    (double) server->lifetimems / server->nclosed / 1000);
+	else
+	    printf("%7s %7.1f %7s\n", "-", server->retransmits, "-");
+	servers = server->next;
+	free(server);
+    }
+
+    printf("\nFAILURES (rates) fallbacks %.1f unroutable %.1f bad replies %.1f "
+	    "methods refused %.1f authentication %.1f\n",
+	    totals[STAT_FALLBACKS], totals[STAT_UNROUTABLE],
+	    totals[STAT_BADREPLIES], totals[STAT_METHODREFUSED],
+	    totals[STAT_AUTHFAILED]);
+    for (i = 1; i <= STATS_SOCKS5ERRORS; i++) {
+	if (socks5[i % STATS_SOCKS5ERRORS])
+	    printf("  SOCKS 5 %-28s %12llu\n", socks5errors[i % STATS_SOCKS5ERRORS],
+		    (unsigned long long) socks5[i % STATS_SOCKS5ERRORS]);
+    }
+    for (i = 1; i <= STATS_SOCKS4ERRORS; i++) {
+	if (socks4[i % STATS_SOCKS4ERRORS])
+	    printf("  SOCKS 4 %-28s %12llu\n", socks4errors[i % STATS_SOCKS4ERRORS],
+		    (unsigned long long) socks4[i % STATS_SOCKS4ERRORS]);
+    }
+
+    printf("\n%-12s %14s %12s\n", "CALL (totals)", "CALLS", "US/CALL");
+    for (i = 0; i < STAT_CALLS; i++) {
+	ns = (calls[i] ? (double) callns[i] / calls[i] : 0);
+	printf("%-12s %14llu %12.2f\n", callnames[i],
+		(unsigned long long) calls[i], ns / 1000);
+    }
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
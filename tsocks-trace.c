@@ -0,0 +1,237 @@
+/*
+ * TSOCKS-TRACE - Part of the tsocks package
+ * This utility converts the handshake timelines libtsocks writes when
+ * TSOCKS_TRACE_FILE is set (see trace.h) to the JSON trace event
+ * format Chrome's about:tracing and Perfetto read. Each connection is
+ * shown on the track of its process and file descriptor, as a span for
+ * the whole handshake containing a span for each phase of it (the TCP
+ * connect to the server, method negotiation, authentication and the
+ * connect request) and, with -a, a span for every state it went
+ * through.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Global configuration variables */
+char *progname = "tsocks-trace";	   /* Name for error msgs      */
+
+/* Header Files */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <common.h>
+#include <tsocks.h>
+
+static char *statenames[] = { "UNSTARTED", "CONNECTING", "CONNECTED",
+	"SENDING", "RECEIVING", "SENTV4REQ", "GOTV4REQ", "SENTV5METHOD",
+	"GOTV5METHOD", "SENTV5AUTH", "GOTV5AUTH", "SENTV5CONNECT",
+	"GOTV5CONNECT", "DONE", "FAILED", "SENTHTTPCONNECT",
+	"GOTHTTPCONNECT" };
+
+static int events = 0;
+
+static int convert(FILE *, char *, FILE *, int);
+static void span(FILE *, struct tracerecord *, char *, uint64_t, uint64_t,
+	char *);
+static char *statename(int);
+
+int main(int argc, char *argv[]) {
+    char *usage = "Usage: [-a] [-o output] tracefile...";
+    char *output = NULL;
+    FILE *in, *out = stdout;
+    int allstates = 0, failed = 0, c, i;
+
+    while ((c = getopt(argc, argv, "ao:")) != -1) {
+	switch (c) {
+	    case 'a':
+		allstates = 1;
+		break;
+	    case 'o':
+		output = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    if (optind == argc) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+
+    if (output && ((out = fopen(output, "w")) == NULL)) {
+	show_msg(MSGERR, "Could not write %s (%s)\n", output, strerror(errno));
+	exit(1);
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (i = optind; i < argc; i++) {
+	if ((in = fopen(argv[i], "r")) == NULL) {
+	    show_msg(MSGERR, "Could not read %s (%s)\n", argv[i],
+		    strerror(errno));
+	    failed = 1;
+	    continue;
+	}
+	failed |= convert(in, argv[i], out, allstates);
+	fclose(in);
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out)) {
+	show_msg(MSGERR, "Could not write %s (%s)\n", (output ? output :
+		    "output"), strerror(errno));
+	failed = 1;
+    }
+
+    return failed;
+}
+
+/* Convert the records in a trace file, the phase a state belongs */
+/* to is only known once the request moves on to the next message */
+static int convert(FILE *in, char *filename, FILE *out, int allstates) {
+    struct tracerecord record;
+    struct traceheader *header = (struct traceheader *) &record;
+    char *phase, result[64];
+    uint64_t phasestart, at, next;
+    size_t fixed = TRACE_RECORDSIZE(0);
+    int i, state;
+
+    while (fread(&record, sizeof(*header), 1, in) == 1) {
+	/* Another process started the file at the same time */
+	if (header->magic == TRACE_MAGIC) {
+	    if (header->version != TRACE_VERSION) {
+		show_msg(MSGERR, "%s is version %d, not %d\n", filename,
+			header->version, TRACE_VERSION);
+		return 1;
+	    }
+	    continue;
+	}
+	if ((record.size < fixed) || (record.nstamps == 0) ||
+		(record.nstamps > TRACE_STAMPS) ||
+		(record.size != TRACE_RECORDSIZE(record.nstamps)) ||
+		(fread((char *) &record + sizeof(*header),
+		       record.size - sizeof(*header), 1, in) != 1)) {
+	    show_msg(MSGERR, "%s is truncated or corrupt\n", filename);
+	    return 1;
+	}
+
+	at = TRACE_OFFSET(record.stamps[record.nstamps - 1]);
+	if (record.err)
+	    snprintf(result, sizeof(result), "%s", strerror(record.err));
+	else
+	    strcpy(result, "completed");
+	span(out, &record, NULL, 0, at, result);
+
+	phase = "tcp connect";
+	phasestart = 0;
+	for (i = 0; i < record.nstamps; i++) {
+	    state = TRACE_STATE(record.stamps[i]);
+	    at = TRACE_OFFSET(record.stamps[i]);
+	    if (allstates && (i < record.nstamps - 1)) {
+		next = TRACE_OFFSET(record.stamps[i + 1]);
+		span(out, &record, statename(state), at, next, NULL);
+	    }
+	    switch (state) {
+		case CONNECTED:
+		case GOTV4REQ:
+		case GOTV5METHOD:
+		case GOTV5AUTH:
+		case GOTV5CONNECT:
+		    span(out, &record, phase, phasestart, at, NULL);
+		    phase = NULL;
+		    phasestart = at;
+		    break;
+		case SENTV4REQ:
+		case SENTV5CONNECT:
+		    phase = "connect request";
+		    break;
+		case SENTV5METHOD:
+		    phase = "method negotiation";
+		    break;
+		case SENTV5AUTH:
+		    phase = "authentication";
+		    break;
+		case FAILED:
+		    span(out, &record, (phase ? phase : "handshake"),
+			    phasestart, at, result);
+		    break;
+	    }
+	}
+    }
+
+    if (ferror(in)) {
+	show_msg(MSGERR, "Could not read %s (%s)\n", filename, strerror(errno));
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Print a complete event from start to end ns into the request, */
+/* the span for the whole request (with no name) has its details */
+static void span(FILE *out, struct tracerecord *record, char *name,
+	uint64_t start, uint64_t end, char *result) {
+    struct in_addr addr;
+    char dst[INET6_ADDRSTRLEN + 2], server[INET_ADDRSTRLEN];
+
+    /* IPv6 destinations are bracketed to set them off from the port */
+    if (record->family == AF_INET6) {
+	dst[0] = '[';
+	inet_ntop(AF_INET6, record->dstip6, dst + 1, INET6_ADDRSTRLEN);
+	strcat(dst, "]");
+    } else {
+	addr.s_addr = record->dstip;
+	inet_ntop(AF_INET, &addr, dst, sizeof(dst));
+    }
+    addr.s_addr = record->serverip;
+    inet_ntop(AF_INET, &addr, server, sizeof(server));
+
+    fprintf(out, "%s\n{\"ph\":\"X\",\"cat\":\"tsocks\",\"pid\":%d,\"tid\":%d,"
+	    "\"ts\":%.3f,\"dur\":%.3f,", (events++ ? "," : ""), record->pid,
+	    record->sockid, (record->start + start) / 1000.0,
+	    (end - start) / 1000.0);
+    if (name) {
+	fprintf(out, "\"name\":\"%s\"", name);
+	if (result)
+	    fprintf(out, ",\"args\":{\"result\":\"%s\"}", result);
+    } else {
+	fprintf(out, "\"name\":\"connect %s:%d\",\"args\":{\"server\":"
+		"\"%s:%d\",\"type\":%d,\"line\":%d,\"result\":\"%s\"}",
+		dst, ntohs(record->dstport), server, ntohs(record->serverport),
+		record->type, record->lineno, result);
+    }
+    fprintf(out, "}");
+}
+
+static char *statename(int state) {
+
+    if ((state < 0) || (state >= (int) (sizeof(statenames) /
+		    sizeof(*statenames))))
+	return "UNKNOWN";
+
+    return statenames[state];
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
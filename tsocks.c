@@ -21,7 +21,7 @@
 /* PreProcessor Defines */
 #include <config.h>
 
-#ifdef USE_GNU_SOURCE
+#if defined(USE_GNU_SOURCE) || defined(ENABLE_UDP)
 #define _GNU_SOURCE
 #endif
 
@@ -37,20 +37,39 @@ char *progname = "libtsocks";         	   /* Name used in err msgs    */
 #include <sys/socket.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <pwd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <common.h>
 #include <stdarg.h>
 #ifdef USE_SOCKS_DNS
 #include <resolv.h>
 #endif
+/* parser.h has a struct netent of its own, unrelated to netdb.h's */
+#define netent tsocks_netent
 #include <parser.h>
+#include <cache.h>
+#undef netent
+#include <names.h>
+#ifdef ENABLE_DNSCACHE
+#include <dnscache.h>
+#endif
+#include <stats.h>
+#include <probes.h>
 #include <tsocks.h>
+#ifdef ENABLE_UDP
+#include <udp.h>
+#endif
 
 /* Global Declarations */
 #ifdef USE_SOCKS_DNS
@@ -61,10 +80,41 @@ static int (*realselect)(SELECT_SIGNATURE);
 static int (*realpoll)(POLL_SIGNATURE);
 static int (*realclose)(CLOSE_SIGNATURE);
 static int (*realgetpeername)(GETPEERNAME_SIGNATURE);
-static struct parsedfile *config;
+static int (*realgetsockopt)(GETSOCKOPT_SIGNATURE);
+static int (*realgetaddrinfo)(GETADDRINFO_SIGNATURE);
+static struct hostent *(*realgethostbyname)(GETHOSTBYNAME_SIGNATURE);
+static int (*realgethostbyname_r)(GETHOSTBYNAME_R_SIGNATURE);
+#ifdef ENABLE_UDP
+static ssize_t (*realsend)(SEND_SIGNATURE);
+static ssize_t (*realrecv)(RECV_SIGNATURE);
+static ssize_t (*realsendto)(SENDTO_SIGNATURE);
+static ssize_t (*realrecvfrom)(RECVFROM_SIGNATURE);
+static ssize_t (*realsendmsg)(SENDMSG_SIGNATURE);
+static ssize_t (*realrecvmsg)(RECVMSG_SIGNATURE);
+static int (*realsendmmsg)(SENDMMSG_SIGNATURE);
+static int (*realrecvmmsg)(RECVMMSG_SIGNATURE);
+static int udp = 0; /* Relay UDP, opt in with TSOCKS_UDP */
+#endif
+static struct confref *config = NULL;
 static struct connreq *requests = NULL;
+/* Protects the requests list, each request is only handled by the */
+/* threads using its socket but the list itself is shared           */
+static pthread_mutex_t requests_lock = PTHREAD_MUTEX_INITIALIZER;
 static int suid = 0;
+#ifndef BUILTIN_CONFIG
 static char *conffile = NULL;
+#endif
+
+/* Configuration reload state, reloading is opt in (see get_config()) */
+static char confpath[BUFSIZ];
+static struct stat confstat, cachestat;
+static struct confref *retired = NULL;
+static int holding = 0; /* Callers of hold_config() between reading */
+			/* config and taking their reference       */
+static int reload_interval = 0;
+static int reloading = 0;
+static time_t next_check = 0;
+static volatile sig_atomic_t reload_pending = 0;
 
 /* Exported Function Prototypes */
 void tsocks_init(void) __attribute__((constructor));
@@ -73,32 +123,92 @@ int select(SELECT_SIGNATURE);
 int poll(POLL_SIGNATURE);
 int close(CLOSE_SIGNATURE);
 int getpeername(GETPEERNAME_SIGNATURE);
+int getsockopt(GETSOCKOPT_SIGNATURE);
+int getaddrinfo(GETADDRINFO_SIGNATURE);
+struct hostent *gethostbyname(GETHOSTBYNAME_SIGNATURE);
+int gethostbyname_r(GETHOSTBYNAME_R_SIGNATURE);
 #ifdef USE_SOCKS_DNS
 int res_init(void);
 #endif
+#ifdef ENABLE_UDP
+ssize_t send(SEND_SIGNATURE);
+ssize_t recv(RECV_SIGNATURE);
+ssize_t sendto(SENDTO_SIGNATURE);
+ssize_t recvfrom(RECVFROM_SIGNATURE);
+ssize_t sendmsg(SENDMSG_SIGNATURE);
+ssize_t recvmsg(RECVMSG_SIGNATURE);
+int sendmmsg(SENDMMSG_SIGNATURE);
+int recvmmsg(RECVMMSG_SIGNATURE);
+#endif
 
 /* Private Function Prototypes */
-static int get_config();
+static struct confref *get_config();
+static struct confref *new_config(int);
+static void check_config();
+static int stat_config(struct stat *, struct stat *);
+static void *reload_config(void *);
+static void reload_forked(void);
+static void reclaim_config(void);
+static struct confref *hold_config();
+static void release_config(struct confref *);
+#ifndef BUILTIN_CONFIG
+static void reload_handler(int);
+#endif
+static int handle_connect(CONNECT_SIGNATURE);
+static int route_connect(struct confref *, struct sockaddr_in *,
+	struct in6_addr *, CONNECT_SIGNATURE);
 static int get_environment();
+static int want_names();
 static int connect_server(struct connreq *conn);
 static int send_socks_request(struct connreq *conn);
 static struct connreq *new_socks_request(int sockid, struct sockaddr_in *connaddr,
-	struct sockaddr_in *serveraddr,
-	struct serverent *path);
+	struct in6_addr *connaddr6, int family, struct sockaddr_in *serveraddr,
+	struct serverent *path, struct confref *ref);
 static void kill_socks_request(struct connreq *conn);
 static int handle_request(struct connreq *conn);
 static struct connreq *find_socks_request(int sockid, int includefailed);
+static int socket_error(int sockid);
+static void finish_request(struct connreq *conn);
 static int connect_server(struct connreq *conn);
 static int send_socks_request(struct connreq *conn);
 static int send_socksv4_request(struct connreq *conn);
 static int send_socksv5_method(struct connreq *conn);
 static int send_socksv5_connect(struct connreq *conn);
+static int send_http_request(struct connreq *conn);
+static int send_chain(struct connreq *conn);
+static void chain_hops(struct connreq *conn);
+static int next_hop(struct connreq *conn);
+static int sent_state(struct connreq *conn);
+static int have_password(struct connreq *conn);
+static int socks_credentials(struct connreq *conn, char **uname,
+	char **upass);
+static int socksv4_request(struct connreq *conn, int hop, char *buf,
+	int space);
+static int socksv5_auth(char *uname, char *upass, char *buf, int space);
+static int socksv5_connect(struct connreq *conn, int hop, char *buf,
+	int space);
+static int http_request(struct connreq *conn, int hop, char *uname,
+	char *upass, char *buf, int space);
+static void base64(const char *in, int len, char *out);
 static int send_buffer(struct connreq *conn);
 static int recv_buffer(struct connreq *conn);
 static int read_socksv5_method(struct connreq *conn);
 static int read_socksv4_req(struct connreq *conn);
 static int read_socksv5_connect(struct connreq *conn);
 static int read_socksv5_auth(struct connreq *conn);
+static int recv_http_reply(struct connreq *conn);
+static int http_status(struct connreq *conn);
+static int read_http_reply(struct connreq *conn);
+#ifdef ENABLE_UDP
+static int udp_connect(CONNECT_SIGNATURE);
+static int start_association(int, struct mmsghdr *, unsigned int);
+static int associate(int, struct confref *, struct serverent *);
+static void end_association(struct udpassoc *);
+static int send_datagrams(int, struct mmsghdr *, unsigned int, int, int);
+static int real_send(int, struct mmsghdr *, unsigned int, int, int);
+static int recv_datagrams(struct udpassoc *, int, struct mmsghdr *,
+	unsigned int, int, struct timespec *, int);
+#endif
 
 void tsocks_init(void) {
 #ifdef USE_OLD_DLSYM
@@ -118,18 +228,46 @@ void tsocks_init(void) {
     realpoll = dlsym(RTLD_NEXT, "poll");
     realclose = dlsym(RTLD_NEXT, "close");
     realgetpeername = dlsym(RTLD_NEXT, "getpeername");
+    realgetsockopt = dlsym(RTLD_NEXT, "getsockopt");
+    realgetaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
+    realgethostbyname = dlsym(RTLD_NEXT, "gethostbyname");
+    realgethostbyname_r = dlsym(RTLD_NEXT, "gethostbyname_r");
 #ifdef USE_SOCKS_DNS
     realresinit = dlsym(RTLD_NEXT, "res_init");
 #endif /* USE_SOCKS_DNS */
+#ifdef ENABLE_UDP
+    realsend = dlsym(RTLD_NEXT, "send");
+    realrecv = dlsym(RTLD_NEXT, "recv");
+    realsendto = dlsym(RTLD_NEXT, "sendto");
+    realrecvfrom = dlsym(RTLD_NEXT, "recvfrom");
+    realsendmsg = dlsym(RTLD_NEXT, "sendmsg");
+    realrecvmsg = dlsym(RTLD_NEXT, "recvmsg");
+    realsendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
+    realrecvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
+#endif /* ENABLE_UDP */
 #else
     lib = dlopen(LIBCONNECT, RTLD_LAZY);
     realconnect = dlsym(lib, "connect");
     realselect = dlsym(lib, "select");
     realpoll = dlsym(lib, "poll");
     realgetpeername = dlsym(lib, "getpeername");
+    realgetsockopt = dlsym(lib, "getsockopt");
+    realgetaddrinfo = dlsym(lib, "getaddrinfo");
+    realgethostbyname = dlsym(lib, "gethostbyname");
+    realgethostbyname_r = dlsym(lib, "gethostbyname_r");
 #ifdef USE_SOCKS_DNS
     realresinit = dlsym(lib, "res_init");
 #endif /* USE_SOCKS_DNS */
+#ifdef ENABLE_UDP
+    realsend = dlsym(lib, "send");
+    realrecv = dlsym(lib, "recv");
+    realsendto = dlsym(lib, "sendto");
+    realrecvfrom = dlsym(lib, "recvfrom");
+    realsendmsg = dlsym(lib, "sendmsg");
+    realrecvmsg = dlsym(lib, "recvmsg");
+    realsendmmsg = dlsym(lib, "sendmmsg");
+    realrecvmmsg = dlsym(lib, "recvmmsg");
+#endif /* ENABLE_UDP */
     dlclose(lib);
 
     lib = dlopen(LIBC, RTLD_LAZY);
@@ -158,47 +296,309 @@ static int get_environment() {
     set_log_options(loglevel, logfile, 1);
 #endif
 
+#ifdef ENABLE_UDP
+    /* Relaying UDP is opt in, it changes what every send and */
+    /* receive call on a UDP socket does                       */
+    if ((env = getenv("TSOCKS_UDP")))
+	udp = (atoi(env) > 0);
+#endif
+
     done = 1;
 
     return 0;
 }
 
-static int get_config () {
+static struct confref *get_config () {
     static int done = 0;
+#ifndef BUILTIN_CONFIG
+    struct sigaction action, oldaction;
+    char *env;
+#endif
 
-    if (done)
-	return 0;
+    if (done) {
+	if (reload_interval ||
+		__atomic_load_n(&reload_pending, __ATOMIC_RELAXED))
+	    check_config();
+	return __atomic_load_n(&config, __ATOMIC_ACQUIRE);
+    }
 
+#ifdef BUILTIN_CONFIG
+    /* The configuration was compiled into this library (see the */
+    /* builtin target in the Makefile), there is nothing to read */
+    /* or to reload                                              */
+    strcpy(confpath, "(builtin)");
+#else
     /* Determine the location of the config file */
 #ifdef ALLOW_ENV_CONFIG
     if (!suid)
 	conffile = getenv("TSOCKS_CONF_FILE");
 #endif
+    if (conffile) {
+	strncpy(confpath, conffile, sizeof(confpath) - 1);
+	confpath[sizeof(confpath) - 1] = '\0';
+    } else if (find_config(confpath) == NULL) {
+	strncpy(confpath, CONF_FILE, sizeof(confpath) - 1);
+    }
+
+    /* Long running programs can ask for the configuration to be */
+    /* reloaded when it changes, either by checking it every few */
+    /* seconds or when sent a signal                             */
+    if ((env = getenv("TSOCKS_RELOAD")))
+	reload_interval = atoi(env);
+    if ((env = getenv("TSOCKS_RELOAD_SIGNAL")) && (atoi(env) > 0)) {
+	/* Never take a signal away from the program itself */
+	if (!sigaction(atoi(env), NULL, &oldaction) &&
+		(oldaction.sa_handler == SIG_DFL)) {
+	    memset(&action, 0x0, sizeof(action));
+	    action.sa_handler = reload_handler;
+	    action.sa_flags = SA_RESTART;
+	    sigemptyset(&action.sa_mask);
+	    if (!sigaction(atoi(env), &action, NULL))
+		show_msg(MSGDEBUG, "Configuration will be reloaded on "
+			"signal %s\n", env);
+	} else {
+	    show_msg(MSGWARN, "Signal %s is already in use, configuration "
+		    "will not be reloaded on it\n", env);
+	}
+    }
+#endif
 
     /* Read in the config file */
-    config = malloc(sizeof(*config));
-    if (!config)
-	return 0;
-    read_config(conffile, config);
-    if (config->paths)
-	show_msg(MSGDEBUG, "First lineno for first path is %d\n", config->paths->lineno);
+    config = new_config(1);
+    if (config && config->conf.paths)
+	show_msg(MSGDEBUG, "First lineno for first path is %d\n", config->conf.paths->lineno);
 
     done = 1;
 
-    return 0;
+    return config;
+}
+
+/* Load the configuration, remembering the state of the files it */
+/* came from so changes can be detected. Only the first load falls */
+/* back to treating every network as local when the file can't be */
+/* read, a reload returns NULL instead so the current           */
+/* configuration is kept (e.g while the file is being replaced)  */
+static struct confref *new_config(int first) {
+    struct confref *ref;
+#ifdef BUILTIN_CONFIG
+    static struct confref builtin;
+
+    ref = &builtin;
+    load_config(confpath, &(ref->conf));
+#else
+    struct stat st, cst;
+
+    if ((ref = malloc(sizeof(*ref))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for configuration\n");
+	return NULL;
+    }
+    memset(ref, 0x0, sizeof(*ref));
+
+    if (stat_config(&st, &cst) && !first) {
+	free(ref);
+	return NULL;
+    }
+    if (load_config(confpath, &(ref->conf)) && !first) {
+	free_config(&(ref->conf));
+	free(ref);
+	return NULL;
+    }
+    confstat = st;
+    cachestat = cst;
+#endif
+
+    return ref;
+}
+
+/* Find the state of the configuration file and its cache (which */
+/* needn't exist), returns non zero if the file can't be found   */
+static int stat_config(struct stat *conf, struct stat *cache) {
+    char cachefile[BUFSIZ + sizeof(CACHE_SUFFIX)];
+    int rc;
+
+    memset(conf, 0x0, sizeof(*conf));
+    memset(cache, 0x0, sizeof(*cache));
+    rc = stat(confpath, conf);
+    snprintf(cachefile, sizeof(cachefile), "%s" CACHE_SUFFIX, confpath);
+    stat(cachefile, cache);
+
+    return rc;
+}
+
+/* See if the configuration file, its cache or a file of networks */
+/* it names has changed and if so have reload_config() load it in  */
+/* a thread of its own, so the connect() that noticed isn't held   */
+/* up parsing it                                                   */
+static void check_config() {
+    sigset_t all, mask;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct stat st, cst;
+    struct timespec ts;
+    time_t now;
+    int rc;
+
+    /* Reloads are timed by the monotonic clock so setting the time */
+    /* doesn't hold them up                                         */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec;
+    if (!__atomic_load_n(&reload_pending, __ATOMIC_RELAXED) &&
+	    (!reload_interval ||
+	     (now < __atomic_load_n(&next_check, __ATOMIC_RELAXED))))
+	return;
+
+    /* Only one caller gets to reload, everyone else carries on */
+    /* with the current configuration                           */
+    if (__atomic_exchange_n(&reloading, 1, __ATOMIC_ACQUIRE))
+	return;
+
+    __atomic_store_n(&next_check, now + reload_interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&reload_pending, 0, __ATOMIC_RELAXED);
+
+    reclaim_config();
+
+    if (stat_config(&st, &cst)) {
+	show_msg(MSGWARN, "Configuration file %s has gone, keeping the "
+		"current configuration\n", confpath);
+    } else if (!SAME_FILE(st, confstat) || !SAME_FILE(cst, cachestat) ||
+	    (config && config_files_changed(&(config->conf)))) {
+	show_msg(MSGNOTICE, "Configuration file %s has changed, reloading\n",
+		confpath);
+	/* The thread mustn't take the program's signals */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &mask);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, reload_config, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	if (rc)
+	    reload_config(NULL);
+	return;
+    }
+
+    __atomic_store_n(&reloading, 0, __ATOMIC_RELEASE);
+}
+
+/* Load the changed configuration and publish it in place of the */
+/* current one, which requests may still be using so it is       */
+/* retired rather than freed. Lets the next reload go when done  */
+static void *reload_config(void *arg) {
+    static int registered = 0;
+    struct confref *ref, *old;
+
+    /* A child forked during the reload has no thread to finish it */
+    if (!registered) {
+	pthread_atfork(NULL, NULL, reload_forked);
+	registered = 1;
+    }
+
+    if ((ref = new_config(0)) == NULL) {
+	show_msg(MSGWARN, "Could not reload configuration file %s, "
+		"keeping the current configuration\n", confpath);
+    } else {
+	old = __atomic_exchange_n(&config, ref, __ATOMIC_SEQ_CST);
+	if (old) {
+	    old->quiesced = 0;
+	    old->next = retired;
+	    retired = old;
+	}
+    }
+
+    __atomic_store_n(&reloading, 0, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void reload_forked(void) {
+
+    __atomic_store_n(&reloading, 0, __ATOMIC_RELAXED);
+}
+
+/* Free retired configurations nothing refers to any more. A caller */
+/* of hold_config() may have read the pointer to a configuration    */
+/* just before it was retired and not have taken its reference yet, */
+/* so a retired configuration can only be freed once no caller has  */
+/* been between the two since it was retired (it is quiesced),      */
+/* after which its reference count can be trusted                   */
+static void reclaim_config() {
+    struct confref **prev, *ref;
+    int idle;
+
+    idle = (__atomic_load_n(&holding, __ATOMIC_SEQ_CST) == 0);
+    for (prev = &retired; (ref = *prev) != NULL; ) {
+	if (idle)
+	    ref->quiesced = 1;
+	if (ref->quiesced &&
+		(__atomic_load_n(&(ref->refs), __ATOMIC_SEQ_CST) == 0)) {
+	    *prev = ref->next;
+	    show_msg(MSGDEBUG, "Freeing retired configuration\n");
+	    free_config(&(ref->conf));
+	    free(ref);
+	} else {
+	    prev = &(ref->next);
+	}
+    }
+}
+
+/* Take a reference to the current configuration. Between reading */
+/* the pointer and taking the reference the caller is counted in  */
+/* holding, which keeps reclaim_config() from freeing a            */
+/* configuration retired in the meantime (see there)               */
+static struct confref *hold_config() {
+    struct confref *ref;
+
+    /* Loads the configuration and checks it for changes */
+    if (get_config() == NULL)
+	return NULL;
+
+    __atomic_add_fetch(&holding, 1, __ATOMIC_SEQ_CST);
+    ref = __atomic_load_n(&config, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(ref->refs), 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&holding, 1, __ATOMIC_SEQ_CST);
 
+    return ref;
 }
 
+static void release_config(struct confref *ref) {
+
+    if (ref)
+	__atomic_sub_fetch(&(ref->refs), 1, __ATOMIC_ACQ_REL);
+}
+
+#ifndef BUILTIN_CONFIG
+static void reload_handler(int signo) {
+
+    reload_pending = 1;
+}
+#endif
+
 int connect(CONNECT_SIGNATURE) {
+    uint64_t start;
+    int rc;
+
+    get_environment();
+    stats_open(suid);
+    trace_open(suid);
+
+    start = stats_clock();
+    rc = handle_connect(__fd, __addr, __len);
+    stats_call(STAT_CONNECT, start, 0);
+    PROBE3(connect__return, __fd, rc, (rc ? errno : 0));
+
+    return rc;
+}
+
+static int handle_connect(CONNECT_SIGNATURE) {
     struct sockaddr_in *connaddr;
-    struct sockaddr_in peer_address;
-    struct sockaddr_in server_address;
-    int gotvalidserver = 0, rc;
+    struct sockaddr_in6 *connaddr6;
+    struct sockaddr_in dst, peer_address;
+    struct in6_addr dst6;
+    int rc, saveerr;
     socklen_t namelen = sizeof(peer_address);
     int sock_type = -1;
     socklen_t sock_type_len = sizeof(sock_type);
-    unsigned int res = -1;
-    struct serverent *path;
+    struct confref *ref;
     struct connreq *newconn;
 
     get_environment();
@@ -217,20 +617,48 @@ int connect(CONNECT_SIGNATURE) {
     getsockopt(__fd, SOL_SOCKET, SO_TYPE,
 	    (void *) &sock_type, &sock_type_len);
 
-    /* If this isn't an INET socket for a TCP stream we can't  */
-    /* handle it, just call the real connect now               */
-    if ((connaddr->sin_family != AF_INET) ||
+#ifdef ENABLE_UDP
+    /* Connecting a UDP socket only picks where its datagrams go */
+    if (udp && (sock_type == SOCK_DGRAM))
+	return udp_connect(__fd, __addr, __len);
+#endif
+
+    /* If this isn't an INET or INET6 socket for a TCP stream we */
+    /* can't handle it, just call the real connect now           */
+    if (((connaddr->sin_family != AF_INET) &&
+	 ((connaddr->sin_family != AF_INET6) ||
+	  (__len < sizeof(struct sockaddr_in6)))) ||
 	    (sock_type != SOCK_STREAM)) {
 	show_msg(MSGDEBUG, "Connection isn't a TCP stream ignoring\n");
 	return realconnect(__fd, __addr, __len);
     }
 
-    /* If we haven't initialized yet, do it now */
-    get_config();
+    /* An IPv6 destination is kept apart with AF_INET6 and just the */
+    /* port in dst, except an IPv4-mapped one which is routed and   */
+    /* requested as the IPv4 address                                */
+    memset(&dst6, 0x0, sizeof(dst6));
+    if (connaddr->sin_family == AF_INET6) {
+	connaddr6 = (struct sockaddr_in6 *) __addr;
+	memset(&dst, 0x0, sizeof(dst));
+	dst.sin_port = connaddr6->sin6_port;
+	if (IN6_IS_ADDR_V4MAPPED(&(connaddr6->sin6_addr))) {
+	    dst.sin_family = AF_INET;
+	    memcpy(&(dst.sin_addr), &(connaddr6->sin6_addr.s6_addr[12]), 4);
+	} else {
+	    dst.sin_family = AF_INET6;
+	    dst6 = connaddr6->sin6_addr;
+	}
+    } else {
+	memcpy(&dst, connaddr, sizeof(dst));
+    }
 
     /* Are we already handling this connect? */
-    if ((newconn = find_socks_request(__fd, 1))) {
-	if (memcmp(&newconn->connaddr, connaddr, sizeof(*connaddr))) {
+    pthread_mutex_lock(&requests_lock);
+    newconn = find_socks_request(__fd, 1);
+    pthread_mutex_unlock(&requests_lock);
+    if (newconn) {
+	if (memcmp(&newconn->connaddr, &dst, sizeof(dst)) ||
+		memcmp(&newconn->connaddr6, &dst6, sizeof(dst6))) {
 	    /* Ok, they're calling connect on a socket that is in our
 	     * queue but this connect() isn't to the same destination,
 	     * they're obviously not trying to check the status of
@@ -277,17 +705,77 @@ int connect(CONNECT_SIGNATURE) {
 	return realconnect(__fd, __addr, __len);
     }
 
+    /* Hold on to the current configuration while we use it, */
+    /* it may be replaced by a reload in the meantime         */
+    if ((ref = hold_config()) == NULL)
+	return realconnect(__fd, __addr, __len);
+    rc = route_connect(ref, &dst, &dst6, __fd, __addr, __len);
+    saveerr = errno;
+    release_config(ref);
+    errno = saveerr;
+
+    return rc;
+}
+
+/* Work out how to reach the destination of a connect() using */
+/* the configuration provided and start the request, connaddr  */
+/* is the destination as handle_connect() set it out           */
+static int route_connect(struct confref *ref, struct sockaddr_in *connaddr,
+	struct in6_addr *connaddr6, CONNECT_SIGNATURE) {
+    struct parsedfile *config = &(ref->conf);
+    struct sockaddr_in server_address;
+    int gotvalidserver = 0, rc;
+    int v6 = (connaddr->sin_family == AF_INET6);
+    int family = ((struct sockaddr *) __addr)->sa_family;
+    int domain = ROUTE_NOMATCH;
+    char dsttext[INET6_ADDRSTRLEN], name[NAMES_MAXLEN];
+    unsigned int res = -1;
+    struct serverent *path;
+    struct connreq *newconn;
+
+    if (v6)
+	inet_ntop(AF_INET6, connaddr6, dsttext, sizeof(dsttext));
+    else
+	inet_ntop(AF_INET, &(connaddr->sin_addr), dsttext, sizeof(dsttext));
     show_msg(MSGDEBUG, "Got connection request for socket %d to "
-	    "%s\n", __fd, inet_ntoa(connaddr->sin_addr));
+	    "%s\n", __fd, dsttext);
+    stats_count(STAT_CONNECTS);
+    stats_tag(__fd, NULL);
+    if (v6)
+	PROBE3(connect6, __fd, connaddr6->s6_addr, ntohs(connaddr->sin_port));
+    else
+	PROBE3(connect, __fd, connaddr->sin_addr.s_addr,
+		ntohs(connaddr->sin_port));
+
+    /* The name the address was resolved from is routed by the */
+    /* domain rules first                                      */
+    if (config->index.domains.nrules &&
+	    !names_find((v6 ? AF_INET6 : AF_INET),
+		(v6 ? (void *) connaddr6 : (void *) &(connaddr->sin_addr)),
+		name, sizeof(name)) &&
+	    ((domain = route_domain(&(config->index.domains), name)) !=
+	     ROUTE_NOMATCH))
+	show_msg(MSGDEBUG, "Connection for socket %d is to %s, routed by "
+		"domain\n", __fd, name);
 
     /* If the address is local call realconnect */
-    if (!(is_local(config, &(connaddr->sin_addr)))) {
+    if ((domain == ROUTE_LOCAL) || ((domain == ROUTE_NOMATCH) &&
+		!(v6 ? is_local6(config, connaddr6) :
+		  is_local(config, &(connaddr->sin_addr))))) {
 	show_msg(MSGDEBUG, "Connection for socket %d is local\n", __fd);
+	stats_count(STAT_LOCAL);
+	PROBE5(route, __fd, PROBE_LOCAL, -1, 0, 0);
 	return realconnect(__fd, __addr, __len);
     }
 
     /* Ok, so its not local, we need a path to the net */
-    pick_server(config, &path, &(connaddr->sin_addr), ntohs(connaddr->sin_port));
+    if (domain >= 0)
+	path = config->index.paths[domain];
+    else if (v6)
+	pick_server6(config, &path, connaddr6, ntohs(connaddr->sin_port));
+    else
+	pick_server(config, &path, &(connaddr->sin_addr),
+		ntohs(connaddr->sin_port));
 
     show_msg(MSGDEBUG, "Picked server %s for connection\n",
 	    (path->address ? path->address : "(Not Provided)"));
@@ -299,6 +787,8 @@ int connect(CONNECT_SIGNATURE) {
                                  "the default server has not "
                                  "been specified. Fallback is 'yes' so "
                                  "Falling back to direct connection.\n");
+                stats_count(STAT_FALLBACKS);
+                PROBE5(route, __fd, PROBE_FALLBACK, path->lineno, 0, 0);
                 return(realconnect(__fd, __addr, __len));
             } else {
                 show_msg(MSGERR, "Connection needs to be made "
@@ -314,6 +804,10 @@ int connect(CONNECT_SIGNATURE) {
                              "the server has not been "
                              "specified for this path\n",
                              path->lineno);
+    } else if (v6 && (path->type == 4)) {
+	show_msg(MSGERR, "Connection to %s needs to be made via the SOCKS "
+		"server at line %d in configuration file but SOCKS 4 "
+		"servers can't reach IPv6 addresses\n", dsttext, path->lineno);
     } else if ((res = resolve_ip(path->address, 0, HOSTNAMES)) == -1) {
 	show_msg(MSGERR, "The SOCKS server (%s) listed in the configuration "
 		"file which needs to be used for this connection "
@@ -335,10 +829,16 @@ int connect(CONNECT_SIGNATURE) {
 
     /* If we haven't found a valid server we return connection refused */
     if (!gotvalidserver ||
-	    !(newconn = new_socks_request(__fd, connaddr, &server_address, path))) {
+	    !(newconn = new_socks_request(__fd, connaddr, connaddr6, family,
+					  &server_address, path, ref))) {
+	stats_count(STAT_UNROUTABLE);
+	PROBE5(route, __fd, PROBE_UNROUTABLE, path->lineno, 0, 0);
 	errno = ECONNREFUSED;
 	return -1;
     } else {
+	stats_request(path, STAT_PROXIED, 0);
+	PROBE5(route, __fd, PROBE_PROXY, path->lineno,
+		server_address.sin_addr.s_addr, path->port);
 	/* Now we call the main function to handle the connect. */
 	rc = handle_request(newconn);
 	/* If the request completed immediately it mustn't have been
@@ -357,22 +857,34 @@ int select(SELECT_SIGNATURE) {
     int setevents = 0;
     int monitoring = 0;
     struct connreq *conn, *nextconn;
-    fd_set mywritefds, myreadfds, myexceptfds;
+    fd_set mywritefds, myreadfds, myexceptfds, ourfds;
+    uint64_t start, before, waited = 0;
 
     /* If we're not currently managing any requests we can just
      * leave here */
-    if (!requests) {
+    if (!__atomic_load_n(&requests, __ATOMIC_RELAXED)) {
         show_msg(MSGDEBUG, "No requests waiting, calling real select\n");
+	stats_call(STAT_SELECT, 0, 0);
 	return realselect(n, readfds, writefds, exceptfds, timeout);
    }
 
+    start = stats_clock();
     get_environment();
 
     show_msg(MSGDEBUG, "Intercepted call to select with %d fds, "
 	    "0x%08x 0x%08x 0x%08x, timeout %08x\n", n,
 	    readfds, writefds, exceptfds, timeout);
 
+    /* Only requests for sockets in the caller's sets are touched, */
+    /* other threads may be handling the rest                      */
+    FD_ZERO(&ourfds);
+    pthread_mutex_lock(&requests_lock);
     for (conn = requests; conn != NULL; conn = conn->next) {
+	if ((conn->sockid >= n) ||
+		!((writefds && FD_ISSET(conn->sockid, writefds)) ||
+		  (readfds && FD_ISSET(conn->sockid, readfds)) ||
+		  (exceptfds && FD_ISSET(conn->sockid, exceptfds))))
+	    continue;
 	if ((conn->state == FAILED) || (conn->state == DONE))
 	    continue;
 	conn->selectevents = 0;
@@ -381,14 +893,17 @@ int select(SELECT_SIGNATURE) {
 	conn->selectevents |= (writefds ? (FD_ISSET(conn->sockid, writefds) ? WRITE : 0) : 0);
 	conn->selectevents |= (readfds ? (FD_ISSET(conn->sockid, readfds) ? READ : 0) : 0);
 	conn->selectevents |= (exceptfds ? (FD_ISSET(conn->sockid, exceptfds) ? EXCEPT : 0) : 0);
-	if (conn->selectevents) {
-	    show_msg(MSGDEBUG, "Socket %d was set for events\n", conn->sockid);
-	    monitoring = 1;
-	}
+	show_msg(MSGDEBUG, "Socket %d was set for events\n", conn->sockid);
+	FD_SET(conn->sockid, &ourfds);
+	monitoring = 1;
     }
 
-    if (!monitoring)
+    if (!monitoring) {
+	pthread_mutex_unlock(&requests_lock);
+	stats_call(STAT_SELECT, start, 0);
 	return realselect(n, readfds, writefds, exceptfds, timeout);
+    }
+    PROBE1(select, n);
 
     /* This is our select loop. In it we repeatedly call select(). We
      * pass select the same fdsets as provided by the caller except we
@@ -415,8 +930,8 @@ int select(SELECT_SIGNATURE) {
 
 	/* Now enable our sockets for the events WE want to hear about */
 	for (conn = requests; conn != NULL; conn = conn->next) {
-	    if ((conn->state == FAILED) || (conn->state == DONE) ||
-		    (conn->selectevents == 0))
+	    if ((conn->sockid >= n) || !FD_ISSET(conn->sockid, &ourfds) ||
+		    (conn->state == FAILED) || (conn->state == DONE))
 		continue;
 	    /* We always want to know about socket exceptions */
 	    FD_SET(conn->sockid, &myexceptfds);
@@ -434,7 +949,11 @@ int select(SELECT_SIGNATURE) {
 		FD_CLR(conn->sockid,&myreadfds);
 	}
 
+	pthread_mutex_unlock(&requests_lock);
+	before = stats_clock();
 	nevents = realselect(n, &myreadfds, &mywritefds, &myexceptfds, timeout);
+	waited += stats_clock() - before;
+	pthread_mutex_lock(&requests_lock);
 	/* If there were no events we must have timed out or had an error */
 	if (nevents <= 0)
 	    break;
@@ -443,7 +962,8 @@ int select(SELECT_SIGNATURE) {
 	 * any of them have had events */
 	for (conn = requests; conn != NULL; conn = nextconn) {
 	    nextconn = conn->next;
-	    if ((conn->state == FAILED) || (conn->state == DONE))
+	    if ((conn->sockid >= n) || !FD_ISSET(conn->sockid, &ourfds) ||
+		    (conn->state == FAILED) || (conn->state == DONE))
 		continue;
 	    show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
 	    /* Clear all the events on the socket (if any), we'll reset
@@ -474,7 +994,10 @@ int select(SELECT_SIGNATURE) {
 	    }
 
 	    if (setevents & EXCEPT) {
+		PROBE3(state, conn->sockid, conn->state, FAILED);
 		conn->state = FAILED;
+		conn->err = socket_error(conn->sockid);
+		finish_request(conn);
 	    } else {
 		rc = handle_request(conn);
 	    }
@@ -522,6 +1045,7 @@ int select(SELECT_SIGNATURE) {
 	    }
 	}
     } while (nevents == 0);
+    pthread_mutex_unlock(&requests_lock);
 
     show_msg(MSGDEBUG, "Finished intercepting select(), %d events\n", nevents);
 
@@ -533,6 +1057,9 @@ int select(SELECT_SIGNATURE) {
     if (exceptfds)
 	memcpy(exceptfds, &myexceptfds, sizeof(myexceptfds));
 
+    stats_call(STAT_SELECT, start, waited);
+    PROBE2(select__return, n, nevents);
+
     return nevents;
 }
 
@@ -542,33 +1069,42 @@ int poll(POLL_SIGNATURE) {
     int setevents = 0;
     int monitoring = 0;
     struct connreq *conn, *nextconn;
+    uint64_t start, before, waited = 0;
 
     /* If we're not currently managing any requests we can just
      * leave here */
-    if (!requests)
+    if (!__atomic_load_n(&requests, __ATOMIC_RELAXED)) {
+	stats_call(STAT_POLL, 0, 0);
 	return realpoll(ufds, nfds, timeout);
+    }
 
+    start = stats_clock();
     get_environment();
 
     show_msg(MSGDEBUG, "Intercepted call to poll with %d fds, "
 	    "0x%08x timeout %d\n", nfds, ufds, timeout);
 
-    for (conn = requests; conn != NULL; conn = conn->next)
-	conn->selectevents = 0;
-
     /* Record what events on our sockets the caller was interested
-     * in */
+     * in, only requests for sockets in the caller's list are touched,
+     * other threads may be handling the rest */
+    pthread_mutex_lock(&requests_lock);
     for (i = 0; i < nfds; i++) {
-	if (!(conn = find_socks_request(ufds[i].fd, 0)))
+	if (!(conn = find_socks_request(ufds[i].fd, 1)))
+	    continue;
+	conn->selectevents = ufds[i].events;
+	if ((conn->state == FAILED) || (conn->state == DONE))
 	    continue;
 	show_msg(MSGDEBUG, "Have event checks for socks enabled socket %d\n",
 		conn->sockid);
-	conn->selectevents = ufds[i].events;
 	monitoring = 1;
     }
 
-    if (!monitoring)
+    if (!monitoring) {
+	pthread_mutex_unlock(&requests_lock);
+	stats_call(STAT_POLL, start, 0);
 	return realpoll(ufds, nfds, timeout);
+    }
+    PROBE1(poll, nfds);
 
     /* This is our poll loop. In it we repeatedly call poll(). We
      * pass select the same event list as provided by the caller except we
@@ -581,8 +1117,14 @@ int poll(POLL_SIGNATURE) {
     do {
 	/* Enable our sockets for the events WE want to hear about */
 	for (i = 0; i < nfds; i++) {
-	    if (!(conn = find_socks_request(ufds[i].fd, 0)))
+	    if (!(conn = find_socks_request(ufds[i].fd, 1)))
+		continue;
+
+	    /* Completed connections get the events the caller asked for */
+	    if ((conn->state == FAILED) || (conn->state == DONE)) {
+		ufds[i].events = conn->selectevents;
 		continue;
+	    }
 
 	    /* We always want to know about socket exceptions but they're
 	     * always returned (i.e they don't need to be in the list of
@@ -599,7 +1141,11 @@ int poll(POLL_SIGNATURE) {
 		ufds[i].events |= POLLIN;
 	}
 
+	pthread_mutex_unlock(&requests_lock);
+	before = stats_clock();
 	nevents = realpoll(ufds, nfds, timeout);
+	waited += stats_clock() - before;
+	pthread_mutex_lock(&requests_lock);
 	/* If there were no events we must have timed out or had an error */
 	if (nevents <= 0)
 	    break;
@@ -608,8 +1154,6 @@ int poll(POLL_SIGNATURE) {
 	 * any of them have had events */
 	for (conn = requests; conn != NULL; conn = nextconn) {
 	    nextconn = conn->next;
-	    if ((conn->state == FAILED) || (conn->state == DONE))
-		continue;
 
 	    /* Find the socket in the poll list */
 	    for (i = 0; ((i < nfds) && (ufds[i].fd != conn->sockid)); i++)
@@ -617,6 +1161,9 @@ int poll(POLL_SIGNATURE) {
 	    if (i == nfds)
 		continue;
 
+	    if ((conn->state == FAILED) || (conn->state == DONE))
+		continue;
+
 	    show_msg(MSGDEBUG, "Checking socket %d for events\n", conn->sockid);
 
 	    if (!ufds[i].revents) {
@@ -642,7 +1189,10 @@ int poll(POLL_SIGNATURE) {
 
 	    /* Now handle this event */
 	    if (setevents & (POLLERR | POLLNVAL | POLLHUP)) {
+		PROBE3(state, conn->sockid, conn->state, FAILED);
 		conn->state = FAILED;
+		conn->err = socket_error(conn->sockid);
+		finish_request(conn);
 	    } else {
 		rc = handle_request(conn);
 	    }
@@ -658,22 +1208,28 @@ int poll(POLL_SIGNATURE) {
 	     * check the status, we delete it then */
 
 	    if (conn->state == FAILED) {
-		/* Damn, the connection failed. Just copy back the error events
-		 * from the poll call, error events are always valid even if not
-		 * requested by the client */
+		/* Damn, the connection failed. Error events from the poll call
+		 * are always valid even if not requested by the client, if
+		 * there weren't any (e.g the server refused the request) we
+		 * flag whatever the socket was polled for */
 		/* We should use setsockopt to set the SO_ERROR errno for this
 		 * socket, but this isn't allowed for some silly reason which
 		 * leaves us a bit hamstrung.
 		 * We don't delete the request so that hopefully we can
 		 * return the error on the socket if they call connect() on it */
+		if (!ufds[i].revents &&
+			(conn->selectevents & (POLLIN | POLLOUT))) {
+		    ufds[i].revents = conn->selectevents & (POLLIN | POLLOUT);
+		    nevents++;
+		}
 	    } else {
 		/* The connection is done,  if the client polled for
 		 * writing we can go ahead and signal that now (since the socket must
 		 * be ready for writing), otherwise we'll just let the select loop
 		 * come around again (since we can't flag it for read, we don't know
 		 * if there is any data to be read and can't be bothered checking) */
-		if (conn->selectevents & WRITE) {
-		    setevents |= POLLOUT;
+		if (conn->selectevents & POLLOUT) {
+		    ufds[i].revents |= POLLOUT;
 		    nevents++;
 		}
 	    }
@@ -689,6 +1245,10 @@ int poll(POLL_SIGNATURE) {
 
 	ufds[i].events = conn->selectevents;
     }
+    pthread_mutex_unlock(&requests_lock);
+
+    stats_call(STAT_POLL, start, waited);
+    PROBE2(poll__return, nfds, nevents);
 
     return nevents;
 }
@@ -696,24 +1256,43 @@ int poll(POLL_SIGNATURE) {
 int close(CLOSE_SIGNATURE) {
     int rc;
     struct connreq *conn;
+#ifdef ENABLE_UDP
+    struct udpassoc *assoc;
+#endif
+    uint64_t start;
 
     if (realclose == NULL) {
 	show_msg(MSGERR, "Unresolved symbol: close\n");
 	return -1;
     }
 
-    show_msg(MSGDEBUG, "Call to close(%d)\n", fd);
+    start = stats_clock();
 
-    rc = realclose(fd);
+    show_msg(MSGDEBUG, "Call to close(%d)\n", fd);
 
     /* If we have this fd in our request handling list we
-     * remove it now */
-    if ((conn = find_socks_request(fd, 1))) {
+     * remove it now, before the fd can be reused by another
+     * thread */
+    pthread_mutex_lock(&requests_lock);
+    conn = find_socks_request(fd, 1);
+    pthread_mutex_unlock(&requests_lock);
+    if (conn) {
 	show_msg(MSGDEBUG, "Call to close() received on file descriptor "
 		"%d which is a connection request of status %d\n",
 		conn->sockid, conn->state);
 	kill_socks_request(conn);
     }
+    PROBE2(close, fd, (conn != NULL));
+#ifdef ENABLE_UDP
+    if (__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) &&
+	    ((assoc = udp_remove(fd)) != NULL))
+	end_association(assoc);
+#endif
+
+    stats_closing(fd);
+    trace_closed(fd);
+    rc = realclose(fd);
+    stats_call(STAT_CLOSE, start, 0);
 
     return rc;
 }
@@ -735,6 +1314,10 @@ int close(CLOSE_SIGNATURE) {
  */
 int getpeername(GETPEERNAME_SIGNATURE) {
     struct connreq *conn;
+#ifdef ENABLE_UDP
+    struct udpassoc *assoc;
+#endif
+    uint64_t start;
     int rc;
 
      if (realgetpeername == NULL) {
@@ -744,141 +1327,839 @@ int getpeername(GETPEERNAME_SIGNATURE) {
 
     show_msg(MSGDEBUG, "Call to getpeername for fd %d\n", __fd);
 
-
+    start = stats_clock();
     rc = realgetpeername(__fd, __name, __namelen);
-    if (rc == -1)
+    if (rc == -1) {
+        stats_call(STAT_GETPEERNAME, start, 0);
         return rc;
+    }
+
+#ifdef ENABLE_UDP
+    /* A UDP socket connected through its relay has the peer the */
+    /* caller connected it to                                     */
+    if (__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) &&
+	    ((assoc = udp_find(__fd)) != NULL) && assoc->peer.sin_family) {
+	memcpy(__name, &(assoc->peer), (*__namelen < sizeof(assoc->peer) ?
+		    *__namelen : sizeof(assoc->peer)));
+	*__namelen = sizeof(assoc->peer);
+    }
+#endif
 
     /* Are we handling this connect? */
-    if ((conn = find_socks_request(__fd, 1))) {
+    pthread_mutex_lock(&requests_lock);
+    conn = find_socks_request(__fd, 1);
+    pthread_mutex_unlock(&requests_lock);
+    if (conn) {
         /* While we are at it, we might was well try to do something useful */
         handle_request(conn);
 
         if (conn->state != DONE) {
             errno = ENOTCONN;
-            return(-1);
+            rc = -1;
         }
     }
+    stats_call(STAT_GETPEERNAME, start, 0);
     return rc;
 }
 
-static struct connreq *new_socks_request(int sockid, struct sockaddr_in *connaddr,
-	struct sockaddr_in *serveraddr,
-	struct serverent *path) {
-    struct connreq *newconn;
+/* Report the error a SOCKS request failed with as the socket's     */
+/* pending error. Programs waiting for a non blocking connect often */
+/* poll for the socket to be writable and then read SO_ERROR rather */
+/* than calling connect() again, and the socket's own error has     */
+/* been read by libtsocks by then (or there never was one, as when  */
+/* the SOCKS server refused the request)                             */
+int getsockopt(GETSOCKOPT_SIGNATURE) {
+    struct connreq *conn;
+    int err = 0;
 
-    if ((newconn = malloc(sizeof(*newconn))) == NULL) {
-	/* Could not malloc, we're stuffed */
-	show_msg(MSGERR, "Could not allocate memory for new socks request\n");
-	return NULL;
+    if (realgetsockopt == NULL) {
+	show_msg(MSGERR, "Unresolved symbol: getsockopt\n");
+	return(-1);
     }
 
-    /* Add this connection to be proxied to the list */
-    memset(newconn, 0x0, sizeof(*newconn));
-    newconn->sockid = sockid;
-    newconn->state = UNSTARTED;
-    newconn->path = path;
-    memcpy(&(newconn->connaddr), connaddr, sizeof(newconn->connaddr));
-    memcpy(&(newconn->serveraddr), serveraddr, sizeof(newconn->serveraddr));
-    newconn->next = requests;
-    requests = newconn;
+    if ((__level != SOL_SOCKET) || (__optname != SO_ERROR) ||
+	    (__optval == NULL) || (__optlen == NULL) ||
+	    (*__optlen < sizeof(int)))
+	return realgetsockopt(__fd, __level, __optname, __optval, __optlen);
 
-    return newconn;
+    pthread_mutex_lock(&requests_lock);
+    if (((conn = find_socks_request(__fd, 1)) != NULL) &&
+	    (conn->state == FAILED))
+	err = conn->err;
+    pthread_mutex_unlock(&requests_lock);
+    if (!err)
+	return realgetsockopt(__fd, __level, __optname, __optval, __optlen);
+
+    show_msg(MSGDEBUG, "Reporting error %d for failed request on socket %d "
+	    "as SO_ERROR\n", err, __fd);
+    *((int *) __optval) = err;
+    *__optlen = sizeof(int);
+
+    return 0;
 }
 
-static void kill_socks_request(struct connreq *conn) {
-    struct connreq *connnode;
+/* The resolver calls, when the configuration has domain rules the */
+/* names of the addresses they return are kept (see names.c) so    */
+/* connections to them can be routed by name. With TSOCKS_DNS_CACHE */
+/* set they are answered from the shared cache (see dnscache.c)     */
 
-    if (requests == conn)
-	requests = conn->next;
-    else {
-	for (connnode = requests; connnode != NULL; connnode = connnode->next) {
-	    if (connnode->next == conn) {
-		connnode->next = conn->next;
-		break;
-	    }
-	}
+int getaddrinfo(GETADDRINFO_SIGNATURE) {
+    struct addrinfo *ai;
+    int rc, saveerr, ttl = 0;
+
+    if (realgetaddrinfo == NULL) {
+	show_msg(MSGERR, "Unresolved symbol: getaddrinfo\n");
+	return EAI_SYSTEM;
     }
 
-    free(conn);
+#ifdef ENABLE_DNSCACHE
+    get_environment();
+    if (dnscache_open(suid))
+	rc = dnscache_getaddrinfo(realgetaddrinfo, realconnect, &ttl, __name,
+		__service, __req, __pai);
+    else
+#endif
+	rc = realgetaddrinfo(__name, __service, __req, __pai);
+    if (rc || (__name == NULL) || !want_names())
+	return rc;
+
+    saveerr = errno;
+    for (ai = *__pai; ai != NULL; ai = ai->ai_next) {
+	if (ai->ai_family == AF_INET)
+	    names_add(AF_INET, &(((struct sockaddr_in *) ai->ai_addr)->sin_addr),
+		    __name, ttl);
+	else if (ai->ai_family == AF_INET6)
+	    names_add(AF_INET6,
+		    &(((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr), __name,
+		    ttl);
+    }
+    errno = saveerr;
+
+    return rc;
 }
 
-static struct connreq *find_socks_request(int sockid, int includefinished) {
-    struct connreq *connnode;
+struct hostent *gethostbyname(GETHOSTBYNAME_SIGNATURE) {
+#ifdef ENABLE_DNSCACHE
+    /* Answers from the cache are kept for each thread, answers that */
+    /* don't fit come from the real call                             */
+    static __thread struct hostent hostbuf;
+    static __thread char buf[1024];
+    int herr;
+#endif
+    struct hostent *he;
+    int i, saveerr, ttl = 0;
 
-    for (connnode = requests; connnode != NULL; connnode = connnode->next) {
-	if (connnode->sockid == sockid) {
-	    if (((connnode->state == FAILED) || (connnode->state == DONE)) &&
-		    !includefinished)
-		break;
-	    else
-		return connnode;
-	}
+    if (realgethostbyname == NULL) {
+	show_msg(MSGERR, "Unresolved symbol: gethostbyname\n");
+	h_errno = NO_RECOVERY;
+	return NULL;
     }
 
-    return NULL;
+#ifdef ENABLE_DNSCACHE
+    get_environment();
+    if ((realgethostbyname_r != NULL) && dnscache_open(suid)) {
+	if (dnscache_gethostbyname_r(realgethostbyname_r, &ttl, __name,
+		    &hostbuf, buf, sizeof(buf), &he, &herr) == ERANGE)
+	    he = realgethostbyname(__name);
+	else if (he == NULL)
+	    h_errno = herr;
+    } else
+#endif
+	he = realgethostbyname(__name);
+    if ((he == NULL) || !want_names())
+	return he;
+
+    saveerr = errno;
+    for (i = 0; he->h_addr_list[i] != NULL; i++)
+	names_add(he->h_addrtype, he->h_addr_list[i], __name, ttl);
+    errno = saveerr;
+
+    return he;
 }
 
-static int handle_request(struct connreq *conn) {
-    int rc = 0;
-    int i = 0;
+int gethostbyname_r(GETHOSTBYNAME_R_SIGNATURE) {
+    int rc, i, saveerr, ttl = 0;
 
-    show_msg(MSGDEBUG, "Beginning handle loop for socket %d\n", conn->sockid);
+    if (realgethostbyname_r == NULL) {
+	show_msg(MSGERR, "Unresolved symbol: gethostbyname_r\n");
+	*__result = NULL;
+	*__h_errnop = NO_RECOVERY;
+	return ENOSYS;
+    }
 
-    while ((rc == 0) &&
-	    (conn->state != FAILED) &&
-	    (conn->state != DONE) &&
-	    (i++ < 20)) {
-	show_msg(MSGDEBUG, "In request handle loop for socket %d, "
-		"current state of request is %d\n", conn->sockid,
-		conn->state);
-	switch(conn->state) {
-	    case UNSTARTED:
-	    case CONNECTING:
-		rc = connect_server(conn);
-		break;
-	    case CONNECTED:
-		rc = send_socks_request(conn);
-		break;
-	    case SENDING:
-		rc = send_buffer(conn);
-		break;
-	    case RECEIVING:
-		rc = recv_buffer(conn);
-		break;
-	    case SENTV4REQ:
-		show_msg(MSGDEBUG, "Receiving reply to SOCKS V4 connect request\n");
-		conn->datalen = sizeof(struct sockrep);
-		conn->datadone = 0;
-		conn->state = RECEIVING;
-		conn->nextstate = GOTV4REQ;
-		break;
-	    case GOTV4REQ:
-		rc = read_socksv4_req(conn);
-		break;
-	    case SENTV5METHOD:
-		show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 method negotiation\n");
-		conn->datalen = 2;
-		conn->datadone = 0;
-		conn->state = RECEIVING;
-		conn->nextstate = GOTV5METHOD;
-		break;
-	    case GOTV5METHOD:
-		rc = read_socksv5_method(conn);
-		break;
-	    case SENTV5AUTH:
-		show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 authentication negotiation\n");
-		conn->datalen = 2;
-		conn->datadone = 0;
-		conn->state = RECEIVING;
-		conn->nextstate = GOTV5AUTH;
+#ifdef ENABLE_DNSCACHE
+    get_environment();
+    if (dnscache_open(suid))
+	rc = dnscache_gethostbyname_r(realgethostbyname_r, &ttl, __name,
+		__result_buf, __buf, __buflen, __result, __h_errnop);
+    else
+#endif
+	rc = realgethostbyname_r(__name, __result_buf, __buf, __buflen,
+		__result, __h_errnop);
+    if (rc || (*__result == NULL) || !want_names())
+	return rc;
+
+    saveerr = errno;
+    for (i = 0; (*__result)->h_addr_list[i] != NULL; i++)
+	names_add((*__result)->h_addrtype, (*__result)->h_addr_list[i], __name,
+		ttl);
+    errno = saveerr;
+
+    return rc;
+}
+
+/* Names are only kept when the configuration has domain rules */
+static int want_names() {
+    struct confref *ref;
+    int want;
+
+    get_environment();
+    if ((ref = hold_config()) == NULL)
+	return 0;
+    want = (ref->conf.index.domains.nrules != 0);
+    release_config(ref);
+
+    return want;
+}
+
+#ifdef ENABLE_UDP
+/* The calls that send and receive datagrams. While TSOCKS_UDP is  */
+/* set a UDP socket's datagrams for destinations that aren't local */
+/* go through a SOCKS 5 UDP association (see udp.c), the rest go   */
+/* straight to the real calls. Every call is handled as a batch of */
+/* messages so sendmmsg() and recvmmsg() stay one system call for  */
+/* each batch of up to UDP_BATCH messages                          */
+
+ssize_t send(SEND_SIGNATURE) {
+    struct iovec iov = { (void *) __buf, __n };
+    struct udpassoc *assoc;
+    struct mmsghdr msg;
+
+    get_environment();
+    if (!udp || !__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) ||
+	    ((assoc = udp_find(__fd)) == NULL) || !assoc->peer.sin_family)
+	return realsend(__fd, __buf, __n, __flags);
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+
+    return (send_datagrams(__fd, &msg, 1, __flags, 0) == 1 ?
+	    (ssize_t) msg.msg_len : -1);
+}
+
+ssize_t recv(RECV_SIGNATURE) {
+    struct iovec iov = { __buf, __n };
+    struct udpassoc *assoc;
+    struct mmsghdr msg;
+
+    get_environment();
+    if (!udp || !__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) ||
+	    ((assoc = udp_find(__fd)) == NULL))
+	return realrecv(__fd, __buf, __n, __flags);
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+
+    return (recv_datagrams(assoc, __fd, &msg, 1, __flags, NULL, 0) == 1 ?
+	    (ssize_t) msg.msg_len : -1);
+}
+
+ssize_t sendto(SENDTO_SIGNATURE) {
+    struct iovec iov = { (void *) __buf, __n };
+    struct mmsghdr msg;
+
+    get_environment();
+    if (!udp || ((__addr == NULL) && (!__atomic_load_n(&udpsockets,
+			__ATOMIC_ACQUIRE) || (udp_find(__fd) == NULL))))
+	return realsendto(__fd, __buf, __n, __flags, __addr, __addr_len);
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_hdr.msg_name = (void *) __addr;
+    msg.msg_hdr.msg_namelen = __addr_len;
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+
+    return (send_datagrams(__fd, &msg, 1, __flags, 0) == 1 ?
+	    (ssize_t) msg.msg_len : -1);
+}
+
+ssize_t recvfrom(RECVFROM_SIGNATURE) {
+    struct iovec iov = { __buf, __n };
+    struct udpassoc *assoc;
+    struct mmsghdr msg;
+
+    get_environment();
+    if (!udp || !__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) ||
+	    ((assoc = udp_find(__fd)) == NULL))
+	return realrecvfrom(__fd, __buf, __n, __flags, __addr, __addr_len);
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_hdr.msg_name = __addr;
+    msg.msg_hdr.msg_namelen = (__addr_len ? *__addr_len : 0);
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+
+    if (recv_datagrams(assoc, __fd, &msg, 1, __flags, NULL, 0) != 1)
+	return -1;
+    if (__addr_len)
+	*__addr_len = msg.msg_hdr.msg_namelen;
+
+    return msg.msg_len;
+}
+
+ssize_t sendmsg(SENDMSG_SIGNATURE) {
+    struct mmsghdr msg;
+
+    get_environment();
+    if (!udp || ((__message->msg_name == NULL) &&
+		(!__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) ||
+		 (udp_find(__fd) == NULL))))
+	return realsendmsg(__fd, __message, __flags);
+
+    msg.msg_hdr = *__message;
+    msg.msg_len = 0;
+
+    return (send_datagrams(__fd, &msg, 1, __flags, 0) == 1 ?
+	    (ssize_t) msg.msg_len : -1);
+}
+
+ssize_t recvmsg(RECVMSG_SIGNATURE) {
+    struct udpassoc *assoc;
+    struct mmsghdr msg;
+
+    get_environment();
+    if (!udp || !__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) ||
+	    ((assoc = udp_find(__fd)) == NULL))
+	return realrecvmsg(__fd, __message, __flags);
+
+    msg.msg_hdr = *__message;
+    msg.msg_len = 0;
+    if (recv_datagrams(assoc, __fd, &msg, 1, __flags, NULL, 0) != 1)
+	return -1;
+    *__message = msg.msg_hdr;
+
+    return msg.msg_len;
+}
+
+int sendmmsg(SENDMMSG_SIGNATURE) {
+
+    get_environment();
+    if (!udp)
+	return realsendmmsg(__fd, __vmessages, __vlen, __flags);
+
+    return send_datagrams(__fd, __vmessages, __vlen, __flags, 1);
+}
+
+int recvmmsg(RECVMMSG_SIGNATURE) {
+    struct udpassoc *assoc;
+
+    get_environment();
+    if (!udp || !__atomic_load_n(&udpsockets, __ATOMIC_ACQUIRE) ||
+	    ((assoc = udp_find(__fd)) == NULL))
+	return realrecvmmsg(__fd, __vmessages, __vlen, __flags, __tmo);
+
+    return recv_datagrams(assoc, __fd, __vmessages, __vlen, __flags,
+	    (struct timespec *) __tmo, 1);
+}
+
+/* connect() on a UDP socket: a destination that isn't local is */
+/* remembered as the peer and the socket really connected to the */
+/* relay, so it only receives what comes through the relay       */
+static int udp_connect(CONNECT_SIGNATURE) {
+    struct sockaddr_in *dst = (struct sockaddr_in *) __addr;
+    struct udpassoc *assoc;
+    struct mmsghdr msg;
+    int route = UDP_DIRECT;
+
+    assoc = udp_find(__fd);
+    if ((__len >= sizeof(*dst)) && (dst->sin_family == AF_INET)) {
+	if (assoc) {
+	    route = udp_lookup(assoc, dst);
+	} else {
+	    memset(&msg, 0x0, sizeof(msg));
+	    msg.msg_hdr.msg_name = dst;
+	    msg.msg_hdr.msg_namelen = sizeof(*dst);
+	    if ((route = start_association(__fd, &msg, 1)) < 0)
+		return -1;
+	    assoc = udp_find(__fd);
+	}
+    }
+
+    if (route == UDP_UNROUTABLE) {
+	errno = ENETUNREACH;
+	return -1;
+    }
+    if ((route == UDP_DIRECT) || (assoc == NULL)) {
+	if (assoc)
+	    memset(&(assoc->peer), 0x0, sizeof(assoc->peer));
+	return realconnect(__fd, __addr, __len);
+    }
+
+    show_msg(MSGDEBUG, "UDP socket %d connected to %s through its relay\n",
+	    __fd, inet_ntoa(dst->sin_addr));
+    memcpy(&(assoc->peer), dst, sizeof(assoc->peer));
+
+    return realconnect(__fd, (CONNECT_SOCKARG) &(assoc->relay),
+	    sizeof(assoc->relay));
+}
+
+/* Make the association for a socket if one of the messages needs */
+/* to be relayed, returns 1 if it was made, 0 if none is needed   */
+/* and -1 (with errno set) if it can't be made                    */
+static int start_association(int fd, struct mmsghdr *msgs, unsigned int n) {
+    struct sockaddr_in *dst;
+    struct serverent *path;
+    struct confref *ref;
+    int type = -1, route, rc = 0;
+    socklen_t len = sizeof(type);
+    unsigned int i;
+
+    if ((ref = hold_config()) == NULL)
+	return 0;
+
+    for (i = 0; i < n; i++) {
+	dst = msgs[i].msg_hdr.msg_name;
+	if ((dst == NULL) || (msgs[i].msg_hdr.msg_namelen < sizeof(*dst)) ||
+		(dst->sin_family != AF_INET))
+	    continue;
+	if ((route = udp_route(&(ref->conf), dst, &path)) == UDP_DIRECT)
+	    continue;
+
+	/* Only UDP sockets, sendto() on a TCP socket (Fast Open) is */
+	/* left to connect()                                         */
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) ||
+		(type != SOCK_DGRAM))
+	    break;
+	if (route == UDP_UNROUTABLE) {
+	    show_msg(MSGERR, "UDP to %s needs to be relayed but no SOCKS 5 "
+		    "server is specified for it\n", inet_ntoa(dst->sin_addr));
+	    errno = ENETUNREACH;
+	    rc = -1;
+	} else {
+	    rc = associate(fd, ref, path);
+	}
+	break;
+    }
+    release_config(ref);
+
+    return rc;
+}
+
+/* Ask the SOCKS 5 server for path for a UDP association for a */
+/* socket, over a connection of its own that lasts as long as  */
+/* the socket. The request is made like a blocking connect()   */
+static int associate(int fd, struct confref *ref, struct serverent *path) {
+    struct sockaddr_in server, any;
+    struct udpassoc *assoc, *existing;
+    struct connreq *conn;
+    unsigned int res;
+    int ctlfd, rc;
+
+    if ((res = resolve_ip(path->address, 0, HOSTNAMES)) == -1) {
+	show_msg(MSGERR, "The SOCKS server (%s) listed in the configuration "
+		"file which needs to be used for this UDP is invalid\n",
+		path->address);
+	errno = ENETUNREACH;
+	return -1;
+    }
+    memset(&server, 0x0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = res;
+    server.sin_port = htons(path->port);
+    if (is_local(&(ref->conf), &(server.sin_addr))) {
+	show_msg(MSGERR, "SOCKS server %s (%s) is not on a local subnet!\n",
+		path->address, inet_ntoa(server.sin_addr));
+	errno = ENETUNREACH;
+	return -1;
+    }
+
+    /* The request is for whatever address and port the socket */
+    /* sends from                                               */
+    memset(&any, 0x0, sizeof(any));
+    any.sin_family = AF_INET;
+    if ((ctlfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+    fcntl(ctlfd, F_SETFD, FD_CLOEXEC);
+    if ((conn = new_socks_request(ctlfd, &any, NULL, AF_INET, &server, path,
+		    ref)) == NULL) {
+	realclose(ctlfd);
+	errno = ENOMEM;
+	return -1;
+    }
+    conn->command = SOCKS_UDPASSOCIATE;
+    rc = handle_request(conn);
+    if ((conn->state != DONE) || (conn->buffer[3] != 1)) {
+	if (conn->state == DONE)
+	    show_msg(MSGERR, "SOCKS server relays UDP from an address "
+		    "that isn't IPv4\n");
+	kill_socks_request(conn);
+	realclose(ctlfd);
+	errno = (rc ? rc : ECONNABORTED);
+	return -1;
+    }
+
+    if ((assoc = malloc(sizeof(*assoc))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for UDP association\n");
+	exit(1);
+    }
+    memset(assoc, 0x0, sizeof(*assoc));
+    assoc->sockid = fd;
+    assoc->ctlfd = ctlfd;
+    assoc->path = path;
+    assoc->relay.sin_family = AF_INET;
+    memcpy(&(assoc->relay.sin_addr), &(conn->buffer[4]), 4);
+    memcpy(&(assoc->relay.sin_port), &(conn->buffer[8]), 2);
+    kill_socks_request(conn);
+    /* Servers often leave it to us to know where they are */
+    if (!assoc->relay.sin_addr.s_addr)
+	assoc->relay.sin_addr = server.sin_addr;
+    assoc->config = ref;
+    __atomic_add_fetch(&(ref->refs), 1, __ATOMIC_ACQ_REL);
+
+    if ((existing = udp_insert(assoc)) != assoc) {
+	/* Another thread associated the socket first */
+	end_association(assoc);
+	if (existing == NULL) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	return 1;
+    }
+    show_msg(MSGDEBUG, "UDP for socket %d is relayed by %s:%d\n", fd,
+	    inet_ntoa(assoc->relay.sin_addr), ntohs(assoc->relay.sin_port));
+
+    return 1;
+}
+
+/* End an association taken out of the index, closing its */
+/* connection to the server ends it there too              */
+static void end_association(struct udpassoc *assoc) {
+
+    stats_closing(assoc->ctlfd);
+    realclose(assoc->ctlfd);
+    release_config(assoc->config);
+    free(assoc);
+}
+
+/* Send a batch of messages, those for destinations that aren't */
+/* local through the socket's association, returns the number   */
+/* sent like sendmmsg(). batch says whether the caller sent a   */
+/* batch or one message                                         */
+static int send_datagrams(int fd, struct mmsghdr *msgs, unsigned int n,
+	int flags, int batch) {
+    struct mmsghdr out[UDP_BATCH];
+    struct udpwrap wraps[UDP_BATCH];
+    struct iovec iovs[UDP_IOVS];
+    struct sockaddr_in *dst;
+    struct udpassoc *assoc;
+    struct msghdr *in;
+    unsigned int done = 0, count, used, i;
+    int route, stop = 0, rc;
+
+    if ((assoc = udp_find(fd)) == NULL) {
+	if ((rc = start_association(fd, msgs, n)) < 0)
+	    return -1;
+	if ((rc == 0) || ((assoc = udp_find(fd)) == NULL))
+	    return real_send(fd, msgs, n, flags, batch);
+    }
+
+    while ((done < n) && !stop) {
+	for (count = 0, used = 0; (count < UDP_BATCH) && (done + count < n);
+		count++) {
+	    in = &(msgs[done + count].msg_hdr);
+	    dst = in->msg_name;
+	    if (dst == NULL)
+		dst = (assoc->peer.sin_family ? &(assoc->peer) : NULL);
+	    else if ((in->msg_namelen < sizeof(*dst)) ||
+		    (dst->sin_family != AF_INET))
+		dst = NULL;
+
+	    wraps[count].wrapped = 0;
+	    if ((route = (dst ? udp_lookup(assoc, dst) : UDP_DIRECT)) ==
+		    UDP_UNROUTABLE) {
+		errno = ENETUNREACH;
+		stop = 1;
+		break;
+	    }
+	    if (route == UDP_DIRECT) {
+		out[count].msg_hdr = *in;
+		continue;
+	    }
+	    if (used + in->msg_iovlen + 1 > UDP_IOVS) {
+		if (count == 0) {
+		    errno = EMSGSIZE;
+		    stop = 1;
+		}
+		break;
+	    }
+	    udp_wrap(assoc, &wraps[count], &(out[count].msg_hdr),
+		    &iovs[used], in, dst);
+	    used += in->msg_iovlen + 1;
+	}
+	if (count == 0)
+	    break;
+
+	if ((rc = real_send(fd, out, count, flags, batch)) < 0)
+	    break;
+	for (i = 0; i < (unsigned int) rc; i++)
+	    msgs[done + i].msg_len = out[i].msg_len -
+		(wraps[i].wrapped ? UDP_HEADER : 0);
+	done += rc;
+	if ((unsigned int) rc < count)
+	    break;
+    }
+
+    return (done ? (int) done : -1);
+}
+
+/* Send messages with the real call the caller used */
+static int real_send(int fd, struct mmsghdr *msgs, unsigned int n,
+	int flags, int batch) {
+    ssize_t rc;
+
+    if (batch)
+	return realsendmmsg(fd, msgs, n, flags);
+
+    if ((rc = realsendmsg(fd, &(msgs[0].msg_hdr), flags)) < 0)
+	return -1;
+    msgs[0].msg_len = rc;
+
+    return 1;
+}
+
+/* Receive a batch of messages on a socket with an association, */
+/* returns the number received like recvmmsg(). Datagrams that  */
+/* can't be given back to the caller are dropped                */
+static int recv_datagrams(struct udpassoc *assoc, int fd,
+	struct mmsghdr *msgs, unsigned int n, int flags,
+	struct timespec *timeout, int batch) {
+    struct mmsghdr out[UDP_BATCH];
+    struct udpwrap wraps[UDP_BATCH];
+    struct iovec iovs[UDP_IOVS];
+    struct msghdr *in;
+    unsigned int count, used, i;
+    ssize_t rc;
+    size_t len;
+
+    do {
+	for (count = 0, used = 0; (count < n) && (count < UDP_BATCH);
+		count++) {
+	    in = &(msgs[count].msg_hdr);
+	    if (used + in->msg_iovlen + 1 > UDP_IOVS)
+		break;
+	    udp_prepare(&wraps[count], &(out[count].msg_hdr), &iovs[used],
+		    in);
+	    used += in->msg_iovlen + 1;
+	}
+	if (count == 0) {
+	    errno = EMSGSIZE;
+	    return -1;
+	}
+
+	if (batch) {
+	    if ((rc = realrecvmmsg(fd, out, count, flags, (void *) timeout)) <= 0)
+		return rc;
+	} else {
+	    if ((rc = realrecvmsg(fd, &(out[0].msg_hdr), flags)) < 0)
+		return -1;
+	    out[0].msg_len = rc;
+	    rc = 1;
+	}
+
+	for (i = 0; i < (unsigned int) rc; i++) {
+	    len = out[i].msg_len;
+	    if (udp_unwrap(assoc, &wraps[i], &(out[i].msg_hdr),
+			&(msgs[i].msg_hdr), &len))
+		break;
+	    msgs[i].msg_len = len;
+	}
+	if (i < (unsigned int) rc) {
+	    show_msg(MSGDEBUG, "Dropped a datagram on socket %d the relay "
+		    "can't give back\n", fd);
+	    /* A peeked datagram has to be taken off the socket */
+	    if (flags & MSG_PEEK)
+		realrecv(fd, NULL, 0, (flags & ~MSG_PEEK) | MSG_DONTWAIT);
+	}
+	/* Datagrams received after a dropped one are lost with it, */
+	/* unless it was the first in which case try again          */
+    } while (i == 0);
+
+    return i;
+}
+#endif
+
+static struct connreq *new_socks_request(int sockid, struct sockaddr_in *connaddr,
+	struct in6_addr *connaddr6, int family, struct sockaddr_in *serveraddr,
+	struct serverent *path, struct confref *ref) {
+    struct connreq *newconn;
+
+    if ((newconn = malloc(sizeof(*newconn))) == NULL) {
+	/* Could not malloc, we're stuffed */
+	show_msg(MSGERR, "Could not allocate memory for new socks request\n");
+	return NULL;
+    }
+
+    /* Add this connection to be proxied to the list */
+    memset(newconn, 0x0, sizeof(*newconn));
+    newconn->sockid = sockid;
+    newconn->state = UNSTARTED;
+    newconn->path = path;
+    newconn->config = ref;
+    newconn->command = SOCKS_CONNECT;
+    newconn->started = stats_clock();
+    trace_state(newconn);
+    __atomic_add_fetch(&(ref->refs), 1, __ATOMIC_ACQ_REL);
+    memcpy(&(newconn->connaddr), connaddr, sizeof(newconn->connaddr));
+    if (connaddr6)
+	memcpy(&(newconn->connaddr6), connaddr6, sizeof(newconn->connaddr6));
+    newconn->family = family;
+    memcpy(&(newconn->serveraddr), serveraddr, sizeof(newconn->serveraddr));
+    if (path->chain)
+	chain_hops(newconn);
+    pthread_mutex_lock(&requests_lock);
+    newconn->next = requests;
+    __atomic_store_n(&requests, newconn, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&requests_lock);
+
+    return newconn;
+}
+
+static void kill_socks_request(struct connreq *conn) {
+    struct connreq *connnode;
+
+    pthread_mutex_lock(&requests_lock);
+    if (requests == conn)
+	__atomic_store_n(&requests, conn->next, __ATOMIC_RELAXED);
+    else {
+	for (connnode = requests; connnode != NULL; connnode = connnode->next) {
+	    if (connnode->next == conn) {
+		connnode->next = conn->next;
+		break;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&requests_lock);
+
+    release_config(conn->config);
+    free(conn);
+}
+
+/* requests_lock must be held */
+static struct connreq *find_socks_request(int sockid, int includefinished) {
+    struct connreq *connnode;
+
+    for (connnode = requests; connnode != NULL; connnode = connnode->next) {
+	if (connnode->sockid == sockid) {
+	    if (((connnode->state == FAILED) || (connnode->state == DONE)) &&
+		    !includefinished)
+		break;
+	    else
+		return connnode;
+	}
+    }
+
+    return NULL;
+}
+
+/* Count a request that has just completed or failed, once */
+static void finish_request(struct connreq *conn) {
+
+    if (conn->finished)
+	return;
+    conn->finished = 1;
+    trace_state(conn);
+    trace_request(conn);
+    PROBE4(done, conn->sockid, (conn->state == DONE), conn->err,
+	    conn->path->lineno);
+    stats_request(conn->path, (conn->state == DONE ? STAT_COMPLETED :
+		STAT_FAILED), conn->started);
+    if (conn->state == DONE)
+	stats_tag(conn->sockid, conn->path);
+}
+
+/* The error pending on a socket that select() or poll() flagged, */
+/* if there isn't one the SOCKS server must have hung up. Reading  */
+/* it clears it, getsockopt() reports it to the caller instead     */
+static int socket_error(int sockid) {
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (realgetsockopt(sockid, SOL_SOCKET, SO_ERROR, &err, &len) || !err)
+	err = ECONNRESET;
+
+    return err;
+}
+
+static int handle_request(struct connreq *conn) {
+    int limit = 20 * (conn->nhops + 1);
+    int rc = 0;
+    int i = 0;
+    int prev;
+
+    show_msg(MSGDEBUG, "Beginning handle loop for socket %d\n", conn->sockid);
+
+    while ((rc == 0) &&
+	    (conn->state != FAILED) &&
+	    (conn->state != DONE) &&
+	    (i++ < limit)) {
+	show_msg(MSGDEBUG, "In request handle loop for socket %d, "
+		"current state of request is %d\n", conn->sockid,
+		conn->state);
+	prev = conn->state;
+	switch(conn->state) {
+	    case UNSTARTED:
+	    case CONNECTING:
+		rc = connect_server(conn);
+		break;
+	    case CONNECTED:
+		rc = send_socks_request(conn);
+		break;
+	    case SENDING:
+		rc = send_buffer(conn);
+		break;
+	    case RECEIVING:
+		if (conn->nextstate == GOTHTTPCONNECT)
+		    rc = recv_http_reply(conn);
+		else
+		    rc = recv_buffer(conn);
+		break;
+	    case SENTV4REQ:
+		show_msg(MSGDEBUG, "Receiving reply to SOCKS V4 connect request\n");
+		conn->datalen = sizeof(struct sockrep);
+		conn->datadone = 0;
+		conn->state = RECEIVING;
+		conn->nextstate = GOTV4REQ;
+		break;
+	    case GOTV4REQ:
+		rc = read_socksv4_req(conn);
+		break;
+	    case SENTV5METHOD:
+		show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 method negotiation\n");
+		conn->datalen = 2;
+		conn->datadone = 0;
+		conn->state = RECEIVING;
+		conn->nextstate = GOTV5METHOD;
+		break;
+	    case GOTV5METHOD:
+		rc = read_socksv5_method(conn);
+		break;
+	    case SENTV5AUTH:
+		show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 authentication negotiation\n");
+		conn->datalen = 2;
+		conn->datadone = 0;
+		conn->state = RECEIVING;
+		conn->nextstate = GOTV5AUTH;
 		break;
 	    case GOTV5AUTH:
 		rc = read_socksv5_auth(conn);
 		break;
 	    case SENTV5CONNECT:
 		show_msg(MSGDEBUG, "Receiving reply to SOCKS V5 connect request\n");
-		conn->datalen = 10;
+		/* Up to the bound address's type and the length of a */
+		/* name, the rest is sized by them                    */
+		conn->datalen = 5;
 		conn->datadone = 0;
 		conn->state = RECEIVING;
 		conn->nextstate = GOTV5CONNECT;
@@ -886,29 +2167,66 @@ static int handle_request(struct connreq *conn) {
 	    case GOTV5CONNECT:
 		rc = read_socksv5_connect(conn);
 		break;
+	    case SENTHTTPCONNECT:
+		show_msg(MSGDEBUG, "Receiving reply to HTTP CONNECT request\n");
+		conn->datalen = 0;
+		conn->datadone = 0;
+		conn->httpstatus = 0;
+		conn->state = RECEIVING;
+		conn->nextstate = GOTHTTPCONNECT;
+		break;
+	    case GOTHTTPCONNECT:
+		rc = read_http_reply(conn);
+		break;
 	}
 
-	conn->err = errno;
+	/* Keep the error to report when the caller asks with connect() */
+	conn->err = (rc ? rc : errno);
+	trace_state(conn);
+	if (conn->state != prev)
+	    PROBE3(state, conn->sockid, prev, conn->state);
     }
 
-    if (i == 20)
+    if (i == limit)
 	show_msg(MSGERR, "Ooops, state loop while handling request %d\n",
 		conn->sockid);
 
+    if ((conn->state == FAILED) || (conn->state == DONE))
+	finish_request(conn);
+
     show_msg(MSGDEBUG, "Handle loop completed for socket %d in state %d, "
 	    "returning %d\n", conn->sockid, conn->state, rc);
     return rc;
 }
 
 static int connect_server(struct connreq *conn) {
-    int rc;
+    struct sockaddr_in6 mapped;
+    int rc, off = 0;
 
     /* Connect this socket to the socks server */
     show_msg(MSGDEBUG, "Connecting to %s port %d\n",
 	    inet_ntoa(conn->serveraddr.sin_addr), ntohs(conn->serveraddr.sin_port));
 
-    rc = realconnect(conn->sockid, (CONNECT_SOCKARG) &(conn->serveraddr),
-	    sizeof(conn->serveraddr));
+    if (conn->family == AF_INET6) {
+	/* An IPv6 socket reaches the server at its IPv4-mapped address, */
+	/* which it can't if it is IPV6_V6ONLY (set by the program or by */
+	/* net.ipv6.bindv6only). It isn't connected yet so that can      */
+	/* still be turned off, unless it was bound to an IPv6 address    */
+	if (setsockopt(conn->sockid, IPPROTO_IPV6, IPV6_V6ONLY, &off,
+		    sizeof(off)))
+	    show_msg(MSGDEBUG, "Could not turn off IPV6_V6ONLY on socket %d "
+		    "(%s)\n", conn->sockid, strerror(errno));
+	memset(&mapped, 0x0, sizeof(mapped));
+	mapped.sin6_family = AF_INET6;
+	mapped.sin6_port = conn->serveraddr.sin_port;
+	mapped.sin6_addr.s6_addr[10] = mapped.sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&(mapped.sin6_addr.s6_addr[12]), &(conn->serveraddr.sin_addr), 4);
+	rc = realconnect(conn->sockid, (CONNECT_SOCKARG) &mapped,
+		sizeof(mapped));
+    } else {
+	rc = realconnect(conn->sockid, (CONNECT_SOCKARG) &(conn->serveraddr),
+		sizeof(conn->serveraddr));
+    }
 
     show_msg(MSGDEBUG, "Connect returned %d, errno is %d\n", rc, errno);
     if (rc) {
@@ -931,8 +2249,22 @@ static int connect_server(struct connreq *conn) {
 static int send_socks_request(struct connreq *conn) {
     int rc = 0;
 
+    /* The servers of a chain are all asked at once if their      */
+    /* messages fit in the buffer and no SOCKS 5 server has to     */
+    /* choose between authenticating or not first, or else one at */
+    /* a time                                                      */
+    if (conn->nhops && (conn->hop == 0) &&
+	    ((conn->path->type != 5) || !have_password(conn))) {
+	if ((rc = send_chain(conn)) >= 0)
+	    return rc;
+	show_msg(MSGDEBUG, "Negotiating with the servers of the chain one "
+		"at a time\n");
+    }
+
     if (conn->path->type == 4)
 	rc = send_socksv4_request(conn);
+    else if (conn->path->type == SERVER_HTTP)
+	rc = send_http_request(conn);
     else
 	rc = send_socksv5_method(conn);
 
@@ -940,34 +2272,16 @@ static int send_socks_request(struct connreq *conn) {
 }
 
 static int send_socksv4_request(struct connreq *conn) {
-    struct passwd *user;
-    struct sockreq *thisreq;
-
-    /* Determine the current username */
-    user = getpwuid(getuid());
-
-    thisreq = (struct sockreq *) conn->buffer;
 
     /* Check the buffer has enough space for the request  */
     /* and the user name                                  */
-    conn->datalen = sizeof(struct sockreq) +
-	(user == NULL ? 0 : strlen(user->pw_name)) + 1;
-    if (sizeof(conn->buffer) < conn->datalen) {
+    if ((conn->datalen = socksv4_request(conn, conn->hop, conn->buffer,
+		    sizeof(conn->buffer))) < 0) {
 	show_msg(MSGERR, "The SOCKS username is too long");
 	conn->state = FAILED;
 	return ECONNREFUSED;
     }
 
-    /* Create the request */
-    thisreq->version = 4;
-    thisreq->command = 1;
-    thisreq->dstport = conn->connaddr.sin_port;
-    thisreq->dstip   = conn->connaddr.sin_addr.s_addr;
-
-    /* Copy the username */
-    strcpy((char *) thisreq + sizeof(struct sockreq),
-	    (user == NULL ? "" : user->pw_name));
-
     conn->datadone = 0;
     conn->state = SENDING;
     conn->nextstate = SENTV4REQ;
@@ -992,26 +2306,383 @@ static int send_socksv5_method(struct connreq *conn) {
 }
 
 static int send_socksv5_connect(struct connreq *conn) {
-    char constring[] = { 0x05,    /* Version 5 SOCKS */
-	0x01,    /* Connect request */
-	0x00,    /* Reserved        */
-	0x01 };  /* IP Version 4    */
+    char verstring[] = { 0x05, 0x02, 0x00, 0x02 };
 
     show_msg(MSGDEBUG, "Constructing V5 connect request\n");
     conn->datadone = 0;
     conn->state = SENDING;
     conn->nextstate = SENTV5CONNECT;
-    memcpy(conn->buffer, constring, sizeof(constring));
-    conn->datalen = sizeof(constring);
-    memcpy(&conn->buffer[conn->datalen], &(conn->connaddr.sin_addr.s_addr),
-	    sizeof(conn->connaddr.sin_addr.s_addr));
-    conn->datalen += sizeof(conn->connaddr.sin_addr.s_addr);
-    memcpy(&conn->buffer[conn->datalen], &(conn->connaddr.sin_port), sizeof(conn->connaddr.sin_port));
-    conn->datalen += sizeof(conn->connaddr.sin_port);
+    conn->datalen = socksv5_connect(conn, conn->hop, conn->buffer,
+	    sizeof(conn->buffer));
+
+    /* The next server of a chain can be offered its methods along */
+    /* with the request to connect to it, it doesn't depend on     */
+    /* what this one chose                                         */
+    if ((conn->hop < conn->nhops) &&
+	    (conn->datalen + sizeof(verstring) <= sizeof(conn->buffer))) {
+	memcpy(conn->buffer + conn->datalen, verstring, sizeof(verstring));
+	conn->datalen += sizeof(verstring);
+	conn->offered = 1;
+    }
+
+    return 0;
+}
+
+/* Ask an HTTP proxy for a tunnel with a CONNECT request, sent in */
+/* one write, with Basic authentication if there is a password    */
+static int send_http_request(struct connreq *conn) {
+    char *uname = NULL, *upass = NULL;
+    int rc;
+
+    if (have_password(conn) &&
+	    (rc = socks_credentials(conn, &uname, &upass)))
+	return rc;
+
+    show_msg(MSGDEBUG, "Constructing HTTP CONNECT request\n");
+    if ((conn->datalen = http_request(conn, conn->hop, uname, upass,
+		    conn->buffer, sizeof(conn->buffer))) < 0) {
+	show_msg(MSGERR, "The supplied HTTP proxy username or "
+		"password is too long");
+	conn->state = FAILED;
+	return ECONNREFUSED;
+    }
+
+    conn->datadone = 0;
+    conn->state = SENDING;
+    conn->nextstate = SENTHTTPCONNECT;
 
     return 0;
 }
 
+/* Put every message for the servers of a chain in the buffer to */
+/* send at once. Each server passes on what follows its messages  */
+/* once it has connected to the next, so the replies come back    */
+/* one after the other without waiting for a round trip to each   */
+/* server in turn. Only used when every server's messages are     */
+/* known up front: SOCKS 5 servers are only offered no            */
+/* authentication (there is no password), HTTP proxies are sent   */
+/* Basic authentication if there is one. Returns -1 if the        */
+/* messages don't fit                                             */
+static int send_chain(struct connreq *conn) {
+    char *uname = NULL, *upass = NULL;
+    int hop, len, rc;
+
+    if ((conn->path->type == SERVER_HTTP) && have_password(conn) &&
+	    (rc = socks_credentials(conn, &uname, &upass)))
+	return rc;
+
+    show_msg(MSGDEBUG, "Constructing requests for a chain of %d servers\n",
+	    conn->nhops + 1);
+    conn->datalen = 0;
+    for (hop = 0; hop <= conn->nhops; hop++) {
+	if (conn->path->type == SERVER_HTTP) {
+	    if ((len = http_request(conn, hop, uname, upass,
+			    conn->buffer + conn->datalen,
+			    sizeof(conn->buffer) - conn->datalen)) < 0)
+		return -1;
+	    conn->datalen += len;
+	    continue;
+	}
+	if (conn->path->type == 4) {
+	    if ((len = socksv4_request(conn, hop,
+			    conn->buffer + conn->datalen,
+			    sizeof(conn->buffer) - conn->datalen)) < 0)
+		return -1;
+	    conn->datalen += len;
+	    continue;
+	}
+
+	if (sizeof(conn->buffer) - conn->datalen < 3)
+	    return -1;
+	conn->buffer[conn->datalen++] = 0x05; /* Version 5 SOCKS */
+	conn->buffer[conn->datalen++] = 0x01; /* No. Methods     */
+	conn->buffer[conn->datalen++] = 0x00; /* Null Auth       */
+	if ((len = socksv5_connect(conn, hop, conn->buffer + conn->datalen,
+			sizeof(conn->buffer) - conn->datalen)) < 0)
+	    return -1;
+	conn->datalen += len;
+    }
+
+    conn->pipelined = 1;
+    conn->datadone = 0;
+    conn->state = SENDING;
+    conn->nextstate = sent_state(conn);
+
+    return 0;
+}
+
+/* Read the servers a chain goes through after the first, the */
+/* parser has already checked the string                       */
+static void chain_hops(struct connreq *conn) {
+    struct chainhop *hop;
+    const char *next, *colon;
+    char host[256];
+
+    next = conn->path->chain;
+    while ((next != NULL) && (conn->nhops < CHAIN_MAXHOPS - 1) &&
+	    ((colon = strchr(next, ':')) != NULL) &&
+	    (colon - next < sizeof(host))) {
+	hop = &(conn->hops[conn->nhops++]);
+	hop->host = next;
+	hop->hostlen = colon - next;
+	hop->port = htons(atoi(colon + 1));
+	memcpy(host, next, hop->hostlen);
+	host[hop->hostlen] = '\0';
+	if (inet_pton(AF_INET, host, &(hop->addr)) == 1)
+	    hop->hostlen = 0;
+	if ((next = strchr(colon, ',')) != NULL)
+	    next++;
+    }
+}
+
+/* A server has connected to the next one in the chain, or to the */
+/* destination if it was the last                                 */
+static int next_hop(struct connreq *conn) {
+
+    if (conn->hop == conn->nhops) {
+	conn->state = DONE;
+	return 0;
+    }
+
+    conn->hop++;
+    show_msg(MSGDEBUG, "Socket %d reached server %d of %d in the chain\n",
+	    conn->sockid, conn->hop + 1, conn->nhops + 1);
+    if (conn->pipelined) {
+	conn->state = sent_state(conn);
+    } else if (conn->offered) {
+	conn->offered = 0;
+	conn->state = SENTV5METHOD;
+    } else {
+	conn->state = CONNECTED;
+    }
+
+    return 0;
+}
+
+/* The state a request waits for the first reply from a server in */
+static int sent_state(struct connreq *conn) {
+
+    if (conn->path->type == 4)
+	return SENTV4REQ;
+    else if (conn->path->type == SERVER_HTTP)
+	return SENTHTTPCONNECT;
+
+    return SENTV5METHOD;
+}
+
+/* Whether there is a password to authenticate with */
+static int have_password(struct connreq *conn) {
+
+    return ((getenv("TSOCKS_PASSWORD") != NULL) ||
+	    (conn->path->defpass != NULL));
+}
+
+/* Find the username and password to authenticate with */
+static int socks_credentials(struct connreq *conn, char **uname,
+	char **upass) {
+    struct passwd *nixuser;
+
+    /* Determine the current *nix username */
+    nixuser = getpwuid(getuid());
+
+    if (((*uname = conn->path->defuser) == NULL) &&
+	    ((*uname = getenv("TSOCKS_USERNAME")) == NULL) &&
+	    ((*uname = (nixuser == NULL ? NULL : nixuser->pw_name)) == NULL)) {
+	show_msg(MSGERR, "Could not get SOCKS username from "
+		"local passwd file, tsocks.conf "
+		"or $TSOCKS_USERNAME to authenticate "
+		"with");
+	conn->state = FAILED;
+	return ECONNREFUSED;
+    }
+
+    if (((*upass = getenv("TSOCKS_PASSWORD")) == NULL) &&
+	    ((*upass = conn->path->defpass) == NULL)) {
+	show_msg(MSGERR, "Need a password in tsocks.conf or "
+		"$TSOCKS_PASSWORD to authenticate with");
+	conn->state = FAILED;
+	return ECONNREFUSED;
+    }
+
+    return 0;
+}
+
+/* Make the SOCKS 4 request asking the server at hop to connect to */
+/* the next in the chain, or to the destination. A server given by */
+/* name is asked for in the SOCKS 4A form, an address of 0.0.0.1   */
+/* with the name after the username. Returns the length, or -1 if  */
+/* it doesn't fit in space                                         */
+static int socksv4_request(struct connreq *conn, int hop, char *buf,
+	int space) {
+    struct chainhop *next = (hop < conn->nhops ? &(conn->hops[hop]) : NULL);
+    struct sockreq *thisreq = (struct sockreq *) buf;
+    struct passwd *user;
+    char *name;
+    int len;
+
+    /* Determine the current username */
+    user = getpwuid(getuid());
+    name = (user == NULL ? "" : user->pw_name);
+
+    len = sizeof(struct sockreq) + strlen(name) + 1;
+    if (next && next->hostlen)
+	len += next->hostlen + 1;
+    if (len > space)
+	return -1;
+
+    /* Create the request */
+    thisreq->version = 4;
+    thisreq->command = 1;
+    if (next == NULL) {
+	thisreq->dstport = conn->connaddr.sin_port;
+	thisreq->dstip = conn->connaddr.sin_addr.s_addr;
+    } else {
+	thisreq->dstport = next->port;
+	thisreq->dstip = (next->hostlen ? htonl(1) : next->addr.s_addr);
+    }
+
+    /* Copy the username, and the name of the next server */
+    strcpy(buf + sizeof(struct sockreq), name);
+    if (next && next->hostlen) {
+	memcpy(buf + len - next->hostlen - 1, next->host, next->hostlen);
+	buf[len - 1] = '\0';
+    }
+
+    return len;
+}
+
+/* Make a SOCKS 5 username/password message, returns the length or */
+/* -1 if it doesn't fit in space                                   */
+static int socksv5_auth(char *uname, char *upass, char *buf, int space) {
+    int len = 0;
+
+    if ((3 + strlen(uname) + strlen(upass)) >= space)
+	return -1;
+
+    buf[len] = '\x01';
+    len++;
+    buf[len] = (int8_t) strlen(uname);
+    len++;
+    memcpy(&(buf[len]), uname, strlen(uname));
+    len = len + strlen(uname);
+    buf[len] = (int8_t) strlen(upass);
+    len++;
+    memcpy(&(buf[len]), upass, strlen(upass));
+    len = len + strlen(upass);
+
+    return len;
+}
+
+/* Make the SOCKS 5 request asking the server at hop to connect to */
+/* the next in the chain, by name if that's how it was given, or   */
+/* to the destination with the request's command. Returns the      */
+/* length, or -1 if it doesn't fit in space                        */
+static int socksv5_connect(struct connreq *conn, int hop, char *buf,
+	int space) {
+    struct chainhop *next = (hop < conn->nhops ? &(conn->hops[hop]) : NULL);
+    int v6 = ((next == NULL) && (conn->connaddr.sin_family == AF_INET6));
+    int len = 4;
+
+    if (space < 4 + (next && next->hostlen ? 1 + next->hostlen :
+		(v6 ? 16 : 4)) + 2)
+	return -1;
+
+    buf[0] = 0x05; /* Version 5 SOCKS */
+    buf[1] = (next ? SOCKS_CONNECT : conn->command);
+    buf[2] = 0x00; /* Reserved        */
+    if (next && next->hostlen) {
+	buf[3] = 0x03; /* Domain name */
+	buf[len++] = next->hostlen;
+	memcpy(&buf[len], next->host, next->hostlen);
+	len += next->hostlen;
+    } else if (next) {
+	buf[3] = 0x01; /* IP Version 4 */
+	memcpy(&buf[len], &(next->addr), sizeof(next->addr));
+	len += sizeof(next->addr);
+    } else if (v6) {
+	buf[3] = 0x04; /* IP Version 6 */
+	memcpy(&buf[len], &(conn->connaddr6), sizeof(conn->connaddr6));
+	len += sizeof(conn->connaddr6);
+    } else {
+	buf[3] = 0x01; /* IP Version 4 */
+	memcpy(&buf[len], &(conn->connaddr.sin_addr.s_addr),
+		sizeof(conn->connaddr.sin_addr.s_addr));
+	len += sizeof(conn->connaddr.sin_addr.s_addr);
+    }
+    memcpy(&buf[len], (next ? &(next->port) : &(conn->connaddr.sin_port)), 2);
+    len += 2;
+
+    return len;
+}
+
+/* Make the HTTP CONNECT request asking the proxy at hop for a */
+/* tunnel to the next in the chain, or to the destination. The */
+/* credentials are sent with Basic authentication if upass     */
+/* isn't NULL. Returns the length, or -1 if it doesn't fit in  */
+/* space                                                       */
+static int http_request(struct connreq *conn, int hop, char *uname,
+	char *upass, char *buf, int space) {
+    struct chainhop *next = (hop < conn->nhops ? &(conn->hops[hop]) : NULL);
+    char addr[INET6_ADDRSTRLEN], target[272], cred[512], auth[720];
+    int len;
+
+    if (next && next->hostlen)
+	snprintf(target, sizeof(target), "%.*s:%d", next->hostlen,
+		next->host, ntohs(next->port));
+    else if (next)
+	snprintf(target, sizeof(target), "%s:%d",
+		inet_ntop(AF_INET, &(next->addr), addr, sizeof(addr)),
+		ntohs(next->port));
+    else if (conn->connaddr.sin_family == AF_INET6)
+	snprintf(target, sizeof(target), "[%s]:%d",
+		inet_ntop(AF_INET6, &(conn->connaddr6), addr, sizeof(addr)),
+		ntohs(conn->connaddr.sin_port));
+    else
+	snprintf(target, sizeof(target), "%s:%d",
+		inet_ntop(AF_INET, &(conn->connaddr.sin_addr), addr,
+		    sizeof(addr)), ntohs(conn->connaddr.sin_port));
+
+    auth[0] = '\0';
+    if (upass != NULL) {
+	if ((len = snprintf(cred, sizeof(cred), "%s:%s", uname, upass)) >=
+		sizeof(cred))
+	    return -1;
+	strcpy(auth, "Proxy-Authorization: Basic ");
+	base64(cred, len, auth + strlen(auth));
+	strcat(auth, "\r\n");
+    }
+
+    len = snprintf(buf, space, "CONNECT %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+	    target, target, auth);
+
+    return (len < space ? len : -1);
+}
+
+/* Encode len bytes as base64, with a terminating NUL */
+static void base64(const char *in, int len, char *out) {
+    static const char digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *) in;
+    uint32_t bits;
+    int i;
+
+    for (i = 0; i + 2 < len; i += 3) {
+	bits = (p[i] << 16) | (p[i + 1] << 8) | p[i + 2];
+	*out++ = digits[bits >> 18];
+	*out++ = digits[(bits >> 12) & 63];
+	*out++ = digits[(bits >> 6) & 63];
+	*out++ = digits[bits & 63];
+    }
+    if (i < len) {
+	bits = (p[i] << 16) | (i + 1 < len ? p[i + 1] << 8 : 0);
+	*out++ = digits[bits >> 18];
+	*out++ = digits[(bits >> 12) & 63];
+	*out++ = (i + 1 < len ? digits[(bits >> 6) & 63] : '=');
+	*out++ = '=';
+    }
+    *out = '\0';
+}
+
 static int send_buffer(struct connreq *conn) {
     int rc = 0;
 
@@ -1023,8 +2694,11 @@ static int send_buffer(struct connreq *conn) {
 	    conn->datadone += rc;
 	    rc = 0;
 	} else {
-	    if (errno != EWOULDBLOCK)
+	    if (errno != EWOULDBLOCK) {
 		show_msg(MSGDEBUG, "Write failed, %s\n", strerror(errno));
+		if (errno != EINTR)
+		    conn->state = FAILED;
+	    }
 	    rc = errno;
 	}
     }
@@ -1050,10 +2724,14 @@ static int recv_buffer(struct connreq *conn) {
       } else if (rc == 0) {
          show_msg(MSGDEBUG, "Peer has shutdown but we only read %d of %d bytes.\n",
             conn->datadone, conn->datalen);
+         conn->state = FAILED;
          rc = ENOTCONN; /* ENOTCONN seems like the most fitting error message */
 	} else {
-	    if (errno != EWOULDBLOCK)
+	    if (errno != EWOULDBLOCK) {
 		show_msg(MSGDEBUG, "Read failed, %s\n", strerror(errno));
+		if (errno != EINTR)
+		    conn->state = FAILED;
+	    }
 	    rc = errno;
 	}
     }
@@ -1067,64 +2745,54 @@ static int recv_buffer(struct connreq *conn) {
 }
 
 static int read_socksv5_method(struct connreq *conn) {
-    struct passwd *nixuser;
     char *uname, *upass;
+    int rc;
 
     /* See if we offered an acceptable method */
     if (conn->buffer[1] == '\xff') {
 	show_msg(MSGERR, "SOCKS V5 server refused authentication methods\n");
+	stats_count(STAT_METHODREFUSED);
+	PROBE3(socks__error, conn->sockid, 5, 255);
 	conn->state = FAILED;
 	return ECONNREFUSED;
     }
 
+    /* Anything but a SOCKS 5 reply choosing one of the methods we */
+    /* offered means this isn't a SOCKS 5 server we can talk to    */
+    if ((conn->buffer[0] != '\x05') ||
+	    ((conn->buffer[1] != '\x00') && (conn->buffer[1] != '\x02')) ||
+	    (conn->pipelined && (conn->buffer[1] != '\x00'))) {
+	show_msg(MSGERR, "Invalid reply from SOCKS V5 server to method "
+		"negotiation\n");
+	stats_count(STAT_BADREPLIES);
+	conn->state = FAILED;
+	return ECONNREFUSED;
+    }
+
+    /* A pipelined chain has already sent what comes next */
+    if (conn->pipelined) {
+	conn->state = SENTV5CONNECT;
+	return 0;
+    }
+
     /* If the socks server chose username/password authentication */
     /* (method 2) then do that                                    */
     if ((unsigned short int) conn->buffer[1] == 2) {
 	show_msg(MSGDEBUG, "SOCKS V5 server chose username/password authentication\n");
 
-	/* Determine the current *nix username */
-	nixuser = getpwuid(getuid());
-
-	if (((uname = conn->path->defuser) == NULL) &&
-		((uname = getenv("TSOCKS_USERNAME")) == NULL) &&
-		((uname = (nixuser == NULL ? NULL : nixuser->pw_name)) == NULL)) {
-	    show_msg(MSGERR, "Could not get SOCKS username from "
-		    "local passwd file, tsocks.conf "
-		    "or $TSOCKS_USERNAME to authenticate "
-		    "with");
-	    conn->state = FAILED;
-	    return ECONNREFUSED;
-	}
-
-	if (((upass = getenv("TSOCKS_PASSWORD")) == NULL) &&
-		((upass = conn->path->defpass) == NULL)) {
-	    show_msg(MSGERR, "Need a password in tsocks.conf or "
-		    "$TSOCKS_PASSWORD to authenticate with");
-	    conn->state = FAILED;
-	    return ECONNREFUSED;
-	}
+	if ((rc = socks_credentials(conn, &uname, &upass)))
+	    return rc;
 
 	/* Check that the username / pass specified will */
 	/* fit into the buffer				                */
-	if ((3 + strlen(uname) + strlen(upass)) >= sizeof(conn->buffer)) {
+	if ((conn->datalen = socksv5_auth(uname, upass, conn->buffer,
+			sizeof(conn->buffer))) < 0) {
 	    show_msg(MSGERR, "The supplied socks username or "
 		    "password is too long");
 	    conn->state = FAILED;
 	    return ECONNREFUSED;
 	}
 
-	conn->datalen = 0;
-	conn->buffer[conn->datalen] = '\x01';
-	conn->datalen++;
-	conn->buffer[conn->datalen] = (int8_t) strlen(uname);
-	conn->datalen++;
-	memcpy(&(conn->buffer[conn->datalen]), uname, strlen(uname));
-	conn->datalen = conn->datalen + strlen(uname);
-	conn->buffer[conn->datalen] = (int8_t) strlen(upass);
-	conn->datalen++;
-	memcpy(&(conn->buffer[conn->datalen]), upass, strlen(upass));
-	conn->datalen = conn->datalen + strlen(upass);
-
 	conn->state = SENDING;
 	conn->nextstate = SENTV5AUTH;
 	conn->datadone = 0;
@@ -1138,6 +2806,8 @@ static int read_socksv5_auth(struct connreq *conn) {
 
     if (conn->buffer[1] != '\x00') {
 	show_msg(MSGERR, "SOCKS authentication failed, check username and password\n");
+	stats_count(STAT_AUTHFAILED);
+	PROBE3(socks__error, conn->sockid, 1, (unsigned char) conn->buffer[1]);
 	conn->state = FAILED;
 	return ECONNREFUSED;
     }
@@ -1147,10 +2817,13 @@ static int read_socksv5_auth(struct connreq *conn) {
 }
 
 static int read_socksv5_connect(struct connreq *conn) {
+    int replylen;
 
     /* See if the connection succeeded */
     if (conn->buffer[1] != '\x00') {
 	show_msg(MSGERR, "SOCKS V5 connect failed: ");
+	stats_socks_error(5, (unsigned char) conn->buffer[1]);
+	PROBE3(socks__error, conn->sockid, 5, (unsigned char) conn->buffer[1]);
 	conn->state = FAILED;
 	switch ((int8_t) conn->buffer[1]) {
 	    case 1:
@@ -1183,11 +2856,157 @@ static int read_socksv5_connect(struct connreq *conn) {
 	}
     }
 
-    conn->state = DONE;
+    /* The reply has the bound address, only the first 5 bytes were */
+    /* read so far, read the rest of it and not a byte further       */
+    switch (conn->buffer[3]) {
+	case 1:
+	    replylen = 10;
+	    break;
+	case 3:
+	    replylen = 7 + (unsigned char) conn->buffer[4];
+	    break;
+	case 4:
+	    replylen = 22;
+	    break;
+	default:
+	    show_msg(MSGERR, "SOCKS V5 connect reply has an unknown address "
+		    "type (%d)\n", conn->buffer[3]);
+	    conn->state = FAILED;
+	    return ECONNABORTED;
+    }
+    if (conn->datalen < replylen) {
+	conn->datalen = replylen;
+	conn->state = RECEIVING;
+	conn->nextstate = GOTV5CONNECT;
+	return 0;
+    }
+
+    return next_hop(conn);
+}
 
+/* Read an HTTP proxy's reply up to the blank line ending its   */
+/* headers and not a byte further, whatever follows is from the  */
+/* destination (or the next server of a chain) and is left in    */
+/* the socket. What has arrived is peeked at where it will lie in */
+/* the buffer and scanned there, then read for real up to the end */
+/* of the headers if they end in it. datadone counts the line     */
+/* ends in a row the bytes scanned so far finish with, and once   */
+/* the status line has been seen the buffer is reused if the      */
+/* headers don't fit                                              */
+static int recv_http_reply(struct connreq *conn) {
+    char *buf;
+    int got, len;
+
+    while (conn->state == RECEIVING) {
+	buf = conn->buffer + conn->datalen;
+	got = recv(conn->sockid, buf, sizeof(conn->buffer) - conn->datalen,
+		MSG_PEEK);
+	if (got == 0) {
+	    show_msg(MSGDEBUG, "Peer has shutdown before the end of the HTTP "
+		    "reply\n");
+	    conn->state = FAILED;
+	    return ENOTCONN;
+	} else if (got < 0) {
+	    if (errno != EWOULDBLOCK) {
+		show_msg(MSGDEBUG, "Read failed, %s\n", strerror(errno));
+		if (errno != EINTR)
+		    conn->state = FAILED;
+	    }
+	    return errno;
+	}
+
+	for (len = 0; (len < got) && (conn->datadone < 2); len++) {
+	    if (buf[len] == '\n')
+		conn->datadone++;
+	    else if (buf[len] != '\r')
+		conn->datadone = 0;
+	}
+	if (recv(conn->sockid, buf, len, 0) != len) {
+	    show_msg(MSGDEBUG, "Read of peeked HTTP reply failed\n");
+	    conn->state = FAILED;
+	    return ECONNRESET;
+	}
+	conn->datalen += len;
+
+	if (!conn->httpstatus &&
+		((conn->httpstatus = http_status(conn)) < 0)) {
+	    show_msg(MSGERR, "Invalid reply from HTTP proxy to CONNECT "
+		    "request\n");
+	    stats_count(STAT_BADREPLIES);
+	    conn->state = FAILED;
+	    return ECONNREFUSED;
+	}
+
+	if (conn->datadone == 2)
+	    conn->state = conn->nextstate;
+	else if (conn->datalen == sizeof(conn->buffer))
+	    conn->datalen = 0;
+    }
+
+    show_msg(MSGDEBUG, "Received HTTP reply with status %d\n",
+	    conn->httpstatus);
     return 0;
 }
 
+/* The status in the status line at the start of the buffer, 0 if */
+/* the line hasn't all arrived and -1 if it isn't an HTTP reply    */
+static int http_status(struct connreq *conn) {
+    char *line = conn->buffer, *end, *code;
+
+    if (memcmp(line, "HTTP/", (conn->datalen < 5 ? conn->datalen : 5)))
+	return -1;
+    if ((end = memchr(line, '\n', conn->datalen)) == NULL)
+	return (conn->datalen < sizeof(conn->buffer) ? 0 : -1);
+
+    /* HTTP/1.1 200 Connection established */
+    if (((code = memchr(line, ' ', end - line)) == NULL) ||
+	    (end - code < 4) ||
+	    !isdigit((unsigned char) code[1]) ||
+	    !isdigit((unsigned char) code[2]) ||
+	    !isdigit((unsigned char) code[3]) || (code[1] == '0') ||
+	    !isspace((unsigned char) code[4]))
+	return -1;
+
+    return (code[1] - '0') * 100 + (code[2] - '0') * 10 + (code[3] - '0');
+}
+
+static int read_http_reply(struct connreq *conn) {
+    int status = conn->httpstatus;
+
+    conn->httpstatus = 0;
+    if ((status >= 200) && (status < 300))
+	return next_hop(conn);
+
+    show_msg(MSGERR, "HTTP CONNECT failed (%d): ", status);
+    PROBE3(socks__error, conn->sockid, 0, status);
+    conn->state = FAILED;
+    switch (status) {
+	case 403:
+	    show_msg(MSGERR, "Connection denied by rule\n");
+	    return ECONNABORTED;
+	case 404:
+	    show_msg(MSGERR, "Host not found\n");
+	    return EHOSTUNREACH;
+	case 407:
+	    show_msg(MSGERR, "Proxy authentication failed, check username "
+		    "and password\n");
+	    stats_count(STAT_AUTHFAILED);
+	    return ECONNREFUSED;
+	case 502:
+	    show_msg(MSGERR, "Bad gateway, the proxy could not connect\n");
+	    return ECONNREFUSED;
+	case 503:
+	    show_msg(MSGERR, "Service unavailable\n");
+	    return ENETUNREACH;
+	case 504:
+	    show_msg(MSGERR, "Gateway timeout\n");
+	    return ETIMEDOUT;
+	default:
+	    show_msg(MSGERR, "Unknown error\n");
+	    return ECONNABORTED;
+    }
+}
+
 static int read_socksv4_req(struct connreq *conn) {
     struct sockrep *thisrep;
 
@@ -1195,6 +3014,8 @@ static int read_socksv4_req(struct connreq *conn) {
 
     if (thisrep->result != 90) {
 	show_msg(MSGERR, "SOCKS V4 connect rejected:\n");
+	stats_socks_error(4, (unsigned char) thisrep->result);
+	PROBE3(socks__error, conn->sockid, 4, (unsigned char) thisrep->result);
 	conn->state = FAILED;
 	switch(thisrep->result) {
 	    case 91:
@@ -1216,9 +3037,7 @@ static int read_socksv4_req(struct connreq *conn) {
 	}
     }
 
-    conn->state = DONE;
-
-    return 0;
+    return next_hop(conn);
 }
 
 #ifdef USE_SOCKS_DNS
@@ -4,7 +4,9 @@
 
 #define _TSOCKS_H	1
 
+#include <time.h>
 #include <parser.h>
+#include <trace.h>
 
 /* Structure representing a socks connection request */
 struct sockreq {
@@ -23,15 +25,58 @@ struct sockrep {
    int32_t ignore2;
 };
 
+/* Structure representing a loaded configuration, configurations */
+/* replaced by a reload are retired but kept until no request    */
+/* refers to them any more                                       */
+struct confref {
+   struct parsedfile conf;
+   int refs; /* Number of users of this configuration */
+   int quiesced; /* Retired and no hold_config() caller can */
+		 /* still be about to take a reference     */
+   struct confref *next; /* Next retired configuration */
+};
+
+/* Structure representing a server a chain goes through after the */
+/* first, read from the path's chain string when a request starts  */
+struct chainhop {
+   const char *host; /* Points into the chain string, not terminated */
+   int hostlen; /* 0 for a server given as an IPv4 address */
+   struct in_addr addr; /* The address, if it was given as one */
+   in_port_t port; /* Network byte order */
+};
+
 /* Structure representing a socket which we are currently proxying */
 struct connreq {
    /* Information about the socket and target */
    int sockid;
-   struct sockaddr_in connaddr;
+   struct sockaddr_in connaddr; /* AF_INET6 with just the port for an */
+   struct in6_addr connaddr6;   /* IPv6 target, whose address is here */
+   int family; /* Of the socket, an IPv6 one is connected to the server */
+	       /* at its IPv4-mapped address                             */
    struct sockaddr_in serveraddr;
 
-   /* Pointer to the config entry for the socks server */
+   /* SOCKS 5 command to send, normally CONNECT */
+   int command;
+
+   /* For a path with a chain, the servers after the one connected to */
+   /* and which one is being negotiated with (0 for the first). When  */
+   /* every server's messages are sent at once the request is         */
+   /* pipelined, otherwise offered is set when the next SOCKS 5       */
+   /* server's methods went with the request to connect to it         */
+   int nhops;
+   int hop;
+   struct chainhop hops[CHAIN_MAXHOPS - 1];
+   int pipelined;
+   int offered;
+
+   /* Status of an HTTP proxy's reply once its status line has been */
+   /* read, 0 before                                                 */
+   int httpstatus;
+
+   /* Pointer to the config entry for the socks server and the */
+   /* configuration it belongs to                              */
    struct serverent *path;
+   struct confref *config;
 
    /* Current state of this proxied socket */
    int state;
@@ -49,6 +94,16 @@ struct connreq {
     * poll() */
    int selectevents;
 
+   /* When the request was started and whether its outcome has been
+    * counted, for the statistics (see stats.h) */
+   uint64_t started;
+   int finished;
+
+   /* The states this request has been through and when, only kept
+    * while tracing (see trace.h) */
+   int nstamps;
+   struct tracestamp stamps[TRACE_STAMPS];
+
    /* Buffer for sending and receiving on the socket */
    int datalen;
    int datadone;
@@ -73,7 +128,13 @@ struct connreq {
 #define GOTV5CONNECT 12
 #define DONE 13 
 #define FAILED 14 
+#define SENTHTTPCONNECT 15
+#define GOTHTTPCONNECT 16
    
+/* SOCKS 5 commands */
+#define SOCKS_CONNECT 1
+#define SOCKS_UDPASSOCIATE 3
+
 /* Flags to indicate what events a socket was select()ed for */
 #define READ (1<<0)
 #define WRITE (1<<1)
@@ -0,0 +1,1472 @@
+/*
+ * TSOCKSD - Part of the tsocks package
+ * A SOCKS 4, 4a and 5 server, with optional username/password
+ * authentication (RFC 1929), for relaying on a host and as a realistic
+ * server to test and benchmark libtsocks against.
+ *
+ * Each worker thread is pinned to a CPU and has its own listening
+ * socket (SO_REUSEPORT lets the kernel spread connections over them)
+ * and its own epoll instance, so the workers share nothing on the data
+ * path. The state for a connection comes from a pool each worker keeps
+ * and reuses, pipes included. Once a request has been granted data is
+ * moved between the client and the destination with splice() through a
+ * pipe for each direction, so it is never copied to user space. Names
+ * (SOCKS 4a and SOCKS 5 domain names) are resolved by a thread for each
+ * worker so the worker never blocks.
+ *
+ * Given a tsocks.conf with -f only destinations it lists as local (that
+ * is, reachable directly) are relayed to.
+ *
+ * Built with REDIRECT defined this is tsocks-redir, which accepts
+ * connections iptables or nftables has redirected to it (REDIRECT or
+ * TPROXY) instead of SOCKS requests. It finds where each was going
+ * from conntrack (SO_ORIGINAL_DST), or the local address for TPROXY,
+ * and routes it by tsocks.conf just as libtsocks would, directly or
+ * with a SOCKS 4 or 5 request to the server it picks. That reaches
+ * programs libtsocks can't be preloaded into (statically linked ones)
+ * and every process in a network namespace or cgroup at once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Global configuration variables */
+#ifdef REDIRECT
+char *progname = "tsocks-redir";	   /* Name for error msgs      */
+#else
+char *progname = "tsocksd";		   /* Name for error msgs      */
+#endif
+
+/* Header Files */
+#define _GNU_SOURCE /* For accept4(), pipe2(), splice() and CPU affinity */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <string.h>
+#include <pwd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/netfilter_ipv4.h>
+#include <errno.h>
+#include <common.h>
+/* parser.h has a struct netent of its own, unrelated to netdb.h's */
+#define netent tsocks_netent
+#include <parser.h>
+#undef netent
+
+#define POOLSLAB	64	/* Sessions allocated at a time */
+#define MAXEVENTS	256	/* Events handled for each epoll_wait() */
+#define ACCEPTS		64	/* Connections accepted for each event */
+#define RELAYROUNDS	4	/* Splices a direction gets for each event */
+#define SPLICEMAX	(1 << 20)
+
+#ifdef REDIRECT
+#define REDIRECTING	1
+#define DEFAULTPORT	12345
+#define OPTIONS		"l:p:w:f:t:P:m:Td"
+#define USAGE		"Usage: [-l address] [-p port] [-w workers] " \
+	"[-f tsocks.conf] [-t timeout secs] [-P pipe bytes] [-m mark] [-T] [-d]"
+#else
+#define REDIRECTING	0
+#define DEFAULTPORT	1080
+#define OPTIONS		"l:p:w:a:f:t:P:d"
+#define USAGE		"Usage: [-l address] [-p port] [-w workers] " \
+	"[-a user:pass] [-f tsocks.conf] [-t timeout secs] [-P pipe bytes] " \
+	"[-d]"
+#endif
+
+/* SOCKS 5 reply codes, SOCKS 4 only has granted (90) and rejected (91) */
+#define REPLY_OK		0
+#define REPLY_FAILURE		1
+#define REPLY_NOTALLOWED	2
+#define REPLY_NETUNREACH	3
+#define REPLY_HOSTUNREACH	4
+#define REPLY_REFUSED		5
+#define REPLY_BADCOMMAND	7
+#define REPLY_BADADDRESS	8
+
+/* States of a session */
+enum sessionstate {
+   ST_FREE,		/* In the pool */
+   ST_GREETING,		/* Waiting for a SOCKS 4 request or SOCKS 5 methods */
+   ST_AUTH,		/* Waiting for a SOCKS 5 username and password */
+   ST_REQUEST,		/* Waiting for a SOCKS 5 request */
+   ST_RESOLVING,	/* The resolver thread has it */
+   ST_CONNECTING,	/* Connecting to the destination (or SOCKS server) */
+   ST_V4REPLY,		/* Waiting for the SOCKS server, tsocks-redir only */
+   ST_V5METHOD,
+   ST_V5AUTH,
+   ST_V5REPLY,
+   ST_RELAY,		/* Splicing data between them */
+   ST_CLOSED		/* Closed, back in the pool after this epoll_wait() */
+};
+
+/* Structure representing one side of a session, the client (side 0) */
+/* or the destination (side 1), the epoll data points at it          */
+struct half {
+   int fd;
+   int side;
+   int registered; /* With epoll */
+   uint32_t events; /* Registered for */
+   int eof; /* Everything this side will send has been read */
+   int full; /* Its pipe has no room */
+   int shut; /* The other side has been shut down for writing */
+   int pipe[2]; /* Data read from this side for the other, kept in */
+		/* the pool with the session                        */
+   size_t inpipe; /* Bytes in the pipe */
+};
+
+/* Structure representing a SOCKS server tsocks-redir connects through, */
+/* resolved when it starts                                             */
+struct upstream {
+   struct serverent *path;
+   int usable; /* Has an address on a local network */
+   struct sockaddr_in addr;
+   char *user; /* For SOCKS 4 requests and SOCKS 5 authentication */
+   char *pass; /* NULL if SOCKS 5 authentication can't be offered */
+};
+
+/* Structure representing a client connection */
+struct session {
+   struct half half[2];
+   enum sessionstate state;
+   int version; /* SOCKS version the client is using */
+   time_t started; /* For the handshake timeout */
+   int len; /* Of the handshake data in buf */
+   unsigned char buf[1024];
+   struct sockaddr_storage dst;
+   char host[256]; /* Name to resolve for dst */
+   unsigned short port; /* With the name */
+   int resolveerr; /* getaddrinfo() result */
+   struct upstream *upstream; /* Server for a redirected connection, */
+			      /* NULL to connect directly            */
+   struct session *next; /* In the pool, resolver queues or dead list */
+};
+
+/* Structure representing a block of pooled sessions */
+struct slab {
+   struct slab *next;
+   struct session sessions[POOLSLAB];
+};
+
+/* Structure representing a queue of sessions to or from the resolver */
+struct queue {
+   struct session *head;
+   struct session **tail;
+};
+
+/* Structure representing a worker thread */
+struct worker {
+   int id;
+   pthread_t thread;
+   int epfd;
+   int listenfd;
+   int resolvefd; /* eventfd the resolver signals */
+   int paused; /* Not accepting, out of descriptors */
+   time_t now;
+   struct slab *slabs;
+   struct session *free;
+   struct session *dead; /* Closed, freed once their events are handled */
+   pthread_t resolver;
+   pthread_mutex_t lock; /* For the queues */
+   pthread_cond_t wakeup;
+   struct queue toresolve;
+   struct queue resolved;
+   /* Counters */
+   unsigned long accepted, granted, refused, failed, inuse, pooled;
+   unsigned long long bytes[2]; /* From the clients and destinations */
+};
+
+/* Settings */
+static struct sockaddr_in listenaddr;
+static int nworkers = 0;
+static char *username = NULL;
+static char *password = NULL;
+static struct parsedfile config;
+static int haveconfig = 0;
+static int timeout = 30; /* Seconds a handshake and connect may take */
+static int pipesize = 0; /* Bytes, the kernel's default if 0 */
+static struct upstream *upstreams; /* For each path, then the default */
+static int mark = 0; /* SO_MARK for outgoing connections */
+static int transparent = 0; /* Listen with IP_TRANSPARENT for TPROXY */
+static volatile sig_atomic_t stopping = 0;
+
+/* Tags for the epoll data of the descriptors that aren't sessions' */
+static char listentag, resolvetag;
+
+static void stop(int);
+static int setup_worker(struct worker *);
+static void *worker_main(void *);
+static void accept_clients(struct worker *);
+static struct session *session_get(struct worker *);
+static void session_close(struct worker *, struct session *);
+static void session_event(struct worker *, struct half *, uint32_t);
+static int set_events(struct worker *, struct half *, uint32_t);
+static void unregister(struct worker *, struct half *);
+static void consume(struct session *, int);
+static int handshake(struct worker *, struct session *);
+static int socks4_request(struct worker *, struct session *);
+static int begin_request(struct worker *, struct session *, int);
+static int is_direct(struct sockaddr_storage *);
+static int start_connect(struct worker *, struct session *);
+static void connected(struct worker *, struct session *);
+static void start_relay(struct worker *, struct session *);
+static void setup_upstreams(void);
+static int redirect_request(struct worker *, struct session *);
+static int upstream_request(struct worker *, struct session *);
+static int upstream_reply(struct worker *, struct session *);
+static int socks5_connect(struct session *, unsigned char *);
+static int send_reply(struct session *, int);
+static int reply_code(int);
+static void relay(struct worker *, struct session *);
+static void *resolver_main(void *);
+static void resolved(struct worker *);
+static void expire(struct worker *);
+
+int main(int argc, char *argv[]) {
+    char *usage = USAGE;
+    struct worker *workers;
+    struct sigaction action;
+    struct rlimit limit;
+    unsigned long long bytes[2] = { 0, 0 };
+    unsigned long accepted = 0, granted = 0, refused = 0, failed = 0;
+    char *sep, *conffile = NULL;
+    int loglevel = MSGWARN, port = DEFAULTPORT, c, i;
+
+    memset(&listenaddr, 0x0, sizeof(listenaddr));
+    listenaddr.sin_family = AF_INET;
+    listenaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while ((c = getopt(argc, argv, OPTIONS)) != -1) {
+	switch (c) {
+	    case 'l':
+		if (!inet_aton(optarg, &listenaddr.sin_addr)) {
+		    show_msg(MSGERR, "Invalid address %s\n", optarg);
+		    exit(1);
+		}
+		break;
+	    case 'p':
+		port = atoi(optarg);
+		break;
+	    case 'w':
+		nworkers = atoi(optarg);
+		break;
+	    case 'a':
+		if (((sep = strchr(optarg, ':')) == NULL) ||
+			(sep - optarg > 255) || (strlen(sep + 1) > 255)) {
+		    show_msg(MSGERR, "%s\n", usage);
+		    exit(1);
+		}
+		*sep = '\0';
+		username = optarg;
+		password = sep + 1;
+		break;
+	    case 'f':
+		conffile = optarg;
+		break;
+	    case 't':
+		timeout = atoi(optarg);
+		break;
+	    case 'P':
+		pipesize = atoi(optarg);
+		break;
+	    case 'm':
+		mark = strtol(optarg, NULL, 0);
+		break;
+	    case 'T':
+		transparent = 1;
+		break;
+	    case 'd':
+		loglevel = MSGDEBUG;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+    if ((optind != argc) || (port < 1) || (port > 65535) || (nworkers < 0) ||
+	    (timeout < 1) || (pipesize < 0)) {
+	show_msg(MSGERR, "%s\n", usage);
+	exit(1);
+    }
+    listenaddr.sin_port = htons(port);
+    set_log_options(loglevel, NULL, 1);
+
+    /* tsocks-redir routes by the configuration, finding it just as */
+    /* libtsocks does if it isn't given                             */
+    if (conffile || REDIRECTING) {
+	if (read_config(conffile, &config)) {
+	    show_msg(MSGERR, "Could not read %s\n", (conffile ? conffile :
+			"the configuration file"));
+	    exit(1);
+	}
+	haveconfig = 1;
+    }
+    if (REDIRECTING)
+	setup_upstreams();
+
+    /* A worker for each CPU by default */
+    if (!nworkers && ((nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1))
+	nworkers = 1;
+
+    /* Every session needs two descriptors and two pipes */
+    if (!getrlimit(RLIMIT_NOFILE, &limit) &&
+	    (limit.rlim_cur < limit.rlim_max)) {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&action, 0x0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if ((workers = calloc(nworkers, sizeof(*workers))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for workers\n");
+	exit(1);
+    }
+    for (i = 0; i < nworkers; i++) {
+	workers[i].id = i;
+	if (setup_worker(&workers[i]))
+	    exit(1);
+    }
+    show_msg(MSGDEBUG, "Listening on %s:%d with %d workers\n",
+	    inet_ntoa(listenaddr.sin_addr), port, nworkers);
+
+    for (i = 0; i < nworkers; i++) {
+	if (pthread_create(&workers[i].thread, NULL, worker_main,
+		    &workers[i])) {
+	    show_msg(MSGERR, "Could not create worker thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nworkers; i++) {
+	pthread_join(workers[i].thread, NULL);
+	accepted += workers[i].accepted;
+	granted += workers[i].granted;
+	refused += workers[i].refused;
+	failed += workers[i].failed;
+	bytes[0] += workers[i].bytes[0];
+	bytes[1] += workers[i].bytes[1];
+    }
+
+    /* Refused sessions are counted as failed too */
+    printf("%lu connections, %lu requests granted, %lu refused, %lu failed, "
+	    "%llu bytes from clients, %llu bytes to them\n", accepted,
+	    granted, refused, failed - refused, bytes[0], bytes[1]);
+
+    return 0;
+}
+
+static void stop(int sig) {
+
+    (void) sig;
+    stopping = 1;
+}
+
+/* Give a worker its listening socket, epoll instance and resolver */
+static int setup_worker(struct worker *w) {
+    struct epoll_event event;
+    int on = 1;
+
+    w->toresolve.tail = &w->toresolve.head;
+    w->resolved.tail = &w->resolved.head;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wakeup, NULL);
+
+    if (((w->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+			SOCK_CLOEXEC, 0)) < 0) ||
+	    setsockopt(w->listenfd, SOL_SOCKET, SO_REUSEADDR, &on,
+		sizeof(on)) ||
+	    setsockopt(w->listenfd, SOL_SOCKET, SO_REUSEPORT, &on,
+		sizeof(on)) ||
+	    (transparent && setsockopt(w->listenfd, SOL_IP, IP_TRANSPARENT,
+		&on, sizeof(on))) ||
+	    bind(w->listenfd, (struct sockaddr *) &listenaddr,
+		sizeof(listenaddr)) ||
+	    listen(w->listenfd, 4096)) {
+	show_msg(MSGERR, "Could not listen on %s:%d (%s)\n",
+		inet_ntoa(listenaddr.sin_addr), ntohs(listenaddr.sin_port),
+		strerror(errno));
+	return -1;
+    }
+
+    if (((w->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+	    ((w->resolvefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)) {
+	show_msg(MSGERR, "Could not create worker (%s)\n", strerror(errno));
+	return -1;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &listentag;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listenfd, &event))
+	return -1;
+    event.data.ptr = &resolvetag;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->resolvefd, &event))
+	return -1;
+
+    /* Redirected connections are to addresses, never names */
+    if (!REDIRECTING && pthread_create(&w->resolver, NULL, resolver_main,
+		w)) {
+	show_msg(MSGERR, "Could not create resolver thread\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAXEVENTS];
+    struct session *s;
+    cpu_set_t cpus;
+    time_t lastcheck = 0;
+    long ncpus;
+    int nevents, i;
+
+    /* One worker to a CPU */
+    if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(w->id % ncpus, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    while (!stopping) {
+	if ((nevents = epoll_wait(w->epfd, events, MAXEVENTS, 1000)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    show_msg(MSGERR, "epoll_wait failed (%s)\n", strerror(errno));
+	    break;
+	}
+	w->now = time(NULL);
+
+	for (i = 0; i < nevents; i++) {
+	    if (events[i].data.ptr == &listentag)
+		accept_clients(w);
+	    else if (events[i].data.ptr == &resolvetag)
+		resolved(w);
+	    else
+		session_event(w, events[i].data.ptr, events[i].events);
+	}
+
+	/* Events for these may have been in the batch just handled */
+	while ((s = w->dead) != NULL) {
+	    w->dead = s->next;
+	    s->state = ST_FREE;
+	    s->next = w->free;
+	    w->free = s;
+	}
+
+	if (w->now != lastcheck) {
+	    lastcheck = w->now;
+	    expire(w);
+	}
+    }
+
+    if (!REDIRECTING) {
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->wakeup);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->resolver, NULL);
+    }
+
+    return NULL;
+}
+
+/* Accept what connections are waiting, if descriptors run out */
+/* accepting stops until the next check                        */
+static void accept_clients(struct worker *w) {
+    struct epoll_event event;
+    struct session *s;
+    int fd, on = 1, i;
+
+    for (i = 0; i < ACCEPTS; i++) {
+	if ((fd = accept4(w->listenfd, NULL, NULL, SOCK_NONBLOCK |
+			SOCK_CLOEXEC)) < 0) {
+	    if ((errno == EMFILE) || (errno == ENFILE) ||
+		    (errno == ENOBUFS) || (errno == ENOMEM)) {
+		show_msg(MSGWARN, "Could not accept connection (%s)\n",
+			strerror(errno));
+		event.events = 0;
+		event.data.ptr = &listentag;
+		epoll_ctl(w->epfd, EPOLL_CTL_MOD, w->listenfd, &event);
+		w->paused = 1;
+	    }
+	    return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	s = session_get(w);
+	s->half[0].fd = fd;
+	s->state = ST_GREETING;
+	s->started = w->now;
+	w->accepted++;
+	if (REDIRECTING ? redirect_request(w, s) :
+		set_events(w, &s->half[0], EPOLLIN))
+	    session_close(w, s);
+    }
+}
+
+/* Take a session from the pool, growing it if it is empty. Pipes */
+/* stay with a session, so they are only created once              */
+static struct session *session_get(struct worker *w) {
+    struct slab *slab;
+    struct session *s;
+    int i, j;
+
+    if (!w->free) {
+	if ((slab = malloc(sizeof(*slab))) == NULL) {
+	    show_msg(MSGERR, "Could not allocate memory for sessions\n");
+	    exit(1);
+	}
+	for (i = 0; i < POOLSLAB; i++) {
+	    s = &slab->sessions[i];
+	    memset(s, 0x0, sizeof(*s));
+	    for (j = 0; j < 2; j++) {
+		s->half[j].fd = -1;
+		s->half[j].side = j;
+		s->half[j].pipe[0] = s->half[j].pipe[1] = -1;
+	    }
+	    s->state = ST_FREE;
+	    s->next = w->free;
+	    w->free = s;
+	}
+	slab->next = w->slabs;
+	w->slabs = slab;
+	w->pooled += POOLSLAB;
+    }
+
+    s = w->free;
+    w->free = s->next;
+    for (i = 0; i < 2; i++) {
+	s->half[i].fd = -1;
+	s->half[i].registered = 0;
+	s->half[i].events = 0;
+	s->half[i].eof = s->half[i].full = s->half[i].shut = 0;
+	s->half[i].inpipe = 0;
+    }
+    s->version = 0;
+    s->len = 0;
+    s->upstream = NULL;
+    s->next = NULL;
+    w->inuse++;
+
+    return s;
+}
+
+/* Close a session, it goes back to the pool once the events for */
+/* this epoll_wait() have been handled                           */
+static void session_close(struct worker *w, struct session *s) {
+    struct half *h;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	h = &s->half[i];
+	if (h->fd >= 0)
+	    close(h->fd);
+	h->fd = -1;
+	h->registered = 0;
+	/* A pipe with data left in it can't be reused */
+	if (h->inpipe) {
+	    close(h->pipe[0]);
+	    close(h->pipe[1]);
+	    h->pipe[0] = h->pipe[1] = -1;
+	    h->inpipe = 0;
+	}
+    }
+
+    if (s->state != ST_RELAY)
+	w->failed++;
+    s->state = ST_CLOSED;
+    s->next = w->dead;
+    w->dead = s;
+    w->inuse--;
+}
+
+/* Handle readiness on one side of a session */
+static void session_event(struct worker *w, struct half *h,
+	uint32_t events) {
+    struct session *s = (struct session *) ((char *) (h - h->side) -
+	    offsetof(struct session, half));
+    ssize_t got;
+
+    switch (s->state) {
+	case ST_GREETING:
+	case ST_AUTH:
+	case ST_REQUEST:
+	case ST_V4REPLY:
+	case ST_V5METHOD:
+	case ST_V5AUTH:
+	case ST_V5REPLY:
+	    /* A redirected client waits while the SOCKS server is asked */
+	    if (h->side != (s->state >= ST_V4REPLY)) {
+		if (events & (EPOLLERR | EPOLLHUP))
+		    session_close(w, s);
+		return;
+	    }
+	    got = recv(h->fd, s->buf + s->len, sizeof(s->buf) - s->len, 0);
+	    if (got < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR))
+		    return;
+		session_close(w, s);
+		return;
+	    }
+	    s->len += got;
+	    if (!got || ((s->state >= ST_V4REPLY ? upstream_reply(w, s) :
+			    handshake(w, s)) < 0))
+		session_close(w, s);
+	    return;
+	case ST_CONNECTING:
+	    if (h->side == 1)
+		connected(w, s);
+	    else if (events & (EPOLLERR | EPOLLHUP))
+		session_close(w, s);
+	    return;
+	case ST_RELAY:
+	    relay(w, s);
+	    return;
+	default:
+	    return;
+    }
+}
+
+/* Register a side of a session for events if they have changed */
+static int set_events(struct worker *w, struct half *h, uint32_t events) {
+    struct epoll_event event;
+
+    if (h->registered && (h->events == events))
+	return 0;
+
+    event.events = events;
+    event.data.ptr = h;
+    if (epoll_ctl(w->epfd, (h->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD),
+		h->fd, &event)) {
+	show_msg(MSGERR, "epoll_ctl failed (%s)\n", strerror(errno));
+	return -1;
+    }
+    h->registered = 1;
+    h->events = events;
+
+    return 0;
+}
+
+static void unregister(struct worker *w, struct half *h) {
+
+    if (h->registered)
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+    h->registered = 0;
+}
+
+/* Remove a handled message from the front of the handshake buffer */
+static void consume(struct session *s, int len) {
+
+    memmove(s->buf, s->buf + len, s->len - len);
+    s->len -= len;
+}
+
+/* Handle as many complete handshake messages as have arrived (a */
+/* client may send them all at once), returns -1 if the session  */
+/* should be closed                                              */
+static int handshake(struct worker *w, struct session *s) {
+    unsigned char *buf = s->buf, reply[2];
+    int method, need, ok, i;
+
+    while (s->len) {
+	switch (s->state) {
+	    case ST_GREETING:
+		if (buf[0] == 4)
+		    return socks4_request(w, s);
+		if (buf[0] != 5)
+		    return -1;
+		if ((s->len < 2) || (s->len < 2 + buf[1]))
+		    return 0;
+		s->version = 5;
+		method = 0xff;
+		for (i = 0; i < buf[1]; i++) {
+		    if (buf[2 + i] == (username ? 2 : 0))
+			method = buf[2 + i];
+		}
+		reply[0] = 5;
+		reply[1] = method;
+		if (send(s->half[0].fd, reply, 2, MSG_NOSIGNAL) != 2)
+		    return -1;
+		consume(s, 2 + buf[1]);
+		if (method == 0xff) {
+		    w->refused++;
+		    return -1;
+		}
+		s->state = (username ? ST_AUTH : ST_REQUEST);
+		break;
+	    case ST_AUTH:
+		if ((s->len < 2) || (s->len < 3 + buf[1]) ||
+			(s->len < 3 + buf[1] + buf[2 + buf[1]]))
+		    return 0;
+		need = 3 + buf[1] + buf[2 + buf[1]];
+		ok = ((buf[0] == 1) && (buf[1] == strlen(username)) &&
+			!memcmp(&buf[2], username, buf[1]) &&
+			(buf[2 + buf[1]] == strlen(password)) &&
+			!memcmp(&buf[3 + buf[1]], password, buf[2 + buf[1]]));
+		reply[0] = 1;
+		reply[1] = !ok;
+		if (send(s->half[0].fd, reply, 2, MSG_NOSIGNAL) != 2)
+		    return -1;
+		consume(s, need);
+		if (!ok) {
+		    show_msg(MSGDEBUG, "Refused a client with the wrong "
+			    "username or password\n");
+		    w->refused++;
+		    return -1;
+		}
+		s->state = ST_REQUEST;
+		break;
+	    case ST_REQUEST:
+		if (s->len < 5)
+		    return 0;
+		switch (buf[3]) {
+		    case 1:
+			need = 10;
+			break;
+		    case 3:
+			need = 7 + buf[4];
+			break;
+		    case 4:
+			need = 22;
+			break;
+		    default:
+			send_reply(s, REPLY_BADADDRESS);
+			return -1;
+		}
+		if (s->len < need)
+		    return 0;
+		if (buf[0] != 5)
+		    return -1;
+		if (buf[1] != 1) {
+		    /* Only CONNECT */
+		    send_reply(s, REPLY_BADCOMMAND);
+		    return -1;
+		}
+		memset(&s->dst, 0x0, sizeof(s->dst));
+		if (buf[3] == 1) {
+		    ((struct sockaddr_in *) &s->dst)->sin_family = AF_INET;
+		    memcpy(&((struct sockaddr_in *) &s->dst)->sin_addr,
+			    &buf[4], 4);
+		    memcpy(&((struct sockaddr_in *) &s->dst)->sin_port,
+			    &buf[8], 2);
+		} else if (buf[3] == 4) {
+		    ((struct sockaddr_in6 *) &s->dst)->sin6_family = AF_INET6;
+		    memcpy(&((struct sockaddr_in6 *) &s->dst)->sin6_addr,
+			    &buf[4], 16);
+		    memcpy(&((struct sockaddr_in6 *) &s->dst)->sin6_port,
+			    &buf[20], 2);
+		} else {
+		    memcpy(s->host, &buf[5], buf[4]);
+		    s->host[buf[4]] = '\0';
+		    s->port = (buf[5 + buf[4]] << 8) | buf[6 + buf[4]];
+		}
+		i = buf[3];
+		/* Anything left is for the destination */
+		consume(s, need);
+		return begin_request(w, s, (i == 3));
+	    default:
+		return 0;
+	}
+    }
+
+    return 0;
+}
+
+/* Handle a SOCKS 4 or 4a connect request: version, command, port, */
+/* address and a user id ended by a NUL, followed by the name for  */
+/* 4a (when the address is 0.0.0.x)                                */
+static int socks4_request(struct worker *w, struct session *s) {
+    unsigned char *buf = s->buf, *end, *name = NULL;
+    int need;
+
+    if (s->len < 9)
+	return 0;
+    if ((end = memchr(buf + 8, 0, s->len - 8)) == NULL)
+	return (s->len == sizeof(s->buf) ? -1 : 0);
+    need = end - buf + 1;
+    if (!buf[4] && !buf[5] && !buf[6] && buf[7]) {
+	name = buf + need;
+	if ((end = memchr(name, 0, s->len - need)) == NULL)
+	    return (s->len == sizeof(s->buf) ? -1 : 0);
+	if (end - name >= (int) sizeof(s->host))
+	    return -1;
+	need = end - buf + 1;
+    }
+    s->version = 4;
+
+    /* SOCKS 4 has no way to authenticate */
+    if ((buf[1] != 1) || username) {
+	w->refused++;
+	send_reply(s, REPLY_NOTALLOWED);
+	return -1;
+    }
+
+    memset(&s->dst, 0x0, sizeof(s->dst));
+    if (name) {
+	strcpy(s->host, (char *) name);
+	s->port = (buf[2] << 8) | buf[3];
+    } else {
+	((struct sockaddr_in *) &s->dst)->sin_family = AF_INET;
+	memcpy(&((struct sockaddr_in *) &s->dst)->sin_port, &buf[2], 2);
+	memcpy(&((struct sockaddr_in *) &s->dst)->sin_addr, &buf[4], 4);
+    }
+    consume(s, need);
+
+    return begin_request(w, s, (name != NULL));
+}
+
+/* The destination is known, a name is handed to the resolver and */
+/* the client isn't listened to until it has been resolved         */
+static int begin_request(struct worker *w, struct session *s, int named) {
+
+    if (!named)
+	return start_connect(w, s);
+
+    unregister(w, &s->half[0]);
+    s->state = ST_RESOLVING;
+    s->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    *w->toresolve.tail = s;
+    w->toresolve.tail = &s->next;
+    pthread_cond_signal(&w->wakeup);
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/* Whether the configuration says a destination is reached directly, */
+/* IPv4 addresses mapped into IPv6 are looked up as IPv4 addresses    */
+static int is_direct(struct sockaddr_storage *dst) {
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) dst;
+    struct in_addr addr;
+
+    if (dst->ss_family == AF_INET)
+	return !is_local(&config, &((struct sockaddr_in *) dst)->sin_addr);
+    if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+	memcpy(&addr, &addr6->sin6_addr.s6_addr[12], sizeof(addr));
+	return !is_local(&config, &addr);
+    }
+
+    return !is_local6(&config, &addr6->sin6_addr);
+}
+
+/* Start connecting to the destination (or the SOCKS server for it), */
+/* the client is only watched for errors until the connect completes */
+static int start_connect(struct worker *w, struct session *s) {
+    struct sockaddr *to = (struct sockaddr *) &s->dst;
+    int on = 1;
+
+    if (!REDIRECTING && haveconfig && !is_direct(&s->dst)) {
+	show_msg(MSGDEBUG, "Refused a request for a destination that isn't "
+		"local\n");
+	w->refused++;
+	send_reply(s, REPLY_NOTALLOWED);
+	return -1;
+    }
+
+    if (s->upstream)
+	to = (struct sockaddr *) &s->upstream->addr;
+    if ((s->half[1].fd = socket(to->sa_family, SOCK_STREAM |
+		    SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+	send_reply(s, REPLY_FAILURE);
+	return -1;
+    }
+    setsockopt(s->half[1].fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    /* So firewall rules can leave our own connections unredirected */
+    if (mark && setsockopt(s->half[1].fd, SOL_SOCKET, SO_MARK, &mark,
+		sizeof(mark)))
+	show_msg(MSGWARN, "Could not mark connection (%s)\n", strerror(errno));
+
+    if (connect(s->half[1].fd, to, (to->sa_family == AF_INET ?
+		    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6))) &&
+	    (errno != EINPROGRESS)) {
+	send_reply(s, reply_code(errno));
+	return -1;
+    }
+
+    s->state = ST_CONNECTING;
+    if (set_events(w, &s->half[1], EPOLLOUT) ||
+	    set_events(w, &s->half[0], 0))
+	return -1;
+
+    return 0;
+}
+
+/* The connect to the destination (or SOCKS server) has completed */
+static void connected(struct worker *w, struct session *s) {
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(s->half[1].fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+	show_msg(MSGDEBUG, "Connect to %s failed (%s)\n", (s->upstream ?
+		    "SOCKS server" : "destination"), strerror(err));
+	send_reply(s, reply_code(err));
+	session_close(w, s);
+	return;
+    }
+
+    if (s->upstream) {
+	if (upstream_request(w, s))
+	    session_close(w, s);
+	return;
+    }
+
+    start_relay(w, s);
+}
+
+/* The destination has been reached, tell the client and start relaying */
+static void start_relay(struct worker *w, struct session *s) {
+    int i;
+
+    if (send_reply(s, REPLY_OK)) {
+	session_close(w, s);
+	return;
+    }
+    w->granted++;
+
+    /* A client that didn't wait for the reply may have sent data, as */
+    /* may a SOCKS server that didn't wait for tsocks-redir            */
+    if (s->len && (send(s->half[!REDIRECTING].fd, s->buf, s->len,
+		    MSG_NOSIGNAL) != s->len)) {
+	session_close(w, s);
+	return;
+    }
+    s->len = 0;
+
+    for (i = 0; i < 2; i++) {
+	if (s->half[i].pipe[0] >= 0)
+	    continue;
+	if (pipe2(s->half[i].pipe, O_NONBLOCK | O_CLOEXEC)) {
+	    show_msg(MSGWARN, "Could not create pipe (%s)\n", strerror(errno));
+	    s->half[i].pipe[0] = s->half[i].pipe[1] = -1;
+	    session_close(w, s);
+	    return;
+	}
+	if (pipesize)
+	    fcntl(s->half[i].pipe[1], F_SETPIPE_SZ, pipesize);
+    }
+
+    s->state = ST_RELAY;
+    relay(w, s);
+}
+
+/* Send the reply to a request, SOCKS 5 replies give the address the */
+/* connection to the destination is from                             */
+static int send_reply(struct session *s, int code) {
+    struct sockaddr_storage bound;
+    struct linger linger = { 1, 0 };
+    socklen_t len = sizeof(bound);
+    unsigned char reply[22];
+    int rlen;
+
+    /* A redirected client thinks it is connected already, all it can */
+    /* be told is that the connection was reset                       */
+    if (REDIRECTING) {
+	if (code)
+	    setsockopt(s->half[0].fd, SOL_SOCKET, SO_LINGER, &linger,
+		    sizeof(linger));
+	return 0;
+    }
+
+    memset(&bound, 0x0, sizeof(bound));
+    if (!code && getsockname(s->half[1].fd, (struct sockaddr *) &bound, &len))
+	memset(&bound, 0x0, sizeof(bound));
+
+    memset(reply, 0x0, sizeof(reply));
+    if (s->version == 4) {
+	reply[1] = (code ? 91 : 90);
+	if (bound.ss_family == AF_INET) {
+	    memcpy(&reply[2], &((struct sockaddr_in *) &bound)->sin_port, 2);
+	    memcpy(&reply[4], &((struct sockaddr_in *) &bound)->sin_addr, 4);
+	}
+	rlen = 8;
+    } else {
+	reply[0] = 5;
+	reply[1] = code;
+	if (bound.ss_family == AF_INET6) {
+	    reply[3] = 4;
+	    memcpy(&reply[4], &((struct sockaddr_in6 *) &bound)->sin6_addr, 16);
+	    memcpy(&reply[20], &((struct sockaddr_in6 *) &bound)->sin6_port, 2);
+	    rlen = 22;
+	} else {
+	    reply[3] = 1;
+	    if (bound.ss_family == AF_INET) {
+		memcpy(&reply[4], &((struct sockaddr_in *) &bound)->sin_addr,
+			4);
+		memcpy(&reply[8], &((struct sockaddr_in *) &bound)->sin_port,
+			2);
+	    }
+	    rlen = 10;
+	}
+    }
+
+    return (send(s->half[0].fd, reply, rlen, MSG_NOSIGNAL) == rlen ? 0 : -1);
+}
+
+static int reply_code(int err) {
+
+    switch (err) {
+	case ECONNREFUSED:
+	    return REPLY_REFUSED;
+	case ENETUNREACH:
+	    return REPLY_NETUNREACH;
+	case EHOSTUNREACH:
+	case ETIMEDOUT:
+	    return REPLY_HOSTUNREACH;
+	case EACCES:
+	case EPERM:
+	    return REPLY_NOTALLOWED;
+	default:
+	    return REPLY_FAILURE;
+    }
+}
+
+/* Move data each way through the pipes, from a socket into the pipe */
+/* for its direction and from there to the other socket. A side is    */
+/* read while its pipe has room and written while the other's pipe    */
+/* has data, once a side has sent everything and its pipe is empty    */
+/* the other side is shut down for writing                            */
+static void relay(struct worker *w, struct session *s) {
+    struct half *from, *to;
+    ssize_t in, out;
+    int i, rounds;
+
+    for (i = 0; i < 2; i++) {
+	from = &s->half[i];
+	to = &s->half[!i];
+	for (rounds = 0; rounds < RELAYROUNDS; rounds++) {
+	    in = 0;
+	    if (!from->eof && !from->full) {
+		in = splice(from->fd, NULL, from->pipe[1], NULL, SPLICEMAX,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (in > 0) {
+		    from->inpipe += in;
+		    w->bytes[i] += in;
+		} else if (in == 0)
+		    from->eof = 1;
+		else if (errno == EAGAIN) {
+		    /* Either the socket is empty or the pipe is full, */
+		    /* if it is the pipe the other side will drain it   */
+		    if (from->inpipe)
+			from->full = 1;
+		} else if (errno != EINTR)
+		    goto failed;
+	    }
+	    if (from->inpipe) {
+		out = splice(from->pipe[0], NULL, to->fd, NULL, from->inpipe,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (out > 0) {
+		    from->inpipe -= out;
+		    from->full = 0;
+		} else if ((out < 0) && (errno != EAGAIN) && (errno != EINTR))
+		    goto failed;
+	    }
+	    if (from->inpipe || (in <= 0))
+		break;
+	}
+	if (from->eof && !from->inpipe && !from->shut) {
+	    shutdown(to->fd, SHUT_WR);
+	    from->shut = 1;
+	}
+    }
+
+    if (s->half[0].shut && s->half[1].shut) {
+	session_close(w, s);
+	return;
+    }
+
+    for (i = 0; i < 2; i++) {
+	if (set_events(w, &s->half[i], ((!s->half[i].eof && !s->half[i].full ?
+			    EPOLLIN : 0) | (s->half[!i].inpipe ? EPOLLOUT : 0))))
+	    goto failed;
+    }
+    return;
+
+failed:
+    session_close(w, s);
+}
+
+/* Resolve the SOCKS servers in the configuration once, with the */
+/* credentials to give each the way libtsocks finds them         */
+static void setup_upstreams(void) {
+    struct upstream *u;
+    struct passwd *nixuser;
+    char *envuser, *envpass;
+    unsigned int ip;
+    int i;
+
+    if ((upstreams = calloc(config.index.npaths + 1,
+		    sizeof(*upstreams))) == NULL) {
+	show_msg(MSGERR, "Could not allocate memory for servers\n");
+	exit(1);
+    }
+    nixuser = getpwuid(getuid());
+    envuser = getenv("TSOCKS_USERNAME");
+    envpass = getenv("TSOCKS_PASSWORD");
+
+    for (i = 0; i <= config.index.npaths; i++) {
+	u = &upstreams[i];
+	u->path = (i < config.index.npaths ? config.index.paths[i] :
+		&config.defaultserver);
+	if (u->path->address == NULL)
+	    continue;
+	if (u->path->chain != NULL) {
+	    show_msg(MSGERR, "The path at line %d goes through a chain of "
+		    "servers, which %s can't use\n", u->path->lineno, progname);
+	    continue;
+	}
+	if (u->path->type == SERVER_HTTP) {
+	    show_msg(MSGERR, "The server at line %d is an HTTP proxy, which "
+		    "%s can't use\n", u->path->lineno, progname);
+	    continue;
+	}
+	if ((ip = resolve_ip(u->path->address, 0, HOSTNAMES)) ==
+		(unsigned int) -1) {
+	    show_msg(MSGERR, "The SOCKS server (%s) at line %d is invalid\n",
+		    u->path->address, u->path->lineno);
+	    continue;
+	}
+	u->addr.sin_family = AF_INET;
+	u->addr.sin_addr.s_addr = ip;
+	u->addr.sin_port = htons(u->path->port);
+	if (is_local(&config, &u->addr.sin_addr)) {
+	    show_msg(MSGERR, "SOCKS server %s (%s) is not on a local "
+		    "subnet!\n", u->path->address, inet_ntoa(u->addr.sin_addr));
+	    continue;
+	}
+
+	if ((u->user = u->path->defuser) == NULL)
+	    u->user = (envuser ? envuser : (nixuser ? nixuser->pw_name : ""));
+	u->pass = (envpass ? envpass : u->path->defpass);
+	if ((strlen(u->user) > 255) || (u->pass && (strlen(u->pass) > 255))) {
+	    show_msg(MSGERR, "The SOCKS username or password for the server "
+		    "at line %d is too long\n", u->path->lineno);
+	    continue;
+	}
+	u->usable = 1;
+    }
+}
+
+/* Find where a redirected connection was going and route it as */
+/* libtsocks would, directly or through a SOCKS server          */
+static int redirect_request(struct worker *w, struct session *s) {
+    struct sockaddr_in *dst = (struct sockaddr_in *) &s->dst;
+    struct upstream *u;
+    socklen_t len = sizeof(*dst);
+    int route;
+
+    /* REDIRECT leaves the original destination with conntrack, */
+    /* TPROXY leaves it as the local address                    */
+    memset(&s->dst, 0x0, sizeof(s->dst));
+    if (getsockopt(s->half[0].fd, SOL_IP, SO_ORIGINAL_DST, dst, &len)) {
+	len = sizeof(*dst);
+	if (getsockname(s->half[0].fd, (struct sockaddr *) dst, &len))
+	    return -1;
+    }
+
+    /* A connection made to tsocks-redir itself would come back to it */
+    if ((dst->sin_family != AF_INET) ||
+	    ((dst->sin_port == listenaddr.sin_port) &&
+	     ((dst->sin_addr.s_addr == listenaddr.sin_addr.s_addr) ||
+	      (listenaddr.sin_addr.s_addr == htonl(INADDR_ANY))))) {
+	show_msg(MSGDEBUG, "Refused a connection that wasn't redirected\n");
+	w->refused++;
+	send_reply(s, REPLY_NOTALLOWED);
+	return -1;
+    }
+
+    route = route_addr(&config.index, dst->sin_addr.s_addr,
+	    ntohs(dst->sin_port));
+    if (route != ROUTE_LOCAL) {
+	u = &upstreams[(route == ROUTE_DEFAULT ? config.index.npaths :
+		route)];
+	if (u->usable)
+	    s->upstream = u;
+	else if ((u->path != &config.defaultserver) || u->path->address ||
+		!config.fallback) {
+	    show_msg(MSGDEBUG, "No usable SOCKS server for %s:%d\n",
+		    inet_ntoa(dst->sin_addr), ntohs(dst->sin_port));
+	    w->refused++;
+	    send_reply(s, REPLY_NOTALLOWED);
+	    return -1;
+	}
+    }
+
+    return start_connect(w, s);
+}
+
+/* Ask the SOCKS server to connect to the original destination. With */
+/* no password to offer a SOCKS 5 server the connect request goes    */
+/* with the methods, saving a round trip                             */
+static int upstream_request(struct worker *w, struct session *s) {
+    struct sockaddr_in *dst = (struct sockaddr_in *) &s->dst;
+    struct upstream *u = s->upstream;
+    unsigned char msg[272];
+    int len;
+
+    if (u->path->type == 4) {
+	msg[0] = 4;
+	msg[1] = 1;
+	memcpy(&msg[2], &dst->sin_port, 2);
+	memcpy(&msg[4], &dst->sin_addr, 4);
+	strcpy((char *) &msg[8], u->user);
+	len = 9 + strlen(u->user);
+	s->state = ST_V4REPLY;
+    } else {
+	msg[0] = 5;
+	if (u->pass) {
+	    msg[1] = 2;
+	    msg[2] = 0;
+	    msg[3] = 2;
+	    len = 4;
+	} else {
+	    msg[1] = 1;
+	    msg[2] = 0;
+	    len = 3 + socks5_connect(s, &msg[3]);
+	}
+	s->state = ST_V5METHOD;
+    }
+
+    if (send(s->half[1].fd, msg, len, MSG_NOSIGNAL) != len)
+	return -1;
+
+    return set_events(w, &s->half[1], EPOLLIN);
+}
+
+/* Handle the SOCKS server's replies, relaying starts once it has */
+/* connected to the destination                                   */
+static int upstream_reply(struct worker *w, struct session *s) {
+    struct upstream *u = s->upstream;
+    unsigned char *buf = s->buf, msg[520];
+    int need, len, ulen, plen;
+
+    while (1) {
+	len = 0;
+	switch (s->state) {
+	    case ST_V4REPLY:
+		if (s->len < 8)
+		    return 0;
+		if (buf[1] != 90)
+		    goto refused;
+		consume(s, 8);
+		start_relay(w, s);
+		return 0;
+	    case ST_V5METHOD:
+		if (s->len < 2)
+		    return 0;
+		if ((buf[0] != 5) || ((buf[1] != 0) &&
+			    ((buf[1] != 2) || !u->pass)))
+		    goto refused;
+		if (buf[1] == 2) {
+		    ulen = strlen(u->user);
+		    plen = strlen(u->pass);
+		    msg[0] = 1;
+		    msg[1] = ulen;
+		    memcpy(&msg[2], u->user, ulen);
+		    msg[2 + ulen] = plen;
+		    memcpy(&msg[3 + ulen], u->pass, plen);
+		    len = 3 + ulen + plen;
+		    s->state = ST_V5AUTH;
+		} else {
+		    /* Without a password the request has been sent */
+		    if (u->pass)
+			len = socks5_connect(s, msg);
+		    s->state = ST_V5REPLY;
+		}
+		consume(s, 2);
+		break;
+	    case ST_V5AUTH:
+		if (s->len < 2)
+		    return 0;
+		if (buf[1])
+		    goto refused;
+		consume(s, 2);
+		len = socks5_connect(s, msg);
+		s->state = ST_V5REPLY;
+		break;
+	    case ST_V5REPLY:
+		if (s->len < 5)
+		    return 0;
+		switch (buf[3]) {
+		    case 1:
+			need = 10;
+			break;
+		    case 3:
+			need = 7 + buf[4];
+			break;
+		    case 4:
+			need = 22;
+			break;
+		    default:
+			goto refused;
+		}
+		if (s->len < need)
+		    return 0;
+		if ((buf[0] != 5) || buf[1])
+		    goto refused;
+		consume(s, need);
+		start_relay(w, s);
+		return 0;
+	    default:
+		return -1;
+	}
+	if (len && (send(s->half[1].fd, msg, len, MSG_NOSIGNAL) != len))
+	    return -1;
+    }
+
+refused:
+    show_msg(MSGDEBUG, "SOCKS server refused the request for %s:%d\n",
+	    inet_ntoa(((struct sockaddr_in *) &s->dst)->sin_addr),
+	    ntohs(((struct sockaddr_in *) &s->dst)->sin_port));
+    w->refused++;
+    send_reply(s, REPLY_NOTALLOWED);
+    return -1;
+}
+
+/* Put a SOCKS 5 connect request for the destination in buf, returns */
+/* its length                                                        */
+static int socks5_connect(struct session *s, unsigned char *buf) {
+    struct sockaddr_in *dst = (struct sockaddr_in *) &s->dst;
+
+    buf[0] = 5;
+    buf[1] = 1;
+    buf[2] = 0;
+    buf[3] = 1;
+    memcpy(&buf[4], &dst->sin_addr, 4);
+    memcpy(&buf[8], &dst->sin_port, 2);
+
+    return 10;
+}
+
+/* Resolve names for a worker, one at a time */
+static void *resolver_main(void *arg) {
+    struct worker *w = arg;
+    struct addrinfo hints, *res;
+    struct session *s;
+    char port[8];
+    uint64_t one = 1;
+
+    memset(&hints, 0x0, sizeof(hints));
+    /* Only IPv4 destinations can be checked against tsocks.conf */
+    hints.ai_family = (haveconfig ? AF_INET : AF_UNSPEC);
+    hints.ai_socktype = SOCK_STREAM;
+
+    while (1) {
+	pthread_mutex_lock(&w->lock);
+	while (!w->toresolve.head && !stopping)
+	    pthread_cond_wait(&w->wakeup, &w->lock);
+	if (stopping) {
+	    pthread_mutex_unlock(&w->lock);
+	    break;
+	}
+	s = w->toresolve.head;
+	if ((w->toresolve.head = s->next) == NULL)
+	    w->toresolve.tail = &w->toresolve.head;
+	pthread_mutex_unlock(&w->lock);
+
+	snprintf(port, sizeof(port), "%d", s->port);
+	if ((s->resolveerr = getaddrinfo(s->host, port, &hints, &res)) == 0) {
+	    memcpy(&s->dst, res->ai_addr, res->ai_addrlen);
+	    freeaddrinfo(res);
+	}
+
+	s->next = NULL;
+	pthread_mutex_lock(&w->lock);
+	*w->resolved.tail = s;
+	w->resolved.tail = &s->next;
+	pthread_mutex_unlock(&w->lock);
+	if (write(w->resolvefd, &one, sizeof(one)) != sizeof(one))
+	    show_msg(MSGERR, "Could not wake worker (%s)\n", strerror(errno));
+    }
+
+    return NULL;
+}
+
+/* Carry on with the requests the resolver has finished with */
+static void resolved(struct worker *w) {
+    struct session *s, *next;
+    uint64_t count;
+
+    if (read(w->resolvefd, &count, sizeof(count)) != sizeof(count))
+	return;
+
+    pthread_mutex_lock(&w->lock);
+    s = w->resolved.head;
+    w->resolved.head = NULL;
+    w->resolved.tail = &w->resolved.head;
+    pthread_mutex_unlock(&w->lock);
+
+    for (; s != NULL; s = next) {
+	next = s->next;
+	s->next = NULL;
+	if (s->resolveerr) {
+	    show_msg(MSGDEBUG, "Could not resolve %s (%s)\n", s->host,
+		    gai_strerror(s->resolveerr));
+	    send_reply(s, REPLY_HOSTUNREACH);
+	    session_close(w, s);
+	} else if (start_connect(w, s))
+	    session_close(w, s);
+    }
+}
+
+/* Once a second, close sessions whose handshake or connect has taken */
+/* too long and start accepting again if it had stopped               */
+static void expire(struct worker *w) {
+    struct epoll_event event;
+    struct session *s;
+    struct slab *slab;
+    int i;
+
+    if (w->paused) {
+	event.events = EPOLLIN;
+	event.data.ptr = &listentag;
+	epoll_ctl(w->epfd, EPOLL_CTL_MOD, w->listenfd, &event);
+	w->paused = 0;
+    }
+
+    for (slab = w->slabs; slab != NULL; slab = slab->next) {
+	for (i = 0; i < POOLSLAB; i++) {
+	    s = &slab->sessions[i];
+	    if ((s->state < ST_GREETING) || (s->state > ST_V5REPLY) ||
+		    (s->state == ST_RESOLVING) ||
+		    (w->now - s->started < timeout))
+		continue;
+	    if (s->state >= ST_CONNECTING)
+		send_reply(s, REPLY_HOSTUNREACH);
+	    session_close(w, s);
+	}
+    }
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,273 @@
+/*
+ * udp.c    - SOCKS 5 UDP associations for UDP sockets
+ *
+ * When TSOCKS_UDP is set libtsocks relays datagrams for destinations
+ * tsocks.conf doesn't list as local through a SOCKS 5 server, using a
+ * UDP ASSOCIATE request made the first time a socket sends to one.
+ * This module keeps the associations, indexed by descriptor so the
+ * send and receive calls can find them without taking a lock, and
+ * puts on and takes off the header each relayed datagram carries.
+ * The header always has its own buffer, gathered in front of the
+ * caller's buffers when sending and scattered into when receiving.
+ */
+
+#include <config.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "common.h"
+#include "parser.h"
+#include "tsocks.h"
+#include "udp.h"
+
+#define UDP_PAGE	1024	/* Associations in a page of the index */
+#define UDP_PAGES	1024	/* So descriptors below a million */
+
+/* Number of associations, while there are none the receive calls */
+/* don't need to look                                             */
+int __attribute__ ((visibility ("hidden"))) udpsockets = 0;
+
+/* Pages are only ever added, so they can be read without the lock */
+static struct udpassoc **pages[UDP_PAGES];
+static pthread_mutex_t udp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned char *iov_at(struct iovec *, int, size_t);
+static size_t restore(struct iovec *, int, unsigned char *, size_t,
+	int *);
+
+struct udpassoc __attribute__ ((visibility ("hidden")))
+*udp_find(int fd) {
+    struct udpassoc **page;
+
+    if ((fd < 0) || (fd >= UDP_PAGE * UDP_PAGES) ||
+	    ((page = __atomic_load_n(&pages[fd / UDP_PAGE],
+				     __ATOMIC_ACQUIRE)) == NULL))
+	return NULL;
+
+    return __atomic_load_n(&page[fd % UDP_PAGE], __ATOMIC_ACQUIRE);
+}
+
+/* Add an association, returns the one already there if another */
+/* thread got in first or NULL if it can't be added             */
+struct udpassoc __attribute__ ((visibility ("hidden")))
+*udp_insert(struct udpassoc *assoc) {
+    struct udpassoc **page, *existing;
+    int fd = assoc->sockid;
+
+    if ((fd < 0) || (fd >= UDP_PAGE * UDP_PAGES))
+	return NULL;
+
+    pthread_mutex_lock(&udp_lock);
+    if (((page = pages[fd / UDP_PAGE]) == NULL) &&
+	    ((page = calloc(UDP_PAGE, sizeof(*page))) != NULL))
+	__atomic_store_n(&pages[fd / UDP_PAGE], page, __ATOMIC_RELEASE);
+    if (page == NULL) {
+	pthread_mutex_unlock(&udp_lock);
+	show_msg(MSGERR, "Could not allocate memory for UDP associations\n");
+	return NULL;
+    }
+    if ((existing = page[fd % UDP_PAGE]) == NULL) {
+	__atomic_store_n(&page[fd % UDP_PAGE], assoc, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&udpsockets, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&udp_lock);
+
+    return (existing ? existing : assoc);
+}
+
+/* Take the association for a socket out of the index, for the */
+/* caller to end                                               */
+struct udpassoc __attribute__ ((visibility ("hidden")))
+*udp_remove(int fd) {
+    struct udpassoc **page, *assoc = NULL;
+
+    if ((fd < 0) || (fd >= UDP_PAGE * UDP_PAGES))
+	return NULL;
+
+    pthread_mutex_lock(&udp_lock);
+    if (((page = pages[fd / UDP_PAGE]) != NULL) &&
+	    ((assoc = page[fd % UDP_PAGE]) != NULL)) {
+	__atomic_store_n(&page[fd % UDP_PAGE], NULL, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&udpsockets, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&udp_lock);
+
+    return assoc;
+}
+
+/* Work out how a datagram reaches its destination, the same way a */
+/* connection would except that only SOCKS 5 servers relay UDP,    */
+/* and not through a chain                                          */
+int __attribute__ ((visibility ("hidden")))
+udp_route(struct parsedfile *config, struct sockaddr_in *dst,
+	struct serverent **path) {
+
+    if (!is_local(config, &(dst->sin_addr)))
+	return UDP_DIRECT;
+
+    pick_server(config, path, &(dst->sin_addr), ntohs(dst->sin_port));
+    if ((*path)->address == NULL)
+	return (((*path == &(config->defaultserver)) && config->fallback) ?
+		UDP_DIRECT : UDP_UNROUTABLE);
+    if (((*path)->type != 5) || ((*path)->chain != NULL))
+	return UDP_UNROUTABLE;
+
+    return UDP_RELAY;
+}
+
+/* Route a destination for a socket with an association, remembering */
+/* the last one since most sockets only ever send to one. Relayed     */
+/* destinations must need the association's server                   */
+int __attribute__ ((visibility ("hidden")))
+udp_lookup(struct udpassoc *assoc, struct sockaddr_in *dst) {
+    struct serverent *path;
+    uint64_t key, last;
+    int route;
+
+    key = ((uint64_t) dst->sin_addr.s_addr << 32) |
+	((uint64_t) dst->sin_port << 16) | 0x100;
+    last = __atomic_load_n(&(assoc->lastroute), __ATOMIC_RELAXED);
+    if ((last & ~0xffULL) == key)
+	return (int) (int8_t) (last & 0xff);
+
+    route = udp_route(&(assoc->config->conf), dst, &path);
+    if ((route == UDP_RELAY) && (path != assoc->path)) {
+	show_msg(MSGERR, "UDP to %s needs a different SOCKS server to the "
+		"one this socket is associated with\n",
+		inet_ntoa(dst->sin_addr));
+	route = UDP_UNROUTABLE;
+    }
+    __atomic_store_n(&(assoc->lastroute), key | (uint8_t) route,
+	    __ATOMIC_RELAXED);
+
+    return route;
+}
+
+/* Set out up to send the message in through the relay to dst, iov */
+/* must have room for one more iovec than the message has          */
+int __attribute__ ((visibility ("hidden")))
+udp_wrap(struct udpassoc *assoc, struct udpwrap *wrap, struct msghdr *out,
+	struct iovec *iov, const struct msghdr *in, struct sockaddr_in *dst) {
+    unsigned char *header = wrap->header;
+
+    header[0] = header[1] = 0; /* Reserved */
+    header[2] = 0; /* Not a fragment */
+    header[3] = 1; /* IPv4 address */
+    memcpy(&header[4], &(dst->sin_addr), 4);
+    memcpy(&header[8], &(dst->sin_port), 2);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = UDP_HEADER;
+    memcpy(&iov[1], in->msg_iov, in->msg_iovlen * sizeof(*iov));
+
+    *out = *in;
+    out->msg_name = &(assoc->relay);
+    out->msg_namelen = sizeof(assoc->relay);
+    out->msg_iov = iov;
+    out->msg_iovlen = in->msg_iovlen + 1;
+    wrap->wrapped = 1;
+
+    return 0;
+}
+
+/* Set out up to receive into the buffers of the message in with */
+/* the SOCKS header going into wrap, iov must have room for one  */
+/* more iovec than the message has                               */
+void __attribute__ ((visibility ("hidden")))
+udp_prepare(struct udpwrap *wrap, struct msghdr *out, struct iovec *iov,
+	const struct msghdr *in) {
+
+    iov[0].iov_base = wrap->header;
+    iov[0].iov_len = UDP_HEADER;
+    memcpy(&iov[1], in->msg_iov, in->msg_iovlen * sizeof(*iov));
+
+    *out = *in;
+    out->msg_name = &(wrap->from);
+    out->msg_namelen = sizeof(wrap->from);
+    out->msg_iov = iov;
+    out->msg_iovlen = in->msg_iovlen + 1;
+    out->msg_flags = 0;
+}
+
+/* Finish receiving a datagram of len bytes into the message in, */
+/* the length and source of the datagram the header carried are  */
+/* given back for one from the relay. Returns -1 for datagrams   */
+/* that can't be given back (fragments and anything not from an  */
+/* IPv4 address)                                                 */
+int __attribute__ ((visibility ("hidden")))
+udp_unwrap(struct udpassoc *assoc, struct udpwrap *wrap, struct msghdr *out,
+	struct msghdr *in, size_t *len) {
+    unsigned char *header = wrap->header;
+    struct sockaddr_in from = wrap->from;
+
+    in->msg_controllen = out->msg_controllen;
+    in->msg_flags = out->msg_flags;
+
+    if ((wrap->from.sin_addr.s_addr == assoc->relay.sin_addr.s_addr) &&
+	    (wrap->from.sin_port == assoc->relay.sin_port)) {
+	if ((*len < UDP_HEADER) || header[2] || (header[3] != 1))
+	    return -1;
+	*len -= UDP_HEADER;
+	memcpy(&(from.sin_addr), &header[4], 4);
+	memcpy(&(from.sin_port), &header[8], 2);
+    } else {
+	/* Not through the relay, the start of it went into the header */
+	*len = restore(in->msg_iov, in->msg_iovlen, header, *len,
+		&(in->msg_flags));
+    }
+
+    if (in->msg_name) {
+	memcpy(in->msg_name, &from, (in->msg_namelen < sizeof(from) ?
+		    in->msg_namelen : sizeof(from)));
+	in->msg_namelen = sizeof(from);
+    }
+
+    return 0;
+}
+
+static unsigned char *iov_at(struct iovec *iov, int cnt, size_t off) {
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+	if (off < iov[i].iov_len)
+	    return (unsigned char *) iov[i].iov_base + off;
+	off -= iov[i].iov_len;
+    }
+
+    return NULL;
+}
+
+/* Put the start of a datagram of len bytes back in front of the */
+/* rest of it, as much as fits, returns the length given back    */
+static size_t restore(struct iovec *iov, int cnt, unsigned char *header,
+	size_t len, int *flags) {
+    size_t room = 0, keep, i;
+
+    for (i = 0; i < (size_t) cnt; i++)
+	room += iov[i].iov_len;
+    keep = (len < room ? len : room);
+    if (len > room)
+	*flags |= MSG_TRUNC;
+
+    if ((cnt == 1) && (keep > UDP_HEADER)) {
+	memmove((unsigned char *) iov[0].iov_base + UDP_HEADER,
+		iov[0].iov_base, keep - UDP_HEADER);
+    } else {
+	for (i = keep; i-- > UDP_HEADER; )
+	    *iov_at(iov, cnt, i) = *iov_at(iov, cnt, i - UDP_HEADER);
+    }
+    for (i = 0; (i < UDP_HEADER) && (i < keep); i++)
+	*iov_at(iov, cnt, i) = header[i];
+
+    return keep;
+}
+
+/*
+ * vim:sw=4:sts=4:tw=80
+ */
@@ -0,0 +1,70 @@
+/* udp.h - SOCKS 5 UDP associations (RFC 1928 section 7) for UDP   */
+/* sockets. Datagrams for destinations that aren't local are sent  */
+/* to the association's relay with the SOCKS header gathered in    */
+/* front of the caller's buffers, and received with the header     */
+/* scattered into a buffer of its own, so the data is never copied */
+
+#ifndef _UDP_H
+
+#define _UDP_H	1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define UDP_HEADER	10	/* RSV, FRAG, ATYP and an IPv4 address and port */
+#define UDP_BATCH	64	/* Messages wrapped for each real sendmmsg() */
+				/* or recvmmsg()                             */
+#define UDP_IOVS	256	/* iovecs for a batch, so a message may have */
+				/* one less than this                        */
+
+/* How a datagram gets to its destination, from udp_route() */
+#define UDP_DIRECT	0
+#define UDP_RELAY	1
+#define UDP_UNROUTABLE	-1
+
+struct parsedfile;
+struct serverent;
+struct confref;
+
+/* Structure representing the association for a UDP socket */
+struct udpassoc {
+   int sockid;
+   int ctlfd; /* The association lasts as long as this TCP connection */
+   struct sockaddr_in relay; /* Where the server relays datagrams */
+   struct serverent *path; /* The server, every relayed destination */
+			   /* must be routed through it              */
+   struct confref *config; /* Destinations are routed by this */
+   struct sockaddr_in peer; /* Destination the socket was connect()ed */
+			    /* to, the socket is really connected to  */
+			    /* the relay                              */
+   uint64_t lastroute; /* The last destination routed and how */
+};
+
+/* Structure representing the buffers for sending or receiving one */
+/* message through a relay                                         */
+struct udpwrap {
+   unsigned char header[UDP_HEADER];
+   struct sockaddr_in from; /* Where a received datagram came from */
+   int wrapped; /* Sent through the relay */
+};
+
+/* Functions provided by the udp module */
+extern int udpsockets;
+
+struct udpassoc *udp_find(int fd);
+struct udpassoc *udp_insert(struct udpassoc *assoc);
+struct udpassoc *udp_remove(int fd);
+int udp_route(struct parsedfile *config, struct sockaddr_in *dst,
+	struct serverent **path);
+int udp_lookup(struct udpassoc *assoc, struct sockaddr_in *dst);
+int udp_wrap(struct udpassoc *assoc, struct udpwrap *wrap,
+	struct msghdr *out, struct iovec *iov, const struct msghdr *in,
+	struct sockaddr_in *dst);
+void udp_prepare(struct udpwrap *wrap, struct msghdr *out,
+	struct iovec *iov, const struct msghdr *in);
+int udp_unwrap(struct udpassoc *assoc, struct udpwrap *wrap,
+	struct msghdr *out, struct msghdr *in, size_t *len);
+
+#endif
@@ -35,47 +35,191 @@ char *progname = "validateconf";	      /* Name for error msgs      */
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <common.h>
 #include <parser.h>
+#include <cache.h>
+#include <optimize.h>
+
+/* A configuration being tested in batch mode */
+struct batchconf {
+    struct parsedfile config;
+    char **labels; /* Text for each decision, indexed by decision + 2 */
+    int *servers; /* Server each decision ends up using, as an index */
+		  /* into a table shared with the other configuration */
+    int ndecisions;
+};
+
+/* The part of the input a thread works on and its results */
+struct batchjob {
+    struct batchconf *confs;
+    int nconfs;
+    int summary;
+    char *start, *end; /* Lines to test */
+    char *out; /* Output for these lines */
+    size_t outlen, outsize;
+    unsigned long *counts; /* Count of each decision (or pair of */
+			   /* decisions when comparing)           */
+    unsigned long lines, invalid, differ;
+    pthread_t thread;
+};
 
 void show_server(struct parsedfile *, struct serverent *, int);
 void show_conf(struct parsedfile *config);
+void show_prefixfiles(struct prefixfile *);
 void test_host(struct parsedfile *config, char *);
+static void test_host6(struct parsedfile *config, char *);
+static void show_nets6(struct netent6 *);
+static void show_domains(struct domainent *);
+int test_batch(struct batchconf *, int, char *, int, int);
+static int parse_addr(char *, char *, uint32_t *, unsigned int *);
+static void batch_output(struct batchjob *, char *, size_t);
+static void *batch_thread(void *);
+static void batch_labels(struct batchconf *, int);
+static char *read_all(char *, size_t *);
+int write_source(struct parsedfile *, char *, char *);
+static void write_string(FILE *, char *);
+static void write_table(FILE *, char *, struct routetable *);
+static void write_table6(FILE *, char *, struct routetable6 *);
+static void write_domains(FILE *, struct domaintable *);
+static void write_server(FILE *, struct serverent *, int);
 
 int main(int argc, char *argv[]) {
-    char *usage = "Usage: [-f conf file] [-t hostname/ip[:port]]";
+    char *usage = "Usage: [-f conf file] [-t hostname/ip[:port]] [-c] "
+	"[-g source file]\n"
+	"       [-f conf file] [-a] [-o minimized conf file] "
+	"[-d other conf file]\n"
+	"       [-f conf file] -b address file|- [-d other conf file] "
+	"[-j threads] [-s]";
     char *filename = NULL;
     char *testhost = NULL;
-    struct parsedfile config;
-    int i;
+    char *sourcefile = NULL;
+    char *batchfile = NULL;
+    char *difffile = NULL;
+    char *minfile = NULL;
+    FILE *minconf = NULL;
+    int analyze = 0;
+    int writecache = 0;
+    int nthreads = 0;
+    int summary = 0;
+    struct parsedfile config, other;
+    struct batchconf confs[2];
+    int c;
 
-    if ((argc > 5) || (((argc - 1) % 2) != 0)) {
+    while ((c = getopt(argc, argv, "f:t:cg:b:d:j:sao:")) != -1) {
+	switch (c) {
+	    case 'f':
+		filename = optarg;
+		break;
+	    case 't':
+		testhost = optarg;
+		break;
+	    case 'c':
+		writecache = 1;
+		break;
+	    case 'g':
+		sourcefile = optarg;
+		break;
+	    case 'b':
+		batchfile = optarg;
+		break;
+	    case 'd':
+		difffile = optarg;
+		break;
+	    case 'j':
+		nthreads = atoi(optarg);
+		break;
+	    case 's':
+		summary = 1;
+		break;
+	    case 'a':
+		analyze = 1;
+		break;
+	    case 'o':
+		minfile = optarg;
+		break;
+	    default:
+		show_msg(MSGERR, "%s\n", usage);
+		exit(1);
+	}
+    }
+
+    if (optind != argc) {
 	show_msg(MSGERR, "Invalid number of arguments\n");
 	show_msg(MSGERR, "%s\n", usage);
 	exit(1);
     }
 
-    for (i = 1; i < argc; i = i + 2) {
-	if (!strcmp(argv[i], "-f")) {
-	    filename = argv[(i + 1)];
-	} else if (!strcmp(argv[i], "-t")) {
-	    testhost = argv[(i + 1)];
-	} else {
-	    show_msg(MSGERR, "Unknown option %s\n", argv[i]);
-	    show_msg(MSGERR, "%s\n", usage);
-	    exit(1);
-	}
-    }
-
     if (!filename)
 	filename = strdup(CONF_FILE);
 
+    /* Batch mode only outputs the results */
+    if (batchfile) {
+	if (read_config(filename, &(confs[0].config)) ||
+		(difffile && read_config(difffile, &(confs[1].config))))
+	    exit(1);
+	if (nthreads <= 0)
+	    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	c = test_batch(confs, (difffile ? 2 : 1), batchfile, nthreads, summary);
+	exit(c < 0 ? 2 : c);
+    }
+
     printf("Reading configuration file %s...\n", filename);
     if (read_config(filename, &config) == 0)
 	printf("... Read complete\n\n");
     else
 	exit(1);
 
+    /* Compile the configuration for libtsocks if asked to */
+    if (writecache) {
+	printf("Writing configuration cache %s" CACHE_SUFFIX "...\n", filename);
+	if (write_config_cache(filename, &config))
+	    exit(1);
+	printf("... Write complete\n\n");
+    }
+
+    /* Or turn it into C source for a library with the */
+    /* configuration built in                          */
+    if (sourcefile) {
+	printf("Writing configuration source %s...\n", sourcefile);
+	if (write_source(&config, filename, sourcefile))
+	    exit(1);
+	printf("... Write complete\n\n");
+    }
+
+    /* Look for rules that can never match or can be merged, */
+    /* and possibly write out the minimized configuration    */
+    if (analyze || minfile) {
+	if (minfile && ((minconf = fopen(minfile, "w")) == NULL)) {
+	    show_msg(MSGERR, "Could not create %s (%s)\n", minfile,
+		    strerror(errno));
+	    exit(1);
+	}
+	printf("Analyzing rules...\n");
+	analyze_config(&config, stdout, minconf, filename);
+	if (minconf) {
+	    fclose(minconf);
+	    printf("Wrote minimized configuration to %s\n", minfile);
+	    /* Prove it really is the same */
+	    if (!difffile)
+		difffile = minfile;
+	}
+	printf("\n");
+    }
+
+    /* Check another configuration routes everything the same way */
+    if (difffile) {
+	printf("Comparing routing with %s...\n", difffile);
+	if (read_config(difffile, &other))
+	    exit(1);
+	if (compare_configs(&config, &other, stdout))
+	    exit(1);
+    }
+
+    if (analyze || minfile || difffile)
+	return 0;
+
     /* If they specified a test host, test it, otherwise */
     /* dump the configuration                            */
     if (!testhost)
@@ -92,6 +236,13 @@ void test_host(struct parsedfile *config, char *host) {
     char *hostname, *port;
     char separator;
     unsigned long portno = 0;
+    int domain;
+
+    /* IPv6 addresses have colons of their own */
+    if ((*host == '[') || (strchr(host, ':') != strrchr(host, ':'))) {
+	test_host6(config, host);
+	return;
+    }
 
     /* See if a port has been specified */
     hostname = strsplit(&separator, &host, ": \t\n");
@@ -101,6 +252,19 @@ void test_host(struct parsedfile *config, char *host) {
 	    portno = strtol(port, NULL, 0);
     }
 
+    /* A name in a domain with a rule takes the rule's path */
+    if (((domain = route_domain(&(config->index.domains), hostname)) !=
+		ROUTE_NOMATCH) && !inet_aton(hostname, &hostaddr)) {
+	printf("Finding path for %s...\n", hostname);
+	if (domain == ROUTE_LOCAL) {
+	    printf("Path is local (by domain)\n");
+	} else {
+	    printf("Host is reached via this path (by domain):\n");
+	    show_server(config, config->index.paths[domain], 0);
+	}
+	return;
+    }
+
     /* First resolve the host to an ip */
     if ((hostaddr.s_addr = resolve_ip(hostname, 0, 1)) == -1) {
 	fprintf(stderr, "Error: Cannot resolve %s\n", host);
@@ -124,6 +288,346 @@ void test_host(struct parsedfile *config, char *host) {
     return;
 }
 
+/* Test an IPv6 address, given bare or as [address]:port */
+static void test_host6(struct parsedfile *config, char *host) {
+    struct in6_addr hostaddr;
+    struct serverent *path;
+    char text[INET6_ADDRSTRLEN], *end, *port = NULL;
+    unsigned long portno = 0;
+
+    if (*host == '[') {
+	host++;
+	if ((end = strchr(host, ']')) == NULL) {
+	    fprintf(stderr, "Error: Cannot parse %s\n", host);
+	    return;
+	}
+	*end++ = '\0';
+	if (*end == ':')
+	    port = end + 1;
+    } else {
+	host[strcspn(host, " \t\n")] = '\0';
+    }
+    if (port)
+	portno = strtol(port, NULL, 0);
+
+    if (inet_pton(AF_INET6, host, &hostaddr) != 1) {
+	fprintf(stderr, "Error: Cannot parse %s\n", host);
+	return;
+    }
+
+    printf("Finding path for %s...\n",
+	    inet_ntop(AF_INET6, &hostaddr, text, sizeof(text)));
+    if (!(is_local6(config, &hostaddr))) {
+	printf("Path is local\n");
+    } else {
+	pick_server6(config, &path, &hostaddr, portno);
+	if (path == &(config->defaultserver)) {
+	    printf("Path is via default server:\n");
+	    show_server(config, path, 1);
+	} else {
+	    printf("Host is reached via this path:\n");
+	    show_server(config, path, 0);
+	}
+    }
+}
+
+/* Batch mode: test every address in a file (or stdin) against the */
+/* configuration (and optionally compare it with a second one),    */
+/* splitting the input between threads                             */
+
+/* Parse an address in the form "a.b.c.d[:port]" from the start of a */
+/* line, anything after whitespace following the address is ignored  */
+static int parse_addr(char *p, char *end, uint32_t *ip, unsigned int *port) {
+    uint32_t addr = 0, n;
+    int i, digits;
+
+    for (i = 0; i < 4; i++) {
+	for (n = 0, digits = 0; (p < end) && (*p >= '0') && (*p <= '9');
+		p++, digits++)
+	    n = n * 10 + (*p - '0');
+	if ((digits == 0) || (digits > 3) || (n > 255))
+	    return -1;
+	addr = (addr << 8) | n;
+	if ((i < 3) && ((p >= end) || (*p++ != '.')))
+	    return -1;
+    }
+
+    *port = 0;
+    if ((p < end) && (*p == ':')) {
+	for (p++, n = 0, digits = 0; (p < end) && (*p >= '0') && (*p <= '9');
+		p++, digits++)
+	    n = n * 10 + (*p - '0');
+	if ((digits == 0) || (digits > 5) || (n > 65535))
+	    return -1;
+	*port = n;
+    }
+
+    if ((p < end) && (*p != ' ') && (*p != '\t') && (*p != ',') && (*p != '\r'))
+	return -1;
+
+    *ip = htonl(addr);
+    return 0;
+}
+
+/* Add text to the output of a job */
+static void batch_output(struct batchjob *job, char *text, size_t len) {
+
+    if (job->outlen + len > job->outsize) {
+	job->outsize = (job->outsize + len) * 2;
+	if ((job->out = realloc(job->out, job->outsize)) == NULL) {
+	    show_msg(MSGERR, "Could not allocate memory for output\n");
+	    exit(1);
+	}
+    }
+    memcpy(job->out + job->outlen, text, len);
+    job->outlen += len;
+}
+
+static void *batch_thread(void *arg) {
+    struct batchjob *job = arg;
+    struct batchconf *a = &(job->confs[0]), *b = &(job->confs[1]);
+    char *line, *eol, *label;
+    uint32_t ip;
+    unsigned int port;
+    int da, db = 0;
+
+    for (line = job->start; line < job->end; line = eol + 1) {
+	if ((eol = memchr(line, '\n', job->end - line)) == NULL)
+	    eol = job->end;
+	if ((line == eol) || (*line == '#'))
+	    continue;
+	job->lines++;
+
+	if (parse_addr(line, eol, &ip, &port)) {
+	    if (!job->summary) {
+		batch_output(job, line, eol - line);
+		batch_output(job, " invalid\n", 9);
+	    }
+	    job->invalid++;
+	    continue;
+	}
+
+	da = route_addr(&(a->config.index), ip, port) + 2;
+	if (job->nconfs == 1) {
+	    job->counts[da]++;
+	    if (!job->summary) {
+		label = a->labels[da];
+		batch_output(job, line, strcspn(line, " \t,\r\n"));
+		batch_output(job, " ", 1);
+		batch_output(job, label, strlen(label));
+		batch_output(job, "\n", 1);
+	    }
+	    continue;
+	}
+
+	/* Comparing two configurations, only the server used */
+	/* matters, not which line of the file chose it        */
+	db = route_addr(&(b->config.index), ip, port) + 2;
+	job->counts[da * b->ndecisions + db]++;
+	if (a->servers[da] == b->servers[db])
+	    continue;
+	job->differ++;
+	if (!job->summary) {
+	    batch_output(job, line, strcspn(line, " \t,\r\n"));
+	    batch_output(job, " ", 1);
+	    batch_output(job, a->labels[da], strlen(a->labels[da]));
+	    batch_output(job, " -> ", 4);
+	    batch_output(job, b->labels[db], strlen(b->labels[db]));
+	    batch_output(job, "\n", 1);
+	}
+    }
+
+    return NULL;
+}
+
+/* Name the servers used for each decision, servers are the same in */
+/* both configurations if they have the same address, port and type */
+static void batch_labels(struct batchconf *confs, int nconfs) {
+    char **servers = NULL, buf[512], *key;
+    struct serverent *server;
+    int nservers = 0, i, j, d;
+
+    for (i = 0; i < nconfs; i++) {
+	confs[i].ndecisions = confs[i].config.index.npaths + 2;
+	if (((confs[i].labels = malloc(confs[i].ndecisions * sizeof(char *))) == NULL) ||
+		((confs[i].servers = malloc(confs[i].ndecisions * sizeof(int))) == NULL) ||
+		((servers = realloc(servers, (nservers + confs[i].ndecisions) *
+				    sizeof(char *))) == NULL)) {
+	    show_msg(MSGERR, "Could not allocate memory for labels\n");
+	    exit(1);
+	}
+
+	for (d = 0; d < confs[i].ndecisions; d++) {
+	    if (d == ROUTE_LOCAL + 2) {
+		server = NULL;
+		key = "local";
+	    } else {
+		server = (d == ROUTE_DEFAULT + 2 ? &(confs[i].config.defaultserver) :
+			confs[i].config.index.paths[d - 2]);
+		if (server->address != NULL) {
+		    snprintf(buf, sizeof(buf), "%s:%d/%d", server->address,
+			    server->port, server->type);
+		    key = buf;
+		} else if (confs[i].config.fallback) {
+		    key = "local";
+		} else {
+		    key = "none";
+		}
+	    }
+
+	    for (j = 0; (j < nservers) && strcmp(servers[j], key); j++)
+		/* Empty loop */;
+	    if ((j == nservers) && ((servers[nservers++] = strdup(key)) == NULL))
+		exit(1);
+	    confs[i].servers[d] = j;
+
+	    if (d == ROUTE_LOCAL + 2)
+		confs[i].labels[d] = strdup("local");
+	    else if (d == ROUTE_DEFAULT + 2) {
+		snprintf(buf, sizeof(buf), "default(%s)", servers[j]);
+		confs[i].labels[d] = strdup(buf);
+	    } else {
+		snprintf(buf, sizeof(buf), "line%d(%s)", server->lineno, servers[j]);
+		confs[i].labels[d] = strdup(buf);
+	    }
+	    if (confs[i].labels[d] == NULL)
+		exit(1);
+	}
+    }
+
+    for (j = 0; j < nservers; j++)
+	free(servers[j]);
+    free(servers);
+}
+
+/* Read all of a file (or stdin if the name is "-") into memory */
+static char *read_all(char *filename, size_t *len) {
+    char *buf = NULL;
+    size_t size = 0, got;
+    FILE *in;
+
+    if (!strcmp(filename, "-"))
+	in = stdin;
+    else if ((in = fopen(filename, "r")) == NULL) {
+	show_msg(MSGERR, "Could not open %s (%s)\n", filename, strerror(errno));
+	return NULL;
+    }
+
+    *len = 0;
+    do {
+	if (*len == size) {
+	    size = (size ? size * 2 : 1 << 20);
+	    if ((buf = realloc(buf, size)) == NULL) {
+		show_msg(MSGERR, "Could not allocate memory for %s\n", filename);
+		exit(1);
+	    }
+	}
+	got = fread(buf + *len, 1, size - *len, in);
+	*len += got;
+    } while (got > 0);
+
+    if (in != stdin)
+	fclose(in);
+
+    return buf;
+}
+
+int test_batch(struct batchconf *confs, int nconfs, char *filename,
+	int nthreads, int summary) {
+    struct batchjob *jobs;
+    struct timeval start, end;
+    unsigned long lines = 0, invalid = 0, differ = 0, count;
+    char *input, *p;
+    size_t len;
+    int i, j, ncounts, a, b;
+    double secs;
+
+    if ((input = read_all(filename, &len)) == NULL)
+	return -1;
+
+    batch_labels(confs, nconfs);
+    ncounts = confs[0].ndecisions * (nconfs > 1 ? confs[1].ndecisions : 1);
+
+    if (nthreads < 1)
+	nthreads = 1;
+    if ((jobs = calloc(nthreads, sizeof(*jobs))) == NULL)
+	exit(1);
+
+    gettimeofday(&start, NULL);
+
+    /* Split the input at line boundaries */
+    for (i = 0, p = input; i < nthreads; i++) {
+	jobs[i].confs = confs;
+	jobs[i].nconfs = nconfs;
+	jobs[i].summary = summary;
+	jobs[i].start = p;
+	if (i == nthreads - 1)
+	    p = input + len;
+	else if ((p = input + (len / nthreads) * (i + 1)) < jobs[i].start)
+	    p = jobs[i].start;
+	while ((p < input + len) && (p > jobs[i].start) && (p[-1] != '\n'))
+	    p++;
+	jobs[i].end = p;
+	if ((jobs[i].counts = calloc(ncounts, sizeof(unsigned long))) == NULL)
+	    exit(1);
+	if ((i > 0) && pthread_create(&jobs[i].thread, NULL, batch_thread, &jobs[i])) {
+	    show_msg(MSGERR, "Could not create thread (%s)\n", strerror(errno));
+	    exit(1);
+	}
+    }
+    batch_thread(&jobs[0]);
+    for (i = 1; i < nthreads; i++)
+	pthread_join(jobs[i].thread, NULL);
+
+    gettimeofday(&end, NULL);
+
+    /* Output in input order then add up the counts */
+    for (i = 0; i < nthreads; i++) {
+	if (jobs[i].outlen)
+	    fwrite(jobs[i].out, 1, jobs[i].outlen, stdout);
+	free(jobs[i].out);
+	lines += jobs[i].lines;
+	invalid += jobs[i].invalid;
+	differ += jobs[i].differ;
+	if (i > 0) {
+	    for (j = 0; j < ncounts; j++)
+		jobs[0].counts[j] += jobs[i].counts[j];
+	}
+    }
+
+    if (summary) {
+	for (j = 0; j < ncounts; j++) {
+	    if (!(count = jobs[0].counts[j]))
+		continue;
+	    if (nconfs == 1) {
+		printf("%lu %s\n", count, confs[0].labels[j]);
+		continue;
+	    }
+	    a = j / confs[1].ndecisions;
+	    b = j % confs[1].ndecisions;
+	    printf("%lu %s %s %s\n", count, confs[0].labels[a],
+		    (confs[0].servers[a] == confs[1].servers[b] ? "==" : "->"),
+		    confs[1].labels[b]);
+	}
+	if (invalid)
+	    printf("%lu invalid\n", invalid);
+    }
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    fprintf(stderr, "%lu addresses (%lu invalid", lines, invalid);
+    if (nconfs > 1)
+	fprintf(stderr, ", %lu routed differently", differ);
+    fprintf(stderr, ") in %.3fs with %d threads, %.0f lookups/s\n", secs,
+	    nthreads, (secs > 0 ? lines * nconfs / secs : 0));
+
+    for (i = 0; i < nthreads; i++)
+	free(jobs[i].counts);
+    free(jobs);
+    free(input);
+
+    return (differ ? 1 : 0);
+}
+
 void show_conf(struct parsedfile *config) {
     struct netent *net;
     struct serverent *server;
@@ -138,6 +642,9 @@ void show_conf(struct parsedfile *config) {
 		inet_ntoa(net->localnet));
 	net = net->next;
     }
+    show_nets6(config->localnets6);
+    show_domains(config->localdomains);
+    show_prefixfiles(config->localfiles);
     printf("\n");
 
     /* If we have a default server configuration show it */
@@ -187,11 +694,18 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
     /* Show port */
     printf("Port:         %d\n", server->port);
 
+    /* Show the servers a chain goes on through */
+    if (server->chain != NULL)
+	printf("Then through: %s\n", server->chain);
+
     /* Show SOCKS type */
-    printf("SOCKS type:   %d\n", server->type);
+    if (server->type == SERVER_HTTP)
+	printf("SOCKS type:   http (HTTP CONNECT proxy)\n");
+    else
+	printf("SOCKS type:   %d\n", server->type);
 
     /* Show default username and password info */
-    if (server->type == 5) {
+    if ((server->type == 5) || (server->type == SERVER_HTTP)) {
 	/* Show the default user info */
 	printf("Default user: %s\n",
 		(server->defuser == NULL) ?
@@ -211,12 +725,13 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
 	if ((server->defuser != NULL) || (server->defpass != NULL))
 	    fprintf(stderr, "Error: Default user and password "
 		    "may only be specified for version 5 "
-		    "servers\n");
+		    "and HTTP servers\n");
     }
 
     /* If this is the default servers and it has reachnets, thats stupid */
     if (def) {
-	if (server->reachnets != NULL) {
+	if ((server->reachnets != NULL) || (server->reachnets6 != NULL) ||
+		(server->reachfiles != NULL) || (server->reachdomains != NULL)) {
 	    fprintf(stderr, "Error: The default server has "
 		    "specified networks it can reach (reach statements), "
 		    "these statements are ignored since the "
@@ -224,7 +739,8 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
 		    "which is not specified in a reach statement "
 		    "for other servers\n");
 	}
-    } else if (server->reachnets == NULL) {
+    } else if ((server->reachnets == NULL) && (server->reachnets6 == NULL) &&
+	    (server->reachfiles == NULL) && (server->reachdomains == NULL)) {
 	fprintf(stderr, "Error: No reach statements specified for "
 		"server, this server will never be used\n");
     } else {
@@ -241,7 +757,241 @@ void show_server(struct parsedfile *config, struct serverent *server, int def) {
 	    printf("\n");
 	    net = net->next;
 	}
+	show_nets6(server->reachnets6);
+	show_domains(server->reachdomains);
+	show_prefixfiles(server->reachfiles);
+    }
+}
+
+static void show_nets6(struct netent6 *net) {
+    char text[INET6_ADDRSTRLEN];
+
+    for (; net != NULL; net = net->next) {
+	printf("Network: %s/%d ", inet_ntop(AF_INET6, &(net->net), text,
+		    sizeof(text)), net->prefixlen);
+	if (net->startport)
+	    printf("Ports: %5lu - %5lu", net->startport, net->endport);
+	printf("\n");
+    }
+}
+
+static void show_domains(struct domainent *dom) {
+
+    for (; dom != NULL; dom = dom->next)
+	printf("Domain:  %s (and names under it)\n", dom->domain);
+}
+
+void show_prefixfiles(struct prefixfile *pf) {
+
+    for (; pf != NULL; pf = pf->next) {
+	printf("Networks from %s (line %d):\n", pf->filename, pf->lineno);
+	printf("    %lu lines, %lu networks, %lu invalid, "
+		"%lu duplicate, %lu merged\n", pf->lines, pf->parsed,
+		pf->invalid, pf->duplicates, pf->merged);
+	printf("    %u networks kept, read in %ld.%03ld ms\n", pf->nents,
+		pf->usecs / 1000, pf->usecs % 1000);
+    }
+}
+
+/* Write the configuration out as C source defining constant     */
+/* tables and the load_config() and free_config() functions, so  */
+/* it can be linked into libtsocks in place of the parser        */
+int write_source(struct parsedfile *config, char *filename, char *sourcefile) {
+    FILE *out;
+    int i;
+
+    if ((out = fopen(sourcefile, "w")) == NULL) {
+	show_msg(MSGERR, "Could not create %s (%s)\n", sourcefile,
+		strerror(errno));
+	return -1;
+    }
+
+    fprintf(out, "/*\n * Generated by validateconf from %s, do not edit\n */\n\n",
+	    filename);
+    fprintf(out, "#include <string.h>\n#include <netinet/in.h>\n"
+	    "#include <parser.h>\n\n");
+
+    write_table(out, "local", &(config->index.local));
+    write_table(out, "reach", &(config->index.reach));
+    write_table6(out, "local6", &(config->index.local6));
+    write_table6(out, "reach6", &(config->index.reach6));
+    write_domains(out, &(config->index.domains));
+
+    if (config->index.npaths) {
+	fprintf(out, "static struct serverent paths[%d] = {\n",
+		config->index.npaths);
+	for (i = 0; i < config->index.npaths; i++)
+	    write_server(out, config->index.paths[i],
+		    (i + 1 < config->index.npaths ? i + 1 : -1));
+	fprintf(out, "};\n\nstatic struct serverent *pathindex[] = {\n");
+	for (i = 0; i < config->index.npaths; i++)
+	    fprintf(out, "    &paths[%d],\n", i);
+	fprintf(out, "};\n\n");
+    }
+
+    fprintf(out, "static const struct parsedfile builtin = {\n");
+    fprintf(out, "    .defaultserver =\n");
+    write_server(out, &(config->defaultserver), -1);
+    fprintf(out, "    .paths = %s,\n", (config->index.npaths ? "paths" : "NULL"));
+    fprintf(out, "    .fallback = %d,\n", config->fallback);
+    fprintf(out, "    .index = {\n");
+    fprintf(out, "\t.local = { %u, %u, (struct routegroup *) %s, "
+	    "(struct routeent *) %s },\n", config->index.local.ngroups,
+	    config->index.local.nents,
+	    (config->index.local.nents ? "local_groups" : "NULL"),
+	    (config->index.local.nents ? "local_ents" : "NULL"));
+    fprintf(out, "\t.reach = { %u, %u, (struct routegroup *) %s, "
+	    "(struct routeent *) %s },\n", config->index.reach.ngroups,
+	    config->index.reach.nents,
+	    (config->index.reach.nents ? "reach_groups" : "NULL"),
+	    (config->index.reach.nents ? "reach_ents" : "NULL"));
+    fprintf(out, "\t.npaths = %d,\n", config->index.npaths);
+    fprintf(out, "\t.paths = %s,\n", (config->index.npaths ? "pathindex" : "NULL"));
+    fprintf(out, "\t.local6 = { %u, %u, (struct routegroup *) %s, "
+	    "(struct routeent6 *) %s },\n", config->index.local6.ngroups,
+	    config->index.local6.nents,
+	    (config->index.local6.nents ? "local6_groups" : "NULL"),
+	    (config->index.local6.nents ? "local6_ents" : "NULL"));
+    fprintf(out, "\t.reach6 = { %u, %u, (struct routegroup *) %s, "
+	    "(struct routeent6 *) %s },\n", config->index.reach6.ngroups,
+	    config->index.reach6.nents,
+	    (config->index.reach6.nents ? "reach6_groups" : "NULL"),
+	    (config->index.reach6.nents ? "reach6_ents" : "NULL"));
+    fprintf(out, "\t.domains = { %u, %u, %u, (uint32_t *) %s, "
+	    "(struct domainrule *) %s, (char *) %s },\n",
+	    config->index.domains.nbuckets, config->index.domains.nrules,
+	    config->index.domains.nameslen,
+	    (config->index.domains.nrules ? "domain_buckets" : "NULL"),
+	    (config->index.domains.nrules ? "domain_rules" : "NULL"),
+	    (config->index.domains.nrules ? "domain_names" : "NULL"));
+    fprintf(out, "    },\n};\n\n");
+
+    fprintf(out, "int load_config(char *filename, struct parsedfile *config) {\n"
+	    "    memcpy(config, &builtin, sizeof(*config));\n"
+	    "    return 0;\n}\n\n");
+    fprintf(out, "void free_config(struct parsedfile *config) {\n}\n\n");
+    fprintf(out, "int config_files_changed(struct parsedfile *config) {\n"
+	    "    return 0;\n}\n");
+
+    if (fclose(out)) {
+	show_msg(MSGERR, "Could not write %s (%s)\n", sourcefile,
+		strerror(errno));
+	return -1;
+    }
+
+    return 0;
+}
+
+static void write_string(FILE *out, char *str) {
+
+    if (str == NULL) {
+	fprintf(out, "NULL");
+	return;
+    }
+
+    fputc('"', out);
+    for (; *str; str++) {
+	if ((*str == '"') || (*str == '\\'))
+	    fprintf(out, "\\%c", *str);
+	else if ((*str < ' ') || (*str > '~'))
+	    fprintf(out, "\\%03o", (unsigned char) *str);
+	else
+	    fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void write_table(FILE *out, char *name, struct routetable *table) {
+    uint32_t i;
+
+    if (table->nents == 0)
+	return;
+
+    fprintf(out, "static const struct routegroup %s_groups[] = {\n", name);
+    for (i = 0; i < table->ngroups; i++)
+	fprintf(out, "    { 0x%08x, %u, %u },\n", table->groups[i].mask,
+		table->groups[i].first, table->groups[i].count);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const struct routeent %s_ents[] = {\n", name);
+    for (i = 0; i < table->nents; i++)
+	fprintf(out, "    { 0x%08x, 0x%08x, %u, %u, %d },\n",
+		table->ents[i].net, table->ents[i].mask,
+		table->ents[i].startport, table->ents[i].endport,
+		table->ents[i].path);
+    fprintf(out, "};\n\n");
+}
+
+static void write_table6(FILE *out, char *name, struct routetable6 *table) {
+    uint32_t i, j;
+
+    if (table->nents == 0)
+	return;
+
+    fprintf(out, "static const struct routegroup %s_groups[] = {\n", name);
+    for (i = 0; i < table->ngroups; i++)
+	fprintf(out, "    { %u, %u, %u },\n", table->groups[i].mask,
+		table->groups[i].first, table->groups[i].count);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const struct routeent6 %s_ents[] = {\n", name);
+    for (i = 0; i < table->nents; i++) {
+	fprintf(out, "    { {");
+	for (j = 0; j < 16; j++)
+	    fprintf(out, " 0x%02x,", table->ents[i].net[j]);
+	fprintf(out, " }, %u, %u, %d },\n", table->ents[i].startport,
+		table->ents[i].endport, table->ents[i].path);
     }
+    fprintf(out, "};\n\n");
+}
+
+static void write_domains(FILE *out, struct domaintable *table) {
+    uint32_t i;
+
+    if (table->nrules == 0)
+	return;
+
+    fprintf(out, "static const uint32_t domain_buckets[] = {\n");
+    for (i = 0; i < table->nbuckets; i++)
+	fprintf(out, "    0x%08x,\n", table->buckets[i]);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const struct domainrule domain_rules[] = {\n");
+    for (i = 0; i < table->nrules; i++)
+	fprintf(out, "    { 0x%08x, 0x%08x, %u, %d },\n", table->rules[i].hash,
+		table->rules[i].next, table->rules[i].name,
+		table->rules[i].path);
+    fprintf(out, "};\n\n");
+
+    /* One string for each name, the NULs between them are written out */
+    fprintf(out, "static const char domain_names[] =");
+    for (i = 0; i < table->nameslen; i += strlen(table->names + i) + 1) {
+	fprintf(out, "\n    ");
+	write_string(out, table->names + i);
+	fprintf(out, " \"\\0\"");
+    }
+    fprintf(out, ";\n\n");
+}
+
+/* Write a server initializer, next is the index in paths of */
+/* the server following it or -1                            */
+static void write_server(FILE *out, struct serverent *server, int next) {
+
+    fprintf(out, "    {\n\t.lineno = %d,\n\t.address = ", server->lineno);
+    write_string(out, server->address);
+    fprintf(out, ",\n\t.port = %d,\n\t.type = %d,\n\t.defuser = ",
+	    server->port, server->type);
+    write_string(out, server->defuser);
+    fprintf(out, ",\n\t.defpass = ");
+    write_string(out, server->defpass);
+    fprintf(out, ",\n\t.chain = ");
+    write_string(out, server->chain);
+    fprintf(out, ",\n\t.next = ");
+    if (next < 0)
+	fprintf(out, "NULL");
+    else
+	fprintf(out, "&paths[%d]", next);
+    fprintf(out, ",\n    },\n");
 }
 
 /*